@@ -2,6 +2,7 @@
 #define STS_GSL_H
 
 #include <functional>
+#include <gsl/gsl_errno.h>
 #include <gsl/gsl_min.h>
 #include <gsl/gsl_roots.h>
 
@@ -21,6 +22,88 @@ double find_root(const std::function<double(double)> fn,
                  const int max_iter = 100,
                  const double tolerance = 1e-3,
                  const gsl_root_fsolver_type *min_type = gsl_root_fsolver_brent);
+
+/// Call a callable of type \c Fn from GSL.
+/// \param d Input value
+/// \param data a pointer to a const \c Fn
+template<typename Fn>
+double callable_to_gsl_function(double d, void *data)
+{
+    return (*static_cast<const Fn*>(data))(d);
+}
+
+/// Minimize any callable taking and returning a \c double without
+/// wrapping it in a \c std::function.
+template<typename Fn>
+double minimize(const Fn& fn,
+                double m = 0.5,
+                double a = 0,
+                double b = 1,
+                const int max_iter = 100,
+                const double tolerance = 1e-3,
+                const gsl_min_fminimizer_type *min_type = gsl_min_fminimizer_brent)
+{
+    int iter = 0, status;
+    gsl_min_fminimizer *s;
+    gsl_function gsl_fn;
+
+    gsl_fn.function = &callable_to_gsl_function<Fn>;
+    gsl_fn.params = const_cast<void*>(static_cast<const void*>(&fn));
+
+    s = gsl_min_fminimizer_alloc(min_type);
+    gsl_min_fminimizer_set(s, &gsl_fn, m, a, b);
+
+    do {
+        iter++;
+        status = gsl_min_fminimizer_iterate(s);
+
+        m = gsl_min_fminimizer_x_minimum(s);
+        a = gsl_min_fminimizer_x_lower(s);
+        b = gsl_min_fminimizer_x_upper(s);
+
+        status = gsl_min_test_interval(a, b, tolerance, 0.0);
+    } while(status == GSL_CONTINUE && iter < max_iter);
+    gsl_min_fminimizer_free(s);
+    return m;
+}
+
+/// Find a root of any callable taking and returning a \c double
+/// without wrapping it in a \c std::function.
+template<typename Fn>
+double find_root(const Fn& fn,
+                 double a = 0,
+                 double b = 1,
+                 const int max_iter = 100,
+                 const double tolerance = 1e-3,
+                 const gsl_root_fsolver_type *solver_type = gsl_root_fsolver_brent)
+{
+    int iter = 0, status;
+    gsl_root_fsolver *s;
+    gsl_function gsl_fn;
+
+    gsl_fn.function = &callable_to_gsl_function<Fn>;
+    gsl_fn.params = const_cast<void*>(static_cast<const void*>(&fn));
+
+    s = gsl_root_fsolver_alloc(solver_type);
+    gsl_root_fsolver_set(s, &gsl_fn, a, b);
+
+    double r = a;
+
+    do {
+        iter++;
+        status = gsl_root_fsolver_iterate(s);
+
+        r = gsl_root_fsolver_root(s);
+        a = gsl_root_fsolver_x_lower(s);
+        b = gsl_root_fsolver_x_upper(s);
+
+        status = gsl_root_test_interval(a, b, tolerance, 0.0);
+    } while (status == GSL_CONTINUE && iter < max_iter);
+
+    gsl_root_fsolver_free(s);
+
+    return r;
+}
 } // namespace gsl
 
 #endif // STS_GSL_H
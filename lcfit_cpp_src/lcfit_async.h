@@ -0,0 +1,390 @@
+/**
+ * \file lcfit_async.h
+ * \brief Asynchronous automatic fitting with C++20 coroutines
+ *
+ * #lcfit::fit_auto_async runs #lcfit_fit_auto as a coroutine that
+ * suspends on each batch of log-likelihood evaluations: the bracketing
+ * and Brent steps, the derivative stencil, lcfit2 and #estimate_ml_t
+ * each \c co_await a caller-supplied awaitable instead of calling a
+ * function. A single thread can then keep many fits in flight, and
+ * #lcfit::batching_executor gathers their requests into one call to a
+ * vectorized or remote likelihood engine:
+ *
+ * \code
+ * lcfit::batching_executor<size_t> executor(
+ *     [&](std::span<const size_t> branch, std::span<const double> t, std::span<double> lnl) {
+ *         my_engine.evaluate(branch, t, lnl);
+ *     });
+ *
+ * std::vector<lcfit::task<lcfit::fit_auto_result>> fits;
+ * for (size_t i = 0; i < n_branches; ++i) {
+ *     fits.push_back(lcfit::fit_auto_async(executor.lnl(i), DEFAULT_INIT, min_t, max_t));
+ *     fits.back().start();
+ * }
+ *
+ * executor.run();
+ *
+ * for (auto& fit : fits) {
+ *     const lcfit::fit_auto_result result = fit.get();
+ * }
+ * \endcode
+ *
+ * Unlike the rest of the C++ API, this header requires C++20. It is
+ * built on the reverse-communication interface in lcfit_auto.h.
+ */
+
+#ifndef LCFIT_ASYNC_H
+#define LCFIT_ASYNC_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "lcfit_async.h requires C++20 coroutines"
+#endif
+
+#include <algorithm>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <new>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "lcfit.h"
+#include "lcfit_auto.h"
+
+namespace lcfit
+{
+
+/**
+ * A lazily started coroutine producing a \c T.
+ *
+ * A task does not run until it is awaited by another coroutine or
+ * started with #start. Destroying a task destroys its coroutine,
+ * whether or not it has finished.
+ */
+template<typename T>
+class task
+{
+public:
+    struct promise_type;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    struct promise_type
+    {
+        std::optional<T> value;
+        std::exception_ptr exception;
+        std::coroutine_handle<> continuation;
+
+        task get_return_object() { return task(handle_type::from_promise(*this)); }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct final_awaiter
+        {
+            bool await_ready() noexcept { return false; }
+
+            std::coroutine_handle<> await_suspend(handle_type h) noexcept
+            {
+                std::coroutine_handle<> next = h.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T v) { value.emplace(std::move(v)); }
+
+        void unhandled_exception() noexcept { exception = std::current_exception(); }
+    };
+
+    task(task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    task& operator=(task&& other) noexcept
+    {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task()
+    {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    /** Run the coroutine until it first suspends, without awaiting it. */
+    void start() { handle_.resume(); }
+
+    /** Whether the coroutine has finished. */
+    bool done() const { return handle_.done(); }
+
+    /** The result of a finished task; rethrows an exception that escaped the coroutine. */
+    T get()
+    {
+        promise_type& p = handle_.promise();
+        if (p.exception) {
+            std::rethrow_exception(p.exception);
+        }
+        return std::move(*p.value);
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() { return get(); }
+
+private:
+    explicit task(handle_type h) : handle_(h) {}
+
+    handle_type handle_;
+};
+
+/** The result of #fit_auto_async. */
+struct fit_auto_result
+{
+    /** Estimated ML branch length, as returned by #lcfit_fit_auto. */
+    double ml_t;
+    /** Fitted model parameters. */
+    bsm_t model;
+    /** #LCFIT_SUCCESS or #LCFIT_ERROR. */
+    int status;
+    /** Number of log-likelihood evaluations. */
+    size_t n_evals;
+};
+
+/**
+ * Fit a model as #lcfit_fit_auto does, awaiting log-likelihoods.
+ *
+ * Each batch of branch lengths the fit needs is passed to \c lnl,
+ * which returns an awaitable; once it resumes the coroutine, the
+ * log-likelihoods must have been written to \c out. Branch lengths
+ * within a batch may be evaluated in any order or concurrently.
+ *
+ * Given the same log-likelihoods, the result matches #lcfit_fit_auto.
+ *
+ * \param[in] lnl    Callable as <tt>lnl(std::span<const double> t, std::span<double> out)</tt>,
+ *                   returning an awaitable. It is copied into the coroutine.
+ * \param[in] model  Initial model parameters.
+ * \param[in] min_t  Lower bound on branch length.
+ * \param[in] max_t  Upper bound on branch length.
+ */
+template<typename AwaitableLnl>
+task<fit_auto_result> fit_auto_async(AwaitableLnl lnl, bsm_t model,
+                                     const double min_t, const double max_t)
+{
+    std::unique_ptr<lcfit_auto_state_t, void (*)(lcfit_auto_state_t*)>
+        state(lcfit_auto_begin(&model, min_t, max_t), &lcfit_auto_free);
+    if (!state) {
+        throw std::bad_alloc();
+    }
+
+    std::vector<double> batch_t;
+    std::vector<double> batch_lnl;
+    size_t n_evals = 0;
+
+    const double* t;
+    size_t n;
+    while ((n = lcfit_auto_next_n(state.get(), &t)) > 0) {
+        // the state's buffer is only valid until it is next used, and
+        // other coroutines may run while this one is suspended
+        batch_t.assign(t, t + n);
+        batch_lnl.resize(n);
+
+        co_await lnl(std::span<const double>(batch_t), std::span<double>(batch_lnl));
+
+        lcfit_auto_supply_n(state.get(), n, batch_lnl.data());
+        n_evals += n;
+    }
+
+    double unused;
+    fit_auto_result result;
+    result.status = lcfit_auto_next(state.get(), &unused);
+    result.ml_t = lcfit_auto_result(state.get(), &model);
+    result.model = model;
+    result.n_evals = n_evals;
+
+    co_return result;
+}
+
+/**
+ * Gathers log-likelihood requests from many coroutines into batches.
+ *
+ * Each coroutine awaits the function returned by #lnl for its own
+ * \c Key, which identifies a log-likelihood function (for instance a
+ * branch). Requests accumulate until #flush, which evaluates all of
+ * them in one call to the engine and resumes the coroutines that made
+ * them; those run until they next await, adding the next round of
+ * requests.
+ *
+ * An executor is not thread-safe, and must outlive the coroutines
+ * awaiting it. If the engine throws, the exception propagates from
+ * #flush and the coroutines in that batch are not resumed.
+ */
+template<typename Key>
+class batching_executor
+{
+public:
+    /**
+     * Engine computing <tt>lnl[i]</tt>, the log-likelihood for
+     * <tt>keys[i]</tt> at branch length <tt>t[i]</tt>, for every \c i.
+     */
+    using engine_type = std::function<void(std::span<const Key> keys,
+                                           std::span<const double> t,
+                                           std::span<double> lnl)>;
+
+    /** Awaitable for one batch of requests from one coroutine. */
+    class awaiter
+    {
+    public:
+        awaiter(batching_executor* executor, const Key& key,
+                std::span<const double> t, std::span<double> out) :
+            executor_(executor), key_(key), t_(t), out_(out) {}
+
+        bool await_ready() const noexcept { return t_.empty(); }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            executor_->enqueue(h, key_, t_, out_);
+        }
+
+        void await_resume() const noexcept {}
+
+    private:
+        batching_executor* executor_;
+        Key key_;
+        std::span<const double> t_;
+        std::span<double> out_;
+    };
+
+    /** Awaitable log-likelihood function for one key, for #fit_auto_async. */
+    class bound_lnl
+    {
+    public:
+        bound_lnl(batching_executor* executor, const Key& key) :
+            executor_(executor), key_(key) {}
+
+        awaiter operator()(std::span<const double> t, std::span<double> out) const
+        {
+            return awaiter(executor_, key_, t, out);
+        }
+
+    private:
+        batching_executor* executor_;
+        Key key_;
+    };
+
+    explicit batching_executor(engine_type engine) : engine_(std::move(engine)) {}
+
+    batching_executor(const batching_executor&) = delete;
+    batching_executor& operator=(const batching_executor&) = delete;
+
+    /** The awaitable log-likelihood function for \c key. */
+    bound_lnl lnl(const Key& key) { return bound_lnl(this, key); }
+
+    /** Number of branch lengths awaiting evaluation. */
+    size_t pending() const { return t_.size(); }
+
+    /** Number of calls made to the engine. */
+    size_t n_batches() const { return n_batches_; }
+
+    /** Number of branch lengths evaluated. */
+    size_t n_evals() const { return n_evals_; }
+
+    /**
+     * Evaluate every pending request in one call to the engine and
+     * resume the coroutines that made them.
+     *
+     * \return The number of branch lengths evaluated.
+     */
+    size_t flush()
+    {
+        if (t_.empty()) {
+            return 0;
+        }
+
+        // resumed coroutines enqueue their next requests, so work on a
+        // batch of our own and keep the buffers for the next flush
+        keys_.swap(batch_keys_);
+        t_.swap(batch_t_);
+        requests_.swap(batch_requests_);
+        keys_.clear();
+        t_.clear();
+        requests_.clear();
+
+        batch_lnl_.resize(batch_t_.size());
+        engine_(std::span<const Key>(batch_keys_), std::span<const double>(batch_t_),
+                std::span<double>(batch_lnl_));
+
+        ++n_batches_;
+        n_evals_ += batch_t_.size();
+
+        for (const request& r : batch_requests_) {
+            std::copy(batch_lnl_.begin() + r.offset,
+                      batch_lnl_.begin() + r.offset + r.out.size(), r.out.begin());
+        }
+        for (const request& r : batch_requests_) {
+            r.handle.resume();
+        }
+
+        return batch_t_.size();
+    }
+
+    /** Flush until no requests are pending. */
+    void run()
+    {
+        while (flush() > 0) {
+        }
+    }
+
+private:
+    struct request
+    {
+        std::coroutine_handle<> handle;
+        size_t offset;
+        std::span<double> out;
+    };
+
+    void enqueue(std::coroutine_handle<> h, const Key& key,
+                 std::span<const double> t, std::span<double> out)
+    {
+        requests_.push_back({h, t_.size(), out});
+        keys_.insert(keys_.end(), t.size(), key);
+        t_.insert(t_.end(), t.begin(), t.end());
+    }
+
+    engine_type engine_;
+
+    std::vector<Key> keys_;
+    std::vector<double> t_;
+    std::vector<request> requests_;
+
+    std::vector<Key> batch_keys_;
+    std::vector<double> batch_t_;
+    std::vector<double> batch_lnl_;
+    std::vector<request> batch_requests_;
+
+    size_t n_batches_ = 0;
+    size_t n_evals_ = 0;
+};
+
+} // namespace lcfit
+
+#endif // LCFIT_ASYNC_H
@@ -0,0 +1,261 @@
+#include "lcfit_columnar.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lcfit {
+
+const char COLUMNAR_MAGIC[8] = {'L', 'C', 'F', 'I', 'T', 'C', 'O', 'L'};
+
+namespace {
+
+const size_t HEADER_SIZE = 24;
+const size_t NAME_SIZE = COLUMNAR_MAX_NAME + 1;
+
+bool host_is_little_endian()
+{
+    const uint16_t one = 1;
+    unsigned char byte;
+    std::memcpy(&byte, &one, 1);
+    return byte == 1;
+}
+
+void put_le(unsigned char* out, uint64_t value, size_t n_bytes)
+{
+    for (size_t i = 0; i < n_bytes; ++i) {
+        out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+uint64_t get_le(const unsigned char* in, size_t n_bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < n_bytes; ++i) {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+} // namespace
+
+//
+// columnar_writer
+//
+
+columnar_writer::columnar_writer(const std::string& path,
+                                 const std::vector<std::string>& column_names) :
+    path_(path), names_(column_names), columns_(column_names.size()),
+    n_rows_(0), closed_(false)
+{
+    for (const std::string& name : names_) {
+        if (name.size() > COLUMNAR_MAX_NAME) {
+            throw std::invalid_argument("column name too long: " + name);
+        }
+    }
+}
+
+columnar_writer::~columnar_writer()
+{
+    if (!closed_) {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+}
+
+void columnar_writer::add_row(const std::vector<double>& values)
+{
+    if (values.size() != n_columns()) {
+        throw std::invalid_argument("row has the wrong number of columns");
+    }
+
+    add_rows(values.data(), 1);
+}
+
+void columnar_writer::add_rows(const double* values, size_t n_rows)
+{
+    const size_t k = n_columns();
+
+    for (size_t j = 0; j < k; ++j) {
+        std::vector<double>& col = columns_[j];
+        col.reserve(col.size() + n_rows);
+        for (size_t i = 0; i < n_rows; ++i) {
+            col.push_back(values[i * k + j]);
+        }
+    }
+
+    n_rows_ += n_rows;
+}
+
+void columnar_writer::close()
+{
+    closed_ = true;
+
+    FILE* fp = std::fopen(path_.c_str(), "wb");
+    if (fp == nullptr) {
+        throw std::runtime_error("could not open " + path_ + " for writing");
+    }
+
+    const size_t k = n_columns();
+    std::vector<unsigned char> header(HEADER_SIZE + NAME_SIZE * k, 0);
+    std::memcpy(header.data(), COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC));
+    put_le(&header[8], COLUMNAR_VERSION, 4);
+    put_le(&header[12], k, 4);
+    put_le(&header[16], n_rows_, 8);
+    for (size_t j = 0; j < k; ++j) {
+        std::memcpy(&header[HEADER_SIZE + NAME_SIZE * j], names_[j].data(), names_[j].size());
+    }
+
+    bool ok = std::fwrite(header.data(), 1, header.size(), fp) == header.size();
+
+    const bool little = host_is_little_endian();
+    std::vector<unsigned char> buf;
+    for (size_t j = 0; j < k && ok; ++j) {
+        const std::vector<double>& col = columns_[j];
+        if (little) {
+            ok = std::fwrite(col.data(), sizeof(double), col.size(), fp) == col.size();
+        } else {
+            buf.resize(col.size() * sizeof(double));
+            for (size_t i = 0; i < col.size(); ++i) {
+                uint64_t bits;
+                std::memcpy(&bits, &col[i], sizeof(bits));
+                put_le(&buf[i * sizeof(double)], bits, sizeof(double));
+            }
+            ok = std::fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+        }
+    }
+
+    if (std::fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        throw std::runtime_error("error writing " + path_);
+    }
+}
+
+//
+// columnar_reader
+//
+
+columnar_reader::columnar_reader(const std::string& path) :
+    map_(nullptr), map_size_(0), data_(nullptr), n_rows_(0)
+{
+    if (!host_is_little_endian()) {
+        throw std::runtime_error("columnar_reader requires a little-endian host");
+    }
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("could not open " + path);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < HEADER_SIZE) {
+        ::close(fd);
+        throw std::runtime_error(path + " is not a columnar file");
+    }
+
+    map_size_ = st.st_size;
+    map_ = ::mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map_ == MAP_FAILED) {
+        map_ = nullptr;
+        throw std::runtime_error("could not map " + path);
+    }
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(map_);
+    const uint64_t version = get_le(bytes + 8, 4);
+    const uint64_t k = get_le(bytes + 12, 4);
+    const uint64_t n = get_le(bytes + 16, 8);
+
+    const char* error = nullptr;
+    if (std::memcmp(bytes, COLUMNAR_MAGIC, sizeof(COLUMNAR_MAGIC)) != 0) {
+        error = " is not a columnar file";
+    } else if (version != COLUMNAR_VERSION) {
+        error = " has an unsupported columnar format version";
+    } else if ((map_size_ - HEADER_SIZE) / NAME_SIZE < k ||
+               (n > 0 && (map_size_ - HEADER_SIZE - NAME_SIZE * k) / sizeof(double) / n < k)) {
+        error = " is truncated";
+    }
+
+    if (error != nullptr) {
+        unmap();
+        throw std::runtime_error(path + error);
+    }
+
+    names_.reserve(k);
+    for (size_t j = 0; j < k; ++j) {
+        const char* name = reinterpret_cast<const char*>(bytes + HEADER_SIZE + NAME_SIZE * j);
+        names_.emplace_back(name, strnlen(name, NAME_SIZE));
+    }
+
+    n_rows_ = n;
+    data_ = reinterpret_cast<const double*>(bytes + HEADER_SIZE + NAME_SIZE * k);
+}
+
+columnar_reader::~columnar_reader()
+{
+    unmap();
+}
+
+columnar_reader::columnar_reader(columnar_reader&& other) noexcept :
+    map_(other.map_), map_size_(other.map_size_), data_(other.data_),
+    names_(std::move(other.names_)), n_rows_(other.n_rows_)
+{
+    other.map_ = nullptr;
+    other.data_ = nullptr;
+}
+
+columnar_reader& columnar_reader::operator=(columnar_reader&& other) noexcept
+{
+    if (this != &other) {
+        unmap();
+        map_ = other.map_;
+        map_size_ = other.map_size_;
+        data_ = other.data_;
+        names_ = std::move(other.names_);
+        n_rows_ = other.n_rows_;
+        other.map_ = nullptr;
+        other.data_ = nullptr;
+    }
+    return *this;
+}
+
+void columnar_reader::unmap()
+{
+    if (map_ != nullptr) {
+        ::munmap(map_, map_size_);
+        map_ = nullptr;
+    }
+}
+
+size_t columnar_reader::column_index(const std::string& name) const
+{
+    for (size_t j = 0; j < names_.size(); ++j) {
+        if (names_[j] == name) {
+            return j;
+        }
+    }
+
+    throw std::out_of_range("no column named " + name);
+}
+
+const double* columnar_reader::column(size_t i) const
+{
+    if (i >= n_columns()) {
+        throw std::out_of_range("column index out of range");
+    }
+
+    return data_ + i * n_rows_;
+}
+
+} // namespace lcfit
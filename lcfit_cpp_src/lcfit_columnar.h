@@ -0,0 +1,138 @@
+/**
+ * \file lcfit_columnar.h
+ * \brief Binary columnar tables
+ *
+ * This file provides a writer and a memory-mapped reader for a simple
+ * binary columnar format, used by lcfit-compare as an alternative to
+ * CSV output.
+ *
+ * A columnar file consists of a header followed by the data:
+ *
+ * | Offset          | Size          | Contents                                   |
+ * |-----------------|---------------|--------------------------------------------|
+ * | 0               | 8             | Magic bytes <tt>LCFITCOL</tt>              |
+ * | 8               | 4             | Format version (currently 1)               |
+ * | 12              | 4             | Number of columns, \c k                    |
+ * | 16              | 8             | Number of rows, \c n                       |
+ * | 24              | 32 * \c k     | Column names, NUL-padded, at most 31 bytes |
+ * | 24 + 32 * \c k  | 8 * \c k * \c n | Column data                              |
+ *
+ * All integers are unsigned and little-endian. The data section holds
+ * each column in turn as \c n little-endian IEEE 754 doubles, so every
+ * column starts on an 8-byte boundary and can be used directly from a
+ * memory-mapped file.
+ */
+
+#ifndef LCFIT_COLUMNAR_H
+#define LCFIT_COLUMNAR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace lcfit {
+
+/** Magic bytes at the start of a columnar file. */
+extern const char COLUMNAR_MAGIC[8];
+
+/** Current columnar format version. */
+const uint32_t COLUMNAR_VERSION = 1;
+
+/** Maximum length of a column name, excluding the terminating NUL. */
+const size_t COLUMNAR_MAX_NAME = 31;
+
+/**
+ * Writer for columnar files.
+ *
+ * Rows are buffered in memory and the file is written by #close.
+ *
+ * Example usage:
+ *
+ * \code
+ * lcfit::columnar_writer writer("fit.lcol", {"node_id", "c", "m", "r", "b"});
+ * writer.add_row({1.0, 1500.0, 1000.0, 1.0, 0.5});
+ * writer.close();
+ * \endcode
+ */
+class columnar_writer {
+public:
+    /**
+     * Create a writer for a file with the given columns.
+     *
+     * \param[in] path          Output file path.
+     * \param[in] column_names  Column names, each at most #COLUMNAR_MAX_NAME bytes.
+     */
+    columnar_writer(const std::string& path, const std::vector<std::string>& column_names);
+
+    /** Write the file, if #close has not been called, ignoring errors. */
+    ~columnar_writer();
+
+    columnar_writer(const columnar_writer&) = delete;
+    columnar_writer& operator=(const columnar_writer&) = delete;
+
+    /** Append a row of #n_columns values. */
+    void add_row(const std::vector<double>& values);
+
+    /** Append \c n_rows rows from \c values, stored row-major. */
+    void add_rows(const double* values, size_t n_rows);
+
+    /** Write the file; throws \c std::runtime_error on I/O failure. */
+    void close();
+
+    size_t n_columns() const { return names_.size(); }
+    size_t n_rows() const { return n_rows_; }
+
+private:
+    std::string path_;
+    std::vector<std::string> names_;
+    std::vector<std::vector<double>> columns_;
+    size_t n_rows_;
+    bool closed_;
+};
+
+/**
+ * Read-only, memory-mapped view of a columnar file.
+ *
+ * Column data is used in place, so this class requires a
+ * little-endian host.
+ */
+class columnar_reader {
+public:
+    /** Map and validate a columnar file; throws \c std::runtime_error if it is invalid. */
+    explicit columnar_reader(const std::string& path);
+    ~columnar_reader();
+
+    columnar_reader(const columnar_reader&) = delete;
+    columnar_reader& operator=(const columnar_reader&) = delete;
+    columnar_reader(columnar_reader&& other) noexcept;
+    columnar_reader& operator=(columnar_reader&& other) noexcept;
+
+    size_t n_columns() const { return names_.size(); }
+    size_t n_rows() const { return n_rows_; }
+
+    /** Name of column \c i. */
+    const std::string& column_name(size_t i) const { return names_.at(i); }
+
+    /** Index of the column named \c name; throws \c std::out_of_range if there is none. */
+    size_t column_index(const std::string& name) const;
+
+    /** Pointer to the #n_rows values of column \c i. */
+    const double* column(size_t i) const;
+
+    /** Value of column \c col in row \c row. */
+    double value(size_t row, size_t col) const { return column(col)[row]; }
+
+private:
+    void unmap();
+
+    void* map_;
+    size_t map_size_;
+    const double* data_;
+    std::vector<std::string> names_;
+    size_t n_rows_;
+};
+
+} // namespace lcfit
+
+#endif // LCFIT_COLUMNAR_H
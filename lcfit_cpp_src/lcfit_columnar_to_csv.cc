@@ -0,0 +1,53 @@
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+#include "lcfit_columnar.h"
+
+void write_csv(const lcfit::columnar_reader& table, std::ostream& output)
+{
+    output << std::setprecision(std::numeric_limits<double>::max_digits10);
+
+    for (size_t j = 0; j < table.n_columns(); ++j) {
+        output << (j ? "," : "") << table.column_name(j);
+    }
+    output << "\n";
+
+    for (size_t i = 0; i < table.n_rows(); ++i) {
+        for (size_t j = 0; j < table.n_columns(); ++j) {
+            output << (j ? "," : "") << table.value(i, j);
+        }
+        output << "\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " INPUT [OUTPUT.csv]\n"
+                  << "Convert an lcfit columnar file to CSV, writing to stdout by default.\n";
+        return 2;
+    }
+
+    try {
+        lcfit::columnar_reader table(argv[1]);
+
+        if (argc == 3) {
+            std::ofstream output(argv[2]);
+            write_csv(table, output);
+            if (!output) {
+                throw std::runtime_error(std::string("error writing ") + argv[2]);
+            }
+        } else {
+            write_csv(table, std::cout);
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,9 +1,19 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <Bpp/App/BppApplication.h>
 #include <Bpp/Numeric/Prob/DiscreteDistribution.h>
@@ -17,6 +27,8 @@
 
 #include "gsl.h"
 #include "lcfit.h"
+#include "lcfit_columnar.h"
+#include "lcfit_curve_sampling.h"
 #include "lcfit_select.h"
 
 struct log_likelihood_data {
@@ -60,7 +72,7 @@ void compute_sampling_bounds(double (*lnl_fn)(double, void*), void* lnl_fn_args,
 
 void sample_curves(double (*lnl_fn)(double, void*), void* lnl_fn_args, const bsm_t* model,
                    const double min_t, const double max_t, const double t0,
-                   const int node_id, std::ostream& output)
+                   const int node_id, std::vector<double>& rows, std::ostream& log)
 {
     const double lnl_t0 = lnl_fn(t0, lnl_fn_args);
     const double lcfit_t0 = lcfit_bsm_log_like(t0, model);
@@ -73,7 +85,7 @@ void sample_curves(double (*lnl_fn)(double, void*), void* lnl_fn_args, const bsm
     compute_sampling_bounds(lnl_fn, lnl_fn_args, min_t, max_t, t0,
                             lnl_threshold, &left_t, &right_t);
 
-    std::cerr << "left = " << left_t << ", right = " << right_t << "\n";
+    log << "left = " << left_t << ", right = " << right_t << "\n";
 
     const size_t n_samples = 501;
     const double delta = (right_t - left_t) / (n_samples - 1);
@@ -83,13 +95,20 @@ void sample_curves(double (*lnl_fn)(double, void*), void* lnl_fn_args, const bsm
         const double empirical_lnl = lnl_fn(t, lnl_fn_args) - lnl_t0;
         const double fit_lnl = lcfit_bsm_log_like(t, model) - lcfit_t0;
 
-        output << node_id << ","
-               << t << ","
-               << empirical_lnl << ","
-               << fit_lnl << "\n";
+        rows.insert(rows.end(), {static_cast<double>(node_id), t, empirical_lnl, fit_lnl});
     }
 }
 
+/** Options controlling how the empirical and lcfit curves are sampled. */
+struct sampling_options {
+    /** Sample adaptively rather than on a uniform grid. */
+    bool adaptive;
+    /** Maximum number of empirical evaluations for adaptive sampling. */
+    size_t max_points;
+    /** Subdivision tolerance for adaptive sampling, in log-likelihood units. */
+    double tolerance;
+};
+
 double compute_fit_error(double (*lnl_fn)(double, void*), void* lnl_fn_args,
                          const bsm_t* model, const double t0, const double t)
 {
@@ -102,6 +121,191 @@ double compute_fit_error(double (*lnl_fn)(double, void*), void* lnl_fn_args,
     return empirical_lnl - fit_lnl;
 }
 
+/** Buffered output for one node, written once all earlier nodes are done. */
+struct node_output {
+    /** Rows for the fit file, stored row-major. */
+    std::vector<double> lcfit_rows;
+    /** Rows for the lnl file, stored row-major. */
+    std::vector<double> lnl_rows;
+    std::string log;
+    std::exception_ptr error;
+    bool done = false;
+};
+
+/** Body of #process_node, writing diagnostics to \c log. */
+void fit_and_sample_node(const bpp::TreeLikelihood& bpp_tree_like, std::mutex& clone_mutex,
+                         const int node_id, const bool quiet, const sampling_options& sampling,
+                         node_output& out, std::ostringstream& log)
+{
+    log << "[lcfit eval] Node " << std::setw(4) << node_id << "\n";
+
+    //
+    // initialize the tree likelihood calculator
+    //
+
+    // clone the tree likelihood calculator to ensure that any
+    // changes are isolated to computations for this node
+
+    std::unique_ptr<bpp::TreeLikelihood> tl;
+    {
+        std::lock_guard<std::mutex> lock(clone_mutex);
+        tl.reset(bpp_tree_like.clone());
+    }
+
+    // derivatives can be enabled/disabled before the call to
+    // `tl->initialize()`. if they are disabled, computed
+    // derivative values will be zero. it appears that "enabled"
+    // is the default, but we enable them explicitly for clarity.
+
+    tl->enableDerivatives(true);
+    tl->initialize();
+
+    log_likelihood_data lnl_data = { tl.get(), node_id };
+
+    //
+    // find t0
+    //
+
+    bpp::DiscreteRatesAcrossSitesTreeLikelihood* drastl = dynamic_cast<bpp::DiscreteRatesAcrossSitesTreeLikelihood*>(tl.get());
+
+    bpp::ParameterList pl;
+    pl.addParameter(drastl->getBranchLengthsParameters().getParameter("BrLen" + std::to_string(node_id)));
+    if (quiet) {
+        // the default message and profiler streams are shared, so
+        // keep workers off them when running in parallel
+        bpp::OptimizationTools::optimizeBranchLengthsParameters(drastl, pl, nullptr, 0.000001, 1000000,
+                                                                nullptr, nullptr, 0);
+    } else {
+        bpp::OptimizationTools::optimizeBranchLengthsParameters(drastl, pl);
+    }
+
+    const double t0 = tl->getParameterValue("BrLen" + std::to_string(node_id));
+
+    log << "t0 = " << t0 << "\n";
+
+    //
+    // find d1 and d2 at t0
+    //
+
+    // ensure branch length is set to t0
+    tl->setParameterValue("BrLen" + std::to_string(node_id), t0);
+
+    // GOTCHA: for unknown reasons the values returned by these
+    // functions appear to be the negatives of the corresponding
+    // derivatives, so we negate them again to get the proper
+    // values.
+    const double d1 = -(tl->getFirstOrderDerivative("BrLen" + std::to_string(node_id)));
+    const double d2 = -(tl->getSecondOrderDerivative("BrLen" + std::to_string(node_id)));
+
+    log << "d1(t0) = " << d1 << "\n";
+    log << "d2(t0) = " << d2 << "\n";
+
+    //
+    // fit with lcfit
+    //
+
+    const double min_t = 1e-6;
+    const double max_t = 20.0;
+
+    bsm_t model = {1100.0, 800.0, 2.0, 0.5};
+
+    // GOTCHA: this function will change the current branch length
+    lcfit_fit_auto(&log_likelihood_callback, &lnl_data, &model, min_t, max_t);
+
+    // compute the fit error at max_t
+    const double err_max_t =
+            compute_fit_error(&log_likelihood_callback, &lnl_data, &model, t0, max_t);
+
+    out.lcfit_rows = {static_cast<double>(node_id), model.c, model.m,
+                      model.r, model.b, t0, d1, d2, err_max_t};
+
+    //
+    // sample empirical and lcfit curves
+    //
+
+    // GOTCHA: this function will change the current branch length
+    if (sampling.adaptive) {
+        lcfit::sample_curves_adaptive(&log_likelihood_callback, &lnl_data, &model,
+                                      min_t, max_t, t0, node_id, sampling.max_points,
+                                      sampling.tolerance, out.lnl_rows, log);
+    } else {
+        sample_curves(&log_likelihood_callback, &lnl_data, &model,
+                      min_t, max_t, t0, node_id, out.lnl_rows, log);
+    }
+}
+
+/**
+ * Fit and sample the likelihood curve for a single node.
+ *
+ * Works on a private clone of \c bpp_tree_like, so calls for
+ * different nodes may run concurrently. Rows for the fit and lnl
+ * files, and diagnostic messages, are stored in \c out rather than
+ * written to the shared streams. The messages are stored even if the
+ * node fails, so they can be printed before the error.
+ */
+void process_node(const bpp::TreeLikelihood& bpp_tree_like, std::mutex& clone_mutex,
+                  const int node_id, const bool quiet, const sampling_options& sampling,
+                  node_output& out)
+{
+    std::ostringstream log;
+
+    try {
+        fit_and_sample_node(bpp_tree_like, clone_mutex, node_id, quiet, sampling, out, log);
+    } catch (...) {
+        out.log = log.str();
+        throw;
+    }
+
+    out.log = log.str();
+}
+
+/** An output table, written either as CSV or as a columnar file. */
+class table_output {
+public:
+    table_output(const std::string& path, const std::vector<std::string>& columns, const bool binary) :
+        n_columns_(columns.size())
+    {
+        if (binary) {
+            binary_.reset(new lcfit::columnar_writer(path, columns));
+            return;
+        }
+
+        csv_.open(path);
+        for (size_t j = 0; j < columns.size(); ++j) {
+            csv_ << (j ? "," : "") << columns[j];
+        }
+        csv_ << "\n";
+        csv_ << std::setprecision(std::numeric_limits<double>::max_digits10);
+    }
+
+    /** Append rows stored row-major. */
+    void add_rows(const std::vector<double>& rows)
+    {
+        if (binary_) {
+            binary_->add_rows(rows.data(), rows.size() / n_columns_);
+            return;
+        }
+
+        for (size_t i = 0; i < rows.size(); ++i) {
+            csv_ << rows[i] << ((i + 1) % n_columns_ ? "," : "\n");
+        }
+    }
+
+    void close()
+    {
+        if (binary_) {
+            binary_->close();
+        } else {
+            csv_.close();
+        }
+    }
+
+private:
+    size_t n_columns_;
+    std::ofstream csv_;
+    std::unique_ptr<lcfit::columnar_writer> binary_;
+};
+
 int run_main(int argc, char** argv)
 {
     bpp::BppApplication lcfit_compare(argc, argv, "lcfit-compare");
@@ -158,106 +362,110 @@ int run_main(int argc, char** argv)
     }
 
     // Output files
+    const std::string output_format = bpp::ApplicationTools::getStringParameter("lcfit.output.format", params, "csv", "", true, false);
+    if (output_format != "csv" && output_format != "binary") {
+        throw std::runtime_error("Unknown output format: " + output_format);
+    }
+    const bool binary = output_format == "binary";
+
     std::string lnl_filename = bpp::ApplicationTools::getAFilePath("lcfit.output.lnl_file", params, true, false);
-    std::ofstream lnl_output(lnl_filename);
-    lnl_output << "node_id,t,empirical,lcfit\n";
-    lnl_output << std::setprecision(std::numeric_limits<double>::max_digits10);
+    table_output lnl_output(lnl_filename, {"node_id", "t", "empirical", "lcfit"}, binary);
 
     std::string lcfit_filename = bpp::ApplicationTools::getAFilePath("lcfit.output.fit_file", params, true, false);
-    std::ofstream lcfit_output(lcfit_filename);
-    lcfit_output << "node_id,c,m,r,b,t0,d1,d2,err_max_t\n";
-    lcfit_output << std::setprecision(std::numeric_limits<double>::max_digits10);
+    table_output lcfit_output(lcfit_filename, {"node_id", "c", "m", "r", "b", "t0", "d1", "d2", "err_max_t"}, binary);
+
+    // Curve sampling
+    const std::string sample_mode = bpp::ApplicationTools::getStringParameter("lcfit.sample.mode", params, "uniform", "", true, false);
+    if (sample_mode != "uniform" && sample_mode != "adaptive") {
+        throw std::runtime_error("Unknown sampling mode: " + sample_mode);
+    }
+
+    sampling_options sampling;
+    sampling.adaptive = sample_mode == "adaptive";
+    sampling.max_points = bpp::ApplicationTools::getParameter<size_t>("lcfit.sample.max_points", params, 101, "", true, false);
+    sampling.tolerance = bpp::ApplicationTools::getDoubleParameter("lcfit.sample.tolerance", params, 1e-2, "", true, false);
 
     //
     // Run evaluations on each node, write output
     //
 
-    for (const int& node_id : tree.getNodesId()) {
-        if (!tree.hasDistanceToFather(node_id)) {
-            continue;
-        }
-
-        clog << "[lcfit eval] Node " << std::setw(4) << node_id << "\n";
-
-        //
-        // initialize the tree likelihood calculator
-        //
-
-        // clone the tree likelihood calculator to ensure that any
-        // changes are isolated to computations for this node
+    // Nodes are handed out to the worker threads in order; each
+    // worker buffers its output, and this thread writes the buffers
+    // out in node order as they complete, so the output files do not
+    // depend on the number of threads.
 
-        std::unique_ptr<bpp::TreeLikelihood> tl(bpp_tree_like->clone());
-
-        // derivatives can be enabled/disabled before the call to
-        // `tl->initialize()`. if they are disabled, computed
-        // derivative values will be zero. it appears that "enabled"
-        // is the default, but we enable them explicitly for clarity.
-
-        tl->enableDerivatives(true);
-        tl->initialize();
-
-        log_likelihood_data lnl_data = { tl.get(), node_id };
-
-        //
-        // find t0
-        //
-
-        bpp::DiscreteRatesAcrossSitesTreeLikelihood* drastl = dynamic_cast<bpp::DiscreteRatesAcrossSitesTreeLikelihood*>(tl.get());
-
-        bpp::ParameterList pl;
-        pl.addParameter(drastl->getBranchLengthsParameters().getParameter("BrLen" + std::to_string(node_id)));
-        bpp::OptimizationTools::optimizeBranchLengthsParameters(drastl, pl);
-
-        const double t0 = tl->getParameterValue("BrLen" + std::to_string(node_id));
-
-        std::cerr << "t0 = " << t0 << "\n";
-
-        //
-        // find d1 and d2 at t0
-        //
-
-        // ensure branch length is set to t0
-        tl->setParameterValue("BrLen" + std::to_string(node_id), t0);
-
-        // GOTCHA: for unknown reasons the values returned by these
-        // functions appear to be the negatives of the corresponding
-        // derivatives, so we negate them again to get the proper
-        // values.
-        const double d1 = -(tl->getFirstOrderDerivative("BrLen" + std::to_string(node_id)));
-        const double d2 = -(tl->getSecondOrderDerivative("BrLen" + std::to_string(node_id)));
-
-        std::cerr << "d1(t0) = " << d1 << "\n";
-        std::cerr << "d2(t0) = " << d2 << "\n";
-
-        //
-        // fit with lcfit
-        //
+    int n_threads = bpp::ApplicationTools::getIntParameter("threads", params, 1, "", true, false);
+    if (n_threads < 1) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
 
-        const double min_t = 1e-6;
-        const double max_t = 20.0;
+    std::vector<int> node_ids;
+    for (const int& node_id : tree.getNodesId()) {
+        if (tree.hasDistanceToFather(node_id)) {
+            node_ids.push_back(node_id);
+        }
+    }
 
-        bsm_t model = {1100.0, 800.0, 2.0, 0.5};
+    std::vector<node_output> outputs(node_ids.size());
+    std::atomic<size_t> next_node(0);
+    std::mutex clone_mutex;
+    std::mutex output_mutex;
+    std::condition_variable output_ready;
+    const bool quiet = n_threads > 1;
+
+    auto worker = [&]() {
+        for (size_t i = next_node++; i < node_ids.size(); i = next_node++) {
+            node_output out;
+            try {
+                process_node(*bpp_tree_like, clone_mutex, node_ids[i], quiet, sampling, out);
+            } catch (...) {
+                out.error = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                outputs[i] = std::move(out);
+                outputs[i].done = true;
+            }
+            output_ready.notify_one();
+        }
+    };
 
-        // GOTCHA: this function will change the current branch length
-        lcfit_fit_auto(&log_likelihood_callback, &lnl_data, &model, min_t, max_t);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < n_threads; ++i) {
+        pool.emplace_back(worker);
+    }
 
-        // compute the fit error at max_t
-        const double err_max_t =
-                compute_fit_error(&log_likelihood_callback, &lnl_data, &model, t0, max_t);
+    std::exception_ptr error;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        std::unique_lock<std::mutex> lock(output_mutex);
+        output_ready.wait(lock, [&outputs, i] { return outputs[i].done; });
+        node_output out = std::move(outputs[i]);
+        lock.unlock();
+
+        std::cerr << out.log;
+        if (out.error) {
+            // stop handing out nodes and report the first failure
+            error = out.error;
+            next_node = node_ids.size();
+            break;
+        }
 
-        lcfit_output << node_id << "," << model.c << "," << model.m << ","
-                     << model.r << "," << model.b << "," << t0 << ","
-                     << d1 << "," << d2 << "," << err_max_t << "\n";
+        lcfit_output.add_rows(out.lcfit_rows);
+        lnl_output.add_rows(out.lnl_rows);
+    }
 
-        //
-        // sample empirical and lcfit curves
-        //
+    for (std::thread& t : pool) {
+        t.join();
+    }
 
-        // GOTCHA: this function will change the current branch length
-        sample_curves(&log_likelihood_callback, &lnl_data, &model,
-                      min_t, max_t, t0, node_id, lnl_output);
+    if (error) {
+        std::rethrow_exception(error);
     }
 
+    lcfit_output.close();
+    lnl_output.close();
+
     return 0;
 }
 
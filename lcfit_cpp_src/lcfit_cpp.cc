@@ -8,6 +8,7 @@
 #include <cassert>
 #include <iterator>
 #include <iostream>
+#include <new>
 #include <stdexcept>
 
 using namespace std;
@@ -15,7 +16,7 @@ using namespace std;
 namespace lcfit
 {
 
-void print_points(const std::vector<Point>& points, std::string prefix = "")
+void print_points(const std::vector<Point>& points, std::string prefix)
 {
     Monotonicity c = monotonicity(points);
     if (c == Monotonicity::MONO_DEC) {
@@ -37,88 +38,142 @@ void print_points(const std::vector<Point>& points, std::string prefix = "")
     fprintf(stderr, "\n");
 }
 
-struct point_by_y_desc
+std::vector<Point> select_points(std::function<double(double)> log_like,
+                                 const std::vector<double>& starting_pts,
+                                 const size_t max_points)
 {
-    inline bool operator()(const Point& p1, const Point& p2)
-    {
-        return p1.y > p2.y;
-    };
-};
+    return select_points<std::function<double(double)>&>(log_like, starting_pts, max_points);
+}
 
-struct point_by_y
+vector<Point> select_points(std::function<double(double)> log_like,
+                            const std::vector<Point>& starting_pts,
+                            const size_t max_points)
 {
-    inline bool operator()(const Point& p1, const Point& p2)
-    {
-        return p1.y < p2.y;
-    };
-};
+    return select_points<std::function<double(double)>&>(log_like, starting_pts, max_points);
+}
 
-struct point_by_x
+PointSet::PointSet(size_t capacity)
 {
-    inline bool operator()(const Point& p1, const Point& p2)
-    {
-        return p1.x < p2.x;
-    };
-};
+    if (!point_set_init(&set_, std::max<size_t>(capacity, 1))) {
+        throw bad_alloc();
+    }
+}
 
-std::vector<Point> select_points(std::function<double(double)> log_like,
-                                 const std::vector<double>& starting_pts,
-                                 const size_t max_points)
+PointSet::~PointSet()
 {
-    std::vector<Point> points;
+    point_set_free(&set_);
+}
 
-    // Evaluate log-likelihood at starting points
-    for (const double& d: starting_pts) {
-        points.push_back({d, log_like(d)});
+PointSet::PointSet(PointSet&& other) noexcept : set_(other.set_)
+{
+    other.set_.buf = nullptr;
+    other.set_.capacity = 0;
+    other.set_.n = 0;
+}
+
+PointSet& PointSet::operator=(PointSet&& other) noexcept
+{
+    if (this != &other) {
+        point_set_free(&set_);
+        set_ = other.set_;
+        other.set_.buf = nullptr;
+        other.set_.capacity = 0;
+        other.set_.n = 0;
     }
 
-    return select_points(log_like, points, max_points);
+    return *this;
 }
 
-vector<Point> select_points(std::function<double(double)> log_like,
-                            const std::vector<Point>& starting_pts,
-                            const size_t max_points)
+void PointSet::reset(size_t capacity)
 {
-    vector<Point> points(starting_pts);
-
-#ifdef VERBOSE
-    print_points(points, "PRE:  ");
-#endif /* VERBOSE */
+    if (capacity > set_.capacity) {
+        point_set_t grown;
+        if (!point_set_init(&grown, capacity)) {
+            throw bad_alloc();
+        }
+        point_set_free(&set_);
+        set_ = grown;
+    } else {
+        point_set_clear(&set_);
+    }
+}
 
-    // Add additional samples until the evaluated branch lengths enclose a maximum.
-    size_t offset; // Position
-    double d;      // Branch length
+void PointSet::insert(const Point& p)
+{
+    const point_t pt = {p.x, p.y};
+    if (!point_set_insert(&set_, pt)) {
+        throw length_error("PointSet is full");
+    }
+}
 
-    Monotonicity c = monotonicity(points);
-    while (points.size() < max_points && c != Monotonicity::NON_MONOTONIC) {
-        switch (c) {
-            case Monotonicity::MONO_INC:
-                // Double largest value
-                d = points.back().x * 2.0;
-                offset = points.size();
-                break;
-            case Monotonicity::MONO_DEC:
-                // Add new smallest value - order of magnitude lower
-                d = points[0].x / 10.0;
-                offset = 0;
-                break;
-            default:
-                assert(false);
-        }
+Monotonicity PointSet::monotonicity() const
+{
+    assert(size() > 1);
+    const bool maybe_inc = set_.n_dec == 0;
+    const bool maybe_dec = set_.n_inc == 0;
+    assert(!(maybe_inc && maybe_dec));
 
-        // Insert point
-        points.insert(begin(points) + offset, {d, log_like(d)});
+    if (!maybe_inc && !maybe_dec) return Monotonicity::NON_MONOTONIC;
+    else if (maybe_inc) return Monotonicity::MONO_INC;
+    else return Monotonicity::MONO_DEC;
+}
 
-        c = monotonicity(points);
+void PointSet::copy_to(std::vector<Point>& out) const
+{
+    const point_t* pts = point_set_points(&set_);
+    out.clear();
+    out.reserve(size());
+    for (size_t i = 0; i < size(); ++i) {
+        out.push_back({pts[i].t, pts[i].ll});
+    }
+}
 
-        assert(is_sorted(points.begin(), points.end(), point_by_x()));
+Fitter::Fitter(const size_t max_points, const int max_iter) :
+    max_points_(max_points),
+    max_iter_(max_iter),
+    points_(max_points),
+    workspace_(lcfit_fit_workspace_alloc())
+{
+    if (workspace_ == nullptr) {
+        throw bad_alloc();
     }
 
-#ifdef VERBOSE
-    print_points(points, "POST: ");
-#endif /* VERBOSE */
+    t_.reserve(max_points);
+    l_.reserve(max_points);
+    w_.reserve(max_points);
+}
 
-    return points;
+Fitter::~Fitter()
+{
+    lcfit_fit_workspace_free(workspace_);
+}
+
+Fitter::Fitter(Fitter&& other) noexcept :
+    max_points_(other.max_points_),
+    max_iter_(other.max_iter_),
+    points_(std::move(other.points_)),
+    t_(std::move(other.t_)),
+    l_(std::move(other.l_)),
+    w_(std::move(other.w_)),
+    workspace_(other.workspace_)
+{
+    other.workspace_ = nullptr;
+}
+
+Fitter& Fitter::operator=(Fitter&& other) noexcept
+{
+    if (this != &other) {
+        lcfit_fit_workspace_free(workspace_);
+        max_points_ = other.max_points_;
+        max_iter_ = other.max_iter_;
+        points_ = std::move(other.points_);
+        t_ = std::move(other.t_);
+        l_ = std::move(other.l_);
+        w_ = std::move(other.w_);
+        workspace_ = other.workspace_;
+        other.workspace_ = nullptr;
+    }
+    return *this;
 }
 
 vector<Point> retain_top(const vector<Point>& points, const size_t n)
@@ -156,31 +211,28 @@ Monotonicity monotonicity(const std::vector<Point>& points)
 LCFitResult fit_bsm_log_likelihood(std::function<double(double)> log_like,
                                    const bsm_t& init_model,
                                    const std::vector<double>& sample_points,
-                                   const size_t max_points, int max_iter)
+                                   const size_t max_points, int max_iter,
+                                   const lcfit_cancel_t* cancel)
 {
-    bsm_t model = init_model;
-
-    const vector<Point> points = lcfit::select_points(log_like, sample_points, max_points);
-    const Point p = *std::max_element(begin(points), end(points), point_by_y());
-    const double scale_factor = lcfit_bsm_scale_factor(p.x, p.y, &model);
-    model.c *= scale_factor;
-    model.m *= scale_factor;
+    return fit_bsm_log_likelihood<std::function<double(double)>&>(log_like, init_model,
+                                                                  sample_points, max_points,
+                                                                  max_iter, cancel);
+}
 
-    vector<double> t, l;
-    t.reserve(points.size());
-    l.reserve(points.size());
-    for (const Point& p : points) {
-        t.push_back(p.x);
-        l.push_back(p.y);
-    }
+Deadline::Deadline(clock::time_point when) :
+    when_(when),
+    token_{&Deadline::cancelled, this}
+{
+}
 
-    const int status = lcfit_fit_bsm(t.size(), t.data(), l.data(), &model, max_iter);
-    // Used to be that lcfit_fit_bsm() could not return a non-zero status,
-    // but now that it can, we are frequently throwing an error here.
-    // temporarily disable this test so SCons can complete the simulation in the face of errors.
-    // if(status) throw runtime_error("lcfit_fit_bsm returned: " + std::to_string(status));
+Deadline::Deadline(clock::duration timeout) :
+    Deadline(clock::now() + timeout)
+{
+}
 
-    return {points, model};
+int Deadline::cancelled(void* ctx)
+{
+    return static_cast<const Deadline*>(ctx)->expired();
 }
 
 } // namespace lcfit
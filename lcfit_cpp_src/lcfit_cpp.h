@@ -9,9 +9,15 @@
 #define LCFIT_CPP_H
 
 #include "lcfit.h"
+#include "lcfit_select.h"
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cstdlib>
 #include <functional>
+#include <string>
+#include <utility>
 #include <vector>
 
 /** lcfit C++ API */
@@ -42,6 +48,85 @@ struct Point
     };
 };
 
+/** Orders points by decreasing \c y. */
+struct point_by_y_desc
+{
+    inline bool operator()(const Point& p1, const Point& p2) const
+    {
+        return p1.y > p2.y;
+    };
+};
+
+/** Orders points by increasing \c y. */
+struct point_by_y
+{
+    inline bool operator()(const Point& p1, const Point& p2) const
+    {
+        return p1.y < p2.y;
+    };
+};
+
+/** Orders points by increasing \c x. */
+struct point_by_x
+{
+    inline bool operator()(const Point& p1, const Point& p2) const
+    {
+        return p1.x < p2.x;
+    };
+};
+
+/**
+ * Owner of a #point_set_t: points ordered by increasing branch
+ * length, with constant-time insertion at either end and
+ * constant-time classification.
+ */
+class PointSet
+{
+public:
+    /** Construct an empty set with room for \c capacity points. */
+    explicit PointSet(size_t capacity);
+    ~PointSet();
+
+    PointSet(const PointSet&) = delete;
+    PointSet& operator=(const PointSet&) = delete;
+    PointSet(PointSet&& other) noexcept;
+    PointSet& operator=(PointSet&& other) noexcept;
+
+    /** Remove all points, growing the storage to hold at least \c capacity points. */
+    void reset(size_t capacity);
+
+    /** Insert a point; throws \c std::length_error if the set is full. */
+    void insert(const Point& p);
+
+    /** Number of points in the set. */
+    size_t size() const { return set_.n; }
+
+    /** The point with the <tt>i</tt>th smallest branch length. */
+    Point operator[](size_t i) const
+    {
+        const point_t& p = point_set_points(&set_)[i];
+        return {p.t, p.ll};
+    }
+
+    /** The point with the smallest branch length. */
+    Point front() const { return (*this)[0]; }
+
+    /** The point with the largest branch length. */
+    Point back() const { return (*this)[size() - 1]; }
+
+    /** The point with the maximum log-likelihood. */
+    Point max() const { return (*this)[set_.max_i]; }
+
+    /** Classify the points as #lcfit::monotonicity would. */
+    Monotonicity monotonicity() const;
+
+    /** Replace the contents of \c out with the points in the set. */
+    void copy_to(std::vector<Point>& out) const;
+
+private:
+    point_set_t set_;
+};
+
 /** Results obtained from lcfit. */
 struct LCFitResult
 {
@@ -49,11 +134,77 @@ struct LCFitResult
     std::vector<Point> evaluated_points;
     /** The fitted model parameters. */
     bsm_t model_fit;
+    /** The #lcfit_status of the fit, #LCFIT_CANCELLED if it was
+     *  stopped by its cancellation token. */
+    int status;
+};
+
+/**
+ * A cancellation token that expires at a point in time.
+ *
+ * Passing #token to a fit bounds its latency: the fit stops before
+ * the first evaluation that would start after the deadline. As the
+ * token refers to the Deadline, it must outlive the fits using it,
+ * and it is neither copyable nor movable.
+ */
+class Deadline
+{
+public:
+    /** Clock the deadline is measured on. */
+    typedef std::chrono::steady_clock clock;
+
+    /** A deadline at \c when. */
+    explicit Deadline(clock::time_point when);
+    /** A deadline \c timeout from now. */
+    explicit Deadline(clock::duration timeout);
+
+    Deadline(const Deadline&) = delete;
+    Deadline& operator=(const Deadline&) = delete;
+
+    /** Whether the deadline has passed. */
+    bool expired() const { return clock::now() >= when_; }
+
+    /** The cancellation token to pass to a fit. */
+    const lcfit_cancel_t* token() const { return &token_; }
+
+private:
+    static int cancelled(void* ctx);
+
+    clock::time_point when_;
+    lcfit_cancel_t token_;
 };
 
 /** Classify a \c std::vector of \ref Point ordered by increasing branch length. */
 Monotonicity monotonicity(const std::vector<Point>& points);
 
+/** Print points and their monotonicity to \c stderr, for debugging. */
+void print_points(const std::vector<Point>& points, std::string prefix = "");
+
+/**
+ * Select points to use in fitting the BSM for a given log-likelihood function.
+ *
+ * This overload accepts any callable taking and returning a \c
+ * double, so that cheap log-likelihood functions can be inlined
+ * rather than called through \c std::function. See
+ * \ref select_points(std::function<double(double)>, const std::vector<double>&, const size_t).
+ */
+template<typename Callable>
+std::vector<Point> select_points(Callable&& log_like,
+                                 const std::vector<double>& starting_pts,
+                                 const size_t max_points=8);
+
+/**
+ * Select points to use in fitting the BSM for a given log-likelihood function.
+ *
+ * This overload accepts any callable taking and returning a \c
+ * double. See
+ * \ref select_points(std::function<double(double)>, const std::vector<Point>&, const size_t).
+ */
+template<typename Callable>
+std::vector<Point> select_points(Callable&& log_like,
+                                 const std::vector<Point>& starting_pts,
+                                 const size_t max_points=8);
+
 /**
  * Select points to use in fitting the BSM for a given log-likelihood function.
  *
@@ -97,6 +248,22 @@ std::vector<Point> select_points(std::function<double(double)>,
                                  const std::vector<Point>&,
                                  const size_t max_points=8);
 
+/**
+ * Extend a \ref PointSet in place until it encloses a maximum.
+ *
+ * This is the in-place form of
+ * \ref select_points(std::function<double(double)>, const std::vector<Point>&, const size_t),
+ * used when the caller wants to reuse the set's storage across calls.
+ * \c points must have room for \c max_points points.
+ *
+ * \return \c false if \c cancel stopped the selection before an
+ *         evaluation, leaving the points evaluated so far.
+ */
+template<typename Callable>
+bool select_points(Callable&& log_like, PointSet& points,
+                   const size_t max_points=8,
+                   const lcfit_cancel_t* cancel=nullptr);
+
 /**
  * Select the top \c n from a \c std::vector of \ref Point by \c y.
  *
@@ -122,13 +289,243 @@ std::vector<Point> retain_top(const std::vector<Point>& points, const size_t n);
  * \param[in] sample_points  Starting branch lengths.
  * \param[in] max_points     Maximum number of points to sample.
  * \param[in] max_iter       Maximum number of fit iterations.
+ * \param[in] cancel         Cancellation token, or \c nullptr. The
+ *                           token is checked before each evaluation;
+ *                           a cancelled fit returns \c init_model
+ *                           rescaled to the best point evaluated so
+ *                           far, with status #LCFIT_CANCELLED.
  *
  * \return The fitted model parameters and points evaluated during fitting.
  */
 LCFitResult fit_bsm_log_likelihood(std::function<double(double)>, const bsm_t&,
                                    const std::vector<double>&,
                                    const size_t max_points=8,
-                                   const int max_iter=250);
+                                   const int max_iter=250,
+                                   const lcfit_cancel_t* cancel=nullptr);
+
+/**
+ * Fit a given model to empirical likelihood data with weighting.
+ *
+ * This overload accepts any callable taking and returning a \c
+ * double. See
+ * \ref fit_bsm_log_likelihood(std::function<double(double)>, const bsm_t&, const std::vector<double>&, const size_t, const int).
+ */
+template<typename Callable>
+LCFitResult fit_bsm_log_likelihood(Callable&& log_like, const bsm_t& init_model,
+                                   const std::vector<double>& sample_points,
+                                   const size_t max_points=8,
+                                   const int max_iter=250,
+                                   const lcfit_cancel_t* cancel=nullptr);
+
+/**
+ * Reusable BSM fitter.
+ *
+ * A Fitter owns the point set, sample buffers and solver workspace
+ * needed by #lcfit::fit_bsm_log_likelihood, and reuses them from one
+ * fit to the next. When fitting many curves in turn (e.g. one per
+ * edge of a tree), keeping a Fitter and an \ref LCFitResult alive
+ * across calls avoids all per-fit allocations once the buffers have
+ * grown to size.
+ *
+ * A Fitter is movable but not copyable, and must not be shared
+ * between threads.
+ */
+class Fitter
+{
+public:
+    /**
+     * \param[in] max_points  Maximum number of points to sample.
+     * \param[in] max_iter    Maximum number of fit iterations.
+     */
+    explicit Fitter(const size_t max_points=8, const int max_iter=250);
+    ~Fitter();
+
+    Fitter(const Fitter&) = delete;
+    Fitter& operator=(const Fitter&) = delete;
+    Fitter(Fitter&& other) noexcept;
+    Fitter& operator=(Fitter&& other) noexcept;
+
+    /**
+     * Fit the BSM to a log-likelihood function.
+     *
+     * Behaves as #lcfit::fit_bsm_log_likelihood, but writes into \c
+     * result, reusing the storage of \c result.evaluated_points.
+     *
+     * \param[in]  log_like       Empirical log-likelihood function.
+     * \param[in]  init_model     Initial model parameters.
+     * \param[in]  sample_points  Starting branch lengths.
+     * \param[out] result         Fitted model and evaluated points.
+     * \param[in]  cancel         Cancellation token, or \c nullptr.
+     *
+     * \return An #lcfit_status code from the underlying fit, also
+     *         stored in \c result.status.
+     */
+    template<typename Callable>
+    int fit(Callable&& log_like, const bsm_t& init_model,
+            const std::vector<double>& sample_points,
+            LCFitResult& result,
+            const lcfit_cancel_t* cancel=nullptr);
+
+private:
+    size_t max_points_;
+    int max_iter_;
+    PointSet points_;
+    std::vector<double> t_, l_, w_;
+    lcfit_fit_workspace* workspace_;
+};
+
+//
+// Template implementations
+//
+
+template<typename Callable>
+std::vector<Point> select_points(Callable&& log_like,
+                                 const std::vector<double>& starting_pts,
+                                 const size_t max_points)
+{
+    std::vector<Point> points;
+    points.reserve(std::max(starting_pts.size(), max_points));
+
+    // Evaluate log-likelihood at starting points
+    for (const double& d: starting_pts) {
+        points.push_back({d, log_like(d)});
+    }
+
+    return select_points<Callable&>(log_like, points, max_points);
+}
+
+template<typename Callable>
+std::vector<Point> select_points(Callable&& log_like,
+                                 const std::vector<Point>& starting_pts,
+                                 const size_t max_points)
+{
+    PointSet points(std::max(starting_pts.size(), max_points));
+    for (const Point& p : starting_pts) {
+        points.insert(p);
+    }
+
+#ifdef VERBOSE
+    print_points(starting_pts, "PRE:  ");
+#endif /* VERBOSE */
+
+    select_points<Callable&>(log_like, points, max_points);
+
+    std::vector<Point> result;
+    points.copy_to(result);
+
+#ifdef VERBOSE
+    print_points(result, "POST: ");
+#endif /* VERBOSE */
+
+    return result;
+}
+
+template<typename Callable>
+bool select_points(Callable&& log_like, PointSet& points,
+                   const size_t max_points, const lcfit_cancel_t* cancel)
+{
+    // Add additional samples until the evaluated branch lengths enclose a maximum.
+    double d = 0.0; // Branch length
+
+    Monotonicity c = points.monotonicity();
+    while (points.size() < max_points && c != Monotonicity::NON_MONOTONIC) {
+        switch (c) {
+            case Monotonicity::MONO_INC:
+                // Double largest value
+                d = points.back().x * 2.0;
+                break;
+            case Monotonicity::MONO_DEC:
+                // Add new smallest value - order of magnitude lower
+                d = points.front().x / 10.0;
+                break;
+            default:
+                assert(false);
+        }
+
+        if (lcfit_cancelled(cancel)) {
+            return false;
+        }
+
+        // Insert point; new points are always at either end, so this
+        // and the classification below take constant time
+        points.insert({d, log_like(d)});
+
+        c = points.monotonicity();
+    }
+
+    return true;
+}
+
+template<typename Callable>
+LCFitResult fit_bsm_log_likelihood(Callable&& log_like, const bsm_t& init_model,
+                                   const std::vector<double>& sample_points,
+                                   const size_t max_points, const int max_iter,
+                                   const lcfit_cancel_t* cancel)
+{
+    Fitter fitter(max_points, max_iter);
+    LCFitResult result;
+
+    // Used to be that lcfit_fit_bsm() could not return a non-zero status,
+    // but now that it can, we are frequently throwing an error here.
+    // temporarily disable this test so SCons can complete the simulation in the face of errors.
+    // if(status) throw runtime_error("lcfit_fit_bsm returned: " + std::to_string(status));
+    fitter.fit(log_like, init_model, sample_points, result, cancel);
+
+    return result;
+}
+
+template<typename Callable>
+int Fitter::fit(Callable&& log_like, const bsm_t& init_model,
+                const std::vector<double>& sample_points,
+                LCFitResult& result,
+                const lcfit_cancel_t* cancel)
+{
+    points_.reset(std::max(sample_points.size(), max_points_));
+
+    bool cancelled = false;
+    for (const double& d : sample_points) {
+        if (lcfit_cancelled(cancel)) {
+            cancelled = true;
+            break;
+        }
+        points_.insert({d, log_like(d)});
+    }
+
+    if (!cancelled) {
+        cancelled = !select_points<Callable&>(log_like, points_, max_points_, cancel);
+    }
+
+    bsm_t& model = result.model_fit;
+    model = init_model;
+    if (points_.size() > 0) {
+        const Point p = points_.max();
+        lcfit_bsm_rescale(p.x, p.y, &model);
+    }
+
+    if (cancelled) {
+        points_.copy_to(result.evaluated_points);
+        result.status = LCFIT_CANCELLED;
+        return result.status;
+    }
+
+    // resize() and assign() keep existing capacity, so these only
+    // allocate while the buffers are still growing
+    const size_t n = points_.size();
+    t_.resize(n);
+    l_.resize(n);
+    w_.assign(n, 1.0);
+    for (size_t i = 0; i < n; ++i) {
+        const Point q = points_[i];
+        t_[i] = q.x;
+        l_[i] = q.y;
+    }
+
+    points_.copy_to(result.evaluated_points);
+
+    result.status = lcfit_fit_bsm_weight_ws(n, t_.data(), l_.data(), w_.data(),
+                                            &model, max_iter_, workspace_);
+    return result.status;
+}
 
 } // namespace lcfit
 
@@ -0,0 +1,417 @@
+#include "lcfit_curve_reader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace lcfit {
+
+const char CURVE_MAGIC[8] = {'L', 'C', 'F', 'I', 'T', 'C', 'R', 'V'};
+
+namespace {
+
+const size_t RECORD_HEADER_SIZE = 16;
+
+/** Initial size of the binary stream buffer. */
+const size_t STREAM_BUFFER_SIZE = 1 << 16;
+
+uint64_t get_le(const unsigned char* in, size_t n_bytes)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < n_bytes; ++i) {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+double get_le_double(const unsigned char* in)
+{
+    const uint64_t bits = get_le(in, 8);
+    double x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+void check_header(const unsigned char* data, size_t size)
+{
+    if (size < CURVE_HEADER_SIZE || std::memcmp(data, CURVE_MAGIC, sizeof(CURVE_MAGIC)) != 0) {
+        throw std::runtime_error("not a binary curve file");
+    }
+    if (get_le(data + 8, 4) != CURVE_VERSION) {
+        throw std::runtime_error("unsupported binary curve file version");
+    }
+}
+
+/** Size in bytes of the record whose header is at \c p. */
+uint64_t record_size(const unsigned char* p)
+{
+    const uint64_t n = get_le(p + 8, 4);
+    const uint32_t flags = get_le(p + 12, 4);
+    const uint64_t n_values = 2 * n + ((flags & CURVE_HAS_DERIVATIVES) ? 3 : 0);
+    return RECORD_HEADER_SIZE + 8 * n_values;
+}
+
+/** Decode the complete record at \c p. */
+void decode_record(const unsigned char* p, curve& c)
+{
+    const uint64_t id = get_le(p, 8);
+    const uint64_t n = get_le(p + 8, 4);
+    const uint32_t flags = get_le(p + 12, 4);
+    c.has_derivatives = (flags & CURVE_HAS_DERIVATIVES) != 0;
+    p += RECORD_HEADER_SIZE;
+
+    c.id = std::to_string(id);
+    c.t.resize(n);
+    c.lnl.resize(n);
+    for (size_t i = 0; i < n; ++i, p += 8) {
+        c.t[i] = get_le_double(p);
+    }
+    for (size_t i = 0; i < n; ++i, p += 8) {
+        c.lnl[i] = get_le_double(p);
+    }
+    if (c.has_derivatives) {
+        c.t0 = get_le_double(p);
+        c.d1 = get_le_double(p + 8);
+        c.d2 = get_le_double(p + 16);
+    }
+}
+
+bool at_end(const char* p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+        ++p;
+    }
+    return *p == '\0';
+}
+
+/** Read up to \c n_bytes from \c fd, stopping early only at the end of the input. */
+std::string read_prefix(int fd, size_t n_bytes)
+{
+    std::string prefix(n_bytes, '\0');
+    size_t n_read = 0;
+    while (n_read < n_bytes) {
+        const ssize_t k = ::read(fd, &prefix[n_read], n_bytes - n_read);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k < 0) {
+            throw std::runtime_error("error reading input");
+        }
+        if (k == 0) {
+            break;
+        }
+        n_read += k;
+    }
+    prefix.resize(n_read);
+    return prefix;
+}
+
+/** A reader together with the file, stream or mapping it reads from. */
+class curve_source : public curve_reader {
+public:
+    curve_source() : fd_(-1), owns_fd_(false), fp_(nullptr), owns_fp_(false),
+                     map_(nullptr), map_size_(0) {}
+
+    ~curve_source()
+    {
+        reader_.reset();
+        if (map_ != nullptr) {
+            ::munmap(map_, map_size_);
+        }
+        if (owns_fp_) {
+            std::fclose(fp_);
+        } else if (owns_fd_) {
+            ::close(fd_);
+        }
+    }
+
+    curve_source(const curve_source&) = delete;
+    curve_source& operator=(const curve_source&) = delete;
+
+    bool next(curve& c) override { return reader_->next(c); }
+
+    int fd_;
+    bool owns_fd_;
+    FILE* fp_;
+    bool owns_fp_;
+    void* map_;
+    size_t map_size_;
+    std::unique_ptr<curve_reader> reader_;
+};
+
+} // namespace
+
+//
+// text_reader
+//
+
+text_reader::text_reader(FILE* fp, const std::string& prefix) :
+    fp_(fp), prefix_(prefix), buf_(nullptr), cap_(0), line_no_(0)
+{
+}
+
+text_reader::~text_reader()
+{
+    std::free(buf_);
+}
+
+bool text_reader::next(curve& c)
+{
+    while (read_line()) {
+        ++line_no_;
+
+        const char* p = line_.c_str();
+        while (*p == ' ' || *p == '\t') {
+            ++p;
+        }
+        if (*p != '\0' && *p != '\n' && *p != '\r' && *p != '#') {
+            parse(p, c);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool text_reader::read_line()
+{
+    const size_t newline = prefix_.find('\n');
+    if (newline != std::string::npos) {
+        line_.assign(prefix_, 0, newline + 1);
+        prefix_.erase(0, newline + 1);
+        return true;
+    }
+
+    const ssize_t n = getline(&buf_, &cap_, fp_);
+    if (n < 0) {
+        if (std::ferror(fp_)) {
+            throw std::runtime_error("error reading input");
+        }
+        line_.swap(prefix_);
+        prefix_.clear();
+        return !line_.empty();
+    }
+
+    line_.swap(prefix_);
+    prefix_.clear();
+    line_.append(buf_, n);
+    return true;
+}
+
+void text_reader::parse(const char* p, curve& c)
+{
+    const char* end = p + std::strcspn(p, " \t");
+    c.id.assign(p, end);
+    p = end;
+
+    char* q;
+    errno = 0;
+    const long n = std::strtol(p, &q, 10);
+    if (q == p || n < 0 || errno != 0) {
+        fail("expected a sample count");
+    }
+    p = q;
+
+    // grow as values are parsed, so a bad count fails at the end of
+    // the line rather than allocating for samples that are not there
+    c.t.clear();
+    c.lnl.clear();
+    for (long i = 0; i < n; ++i) {
+        c.t.push_back(number(p));
+    }
+    for (long i = 0; i < n; ++i) {
+        c.lnl.push_back(number(p));
+    }
+
+    c.has_derivatives = !at_end(p);
+    if (c.has_derivatives) {
+        c.t0 = number(p);
+        c.d1 = number(p);
+        c.d2 = number(p);
+    }
+
+    if (!at_end(p)) {
+        fail("trailing fields");
+    }
+}
+
+double text_reader::number(const char*& p)
+{
+    char* q;
+    const double x = std::strtod(p, &q);
+    if (q == p) {
+        fail("expected a number");
+    }
+    p = q;
+    return x;
+}
+
+void text_reader::fail(const char* what)
+{
+    throw std::runtime_error("line " + std::to_string(line_no_) + ": " + what);
+}
+
+//
+// binary_reader
+//
+
+binary_reader::binary_reader(const unsigned char* data, size_t size) :
+    data_(data), size_(size), pos_(CURVE_HEADER_SIZE)
+{
+    check_header(data_, size_);
+}
+
+bool binary_reader::next(curve& c)
+{
+    if (pos_ == size_) {
+        return false;
+    }
+    if (size_ - pos_ < RECORD_HEADER_SIZE || size_ - pos_ < record_size(data_ + pos_)) {
+        throw std::runtime_error("truncated record");
+    }
+
+    decode_record(data_ + pos_, c);
+    pos_ += record_size(data_ + pos_);
+    return true;
+}
+
+//
+// binary_stream_reader
+//
+
+binary_stream_reader::binary_stream_reader(int fd, const std::string& prefix) :
+    fd_(fd), buf_(std::max(STREAM_BUFFER_SIZE, prefix.size())), begin_(0), end_(prefix.size())
+{
+    std::memcpy(buf_.data(), prefix.data(), prefix.size());
+
+    fill(CURVE_HEADER_SIZE);
+    check_header(buf_.data(), end_);
+    begin_ = CURVE_HEADER_SIZE;
+}
+
+bool binary_stream_reader::next(curve& c)
+{
+    if (!fill(RECORD_HEADER_SIZE)) {
+        if (begin_ == end_) {
+            return false;
+        }
+        throw std::runtime_error("truncated record");
+    }
+
+    const uint64_t size = record_size(buf_.data() + begin_);
+    if (!fill(size)) {
+        throw std::runtime_error("truncated record");
+    }
+
+    decode_record(buf_.data() + begin_, c);
+    begin_ += size;
+    return true;
+}
+
+/**
+ * Read until at least \c n_bytes are buffered; returns false if the
+ * input ends first. The buffer at most doubles per read, so a corrupt
+ * sample count costs no more memory than the data actually read.
+ */
+bool binary_stream_reader::fill(size_t n_bytes)
+{
+    while (end_ - begin_ < n_bytes) {
+        if (begin_ > 0) {
+            std::memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        if (end_ == buf_.size()) {
+            buf_.resize(std::min<size_t>(n_bytes, 2 * buf_.size()));
+        }
+
+        const ssize_t k = ::read(fd_, buf_.data() + end_, buf_.size() - end_);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k < 0) {
+            throw std::runtime_error("error reading input");
+        }
+        if (k == 0) {
+            return false;
+        }
+        end_ += k;
+    }
+
+    return true;
+}
+
+//
+// open_curve_reader
+//
+
+std::unique_ptr<curve_reader> open_curve_reader(const std::string& path)
+{
+    std::unique_ptr<curve_source> source(new curve_source);
+
+    if (path == "-") {
+        source->fd_ = STDIN_FILENO;
+    } else {
+        source->fd_ = ::open(path.c_str(), O_RDONLY);
+        if (source->fd_ < 0) {
+            throw std::runtime_error("could not open " + path);
+        }
+        source->owns_fd_ = true;
+    }
+
+    struct stat st;
+    if (::fstat(source->fd_, &st) != 0) {
+        throw std::runtime_error("could not stat " + path);
+    }
+
+    // stdin is read from its current position, so only named files are mapped
+    if (path != "-" && S_ISREG(st.st_mode) && st.st_size >= static_cast<off_t>(sizeof(CURVE_MAGIC))) {
+        const size_t size = st.st_size;
+        void* map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, source->fd_, 0);
+        if (map == MAP_FAILED) {
+            throw std::runtime_error("could not map " + path);
+        }
+        source->map_ = map;
+        source->map_size_ = size;
+
+        const unsigned char* data = static_cast<const unsigned char*>(map);
+        if (std::memcmp(data, CURVE_MAGIC, sizeof(CURVE_MAGIC)) == 0) {
+            // records are read once, front to back
+            ::madvise(map, size, MADV_SEQUENTIAL);
+            source->reader_.reset(new binary_reader(data, size));
+            return std::unique_ptr<curve_reader>(source.release());
+        }
+
+        ::munmap(map, size);
+        source->map_ = nullptr;
+    }
+
+    const std::string prefix = read_prefix(source->fd_, sizeof(CURVE_MAGIC));
+    if (prefix.size() == sizeof(CURVE_MAGIC) &&
+        std::memcmp(prefix.data(), CURVE_MAGIC, sizeof(CURVE_MAGIC)) == 0) {
+        source->reader_.reset(new binary_stream_reader(source->fd_, prefix));
+        return std::unique_ptr<curve_reader>(source.release());
+    }
+
+    if (path == "-") {
+        source->fp_ = stdin;
+    } else {
+        source->fp_ = ::fdopen(source->fd_, "r");
+        if (source->fp_ == nullptr) {
+            throw std::runtime_error("could not open " + path);
+        }
+        source->owns_fp_ = true;
+    }
+    source->reader_.reset(new text_reader(source->fp_, prefix));
+    return std::unique_ptr<curve_reader>(source.release());
+}
+
+} // namespace lcfit
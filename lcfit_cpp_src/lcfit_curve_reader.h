@@ -0,0 +1,156 @@
+/**
+ * \file lcfit_curve_reader.h
+ * \brief Readers for precomputed likelihood profiles
+ *
+ * This file provides the readers used by lcfit-fit. Profiles are read
+ * one curve per record, in one of two formats.
+ *
+ * Text records are one per line, with whitespace-separated fields
+ *
+ *     curve_id n t_1 ... t_n lnl_1 ... lnl_n [t0 d1 d2]
+ *
+ * Blank lines and lines starting with \c # are ignored.
+ *
+ * Binary input starts with the 8 magic bytes <tt>LCFITCRV</tt>, a
+ * 4-byte format version (currently 1), and 4 reserved bytes. Each
+ * record then consists of
+ *
+ * | Size      | Contents                                        |
+ * |-----------|-------------------------------------------------|
+ * | 8         | Curve ID                                        |
+ * | 4         | Number of samples, \c n                         |
+ * | 4         | Flags; bit 0 is set if t0, d1 and d2 follow     |
+ * | 8 * \c n  | Branch lengths                                  |
+ * | 8 * \c n  | Log-likelihoods                                 |
+ * | 0 or 24   | t0, d1, d2                                      |
+ *
+ * with all integers unsigned and all values little-endian.
+ *
+ * Malformed input makes #curve_reader::next throw
+ * \c std::runtime_error.
+ */
+
+#ifndef LCFIT_CURVE_READER_H
+#define LCFIT_CURVE_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace lcfit {
+
+/** Magic bytes at the start of binary curve input. */
+extern const char CURVE_MAGIC[8];
+
+/** Current binary curve format version. */
+const uint32_t CURVE_VERSION = 1;
+
+/** Size of the binary curve header. */
+const size_t CURVE_HEADER_SIZE = 16;
+
+/** Record flag set when t0, d1 and d2 follow the samples. */
+const uint32_t CURVE_HAS_DERIVATIVES = 1;
+
+/** One likelihood profile. */
+struct curve {
+    std::string id;
+    std::vector<double> t;
+    std::vector<double> lnl;
+    bool has_derivatives;
+    double t0, d1, d2;
+};
+
+/** Source of curves. */
+class curve_reader {
+public:
+    virtual ~curve_reader() = default;
+
+    /** Read the next curve into \c c; returns false at the end of the input. */
+    virtual bool next(curve& c) = 0;
+};
+
+/** Reads text records from a \c FILE, which the reader does not own. */
+class text_reader : public curve_reader {
+public:
+    /**
+     * \param[in] fp      Input stream.
+     * \param[in] prefix  Bytes already read from \c fp, which are read first.
+     */
+    explicit text_reader(FILE* fp, const std::string& prefix = std::string());
+    ~text_reader();
+
+    text_reader(const text_reader&) = delete;
+    text_reader& operator=(const text_reader&) = delete;
+
+    bool next(curve& c) override;
+
+private:
+    bool read_line();
+    void parse(const char* p, curve& c);
+    double number(const char*& p);
+    [[noreturn]] void fail(const char* what);
+
+    FILE* fp_;
+    std::string prefix_;
+    std::string line_;
+    char* buf_;
+    size_t cap_;
+    size_t line_no_;
+};
+
+/** Reads binary records from memory, such as a mapped file. */
+class binary_reader : public curve_reader {
+public:
+    /** Validate the header of \c size bytes at \c data, which must outlive the reader. */
+    binary_reader(const unsigned char* data, size_t size);
+
+    bool next(curve& c) override;
+
+private:
+    const unsigned char* data_;
+    size_t size_;
+    size_t pos_;
+};
+
+/**
+ * Reads binary records from a file descriptor, which the reader does
+ * not own, through a buffer.
+ *
+ * This is used for pipes and other input that cannot be mapped. The
+ * buffer holds at least one record and grows only as record data
+ * arrives.
+ */
+class binary_stream_reader : public curve_reader {
+public:
+    /**
+     * Read and validate the header.
+     *
+     * \param[in] fd      Input file descriptor.
+     * \param[in] prefix  Bytes already read from \c fd, which are read first.
+     */
+    explicit binary_stream_reader(int fd, const std::string& prefix = std::string());
+
+    bool next(curve& c) override;
+
+private:
+    bool fill(size_t n_bytes);
+
+    int fd_;
+    std::vector<unsigned char> buf_;
+    size_t begin_;
+    size_t end_;
+};
+
+/**
+ * Open \c path, or stdin if \c path is \c -, choosing the reader from
+ * the first bytes of the input. Regular files are memory-mapped;
+ * other input is read through a buffer.
+ */
+std::unique_ptr<curve_reader> open_curve_reader(const std::string& path);
+
+} // namespace lcfit
+
+#endif // LCFIT_CURVE_READER_H
@@ -0,0 +1,100 @@
+#include "lcfit_curve_sampling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+namespace lcfit {
+
+void sample_curves_adaptive(double (*lnl_fn)(double, void*), void* lnl_fn_args, const bsm_t* model,
+                            const double min_t, const double max_t, const double t0,
+                            const int node_id, const size_t max_points, const double tolerance,
+                            std::vector<double>& rows, std::ostream& log)
+{
+    struct sample {
+        double t;
+        double empirical;
+        double fit;
+    };
+
+    struct interval {
+        double score;
+        size_t a, mid, b;
+
+        bool operator<(const interval& other) const { return score < other.score; }
+    };
+
+    const double lnl_t0 = lnl_fn(t0, lnl_fn_args);
+    const double lcfit_t0 = lcfit_bsm_log_like(t0, model);
+
+    // threshold relative to lnl_t0, matching sample_curves
+    const double threshold = -std::abs(0.01 * lnl_t0);
+
+    std::vector<sample> samples;
+    samples.reserve(max_points + 2);
+
+    auto eval = [&](const double t) {
+        samples.push_back({t, lnl_fn(t, lnl_fn_args) - lnl_t0,
+                           lcfit_bsm_log_like(t, model) - lcfit_t0});
+        return samples.size() - 1;
+    };
+
+    std::priority_queue<interval> queue;
+
+    // Evaluate the midpoint of [a, b] and queue the interval.
+    auto push = [&](const size_t a, const size_t b) {
+        const size_t mid = eval((samples[a].t + samples[b].t) / 2.0);
+        const sample& sa = samples[a];
+        const sample& sm = samples[mid];
+        const sample& sb = samples[b];
+
+        if (sa.empirical < threshold && sm.empirical < threshold && sb.empirical < threshold) {
+            return;
+        }
+
+        const double curvature_err = std::abs(sm.empirical - (sa.empirical + sb.empirical) / 2.0);
+        const double fit_err = std::abs((sm.empirical - sm.fit) -
+                                        ((sa.empirical - sa.fit) + (sb.empirical - sb.fit)) / 2.0);
+
+        queue.push({std::max(curvature_err, fit_err), a, mid, b});
+    };
+
+    samples.push_back({t0, 0.0, 0.0});
+    const size_t lo = eval(min_t);
+    const size_t hi = eval(max_t);
+    push(lo, 0);
+    push(0, hi);
+
+    while (!queue.empty() && samples.size() + 2 <= max_points) {
+        const interval top = queue.top();
+        if (top.score <= tolerance) {
+            break;
+        }
+        queue.pop();
+
+        push(top.a, top.mid);
+        push(top.mid, top.b);
+    }
+
+    log << "adaptive: " << samples.size() << " evaluations\n";
+
+    std::sort(samples.begin(), samples.end(),
+              [](const sample& x, const sample& y) { return x.t < y.t; });
+
+    size_t first = 0;
+    while (first + 1 < samples.size() && samples[first + 1].empirical < threshold) {
+        ++first;
+    }
+
+    size_t last = samples.size() - 1;
+    while (last > first + 1 && samples[last - 1].empirical < threshold) {
+        --last;
+    }
+
+    for (size_t i = first; i <= last; ++i) {
+        rows.insert(rows.end(), {static_cast<double>(node_id), samples[i].t,
+                                 samples[i].empirical, samples[i].fit});
+    }
+}
+
+} // namespace lcfit
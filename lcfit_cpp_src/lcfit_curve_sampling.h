@@ -0,0 +1,58 @@
+/**
+ * \file lcfit_curve_sampling.h
+ * \brief Adaptive sampling of empirical and fitted likelihood curves
+ *
+ * This file provides the adaptive sampler used by lcfit-compare to
+ * tabulate an empirical log-likelihood curve alongside its lcfit
+ * model.
+ */
+
+#ifndef LCFIT_CURVE_SAMPLING_H
+#define LCFIT_CURVE_SAMPLING_H
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include "lcfit.h"
+
+namespace lcfit {
+
+/**
+ * Sample the empirical and lcfit curves adaptively.
+ *
+ * Starting from a coarse grid over [min_t, max_t], intervals are
+ * bisected in order of their interpolation error: the larger of the
+ * error in linearly interpolating the empirical curve (its curvature)
+ * and the error in interpolating the difference between the empirical
+ * and lcfit curves (where the fit goes wrong). Intervals lying
+ * entirely more than 1% of |lnl(t0)| below lnl(t0) are not refined,
+ * which takes the place of finding the sampling bounds by
+ * root-finding. Subdivision stops when no interval's error exceeds
+ * \c tolerance or the evaluation budget is spent.
+ *
+ * Rows of <tt>node_id, t, lnl(t) - lnl(t0), fit(t) - fit(t0)</tt> are
+ * appended to \c rows in order of increasing branch length, for
+ * points within the threshold region plus the closest point outside
+ * it on either side.
+ *
+ * \param[in]  lnl_fn       Empirical log-likelihood function.
+ * \param[in]  lnl_fn_args  Argument to \c lnl_fn.
+ * \param[in]  model        Fitted model.
+ * \param[in]  min_t        Lower bound on branch length.
+ * \param[in]  max_t        Upper bound on branch length.
+ * \param[in]  t0           ML branch length of the empirical curve.
+ * \param[in]  node_id      Value of the first column of each row.
+ * \param[in]  max_points   Maximum number of evaluations of \c lnl_fn.
+ * \param[in]  tolerance    Subdivision tolerance, in log-likelihood units.
+ * \param[out] rows         Rows, stored row-major.
+ * \param[out] log          Stream for diagnostic messages.
+ */
+void sample_curves_adaptive(double (*lnl_fn)(double, void*), void* lnl_fn_args, const bsm_t* model,
+                            const double min_t, const double max_t, const double t0,
+                            const int node_id, const size_t max_points, const double tolerance,
+                            std::vector<double>& rows, std::ostream& log);
+
+} // namespace lcfit
+
+#endif // LCFIT_CURVE_SAMPLING_H
@@ -0,0 +1,397 @@
+/**
+ * \file lcfit_fit.cc
+ * \brief Fit BSM models to precomputed likelihood profiles.
+ *
+ * <tt>lcfit-fit</tt> reads likelihood profiles, one curve per record,
+ * fits each with #lcfit_fit_bsm_weight (or with lcfit2 when the ML
+ * branch length and derivatives are supplied), and writes one CSV row
+ * per curve to stdout:
+ *
+ *     curve_id,c,m,r,b,status,method
+ *
+ * where \c status is the #lcfit_status returned by the fit and \c
+ * method is \c lcfit4 or \c lcfit2. lcfit2 results are converted to
+ * the four-parameter model.
+ *
+ * Input is read from stdin, or from a file named on the command line,
+ * as text or binary records in the formats described in
+ * lcfit_curve_reader.h. Binary files are memory-mapped; binary input
+ * on stdin or a pipe is read through a buffer.
+ *
+ * Parsing, fitting and output run concurrently: the input is split
+ * into batches that are fitted by a pool of worker threads and written
+ * in input order. At most a fixed number of batches are in flight at
+ * once, so memory use does not depend on the size of the input.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+
+#include "lcfit.h"
+#include "lcfit2.h"
+#include "lcfit_curve_reader.h"
+
+namespace {
+
+using lcfit::curve;
+using lcfit::curve_reader;
+
+/** The fit for one curve. */
+struct fit_result {
+    bsm_t model;
+    int status;
+    bool lcfit2;
+};
+
+/** A batch of curves and their fits; batches are recycled to reuse their storage. */
+struct batch {
+    size_t seq;
+    size_t n_curves;
+    std::vector<curve> curves;
+    std::vector<fit_result> results;
+};
+
+//
+// Fitting
+//
+
+/**
+ * Estimate the log-likelihood at t0 from the sample nearest to it,
+ * using a second-order Taylor expansion about t0.
+ */
+double estimate_lnl_t0(const curve& c)
+{
+    size_t nearest = 0;
+    for (size_t i = 1; i < c.t.size(); ++i) {
+        if (std::abs(c.t[i] - c.t0) < std::abs(c.t[nearest] - c.t0)) {
+            nearest = i;
+        }
+    }
+
+    const double dt = c.t[nearest] - c.t0;
+    return c.lnl[nearest] - c.d1 * dt - 0.5 * c.d2 * dt * dt;
+}
+
+/** Per-thread fitting state. */
+class curve_fitter {
+public:
+    explicit curve_fitter(size_t max_iter) :
+        max_iter_(max_iter), ws_(lcfit_fit_workspace_alloc())
+    {
+        if (ws_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~curve_fitter() { lcfit_fit_workspace_free(ws_); }
+
+    curve_fitter(const curve_fitter&) = delete;
+    curve_fitter& operator=(const curve_fitter&) = delete;
+
+    void fit(const curve& c, fit_result& result)
+    {
+        const size_t n = c.t.size();
+        w_.assign(n, 1.0);
+        result.lcfit2 = c.has_derivatives;
+
+        if (n == 0) {
+            result.model = {NAN, NAN, NAN, NAN};
+            result.status = LCFIT_ERROR;
+            return;
+        }
+
+        if (c.has_derivatives) {
+            const double lnl_t0 = estimate_lnl_t0(c);
+            norm_.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                norm_[i] = c.lnl[i] - lnl_t0;
+            }
+
+            lcfit2_bsm_t model2 = {1100.0, 800.0, c.t0, c.d1, c.d2};
+            result.status = lcfit2n_fit_weighted(n, c.t.data(), norm_.data(), w_.data(), &model2);
+            lcfit2_to_lcfit4(&model2, &result.model);
+            return;
+        }
+
+        if (lcfit_bsm_initial_guess(n, c.t.data(), c.lnl.data(), &result.model) != LCFIT_SUCCESS) {
+            const size_t max_i = std::max_element(c.lnl.begin(), c.lnl.end()) - c.lnl.begin();
+            result.model = DEFAULT_INIT;
+            lcfit_bsm_rescale(c.t[max_i], c.lnl[max_i], &result.model);
+        }
+        result.status = lcfit_fit_bsm_weight_ws(n, c.t.data(), c.lnl.data(), w_.data(),
+                                                &result.model, max_iter_, ws_);
+    }
+
+private:
+    size_t max_iter_;
+    lcfit_fit_workspace* ws_;
+    std::vector<double> w_;
+    std::vector<double> norm_;
+};
+
+//
+// Pipeline
+//
+
+/**
+ * Bounded reader -> workers -> ordered writer pipeline.
+ *
+ * The calling thread reads batches, worker threads fit them, and a
+ * writer thread writes them in sequence order. At most \c max_in_flight
+ * batches exist at once; written batches are returned to a free list
+ * and refilled by the reader.
+ */
+class pipeline {
+public:
+    pipeline(size_t n_threads, size_t batch_size, size_t max_iter, FILE* out) :
+        n_threads_(n_threads), batch_size_(batch_size), max_iter_(max_iter),
+        max_in_flight_(2 * n_threads + 1), out_(out),
+        in_flight_(0), n_batches_(0), eof_(false), failed_(false)
+    {
+    }
+
+    void run(curve_reader& reader)
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < n_threads_; ++i) {
+            threads.emplace_back(&pipeline::work, this);
+        }
+        threads.emplace_back(&pipeline::write, this);
+
+        try {
+            read(reader);
+        } catch (...) {
+            fail(std::current_exception());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            eof_ = true;
+        }
+        work_ready_.notify_all();
+        done_ready_.notify_all();
+
+        for (std::thread& t : threads) {
+            t.join();
+        }
+
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    void read(curve_reader& reader)
+    {
+        for (size_t seq = 0; ; ++seq) {
+            std::unique_ptr<batch> b;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                space_ready_.wait(lock, [this] { return in_flight_ < max_in_flight_ || failed_; });
+                if (failed_) {
+                    return;
+                }
+                ++in_flight_;
+                if (!free_.empty()) {
+                    b = std::move(free_.back());
+                    free_.pop_back();
+                }
+            }
+
+            if (!b) {
+                b.reset(new batch);
+                b->curves.resize(batch_size_);
+                b->results.resize(batch_size_);
+            }
+
+            b->seq = seq;
+            b->n_curves = 0;
+            while (b->n_curves < batch_size_ && reader.next(b->curves[b->n_curves])) {
+                ++b->n_curves;
+            }
+
+            const bool last = b->n_curves < batch_size_;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (b->n_curves > 0) {
+                    pending_.push_back(std::move(b));
+                    ++n_batches_;
+                } else {
+                    --in_flight_;
+                }
+            }
+            work_ready_.notify_one();
+
+            if (last) {
+                return;
+            }
+        }
+    }
+
+    void work()
+    {
+        try {
+            curve_fitter fitter(max_iter_);
+
+            for (;;) {
+                std::unique_ptr<batch> b;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    work_ready_.wait(lock, [this] { return !pending_.empty() || eof_ || failed_; });
+                    if (failed_ || pending_.empty()) {
+                        return;
+                    }
+                    b = std::move(pending_.front());
+                    pending_.pop_front();
+                }
+
+                for (size_t i = 0; i < b->n_curves; ++i) {
+                    fitter.fit(b->curves[i], b->results[i]);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    const size_t seq = b->seq;
+                    done_[seq] = std::move(b);
+                }
+                done_ready_.notify_one();
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    }
+
+    void write()
+    {
+        for (size_t seq = 0; ; ++seq) {
+            std::unique_ptr<batch> b;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                done_ready_.wait(lock, [this, seq] {
+                    return done_.count(seq) || (eof_ && seq == n_batches_) || failed_;
+                });
+                if (failed_ || !done_.count(seq)) {
+                    return;
+                }
+                b = std::move(done_[seq]);
+                done_.erase(seq);
+            }
+
+            for (size_t i = 0; i < b->n_curves; ++i) {
+                const fit_result& r = b->results[i];
+                std::fprintf(out_, "%s,%.17g,%.17g,%.17g,%.17g,%d,%s\n",
+                             b->curves[i].id.c_str(),
+                             r.model.c, r.model.m, r.model.r, r.model.b,
+                             r.status, r.lcfit2 ? "lcfit2" : "lcfit4");
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                free_.push_back(std::move(b));
+                --in_flight_;
+            }
+            space_ready_.notify_one();
+        }
+    }
+
+    void fail(std::exception_ptr e)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_) {
+                error_ = e;
+            }
+            failed_ = true;
+        }
+        work_ready_.notify_all();
+        done_ready_.notify_all();
+        space_ready_.notify_all();
+    }
+
+    const size_t n_threads_;
+    const size_t batch_size_;
+    const size_t max_iter_;
+    const size_t max_in_flight_;
+    FILE* out_;
+
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable done_ready_;
+    std::condition_variable space_ready_;
+
+    std::deque<std::unique_ptr<batch>> pending_;
+    std::map<size_t, std::unique_ptr<batch>> done_;
+    std::vector<std::unique_ptr<batch>> free_;
+    size_t in_flight_;
+    size_t n_batches_;
+    bool eof_;
+    bool failed_;
+    std::exception_ptr error_;
+};
+
+void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [-j THREADS] [-b BATCH_SIZE] [-i MAX_ITER] [FILE]\n"
+              << "Fit BSM models to likelihood profiles read from FILE, or stdin if FILE\n"
+              << "is omitted or -, writing curve_id,c,m,r,b,status,method to stdout.\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    size_t n_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t batch_size = 64;
+    size_t max_iter = 250;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:b:i:h")) != -1) {
+        switch (opt) {
+            case 'j': n_threads = std::max(1l, std::atol(optarg)); break;
+            case 'b': batch_size = std::max(1l, std::atol(optarg)); break;
+            case 'i': max_iter = std::max(1l, std::atol(optarg)); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 2;
+        }
+    }
+
+    if (argc - optind > 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    try {
+        std::printf("curve_id,c,m,r,b,status,method\n");
+        pipeline p(n_threads, batch_size, max_iter, stdout);
+
+        const char* path = optind < argc ? argv[optind] : "-";
+        std::unique_ptr<curve_reader> reader = lcfit::open_curve_reader(path);
+        p.run(*reader);
+
+        if (std::fflush(stdout) != 0) {
+            throw std::runtime_error("error writing output");
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
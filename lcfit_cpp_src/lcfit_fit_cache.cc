@@ -0,0 +1,131 @@
+#include "lcfit_fit_cache.h"
+
+#include <cmath>
+#include <iterator>
+#include <stdexcept>
+
+#include "lcfit_select.h"
+
+namespace lcfit {
+
+size_t fit_cache::key_hash::operator()(const fit_cache_key& key) const
+{
+    // splitmix64 finalizer over both halves of the key
+    uint64_t x = key.split ^ (key.context * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return static_cast<size_t>(x);
+}
+
+fit_cache::fit_cache(size_t capacity, double tolerance) :
+    capacity_(capacity), tolerance_(tolerance), stats_()
+{
+    if (capacity_ == 0) {
+        throw std::invalid_argument("fit_cache capacity must be positive");
+    }
+
+    index_.reserve(capacity_);
+}
+
+double fit_cache::fit(const fit_cache_key& key,
+                      double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                      bsm_t* model, const double min_t, const double max_t)
+{
+    cached_fit cached;
+    const bool found = lookup(key, cached);
+
+    if (found) {
+        const double lnl = lnl_fn(cached.t0, lnl_fn_args);
+        const double residual = std::abs(lnl - lcfit_bsm_log_like(cached.t0, &cached.model));
+
+        if (residual <= tolerance_ * std::abs(lnl)) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++stats_.hits;
+            }
+            *model = cached.model;
+            return cached.t0;
+        }
+
+        // the cached model is a better starting point than the caller's
+        *model = cached.model;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (found) {
+            ++stats_.validation_failures;
+        } else {
+            ++stats_.misses;
+        }
+    }
+
+    const double t0 = lcfit_fit_auto(lnl_fn, lnl_fn_args, model, min_t, max_t);
+    insert(key, {*model, t0});
+
+    return t0;
+}
+
+bool fit_cache::lookup(const fit_cache_key& key, cached_fit& out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        return false;
+    }
+
+    entries_.splice(entries_.begin(), entries_, it->second);
+    out = it->second->second;
+    return true;
+}
+
+void fit_cache::insert(const fit_cache_key& key, const cached_fit& value)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        it->second->second = value;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return;
+    }
+
+    if (entries_.size() == capacity_) {
+        // reuse the least recently used node rather than freeing it
+        auto last = std::prev(entries_.end());
+        index_.erase(last->first);
+        last->first = key;
+        last->second = value;
+        entries_.splice(entries_.begin(), entries_, last);
+        ++stats_.evictions;
+    } else {
+        entries_.emplace_front(key, value);
+    }
+
+    index_.emplace(key, entries_.begin());
+}
+
+void fit_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    index_.clear();
+}
+
+size_t fit_cache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+fit_cache_stats fit_cache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+} // namespace lcfit
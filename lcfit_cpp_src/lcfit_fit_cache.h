@@ -0,0 +1,141 @@
+/**
+ * \file lcfit_fit_cache.h
+ * \brief Cache of fitted models keyed by split
+ *
+ * This file provides a thread-safe cache of fitted models for reuse
+ * when the same split occurs in many trees, as in tree-space MCMC.
+ */
+
+#ifndef LCFIT_FIT_CACHE_H
+#define LCFIT_FIT_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "lcfit.h"
+
+namespace lcfit {
+
+/** Cache key: a caller-supplied split hash and a fingerprint of its context. */
+struct fit_cache_key {
+    /** Hash of the split (bipartition) the branch induces. */
+    uint64_t split;
+    /** Fingerprint of whatever else the likelihood depends on, e.g. the neighborhood. */
+    uint64_t context;
+
+    bool operator==(const fit_cache_key& other) const
+    {
+        return split == other.split && context == other.context;
+    }
+};
+
+/** A cached fit. */
+struct cached_fit {
+    /** Fitted model parameters. */
+    bsm_t model;
+    /** ML branch length returned by #lcfit_fit_auto. */
+    double t0;
+};
+
+/** Cache statistics. */
+struct fit_cache_stats {
+    /** Lookups that found an entry which passed validation. */
+    size_t hits;
+    /** Lookups that found an entry which failed validation. */
+    size_t validation_failures;
+    /** Lookups that found no entry. */
+    size_t misses;
+    /** Entries evicted to make room for new ones. */
+    size_t evictions;
+};
+
+/**
+ * Least-recently-used cache of fitted models.
+ *
+ * #fit looks up the key; on a hit, it checks the cached model with a
+ * single evaluation of the live log-likelihood at the cached \c t0
+ * and returns the cached fit if the residual is within tolerance.
+ * Otherwise it runs #lcfit_fit_auto, starting from the cached model
+ * when there is one, and caches the result.
+ *
+ * All member functions may be called concurrently. Fits run without
+ * holding the cache lock, so two threads missing on the same key at
+ * once will both fit it.
+ *
+ * Example usage:
+ *
+ * \code
+ * lcfit::fit_cache cache(10000);
+ *
+ * bsm_t model = DEFAULT_INIT;
+ * double t0 = cache.fit({split_hash, neighborhood_hash},
+ *                       &my_lnl_callback, &my_lnl_data, &model, min_t, max_t);
+ * \endcode
+ */
+class fit_cache {
+public:
+    /**
+     * \param[in] capacity   Maximum number of cached fits.
+     * \param[in] tolerance  Maximum relative residual,
+     *                       <tt>|lnl(t0) - model(t0)| / |lnl(t0)|</tt>,
+     *                       for a cached fit to be reused.
+     */
+    explicit fit_cache(size_t capacity, double tolerance = 1e-4);
+
+    fit_cache(const fit_cache&) = delete;
+    fit_cache& operator=(const fit_cache&) = delete;
+
+    /**
+     * Fit a model to a log-likelihood function, reusing a cached fit if possible.
+     *
+     * \param[in]     key          Cache key.
+     * \param[in]     lnl_fn       Log-likelihood function to fit.
+     * \param[in]     lnl_fn_args  Additional data to pass to log-likelihood function.
+     * \param[in,out] model        Initial model parameters on a miss; the fitted model on return.
+     * \param[in]     min_t        Lower bound on branch length.
+     * \param[in]     max_t        Upper bound on branch length.
+     *
+     * \return The estimated ML branch length.
+     */
+    double fit(const fit_cache_key& key,
+               double (*lnl_fn)(double, void*), void* lnl_fn_args,
+               bsm_t* model, const double min_t, const double max_t);
+
+    /** Copy the cached fit for \c key into \c out, without validation; returns false if there is none. */
+    bool lookup(const fit_cache_key& key, cached_fit& out);
+
+    /** Insert or replace the fit for \c key. */
+    void insert(const fit_cache_key& key, const cached_fit& value);
+
+    /** Remove all entries; statistics are kept. */
+    void clear();
+
+    /** Number of cached fits. */
+    size_t size() const;
+
+    /** Snapshot of the statistics. */
+    fit_cache_stats stats() const;
+
+private:
+    struct key_hash {
+        size_t operator()(const fit_cache_key& key) const;
+    };
+
+    typedef std::list<std::pair<fit_cache_key, cached_fit>> lru_list;
+
+    const size_t capacity_;
+    const double tolerance_;
+
+    mutable std::mutex mutex_;
+    /** Entries, most recently used first. */
+    lru_list entries_;
+    std::unordered_map<fit_cache_key, lru_list::iterator, key_hash> index_;
+    fit_cache_stats stats_;
+};
+
+} // namespace lcfit
+
+#endif // LCFIT_FIT_CACHE_H
@@ -9,6 +9,7 @@
 #include <gsl/gsl_rng.h>
 
 #include "lcfit.h"
+#include "lcfit_trace.h"
 
 namespace lcfit {
 
@@ -95,12 +96,19 @@ double rejection_sampler::sample() const
     double u = 0.0;
     double f = 0.0;
 
-    do {
+    for (;;) {
         t = gsl_ran_exponential(rng_, mu_);
         u = 1.0 - gsl_rng_uniform(rng_); // 1 - [0, 1) = (0, 1]
         f = std::exp(lcfit_bsm_log_like(t, &model_) - ml_ll_);
-    } while (u > f);
 
+        if (u <= f) {
+            break;
+        }
+
+        LCFIT_TRACE1(sample_reject, t);
+    }
+
+    LCFIT_TRACE1(sample_accept, t);
     return t;
 }
 
@@ -114,6 +122,41 @@ std::vector<double> rejection_sampler::sample_n(size_t n) const
     return samples;
 }
 
+std::vector<double> rejection_sampler::sample_n_mixed(size_t n) const
+{
+    const size_t block_size = 256;
+
+    std::vector<double> samples;
+    samples.reserve(n);
+
+    double t[block_size];
+    double u[block_size];
+    float tf[block_size];
+    float f[block_size];
+
+    while (samples.size() < n) {
+        for (size_t i = 0; i < block_size; ++i) {
+            t[i] = gsl_ran_exponential(rng_, mu_);
+            u[i] = 1.0 - gsl_rng_uniform(rng_); // 1 - [0, 1) = (0, 1]
+            tf[i] = static_cast<float>(t[i]);
+        }
+
+        lcfit_bsm_log_like_shifted_nf(block_size, tf, &model_, ml_ll_, f);
+
+        const size_t n_before = samples.size();
+        size_t i = 0;
+        for (; i < block_size && samples.size() < n; ++i) {
+            if (u[i] <= std::exp(f[i])) {
+                samples.push_back(t[i]);
+            }
+        }
+
+        LCFIT_TRACE2(sample_block, samples.size() - n_before, i);
+    }
+
+    return samples;
+}
+
 double rejection_sampler::log_likelihood(double t) const
 {
     return lcfit_bsm_log_like(t, &model_)
@@ -136,6 +179,23 @@ double rejection_sampler::log_density(double t) const
     return log_likelihood(t) - log_auc_;
 }
 
+void rejection_sampler::log_density_nf(size_t n, const float* t, float* out) const
+{
+    if (!log_auc_cached_) {
+        log_auc_ = std::log(integrate(INFINITY));
+        log_auc_cached_ = true;
+    }
+
+    lcfit_bsm_log_like_shifted_nf(n, t, &model_, ml_ll_, out);
+
+    // log of the exponential prior with mean mu_
+    const double log_mu = std::log(mu_);
+    for (size_t i = 0; i < n; ++i) {
+        const double log_prior = t[i] < 0.0f ? -INFINITY : -t[i] / mu_ - log_mu;
+        out[i] = static_cast<float>(out[i] + log_prior - log_auc_);
+    }
+}
+
 double rejection_sampler::density(double t) const
 {
     return std::exp(log_density(t));
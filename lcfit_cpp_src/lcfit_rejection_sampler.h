@@ -63,6 +63,19 @@ private:
     /** Generate multiple samples from the distribution. */
     std::vector<double> sample_n(size_t n) const;
 
+    /**
+     * Generate multiple samples, testing acceptance in single precision.
+     *
+     * Candidates are drawn exactly as by #sample_n, but their
+     * likelihoods are computed in blocks with
+     * #lcfit_bsm_log_like_shifted_nf. A sample can only differ from the
+     * one #sample_n would accept when its acceptance ratio is within
+     * float rounding of the uniform draw. Candidates left over in the
+     * last block are discarded, so the generator is advanced further
+     * than by #sample_n.
+     */
+    std::vector<double> sample_n_mixed(size_t n) const;
+
     /** Compute the log-likelihood at a given branch length. */
     double log_likelihood(double t) const;
 
@@ -79,6 +92,21 @@ private:
      */
     double log_density(double t) const;
 
+    /**
+     * Compute the approximate log density at many branch lengths in
+     * single precision.
+     *
+     * The likelihood term is computed by #lcfit_bsm_log_like_shifted_nf
+     * relative to the maximum, where single precision loses little, and
+     * the prior and normalization are added in double precision. See
+     * #log_density.
+     *
+     * \param[in]  n    Number of branch lengths.
+     * \param[in]  t    Branch lengths.
+     * \param[out] out  Log density at each branch length.
+     */
+    void log_density_nf(size_t n, const float* t, float* out) const;
+
     /**
      * Compute the approximate density at a given branch length.
      *
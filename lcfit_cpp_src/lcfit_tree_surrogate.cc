@@ -0,0 +1,65 @@
+#include "lcfit_tree_surrogate.h"
+
+#include <stdexcept>
+
+#include "lcfit_dispatch.h"
+
+namespace lcfit {
+
+tree_surrogate::tree_surrogate(const std::vector<bsm_t>& models)
+{
+    c_.reserve(models.size());
+    m_.reserve(models.size());
+    r_.reserve(models.size());
+    b_.reserve(models.size());
+
+    for (const bsm_t& model : models) {
+        push_back(model);
+    }
+}
+
+void tree_surrogate::push_back(const bsm_t& model)
+{
+    c_.push_back(model.c);
+    m_.push_back(model.m);
+    r_.push_back(model.r);
+    b_.push_back(model.b);
+}
+
+void tree_surrogate::set_model(size_t i, const bsm_t& model)
+{
+    if (i >= size()) {
+        throw std::out_of_range("tree_surrogate branch index out of range");
+    }
+
+    c_[i] = model.c;
+    m_[i] = model.m;
+    r_[i] = model.r;
+    b_[i] = model.b;
+}
+
+bsm_t tree_surrogate::model(size_t i) const
+{
+    if (i >= size()) {
+        throw std::out_of_range("tree_surrogate branch index out of range");
+    }
+
+    return {c_[i], m_[i], r_[i], b_[i]};
+}
+
+double tree_surrogate::log_like(const double* t, double* grad) const
+{
+    double lnl = 0.0;
+    log_like_n(1, t, &lnl, grad);
+
+    return lnl;
+}
+
+void tree_surrogate::log_like_n(size_t n_candidates, const double* t, double* lnl,
+                                double* grad) const
+{
+    const lcfit_bsm_soa_t models = {c_.data(), m_.data(), r_.data(), b_.data()};
+    lcfit_bsm_soa_log_like_sum_n(n_candidates, size(), t, &models, lnl, grad);
+}
+
+} // namespace lcfit
@@ -0,0 +1,95 @@
+/**
+ * \file lcfit_tree_surrogate.h
+ * \brief Surrogate log-likelihood of a tree from its fitted branches
+ *
+ * This file provides the sum of the fitted per-branch models as a
+ * cheap stand-in for the log-likelihood of a whole tree, e.g. to
+ * screen proposals in tree-space MCMC.
+ */
+
+#ifndef LCFIT_TREE_SURROGATE_H
+#define LCFIT_TREE_SURROGATE_H
+
+#include <cstddef>
+#include <vector>
+
+#include "lcfit.h"
+
+namespace lcfit {
+
+/**
+ * Sum of fitted branch models over a tree.
+ *
+ * Given a fitted model for every branch, the surrogate log-likelihood
+ * of a vector of branch lengths \f$t\f$ is
+ * \f$\sum_i L(t_i | c_i, m_i, r_i, b_i)\f$, and its gradient has
+ * components \f$\partial L / \partial t_i\f$ of the same terms.
+ *
+ * The models are stored as one array per parameter, so that
+ * #log_like_n evaluates branches a vector at a time with the batched
+ * kernels of lcfit_dispatch.h, and all candidates in a batch in one
+ * pass through the kernel.
+ *
+ * Example usage:
+ *
+ * \code
+ * lcfit::tree_surrogate surrogate(branch_models);
+ *
+ * // k candidate vectors of branch lengths, one per row
+ * std::vector<double> lnl(k), grad(k * surrogate.size());
+ * surrogate.log_like_n(k, candidates.data(), lnl.data(), grad.data());
+ * \endcode
+ */
+class tree_surrogate {
+public:
+    tree_surrogate() = default;
+
+    /** \param[in] models  Fitted model of each branch. */
+    explicit tree_surrogate(const std::vector<bsm_t>& models);
+
+    /** Number of branches. */
+    size_t size() const { return c_.size(); }
+
+    /** Append the model of another branch. */
+    void push_back(const bsm_t& model);
+
+    /** Replace the model of branch \c i; throws \c std::out_of_range if there is none. */
+    void set_model(size_t i, const bsm_t& model);
+
+    /** The model of branch \c i; throws \c std::out_of_range if there is none. */
+    bsm_t model(size_t i) const;
+
+    /**
+     * Compute the surrogate log-likelihood of one vector of branch lengths.
+     *
+     * \param[in]  t     Branch lengths, one per branch.
+     * \param[out] grad  Derivative with respect to each branch length, or \c nullptr.
+     *
+     * \return The sum of #lcfit_bsm_log_like over the branches.
+     */
+    double log_like(const double* t, double* grad = nullptr) const;
+
+    /**
+     * Compute the surrogate log-likelihood of many vectors of branch lengths.
+     *
+     * \param[in]  n_candidates  Number of branch length vectors.
+     * \param[in]  t             An \c n_candidates by #size row-major array
+     *                           of branch lengths.
+     * \param[out] lnl           Surrogate log-likelihood of each vector.
+     * \param[out] grad          An \c n_candidates by #size row-major array
+     *                           receiving the derivative with respect to
+     *                           each branch length, or \c nullptr.
+     */
+    void log_like_n(size_t n_candidates, const double* t, double* lnl,
+                    double* grad = nullptr) const;
+
+private:
+    std::vector<double> c_;
+    std::vector<double> m_;
+    std::vector<double> r_;
+    std::vector<double> b_;
+};
+
+} // namespace lcfit
+
+#endif // LCFIT_TREE_SURROGATE_H
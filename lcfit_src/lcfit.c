@@ -5,8 +5,12 @@
  */
 
 #include "lcfit.h"
+#include "lcfit_auto.h"
+#include "lcfit_dispatch.h"
+#include "lcfit_trace.h"
 
 #include <assert.h>
+#include <float.h>
 #include <math.h>
 #include <limits.h>
 #include <stdbool.h>
@@ -15,7 +19,6 @@
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_deriv.h>
-#include <gsl/gsl_min.h>
 #include <gsl/gsl_multifit_nlin.h>
 #include <gsl/gsl_roots.h>
 #include <gsl/gsl_version.h>
@@ -28,8 +31,6 @@
 #define debug_export static
 #endif
 
-const static double LAMBDA = 50;
-
 /** Minimum bound on mutation rate. */
 const static double BSM_R_MIN = 1e-9;
 
@@ -38,34 +39,11 @@ const static double BSM_R_MAX = 100.0;
 
 const bsm_t DEFAULT_INIT = {1100.0, 800.0, 2.0, 0.5};
 
-/* calculate the sum of logs */
-static double log_sum(const double x, const double y)
-{
-    const static double max_value = DBL_MAX;
-    const double log_limit = -max_value / 100;
-    const static double NATS = 400;
+/** Maximum number of bisections when bracketing a maximum. */
+const size_t BRACKET_MAX_ITER = 30;
 
-    const double temp = y - x;
-    if(temp > NATS || x < log_limit)
-        return y;
-    if(temp < -NATS || y < log_limit)
-        return x;
-    if(temp < 0)
-        return x + log1p(exp(temp));
-    return y + log1p(exp(-temp));
-}
-
-static void log_normalize(gsl_vector* x)
-{
-    double sum = -DBL_MAX;
-    size_t i;
-    const double max_val = gsl_vector_max(x);
-    gsl_vector_add_constant(x, -max_val);
-
-    for(i = 0; i < x->size; i++)
-        sum = log_sum(sum, gsl_vector_get(x, i));
-    gsl_vector_add_constant(x, -sum);
-}
+/** Maximum number of Brent iterations when locating a maximum. */
+const int BRENT_MAX_ITER = 100;
 
 double lcfit_bsm_log_like(const double t, const bsm_t* m)
 {
@@ -80,6 +58,67 @@ double lcfit_bsm_log_like(const double t, const bsm_t* m)
     return (m->c * log((1 + expterm) / 2) + m->m * log((1 - expterm) / 2));
 }
 
+/* The log-likelihood and its derivatives in t from a single expm1.
+ * The logarithms are only taken when lnl is not NULL. */
+static void bsm_log_like_dt(const double t, const bsm_t* m,
+                            double* lnl, double* d1, double* d2)
+{
+    double l, dl, d2l;
+
+    if (t == 0.0 && m->b == 0.0 && m->c > m->m) {
+        l = -INFINITY;
+        dl = INFINITY;
+        d2l = -INFINITY;
+    }
+    else if (t == INFINITY) {
+        l = log(0.5) * (m->c + m->m);
+        dl = 0.0;
+        d2l = 0.0;
+    }
+    else {
+        /* With em = u - 1, 1 + u = 2 + em and 1 - u = -em. */
+        const double em = expm1(-m->r * (t + m->b));
+        const double u = 1.0 + em;
+        const double p = 2.0 + em;
+        const double q = -em;
+
+        l = lnl != NULL ? m->c * log1p(0.5 * em) + m->m * log(0.5 * q) : 0.0;
+        dl = m->r * u * (m->m / q - m->c / p);
+        d2l = m->r * m->r * u * (m->c / (p * p) - m->m / (q * q));
+    }
+
+    if (lnl != NULL) {
+        *lnl = l;
+    }
+    if (d1 != NULL) {
+        *d1 = dl;
+    }
+    if (d2 != NULL) {
+        *d2 = d2l;
+    }
+}
+
+double lcfit_bsm_log_like_dt(const double t, const bsm_t* m, double* d1, double* d2)
+{
+    double lnl;
+    bsm_log_like_dt(t, m, &lnl, d1, d2);
+    return lnl;
+}
+
+double lcfit_bsm_dlnl_dt(const double t, const bsm_t* m)
+{
+    double d1;
+    bsm_log_like_dt(t, m, NULL, &d1, NULL);
+    return d1;
+}
+
+double lcfit_bsm_d2lnl_dt2(const double t, const bsm_t* m)
+{
+    double d2;
+    bsm_log_like_dt(t, m, NULL, NULL, &d2);
+    return d2;
+}
+
 /* The ML branch length for c, m, r, b */
 double lcfit_bsm_ml_t(const bsm_t* m)
 {
@@ -155,27 +194,6 @@ struct data_to_fit {
     size_t iterations;
 };
 
-
-int lcfit_weights(const void* data, gsl_vector* weight)
-{
-    const size_t n = ((const struct data_to_fit*) data)->n;
-    const double* l = ((const struct data_to_fit*) data)->l;
-    size_t i;
-
-    for(i = 0; i < n; i++) {
-        gsl_vector_set(weight, i, l[i]);
-    }
-
-    gsl_vector_scale(weight, 1 / LAMBDA);  /* multiplies the elements of vector a by the constant factor x. */
-    log_normalize(weight);
-
-    /* for(i = 0; i < n; i++) */
-    /*     fprintf(stderr, "%.3f\t", exp(gsl_vector_get(weight, i))); */
-    /* fprintf(stderr, "\n"); */
-
-    return GSL_SUCCESS;
-}
-
 void print_state_gsl(size_t iter, gsl_multifit_fdfsolver* s)
 {
 #if !defined (GSL_MAJOR_VERSION) || GSL_MAJOR_VERSION<2
@@ -219,6 +237,17 @@ int lcfit_pair_f(const gsl_vector* x, void* data, gsl_vector* f)
                gsl_vector_get(x, 2),
                gsl_vector_get(x, 3)};
 
+    if (f->stride == 1) {
+        /* the solvers allocate f contiguously, so use the batched kernel */
+        lcfit_bsm_log_like_n(n, t, &m, f->data);
+
+        for(i = 0; i < n; i++) {
+            f->data[i] = w[i] * (f->data[i] - l[i]);
+        }
+
+        return GSL_SUCCESS;
+    }
+
     for(i = 0; i < n; i++) {
         const double err = lcfit_bsm_log_like(t[i], &m) - l[i];
 
@@ -246,6 +275,19 @@ int lcfit_pair_df(const gsl_vector* x, void* data, gsl_matrix* J)
     bsm_t model = {c, m, r, b};
     double grad_i[4];
 
+    if (J->tda == 4) {
+        /* rows of J are contiguous, so use the batched kernel */
+        lcfit_bsm_gradient_n(n, t, &model, J->data);
+
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                J->data[4 * i + j] *= w[i];
+            }
+        }
+
+        return GSL_SUCCESS;
+    }
+
     for (size_t i = 0; i < n; i++) {
         /* nx4 Jacobian matrix J(i,j) = dfi / dxj, */
         /* where fi = c*log((1+exp(-r*t[i]))/2)+m*log((1-exp(-r*t[i]))/2) - l[i] */
@@ -274,6 +316,64 @@ int lcfit_pair_fdf(const gsl_vector* x, void* data, gsl_vector* f, gsl_matrix* J
     return GSL_SUCCESS;
 }
 
+/*
+ * The reduced model with b = 0 has parameters (c, m, r). With
+ * em = exp(-r t) - 1, (1 + u)/2 = 1 + em/2 and (1 - u)/2 = -em/2,
+ * neither of which cancels for the short branch lengths typical of
+ * regime 1.
+ */
+int lcfit_pair_f_b0(const gsl_vector* x, void* data, gsl_vector* f)
+{
+    const size_t n = ((struct data_to_fit*) data)->n;
+    const double* t = ((struct data_to_fit*) data)->t;
+    const double* l = ((struct data_to_fit*) data)->l;
+    const double* w = ((struct data_to_fit*) data)->w;
+
+    const double c = gsl_vector_get(x, 0);
+    const double m = gsl_vector_get(x, 1);
+    const double r = gsl_vector_get(x, 2);
+
+    for (size_t i = 0; i < n; i++) {
+        const double em = expm1(-r * t[i]);
+        const double err = c * log1p(0.5 * em) + m * log(-0.5 * em) - l[i];
+
+        gsl_vector_set(f, i, w[i] * err);
+    }
+
+    return GSL_SUCCESS;
+}
+
+/* The corresponding n x 3 Jacobian. */
+int lcfit_pair_df_b0(const gsl_vector* x, void* data, gsl_matrix* J)
+{
+    const size_t n = ((struct data_to_fit*) data)->n;
+    const double* t = ((struct data_to_fit*) data)->t;
+    const double* w = ((struct data_to_fit*) data)->w;
+
+    const double c = gsl_vector_get(x, 0);
+    const double m = gsl_vector_get(x, 1);
+    const double r = gsl_vector_get(x, 2);
+
+    for (size_t i = 0; i < n; i++) {
+        const double em = expm1(-r * t[i]);
+        const double u = 1.0 + em;
+
+        gsl_matrix_set(J, i, 0, w[i] * log1p(0.5 * em)); /* df/dc */
+        gsl_matrix_set(J, i, 1, w[i] * log(-0.5 * em)); /* df/dm */
+        gsl_matrix_set(J, i, 2, w[i] * t[i] * u * (-c / (2.0 + em) - m / em)); /* df/dr */
+    }
+
+    return GSL_SUCCESS;
+}
+
+int lcfit_pair_fdf_b0(const gsl_vector* x, void* data, gsl_vector* f, gsl_matrix* J)
+{
+    lcfit_pair_f_b0(x, data, f);
+    lcfit_pair_df_b0(x, data, J);
+
+    return GSL_SUCCESS;
+}
+
 void print_state_nlopt(size_t iter,
                        double sum_sq_err,
                        const double* x,
@@ -325,20 +425,31 @@ double bsm_fit_objective(unsigned p,
     }
 
     bsm_t model = {c, m, r, b};
-    double grad_i[4];
-
-    for (size_t i = 0; i < n; ++i) {
-        const double err = l[i] - lcfit_bsm_log_like(t[i], &model);
+    double lnl[LCFIT_KERNEL_BLOCK];
+    double grad_block[4 * LCFIT_KERNEL_BLOCK];
 
-        sum_sq_err += w[i] * pow(err, 2.0);
+    for (size_t start = 0; start < n; start += LCFIT_KERNEL_BLOCK) {
+        const size_t k = n - start < LCFIT_KERNEL_BLOCK ? n - start : LCFIT_KERNEL_BLOCK;
 
+        lcfit_bsm_log_like_n(k, t + start, &model, lnl);
         if (grad) {
-            lcfit_bsm_gradient(t[i], &model, grad_i);
+            lcfit_bsm_gradient_n(k, t + start, &model, grad_block);
+        }
+
+        for (size_t j = 0; j < k; ++j) {
+            const size_t i = start + j;
+            const double err = l[i] - lnl[j];
 
-            grad[0] -= 2 * w[i] * err * grad_i[0];
-            grad[1] -= 2 * w[i] * err * grad_i[1];
-            grad[2] -= 2 * w[i] * err * grad_i[2];
-            grad[3] -= 2 * w[i] * err * grad_i[3];
+            sum_sq_err += w[i] * pow(err, 2.0);
+
+            if (grad) {
+                const double* grad_i = grad_block + 4 * j;
+
+                grad[0] -= 2 * w[i] * err * grad_i[0];
+                grad[1] -= 2 * w[i] * err * grad_i[1];
+                grad[2] -= 2 * w[i] * err * grad_i[2];
+                grad[3] -= 2 * w[i] * err * grad_i[3];
+            }
         }
     }
 
@@ -346,6 +457,7 @@ double bsm_fit_objective(unsigned p,
     print_state_nlopt(fit_data->iterations, sum_sq_err, x, grad);
 #endif /* LCFIT4_VERBOSE */
     ++fit_data->iterations;
+    LCFIT_TRACE1(slsqp_iter, fit_data->iterations);
     return sum_sq_err;
 }
 
@@ -362,8 +474,117 @@ int lcfit_fit_bsm(const size_t n, const double* t, const double* l, bsm_t *m, in
 }
 
 // Declare our implementations before the delegator function definition.
-int lcfit_fit_bsm_weighted_gsl(const size_t, const double*, const double*, const double*, bsm_t*, size_t);
-int lcfit_fit_bsm_weighted_nlopt(const size_t, const double*, const double*, const double*, bsm_t*, size_t);
+int lcfit_fit_bsm_weighted_gsl(const size_t, const double*, const double*, const double*, bsm_t*, size_t, lcfit_fit_workspace*);
+int lcfit_fit_bsm_weighted_nlopt(const size_t, const double*, const double*, const double*, bsm_t*, size_t, lcfit_fit_workspace*);
+int lcfit_fit_bsm_weighted_gsl_b0(const size_t, const double*, const double*, const double*, bsm_t*, size_t, lcfit_fit_workspace*);
+static bool b0_is_optimal(const size_t, const double*, const double*, const double*, const bsm_t*);
+
+struct lcfit_fit_workspace {
+    /* LM solvers, indexed by number of observations */
+    gsl_multifit_fdfsolver** solvers;
+    size_t n_solvers;
+    /* LM solvers for the reduced model with b = 0 */
+    gsl_multifit_fdfsolver** solvers_b0;
+    size_t n_solvers_b0;
+    /* SLSQP optimizer, created on first use */
+    nlopt_opt opt;
+    /* counters for lcfit_fit_workspace_stats */
+    lcfit_fit_stats stats;
+};
+
+lcfit_fit_workspace* lcfit_fit_workspace_alloc(void)
+{
+    return calloc(1, sizeof(lcfit_fit_workspace));
+}
+
+void lcfit_fit_workspace_free(lcfit_fit_workspace* ws)
+{
+    if (ws == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < ws->n_solvers; ++i) {
+        if (ws->solvers[i] != NULL) {
+            gsl_multifit_fdfsolver_free(ws->solvers[i]);
+        }
+    }
+    free(ws->solvers);
+
+    for (size_t i = 0; i < ws->n_solvers_b0; ++i) {
+        if (ws->solvers_b0[i] != NULL) {
+            gsl_multifit_fdfsolver_free(ws->solvers_b0[i]);
+        }
+    }
+    free(ws->solvers_b0);
+
+    if (ws->opt != NULL) {
+        nlopt_destroy(ws->opt);
+    }
+
+    free(ws);
+}
+
+void lcfit_fit_workspace_stats(const lcfit_fit_workspace* ws, lcfit_fit_stats* stats)
+{
+    *stats = ws->stats;
+}
+
+/* Get an LM solver for n observations and p parameters (4, or 3 for
+ * the reduced model), from the workspace if there is one. */
+static gsl_multifit_fdfsolver* workspace_solver(lcfit_fit_workspace* ws, const size_t n,
+                                                const size_t p)
+{
+    const gsl_multifit_fdfsolver_type *T = gsl_multifit_fdfsolver_lmsder;
+
+    if (ws == NULL) {
+        return gsl_multifit_fdfsolver_alloc(T, n, p);
+    }
+
+    gsl_multifit_fdfsolver*** cache = p == 4 ? &ws->solvers : &ws->solvers_b0;
+    size_t* cache_size = p == 4 ? &ws->n_solvers : &ws->n_solvers_b0;
+
+    if (n >= *cache_size) {
+        gsl_multifit_fdfsolver** solvers =
+                realloc(*cache, sizeof(gsl_multifit_fdfsolver*) * (n + 1));
+        if (solvers == NULL) {
+            return NULL;
+        }
+
+        for (size_t i = *cache_size; i <= n; ++i) {
+            solvers[i] = NULL;
+        }
+        *cache = solvers;
+        *cache_size = n + 1;
+    }
+
+    if ((*cache)[n] == NULL) {
+        (*cache)[n] = gsl_multifit_fdfsolver_alloc(T, n, p);
+    }
+
+    return (*cache)[n];
+}
+
+/* Get the SLSQP optimizer, from the workspace if there is one. */
+static nlopt_opt workspace_opt(lcfit_fit_workspace* ws)
+{
+    if (ws != NULL && ws->opt != NULL) {
+        return ws->opt;
+    }
+
+    const double lower_bounds[4] = { 1.0, 1.0, BSM_R_MIN, 0.0 };
+    const double upper_bounds[4] = { INFINITY, INFINITY, BSM_R_MAX, INFINITY };
+
+    nlopt_opt opt = nlopt_create(NLOPT_LD_SLSQP, 4);
+    nlopt_set_lower_bounds(opt, lower_bounds);
+    nlopt_set_upper_bounds(opt, upper_bounds);
+    nlopt_set_xtol_rel(opt, 1e-4);
+
+    if (ws != NULL) {
+        ws->opt = opt;
+    }
+
+    return opt;
+}
 
 int check_model(const bsm_t* m)
 {
@@ -385,6 +606,157 @@ int check_model(const bsm_t* m)
     return 0;
 }
 
+/* Binary entropy in nats. */
+static double binary_entropy(const double p)
+{
+    return -(p * log(p) + (1.0 - p) * log1p(-p));
+}
+
+/*
+ * The model whose mode is (t0, l0) with second derivative d2 there
+ * and whose fraction of mutated sites is p. With N = c + m, the mode
+ * is at exp(-r (t0 + b)) = 1 - 2p, where the log-likelihood is
+ * -N H(p) and its second derivative is -r^2 N (1 - 2p)^2 / (4 p (1 - p)).
+ */
+static void model_from_mode(const double p, const double t0, const double l0,
+                            const double d2, bsm_t* m)
+{
+    const double n_sites = -l0 / binary_entropy(p);
+    const double u0 = 1.0 - 2.0 * p;
+    const double r = sqrt(-d2 * 4.0 * p * (1.0 - p) / n_sites) / u0;
+
+    m->c = n_sites * (1.0 - p);
+    m->m = n_sites * p;
+    m->r = fmin(fmax(r, BSM_R_MIN), BSM_R_MAX);
+    m->b = fmax(-log(u0) / m->r - t0, 0.0);
+}
+
+/* Sum of squared residuals of a model at the given points, or INFINITY if the model is invalid. */
+static double model_sse(const size_t n, const double* t, const double* l,
+                        const double p, const double t0, const double l0,
+                        const double d2, bsm_t* m)
+{
+    model_from_mode(p, t0, l0, d2, m);
+
+    if (check_model(m) != 0) {
+        return INFINITY;
+    }
+
+    double sse = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        const double err = lcfit_bsm_log_like(t[i], m) - l[i];
+        sse += err * err;
+    }
+
+    return isnan(sse) ? INFINITY : sse;
+}
+
+/* Smallest and largest fractions of mutated sites considered by lcfit_bsm_initial_guess. */
+static const double GUESS_P_MIN = 1e-8;
+static const double GUESS_P_MAX = 0.499;
+
+/* Grid points and golden-section steps over log(p). */
+#define GUESS_GRID_POINTS 32
+#define GUESS_GOLDEN_ITER 40
+
+int lcfit_bsm_initial_guess(const size_t n, const double* t, const double* l, bsm_t* m)
+{
+    size_t i_max = 0;
+    for (size_t i = 1; i < n; ++i) {
+        if (l[i] > l[i_max]) {
+            i_max = i;
+        }
+    }
+
+    /* The empirical maximum needs a neighbor on either side. */
+    size_t lo = n, hi = n;
+    for (size_t i = 0; i < n; ++i) {
+        if (t[i] < t[i_max] && (lo == n || t[i] > t[lo])) {
+            lo = i;
+        }
+        if (t[i] > t[i_max] && (hi == n || t[i] < t[hi])) {
+            hi = i;
+        }
+    }
+
+    if (lo == n || hi == n) {
+        return LCFIT_ERROR;
+    }
+
+    /* The mode and curvature of the parabola through the three points */
+    const double s_lo = (l[i_max] - l[lo]) / (t[i_max] - t[lo]);
+    const double s_hi = (l[hi] - l[i_max]) / (t[hi] - t[i_max]);
+    const double a = (s_hi - s_lo) / (t[hi] - t[lo]);
+
+    if (!(a < 0.0)) {
+        return LCFIT_ERROR;
+    }
+
+    const double t0 = 0.5 * (t[lo] + t[i_max]) - s_lo / (2.0 * a);
+    const double l0 = l[i_max] + s_lo * (t0 - t[i_max]) + a * (t0 - t[lo]) * (t0 - t[i_max]);
+    const double d2 = 2.0 * a;
+
+    if (!(l0 < 0.0)) {
+        return LCFIT_ERROR;
+    }
+
+    /* The mode, its log-likelihood and the curvature there leave the
+     * fraction of mutated sites free; it sets the asymptote
+     * (c + m) log(0.5), so choose it to best match the other points,
+     * first on a grid over log(p) and then by golden-section search. */
+    bsm_t candidate;
+    const double x_min = log(GUESS_P_MIN);
+    const double x_max = log(GUESS_P_MAX);
+    const double step = (x_max - x_min) / (GUESS_GRID_POINTS - 1);
+
+    size_t k_best = 0;
+    double sse_best = INFINITY;
+    for (size_t k = 0; k < GUESS_GRID_POINTS; ++k) {
+        const double sse = model_sse(n, t, l, exp(x_min + k * step), t0, l0, d2, &candidate);
+        if (sse < sse_best) {
+            sse_best = sse;
+            k_best = k;
+        }
+    }
+
+    if (sse_best == INFINITY) {
+        return LCFIT_ERROR;
+    }
+
+    const double golden = 0.5 * (3.0 - sqrt(5.0));
+    double x_lo = x_min + (k_best > 0 ? k_best - 1 : 0) * step;
+    double x_hi = x_min + (k_best < GUESS_GRID_POINTS - 1 ? k_best + 1 : k_best) * step;
+    double x1 = x_lo + golden * (x_hi - x_lo);
+    double x2 = x_hi - golden * (x_hi - x_lo);
+    double f1 = model_sse(n, t, l, exp(x1), t0, l0, d2, &candidate);
+    double f2 = model_sse(n, t, l, exp(x2), t0, l0, d2, &candidate);
+
+    for (int iter = 0; iter < GUESS_GOLDEN_ITER; ++iter) {
+        if (f1 < f2) {
+            x_hi = x2;
+            x2 = x1;
+            f2 = f1;
+            x1 = x_lo + golden * (x_hi - x_lo);
+            f1 = model_sse(n, t, l, exp(x1), t0, l0, d2, &candidate);
+        } else {
+            x_lo = x1;
+            x1 = x2;
+            f1 = f2;
+            x2 = x_hi - golden * (x_hi - x_lo);
+            f2 = model_sse(n, t, l, exp(x2), t0, l0, d2, &candidate);
+        }
+    }
+
+    double x_best = x_min + k_best * step;
+    if (fmin(f1, f2) < sse_best) {
+        x_best = f1 < f2 ? x1 : x2;
+    }
+
+    model_sse(n, t, l, exp(x_best), t0, l0, d2, m);
+
+    return LCFIT_SUCCESS;
+}
+
 /**
  * The fitting procedure first tries unconstrained Levenberg-Marquardt
  * optimization to fit the model parameters to the data. See <a
@@ -404,6 +776,14 @@ int check_model(const bsm_t* m)
  * model, or indicated complete failure, SLSQP starts over with the
  * original initial conditions.
  *
+ * In regime 1 the offset \c b is zero and the four-parameter problem
+ * is poorly conditioned, so the function also fits the reduced model
+ * with <c>b = 0</c> and parameters (c, m, r): first, if the initial
+ * model already has <c>b = 0</c>, keeping the result if increasing \c b
+ * would not improve the fit; and after LM, if the only thing wrong
+ * with its model is <c>b < 0</c>. A successful reduced fit avoids the
+ * SLSQP pass.
+ *
  * A model is considered invalid if any of the following are true:
  * - <c>m.c < 1</c>
  * - <c>m.m < 1</c>
@@ -423,34 +803,118 @@ int lcfit_fit_bsm_weight(const size_t n,
                          const double *w,
                          bsm_t *m,
                          size_t max_iter)
+{
+    return lcfit_fit_bsm_weight_ws(n, t, l, w, m, max_iter, NULL);
+}
+
+int lcfit_fit_bsm_weight_ws(const size_t n,
+                            const double* t,
+                            const double* l,
+                            const double *w,
+                            bsm_t *m,
+                            size_t max_iter,
+                            lcfit_fit_workspace* ws)
 {
     if (n < 4) {
         fprintf(stderr, "ERROR: fitting a model requires at least four points\n");
         return LCFIT_ERROR;
     }
 
+    LCFIT_TRACE1(fit_start, n);
+
     bsm_t initial_model = *m;
+    int status = LCFIT_ERROR;
+    bool reduced = false;
+
+    if (m->b == 0.0) {
+        /* A start on the b = 0 boundary, as from lcfit2_to_lcfit4 or
+         * lcfit_bsm_initial_guess in regime 1, suggests the data do
+         * too, so try the better-conditioned reduced model first. */
+        status = lcfit_fit_bsm_weighted_gsl_b0(n, t, l, w, m, max_iter, ws);
+        reduced = status == LCFIT_SUCCESS && check_model(m) == 0 &&
+                  b0_is_optimal(n, t, l, w, m);
+
+        if (!reduced && check_model(m) != 0) {
+            *m = initial_model;
+        }
+    }
 
-    int status = lcfit_fit_bsm_weighted_gsl(n, t, l, w, m, max_iter);
-    if (check_model(m) != 0) {
+    if (!reduced) {
+        status = lcfit_fit_bsm_weighted_gsl(n, t, l, w, m, max_iter, ws);
+
+        if (check_model(m) == 3) {
+            /* Only b is invalid: the unconstrained optimum has b < 0,
+             * so the constrained one is on the b = 0 boundary. */
+            bsm_t boundary_model = *m;
+            boundary_model.b = 0.0;
+
+            if (lcfit_fit_bsm_weighted_gsl_b0(n, t, l, w, &boundary_model,
+                                              max_iter, ws) == LCFIT_SUCCESS &&
+                check_model(&boundary_model) == 0) {
+                *m = boundary_model;
+                status = LCFIT_SUCCESS;
+                reduced = true;
+            }
+        }
+    }
+
+    bool fallback = false;
+    if (!reduced && check_model(m) != 0) {
         /* GSL returned a bad model, so start over. */
+        LCFIT_TRACE2(nlopt_fallback, n, status);
         *m = initial_model;
-        status = lcfit_fit_bsm_weighted_nlopt(n, t, l, w, m, max_iter);
-    } else if (status != LCFIT_SUCCESS) {
+        status = lcfit_fit_bsm_weighted_nlopt(n, t, l, w, m, max_iter, ws);
+        fallback = true;
+    } else if (!reduced && status != LCFIT_SUCCESS) {
         /* GSL returned a valid model but did not indicate success, so
          * try and refine the model with NLopt. */
-        status = lcfit_fit_bsm_weighted_nlopt(n, t, l, w, m, max_iter);
+        LCFIT_TRACE2(nlopt_fallback, n, status);
+        status = lcfit_fit_bsm_weighted_nlopt(n, t, l, w, m, max_iter, ws);
+        fallback = true;
+    }
+
+    if (ws != NULL) {
+        ++ws->stats.fits;
+        if (reduced) {
+            ++ws->stats.reduced;
+        }
+        if (fallback) {
+            ++ws->stats.fallbacks;
+        }
     }
 
+    LCFIT_TRACE3(fit_done, status, reduced, fallback);
+
     return status;
 }
 
+// translate from GSL status to LCFIT status
+// GSL error codes are defined in gsl_errno.h
+// corresonding lcfit error codes can be found in lcfit.h
+static int lcfit_status_from_gsl(const int status, const size_t iterations,
+                                 const size_t max_iter)
+{
+    if (iterations >= max_iter)
+        return LCFIT_MAXITER;
+    else if (status == GSL_SUCCESS)
+        return LCFIT_SUCCESS;
+    else if (status ==  GSL_ENOPROG)
+        return LCFIT_ENOPROG;
+    else if (status == GSL_ETOLF)
+        return LCFIT_ETOLF;
+    else if (status == GSL_ETOLG)
+        return LCFIT_ETOLG;
+    else
+        return LCFIT_ERROR;
+}
+
 int lcfit_fit_bsm_weighted_gsl(const size_t n,
                                const double* t,
                                const double* l,
                                const double *w,
                                bsm_t *m,
-                               size_t max_iter)
+                               size_t max_iter,
+                               lcfit_fit_workspace* ws)
 {
     double x[4] = {m->c, m->m, m->r, m->b};
     int status = GSL_SUCCESS;
@@ -469,8 +933,7 @@ int lcfit_fit_bsm_weighted_gsl(const size_t n,
     fdf.p = 4; /* 4 parameters */
     fdf.params = &d;
 
-    const gsl_multifit_fdfsolver_type *T = gsl_multifit_fdfsolver_lmsder;
-    gsl_multifit_fdfsolver* s = gsl_multifit_fdfsolver_alloc(T, n, 4);
+    gsl_multifit_fdfsolver* s = workspace_solver(ws, n, 4);
     assert(s != NULL && "Solver allocation failed!");
     gsl_multifit_fdfsolver_set(s, &fdf, &x_view.vector); /* Taking address of view.vector gives a const gsl_vector * */
 
@@ -481,6 +944,7 @@ int lcfit_fit_bsm_weighted_gsl(const size_t n,
     do {
         d.iterations++;
         status = gsl_multifit_fdfsolver_iterate(s);
+        LCFIT_TRACE2(lm_iter, 4, d.iterations);
 
 #ifdef LCFIT4_VERBOSE
         print_state_gsl(d.iterations, s);
@@ -512,21 +976,11 @@ int lcfit_fit_bsm_weighted_gsl(const size_t n,
             gsl_strerror(status), status, d.iterations);
 #endif /* LCFIT4_VERBOSE */
 
-    // translate from GSL status to LCFIT status
-    // GSL error codes are defined in gsl_errno.h
-    // corresonding lcfit error codes can be found in lcfit.h
-    if (d.iterations >= max_iter)
-        status = LCFIT_MAXITER;
-    else if (status == GSL_SUCCESS)
-        status = LCFIT_SUCCESS;
-    else if (status ==  GSL_ENOPROG)
-        status = LCFIT_ENOPROG;
-    else if (status == GSL_ETOLF)
-        status = LCFIT_ETOLF;
-    else if (status == GSL_ETOLG)
-        status = LCFIT_ETOLG;
-    else
-        status = LCFIT_ERROR;
+    if (ws != NULL) {
+        ws->stats.lm_iterations += d.iterations;
+    }
+
+    status = lcfit_status_from_gsl(status, d.iterations, max_iter);
 
     // Update fit
     m->c = FIT(0);
@@ -536,10 +990,95 @@ int lcfit_fit_bsm_weighted_gsl(const size_t n,
 #undef FIT
 #undef ERR
 
-    gsl_multifit_fdfsolver_free(s);
+    if (ws == NULL) {
+        gsl_multifit_fdfsolver_free(s);
+    }
     return status;
 }
 
+/* Fit the reduced model with b = 0, starting from the c, m and r of m. */
+int lcfit_fit_bsm_weighted_gsl_b0(const size_t n,
+                                  const double* t,
+                                  const double* l,
+                                  const double *w,
+                                  bsm_t *m,
+                                  size_t max_iter,
+                                  lcfit_fit_workspace* ws)
+{
+    double x[3] = {m->c, m->m, m->r};
+    int status = GSL_SUCCESS;
+
+    struct data_to_fit d = { n, t, l, w, 0 };
+    gsl_multifit_function_fdf fdf;
+
+    gsl_vector_const_view x_view = gsl_vector_const_view_array(x, 3);
+
+    fdf.f = &lcfit_pair_f_b0;
+    fdf.df = &lcfit_pair_df_b0;
+    fdf.fdf = &lcfit_pair_fdf_b0;
+    fdf.n = n;
+    fdf.p = 3; /* c, m, r */
+    fdf.params = &d;
+
+    gsl_multifit_fdfsolver* s = workspace_solver(ws, n, 3);
+    assert(s != NULL && "Solver allocation failed!");
+    gsl_multifit_fdfsolver_set(s, &fdf, &x_view.vector);
+
+    do {
+        d.iterations++;
+        status = gsl_multifit_fdfsolver_iterate(s);
+        LCFIT_TRACE2(lm_iter, 3, d.iterations);
+        if (status) {
+            break;
+        }
+        status = gsl_multifit_test_delta(s->dx, s->x, 0.0, 1e-4);
+    } while (status == GSL_CONTINUE && d.iterations < max_iter);
+
+#ifdef LCFIT4_VERBOSE
+    fprintf(stderr, "[G3] status = %s (%d)   iterations %zu\n",
+            gsl_strerror(status), status, d.iterations);
+#endif /* LCFIT4_VERBOSE */
+
+    if (ws != NULL) {
+        ws->stats.lm_iterations += d.iterations;
+    }
+
+    status = lcfit_status_from_gsl(status, d.iterations, max_iter);
+
+    m->c = gsl_vector_get(s->x, 0);
+    m->m = gsl_vector_get(s->x, 1);
+    m->r = gsl_vector_get(s->x, 2);
+    m->b = 0.0;
+
+    if (ws == NULL) {
+        gsl_multifit_fdfsolver_free(s);
+    }
+    return status;
+}
+
+/*
+ * Whether b = 0 is optimal for a model fit with b held there, i.e.
+ * whether the weighted sum of squares does not decrease as b grows,
+ * to within rounding of the terms making up its derivative.
+ */
+static bool b0_is_optimal(const size_t n, const double* t, const double* l,
+                          const double* w, const bsm_t* m)
+{
+    double d_sse = 0.0;
+    double scale = 0.0;
+
+    for (size_t i = 0; i < n; ++i) {
+        double grad[4];
+        lcfit_bsm_gradient(t[i], m, grad);
+
+        const double err = lcfit_bsm_log_like(t[i], m) - l[i];
+        d_sse += w[i] * w[i] * err * grad[3];
+        scale += w[i] * w[i] * fabs(l[i] * grad[3]);
+    }
+
+    return d_sse >= -sqrt(DBL_EPSILON) * scale;
+}
+
 const char* nlopt_strerror(int status)
 {
     switch (status) {
@@ -575,19 +1114,13 @@ int lcfit_fit_bsm_weighted_nlopt(const size_t n,
                                  const double* l,
                                  const double *w,
                                  bsm_t *m,
-                                 size_t max_iter)
+                                 size_t max_iter,
+                                 lcfit_fit_workspace* ws)
 {
     struct data_to_fit fit_data = { n, t, l, w, 0 };
 
-    const double lower_bounds[4] = { 1.0, 1.0, BSM_R_MIN, 0.0 };
-    const double upper_bounds[4] = { INFINITY, INFINITY, BSM_R_MAX, INFINITY };
-
-    nlopt_opt opt = nlopt_create(NLOPT_LD_SLSQP, 4);
+    nlopt_opt opt = workspace_opt(ws);
     nlopt_set_min_objective(opt, bsm_fit_objective, &fit_data);
-    nlopt_set_lower_bounds(opt, lower_bounds);
-    nlopt_set_upper_bounds(opt, upper_bounds);
-
-    nlopt_set_xtol_rel(opt, 1e-4);
     nlopt_set_maxeval(opt, max_iter);
 
     double x[4] = { m->c, m->m, m->r, m->b };
@@ -625,11 +1158,42 @@ int lcfit_fit_bsm_weighted_nlopt(const size_t n,
     m->r = x[2];
     m->b = x[3];
 
-    nlopt_destroy(opt);
+    if (ws == NULL) {
+        nlopt_destroy(opt);
+    }
     return status;
 }
 
 #ifdef NOTYET
+/* calculate the sum of logs */
+static double log_sum(const double x, const double y)
+{
+    const static double max_value = DBL_MAX;
+    const double log_limit = -max_value / 100;
+    const static double NATS = 400;
+
+    const double temp = y - x;
+    if(temp > NATS || x < log_limit)
+        return y;
+    if(temp < -NATS || y < log_limit)
+        return x;
+    if(temp < 0)
+        return x + log1p(exp(temp));
+    return y + log1p(exp(-temp));
+}
+
+static void log_normalize(gsl_vector* x)
+{
+    double sum = -DBL_MAX;
+    size_t i;
+    const double max_val = gsl_vector_max(x);
+    gsl_vector_add_constant(x, -max_val);
+
+    for(i = 0; i < x->size; i++)
+        sum = log_sum(sum, gsl_vector_get(x, i));
+    gsl_vector_add_constant(x, -sum);
+}
+
 /* Here we minimize the KL divergence, rather than nonlinear least squares */
 double kl_divergence(const double* unnorm_log_p1,
                      const double* unnorm_log_p2,
@@ -750,17 +1314,6 @@ int lcfit_bsm_minimize_kl(const size_t n, const double* t, const double* l, bsm_
 }
 #endif /* NOTYET */
 
-typedef struct fn_wrapper {
-    double (*fn)(double, void*);
-    void* fn_args;
-} fn_wrapper_t;
-
-static double invert_wrapped_fn(double t, void* data)
-{
-    fn_wrapper_t* wrapper = (fn_wrapper_t*) data;
-    return -(wrapper->fn(t, wrapper->fn_args));
-}
-
 // This function attempts to bisect the range [min_t, max_t] of a
 // supplied function until the evaluated points enclose a maximum. If
 // successful, the function updates min_t and max_t and returns true.
@@ -792,38 +1345,54 @@ static double invert_wrapped_fn(double t, void* data)
 // TODO: [efficiency] likelihood function maxima are far more likely
 // to be found close to zero. it would probably be more efficient if
 // the guesses were biased to the left.
-//
-// TODO: [efficiency] the final values of t and f(t) could be passed
-// back to the caller for reuse in initializing the minimizer (see
-// gsl_min_fminimizer_set_with_values).
 
-debug_export bool bracket_maximum(double (*fn)(double, void*), void* fn_args,
-                                  double* min_t, double* max_t)
+// Advance the bracketing search given the function values f at the
+// points t. Returns 1 if the points enclose a maximum and -1 if they
+// enclose a minimum. Otherwise the interval is narrowed, t[1] is moved
+// to its midpoint, and 0 is returned; f[1] must then be evaluated at
+// the new t[1] before the next call.
+int bracket_maximum_update(double* t, double* f)
+{
+    if (f[1] > f[0] && f[1] > f[2]) {  // maximum enclosed
+        return 1;
+    } else if (f[1] < f[0] && f[1] < f[2]) {  // minimum enclosed
+        return -1;
+    } else if (f[0] < f[1] && f[1] < f[2]) {  // monotonically increasing
+        t[0] = t[1];
+        f[0] = f[1];
+    } else if ((f[0] > f[1] && f[1] > f[2])  // monotonically decreasing
+               || (f[1] == f[2])) {          // asymptote
+        t[2] = t[1];
+        f[2] = f[1];
+    }
+
+    t[1] = (t[0] + t[2]) / 2.0;
+    return 0;
+}
+
+#ifdef LCFIT_DEBUG
+/* The blocking forms of the steps the automatic fits take through
+ * lcfit_auto.c, kept for the tests. */
+
+bool bracket_maximum_ex(double (*fn)(double, void*), void* fn_args,
+                        double* min_t, double* max_t,
+                        const lcfit_executor_t* executor)
 {
     double t[3] = {*min_t, (*min_t + *max_t) / 2.0, *max_t};
-    double f[3] = {fn(t[0], fn_args), fn(t[1], fn_args), fn(t[2], fn_args)};
+    double f[3];
+    lcfit_evaluate_n(executor, fn, fn_args, 3, t, f);
 
-    const size_t MAX_ITER = 30;
     size_t iter = 0;
     bool success = false;
 
-    for (; iter < MAX_ITER; ++iter) {
-        if (f[1] > f[0] && f[1] > f[2]) {  // maximum enclosed
-            success = true;
-            break;
-        } else if (f[1] < f[0] && f[1] < f[2]) {  // minimum enclosed
-            // success = false;
+    for (; iter < BRACKET_MAX_ITER; ++iter) {
+        const int enclosed = bracket_maximum_update(t, f);
+
+        if (enclosed != 0) {
+            success = enclosed > 0;
             break;
-        } else if (f[0] < f[1] && f[1] < f[2]) {  // monotonically increasing
-            t[0] = t[1];
-            f[0] = f[1];
-        } else if ((f[0] > f[1] && f[1] > f[2])  // monotonically decreasing
-                   || (f[1] == f[2])) {          // asymptote
-            t[2] = t[1];
-            f[2] = f[1];
         }
 
-        t[1] = (t[0] + t[2]) / 2.0;
         f[1] = fn(t[1], fn_args);
     }
 
@@ -837,6 +1406,13 @@ debug_export bool bracket_maximum(double (*fn)(double, void*), void* fn_args,
     return success;
 }
 
+bool bracket_maximum(double (*fn)(double, void*), void* fn_args,
+                     double* min_t, double* max_t)
+{
+    return bracket_maximum_ex(fn, fn_args, min_t, max_t, NULL);
+}
+#endif /* LCFIT_DEBUG */
+
 // This function estimates the first and second derivatives of a
 // well-behaved function at a point x using a five-point stencil.
 //
@@ -844,89 +1420,131 @@ debug_export bool bracket_maximum(double (*fn)(double, void*), void* fn_args,
 // evaluation could be saved by passing that value in instead of
 // recomputing it.
 
-debug_export void estimate_derivatives(double (*fn)(double, void*), void* fn_args,
-                                       double x, double* d1, double* d2)
+// Fill t with the five stencil points around x and return their spacing.
+double derivative_stencil(const double x, double* t)
 {
     // the central differences below are fourth order, so use a step
     // size relative to the fourth root of DBL_EPSILON
     const double h = x * pow(DBL_EPSILON, 0.25);
 
+    t[0] = x - 2*h;
+    t[1] = x - h;
+    t[2] = x;
+    t[3] = x + h;
+    t[4] = x + 2*h;
+
+    return h;
+}
+
+// Compute the derivatives from the function values f at the stencil
+// points with spacing h.
+void stencil_derivatives(const double* f, const double h, double* d1, double* d2)
+{
     // https://en.wikipedia.org/wiki/Five-point_stencil
     // https://en.wikipedia.org/wiki/Savitzky%E2%80%93Golay_filter#Tables_of_selected_convolution_coefficients
 
-    double fm2 = fn(x - 2*h, fn_args);
-    double fm1 = fn(x - h, fn_args);
-    double f0 = fn(x, fn_args);
-    double fp1 = fn(x + h, fn_args);
-    double fp2 = fn(x + 2*h, fn_args);
+    const double fm2 = f[0];
+    const double fm1 = f[1];
+    const double f0 = f[2];
+    const double fp1 = f[3];
+    const double fp2 = f[4];
 
     *d1 = (-fp2 + 8*fp1 - 8*fm1 + fm2) / (12*h);
     *d2 = (-fp2 + 16*fp1 - 30*f0 + 16*fm1 - fm2) / (12*h*h);
 }
 
-debug_export double find_maximum(double (*fn)(double, void*), void* fn_args,
-                                 double guess, double min_t, double max_t)
+#ifdef LCFIT_DEBUG
+void estimate_derivatives_ex(double (*fn)(double, void*), void* fn_args,
+                             double x, double* d1, double* d2,
+                             const lcfit_executor_t* executor)
 {
-#ifdef LCFIT_AUTO_VERBOSE
-    fprintf(stderr, "min = %g, guess = %g, max = %g\n", min_t, guess, max_t);
-    fprintf(stderr, "f(min) = %g, f(guess) = %g, f(max) = %g\n",
-            fn(min_t, fn_args),
-            fn(guess, fn_args),
-            fn(max_t, fn_args));
-#endif /* LCFIT_AUTO_VERBOSE */
-
-    fn_wrapper_t wrapper;
-    wrapper.fn = fn;
-    wrapper.fn_args = fn_args;
-
-    gsl_function F;
-    F.function = &invert_wrapped_fn;
-    F.params = &wrapper;
+    double t[5];
+    const double h = derivative_stencil(x, t);
 
-    gsl_min_fminimizer* s = gsl_min_fminimizer_alloc(gsl_min_fminimizer_brent);
-    gsl_min_fminimizer_set(s, &F, guess, min_t, max_t);
+    double f[5];
+    lcfit_evaluate_n(executor, fn, fn_args, 5, t, f);
 
-    const int MAX_ITER = 100;
-    int iter = 0;
-    int status;
+    stencil_derivatives(f, h, d1, d2);
+}
 
-    do {
-        gsl_min_fminimizer_iterate(s);
-        ++iter;
+void estimate_derivatives(double (*fn)(double, void*), void* fn_args,
+                          double x, double* d1, double* d2)
+{
+    estimate_derivatives_ex(fn, fn_args, x, d1, d2, NULL);
+}
+#endif /* LCFIT_DEBUG */
 
-        guess = gsl_min_fminimizer_x_minimum(s);
-        min_t = gsl_min_fminimizer_x_lower(s);
-        max_t = gsl_min_fminimizer_x_upper(s);
+void lcfit_evaluate_n(const lcfit_executor_t* executor,
+                      double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                      const size_t n, const double* t, double* lnl)
+{
+    if (executor == NULL) {
+        for (size_t i = 0; i < n; ++i) {
+            LCFIT_TRACE1(eval_start, t[i]);
+            lnl[i] = lnl_fn(t[i], lnl_fn_args);
+            LCFIT_TRACE2(eval_done, t[i], lnl[i]);
+        }
 
-        status = gsl_min_test_interval(min_t, max_t, 0.0, pow(DBL_EPSILON, 0.25));
-    } while (status == GSL_CONTINUE && iter < MAX_ITER);
+        return;
+    }
 
-#ifdef LCFIT_AUTO_VERBOSE
-    fprintf(stderr, "lcfit_maximize: %d iterations\n", iter);
-#endif /* LCFIT_AUTO_VERBOSE */
+    LCFIT_TRACE1(batch_start, n);
 
-    if (iter == MAX_ITER) {
-        fprintf(stderr, "WARNING: maximum number of iterations reached during minimization\n");
+    for (size_t i = 0; i < n; ++i) {
+        executor->submit(executor->ctx, lnl_fn, lnl_fn_args, t[i], &lnl[i]);
     }
 
-    gsl_min_fminimizer_free(s);
+    executor->wait(executor->ctx);
 
-    return guess;
+    LCFIT_TRACE1(batch_done, n);
+}
+
+int lcfit_cancelled(const lcfit_cancel_t* cancel)
+{
+    return cancel != NULL && cancel->cancelled(cancel->ctx);
 }
 
 double lcfit_maximize(double (*lnl_fn)(double, void*), void* lnl_fn_args,
                       double min_t, double max_t, double* d1, double* d2)
 {
-    bool is_bracketed = bracket_maximum(lnl_fn, lnl_fn_args, &min_t, &max_t);
-    double guess = (min_t + max_t) / 2.0;
+    return lcfit_maximize_ex(lnl_fn, lnl_fn_args, min_t, max_t, d1, d2, NULL);
+}
+
+double lcfit_maximize_ex(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                         double min_t, double max_t, double* d1, double* d2,
+                         const lcfit_executor_t* executor)
+{
+    const lcfit_run_options_t options = {executor, NULL};
+
+    return lcfit_maximize_opt(lnl_fn, lnl_fn_args, min_t, max_t, d1, d2, &options, NULL);
+}
+
+double lcfit_maximize_opt(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                          double min_t, double max_t, double* d1, double* d2,
+                          const lcfit_run_options_t* options, int* status)
+{
+    const bool derivatives = d1 && d2;
 
-    if (is_bracketed) {
-        guess = find_maximum(lnl_fn, lnl_fn_args, guess, min_t, max_t);
+    if (status != NULL) {
+        *status = LCFIT_ERROR;
     }
 
-    if (d1 && d2) {
-        estimate_derivatives(lnl_fn, lnl_fn_args, guess, d1, d2);
+    lcfit_auto_state_t* s = lcfit_auto_begin_maximize(min_t, max_t, derivatives);
+    if (s == NULL) {
+        return NAN;
+    }
+
+    const int run_status = lcfit_auto_run_opt(s, lnl_fn, lnl_fn_args, options);
+    if (status != NULL) {
+        *status = run_status;
     }
 
+    const double guess = lcfit_auto_result(s, NULL);
+    if (derivatives) {
+        lcfit_auto_derivatives(s, d1, d2);
+    }
+
+    lcfit_auto_free(s);
+
     return guess;
 }
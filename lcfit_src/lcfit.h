@@ -39,6 +39,10 @@ typedef enum {
     LCFIT_MAXITER = 1,
     /** A non-specific error occurred. */
     LCFIT_ERROR = 2,
+    /** A reverse-communication fit needs a log-likelihood; see lcfit_auto.h. */
+    LCFIT_NEED_EVAL = 3,
+    /** A fit was stopped by its #lcfit_cancel_t before it finished. */
+    LCFIT_CANCELLED = 4,
     /** Iterations are not making progress toward a solution. */
     LCFIT_ENOPROG = 27,
     /** Cannot reach the tolerance specified for the objective function. */
@@ -93,6 +97,70 @@ typedef enum {
  */
 double lcfit_bsm_log_like(double t, const bsm_t* m);
 
+/** Compute the log-likelihood at many branch lengths in single precision.
+ *
+ * This is the single-precision counterpart of #lcfit_bsm_log_like for
+ * evaluating a fitted model on large grids. The exponential and
+ * logarithms are computed in \c float, in a form that stays accurate
+ * as \f$ t + b \to 0 \f$, and the terms are accumulated in \c double
+ * before rounding; the result agrees with #lcfit_bsm_log_like to
+ * within a relative error of about \f$ 10^{-6} \f$.
+ *
+ * \param[in]  n    Number of branch lengths.
+ * \param[in]  t    Branch lengths.
+ * \param[in]  m    Model parameters.
+ * \param[out] out  Log-likelihood at each branch length; may alias \c t.
+ */
+void lcfit_bsm_log_like_nf(const size_t n, const float* t, const bsm_t* m, float* out);
+
+/** Compute the log-likelihood less a constant at many branch lengths in single precision.
+ *
+ * As #lcfit_bsm_log_like_nf, but \c shift is subtracted in \c double
+ * before rounding, so that log-likelihoods relative to a large value
+ * (e.g. the maximum) keep their precision.
+ *
+ * \param[in]  n      Number of branch lengths.
+ * \param[in]  t      Branch lengths.
+ * \param[in]  m      Model parameters.
+ * \param[in]  shift  Value to subtract from each log-likelihood.
+ * \param[out] out    Shifted log-likelihood at each branch length; may alias \c t.
+ */
+void lcfit_bsm_log_like_shifted_nf(const size_t n, const float* t, const bsm_t* m,
+                                   const double shift, float* out);
+
+/** Compute the BSM log-likelihood and its derivatives with respect to branch length.
+ *
+ * Let \f$u = e^{-r (t + b)}\f$. Then
+ *
+ * \f[
+ *   \frac{dL}{dt} = r u \left( \frac{m}{1 - u} - \frac{c}{1 + u} \right)
+ * \f]
+ *
+ * \f[
+ *   \frac{d^2L}{dt^2} = r^2 u \left( \frac{c}{(1 + u)^2} - \frac{m}{(1 - u)^2} \right)
+ * \f]
+ *
+ * All three are computed from one \c expm1, which keeps \f$1 - u\f$
+ * accurate as \f$t + b \to 0\f$; the log-likelihood agrees with
+ * #lcfit_bsm_log_like to rounding. Where the log-likelihood is
+ * \c -INFINITY as described there, the derivatives are \c INFINITY
+ * and \c -INFINITY; at \c t = \c INFINITY both are 0.
+ *
+ *  \param[in]  t   Branch length.
+ *  \param[in]  m   Model parameters.
+ *  \param[out] d1  First derivative at \c t, or \c NULL.
+ *  \param[out] d2  Second derivative at \c t, or \c NULL.
+ *
+ *  \return The log-likelihood under \c m.
+ */
+double lcfit_bsm_log_like_dt(const double t, const bsm_t* m, double* d1, double* d2);
+
+/** Compute the first derivative of #lcfit_bsm_log_like with respect to branch length; see #lcfit_bsm_log_like_dt. */
+double lcfit_bsm_dlnl_dt(const double t, const bsm_t* m);
+
+/** Compute the second derivative of #lcfit_bsm_log_like with respect to branch length; see #lcfit_bsm_log_like_dt. */
+double lcfit_bsm_d2lnl_dt2(const double t, const bsm_t* m);
+
 /** Compute the maximum-likelihood branch length for a given model.
  *
  * In general,
@@ -195,13 +263,39 @@ double lcfit_bsm_scale_factor(const double t, const double l, const bsm_t* m);
  */
 void lcfit_bsm_rescale(const double t, const double l, bsm_t* m);
 
+/**
+ * Derive an initial model from empirical likelihood data.
+ *
+ * With \f$N = c + m\f$ and \f$p = m / N\f$, a model's maximum is at
+ * \f$e^{-r (t_0 + b)} = 1 - 2p\f$, where the log-likelihood is
+ * \f$-N H(p)\f$ for the binary entropy \f$H\f$ and its second
+ * derivative is \f$-r^2 N (1 - 2p)^2 / (4 p (1 - p))\f$. This function
+ * takes the mode, its log-likelihood and the curvature there from a
+ * parabola through the empirical maximum and its neighbors, which
+ * leaves \f$p\f$, and with it the asymptote \f$(c + m) \log 0.5\f$, to
+ * be chosen to best match the remaining points.
+ *
+ * The result is usually a closer start for #lcfit_fit_bsm_weight
+ * than #DEFAULT_INIT rescaled with #lcfit_bsm_rescale, especially
+ * for short and long branches.
+ *
+ * \param[in]  n  Number of observations in \c t and \c l.
+ * \param[in]  t  Branch lengths, in any order.
+ * \param[in]  l  Log-likelihood value at each \c t.
+ * \param[out] m  Model parameters, unchanged unless #LCFIT_SUCCESS is returned.
+ *
+ * \return #LCFIT_SUCCESS, or #LCFIT_ERROR if the points do not
+ *         enclose a maximum or no valid model matches them.
+ */
+int lcfit_bsm_initial_guess(const size_t n, const double* t, const double* l, bsm_t* m);
+
 /** Fit a given model to empirical likelihood data with weighting.
  *
  * This function fits the binary symmetric model to weighted empirical
  * likelihood samples using non-linear least squares methods, starting
- * with the initial conditions specified by \c m. Combine
- * #DEFAULT_INIT and #lcfit_bsm_scale_factor for reasonable starting
- * conditions.
+ * with the initial conditions specified by \c m. Use
+ * #lcfit_bsm_initial_guess, or combine #DEFAULT_INIT and
+ * #lcfit_bsm_scale_factor, for reasonable starting conditions.
  *
  * \param[in]     n  Number of observations in \c t and \c l.
  * \param[in]     t  Branch lengths.
@@ -214,6 +308,60 @@ void lcfit_bsm_rescale(const double t, const double l, bsm_t* m);
 int lcfit_fit_bsm_weight(const size_t n, const double* t, const double* l,
                          const double* w, bsm_t* m, size_t max_iter);
 
+/** Reusable solver storage for #lcfit_fit_bsm_weight_ws.
+ *
+ * A workspace caches the Levenberg-Marquardt solvers (one per number
+ * of observations seen) and the SLSQP optimizer used when fitting, so
+ * that repeated fits make no allocations once warmed up. A workspace
+ * must not be used by more than one thread at a time.
+ */
+typedef struct lcfit_fit_workspace lcfit_fit_workspace;
+
+/** Allocate an empty fitting workspace.
+ *
+ * \return The workspace, or \c NULL if allocation failed.
+ */
+lcfit_fit_workspace* lcfit_fit_workspace_alloc(void);
+
+/** Free a fitting workspace and the solvers it owns. */
+void lcfit_fit_workspace_free(lcfit_fit_workspace* ws);
+
+/** Counters accumulated by the fits that use a workspace. */
+typedef struct {
+    /** Number of fits. */
+    size_t fits;
+    /** Levenberg-Marquardt iterations over all fits. */
+    size_t lm_iterations;
+    /** Fits that fell back to SLSQP because Levenberg-Marquardt
+     *  failed or returned an invalid model. */
+    size_t fallbacks;
+    /** Fits that ended with the reduced three-parameter model with
+     *  <c>b = 0</c>; see #lcfit_fit_bsm_weight. */
+    size_t reduced;
+} lcfit_fit_stats;
+
+/** Get the counters accumulated by a workspace since it was allocated. */
+void lcfit_fit_workspace_stats(const lcfit_fit_workspace* ws, lcfit_fit_stats* stats);
+
+/** Fit a given model to weighted empirical likelihood data, reusing a workspace.
+ *
+ * This function behaves exactly as #lcfit_fit_bsm_weight, but takes
+ * its solvers from \c ws instead of allocating them for every fit.
+ *
+ * \param[in]     n         Number of observations in \c t and \c l.
+ * \param[in]     t         Branch lengths.
+ * \param[in]     l         Log-likelihood value at each \c t.
+ * \param[in]     w         Weight for sample point at each \c t.
+ * \param[in,out] m         Model parameters, updated in-place.
+ * \param[in]     max_iter  Maximum number of solver iterations.
+ * \param[in,out] ws        Workspace, or \c NULL to allocate temporary solvers.
+ *
+ * \return An #lcfit_status code, zero for success, non-zero otherwise.
+ */
+int lcfit_fit_bsm_weight_ws(const size_t n, const double* t, const double* l,
+                            const double* w, bsm_t* m, size_t max_iter,
+                            lcfit_fit_workspace* ws);
+
 /** Fit a given model to empirical likelihood data without weighting.
  *
  * This is a convenience function for fitting a model without sample
@@ -231,6 +379,68 @@ int lcfit_fit_bsm_weight(const size_t n, const double* t, const double* l,
 int lcfit_fit_bsm(const size_t n, const double* t, const double* l, bsm_t* m,
                   int max_iter);
 
+/** An executor for evaluating a log-likelihood function at several branch lengths concurrently.
+ *
+ * Functions taking an executor submit each batch of independent
+ * evaluations and then wait for all of them before reading any
+ * result. A \c NULL executor evaluates each point in turn on the
+ * calling thread. With an executor, the log-likelihood function must
+ * be safe to call concurrently with itself.
+ */
+typedef struct {
+    /** Start computing <tt>*result = fn(t, fn_args)</tt>. The result
+     *  may be written at any time before the next call to \c wait
+     *  returns. */
+    void (*submit)(void* ctx, double (*fn)(double, void*), void* fn_args,
+                   double t, double* result);
+    /** Block until every evaluation submitted so far has completed. */
+    void (*wait)(void* ctx);
+    /** Executor state, passed to \c submit and \c wait. */
+    void* ctx;
+} lcfit_executor_t;
+
+/** Evaluate a log-likelihood function at several branch lengths.
+ *
+ * \param[in]  executor     Executor to evaluate with, or \c NULL to evaluate sequentially.
+ * \param[in]  lnl_fn       Log-likelihood callback function.
+ * \param[in]  lnl_fn_args  Data for log-likelihood callback function.
+ * \param[in]  n            Number of branch lengths.
+ * \param[in]  t            Branch lengths.
+ * \param[out] lnl          Log-likelihood at each branch length.
+ */
+void lcfit_evaluate_n(const lcfit_executor_t* executor,
+                      double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                      const size_t n, const double* t, double* lnl);
+
+/** A cancellation token for fits that evaluate a log-likelihood function.
+ *
+ * Fits taking a token check it before each batch of evaluations, and
+ * before each evaluation when evaluating sequentially. Once it reports
+ * cancellation, they stop with #LCFIT_CANCELLED and return the best
+ * estimate they have so far. A deadline is a token whose \c cancelled
+ * compares the time against it.
+ */
+typedef struct {
+    /** Return nonzero to stop the fit. */
+    int (*cancelled)(void* ctx);
+    /** Token state, passed to \c cancelled. */
+    void* ctx;
+} lcfit_cancel_t;
+
+/** Check a cancellation token.
+ *
+ * \return Nonzero if \c cancel is not \c NULL and reports cancellation.
+ */
+int lcfit_cancelled(const lcfit_cancel_t* cancel);
+
+/** Options for running an automatic fit, as by #lcfit_maximize_opt. */
+typedef struct {
+    /** Executor to evaluate with, or \c NULL to evaluate sequentially. */
+    const lcfit_executor_t* executor;
+    /** Cancellation token, or \c NULL. */
+    const lcfit_cancel_t* cancel;
+} lcfit_run_options_t;
+
 /** Find the mode of a log-likelihood function and optionally compute derivatives there.
  *
  * \param[in]     lnl_fn       Log-likelihood callback function.
@@ -245,6 +455,67 @@ int lcfit_fit_bsm(const size_t n, const double* t, const double* l, bsm_t* m,
 double lcfit_maximize(double (*lnl_fn)(double, void*), void* lnl_fn_args,
                       double min_t, double max_t, double* d1, double* d2);
 
+/** As #lcfit_maximize, but with independent evaluations issued through an executor.
+ *
+ * The three points that start the bracketing search and the five
+ * points of the derivative stencil are each evaluated as one batch.
+ *
+ * \param[in] executor  Executor to evaluate with, or \c NULL.
+ */
+double lcfit_maximize_ex(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                         double min_t, double max_t, double* d1, double* d2,
+                         const lcfit_executor_t* executor);
+
+/** As #lcfit_maximize, with an executor and a cancellation token.
+ *
+ * If the search is cancelled, this returns the best branch length
+ * evaluated so far, and the derivatives are \c NAN unless they were
+ * already estimated.
+ *
+ * \param[in]  options  Options, or \c NULL for the behavior of #lcfit_maximize.
+ * \param[out] status   #LCFIT_SUCCESS, #LCFIT_ERROR or #LCFIT_CANCELLED, or \c NULL.
+ */
+double lcfit_maximize_opt(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                          double min_t, double max_t, double* d1, double* d2,
+                          const lcfit_run_options_t* options, int* status);
+
+/** Compute the exponential-prior inversion sampling helper \f$K(x)\f$.
+ *
+ * With \f$c\f$ and \f$m\f$ rounded to the nearest integers,
+ *
+ * \f[
+ *   K(x) = x^{\lambda / r} \sum_{i=0}^{c} \sum_{j=0}^{m}
+ *          (-1)^j \binom{c}{i} \binom{m}{j} \frac{x^{i+j}}{i + j + \lambda / r}
+ * \f]
+ *
+ * This function keeps no mutable state and is safe to call
+ * concurrently from multiple threads.
+ *
+ * \param[in]  model   Model parameters.
+ * \param[in]  lambda  Rate of exponential prior.
+ * \param[in]  x       Value at which to evaluate \f$K\f$, in \f$[0, 1]\f$.
+ * \param[out] k       The value of \f$K(x)\f$.
+ *
+ * \return An #lcfit_status code; \c LCFIT_ERROR if the model or prior
+ *         are invalid or the result is not finite.
+ */
+int lcfit_k_exp_prior(const bsm_t* model, double lambda, double x, double* k);
+
+/** Invert #lcfit_k_exp_prior by bisection.
+ *
+ * Finds \f$x \in [0, 1]\f$ such that \f$|K(x) - u| \leq 10^{-6}\f$.
+ *
+ * \param[in]  model   Model parameters.
+ * \param[in]  lambda  Rate of exponential prior.
+ * \param[in]  u       Target value of \f$K\f$.
+ * \param[out] x       The inverted value, or the last bisection point if
+ *                     the search did not converge.
+ *
+ * \return An #lcfit_status code; \c LCFIT_MAXITER if the bisection did
+ *         not reach the tolerance.
+ */
+int lcfit_inv_exp_prior(const bsm_t* model, double lambda, double u, double* x);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
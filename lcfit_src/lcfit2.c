@@ -13,8 +13,10 @@
 #include <string.h>
 
 #include "lcfit.h"
+#include "lcfit_auto.h"
 #include "lcfit2_gsl.h"
 #include "lcfit2_nlopt.h"
+#include "lcfit_weights.h"
 
 void lcfit2_print_array(const char* name, const size_t n, const double* x)
 {
@@ -107,29 +109,50 @@ void lcfit2_to_lcfit4(const lcfit2_bsm_t* model2, bsm_t* model4)
     }
 }
 
-double lcfit2_d1f_t(const double t, const lcfit2_bsm_t* model)
+/* The log-likelihood and its derivatives in t, in terms of
+ * v = (c - m) exp(-r (t - t0)) = (c + m) / theta, so that one
+ * exponential serves all three. The logarithms are only taken when
+ * lnl is not NULL. */
+static void lcfit2_lnl_dt_v(const double t, const lcfit2_bsm_t* model,
+                            double* lnl, double* d1, double* d2)
 {
     const double c = model->c;
     const double m = model->m;
 
     const double r = lcfit2_var_r(model);
-    const double theta = lcfit2_var_theta(t, model);
+    const double v = (c - m) * exp(-r * (t - model->t0));
+    const double p = c + m + v;
+    const double q = c + m - v;
 
-    const double d1f_t = (-c * r) / (theta + 1) + (m * r) / (theta - 1);
+    if (lnl != NULL) {
+        *lnl = c * log(p) + m * log(q) - (c + m) * log(2 * (c + m));
+    }
+    if (d1 != NULL) {
+        *d1 = r * v * (m / q - c / p);
+    }
+    if (d2 != NULL) {
+        *d2 = r * r * (c + m) * v * (c / (p * p) - m / (q * q));
+    }
+}
+
+double lcfit2_lnl_dt(const double t, const lcfit2_bsm_t* model, double* d1, double* d2)
+{
+    double lnl;
+    lcfit2_lnl_dt_v(t, model, &lnl, d1, d2);
+    return lnl;
+}
 
+double lcfit2_d1f_t(const double t, const lcfit2_bsm_t* model)
+{
+    double d1f_t;
+    lcfit2_lnl_dt_v(t, model, NULL, &d1f_t, NULL);
     return d1f_t;
 }
 
 double lcfit2_d2f_t(const double t, const lcfit2_bsm_t* model)
 {
-    const double c = model->c;
-    const double m = model->m;
-
-    const double r = lcfit2_var_r(model);
-    const double theta = lcfit2_var_theta(t, model);
-
-    const double d2f_t = (c * r * r * theta) / pow(theta + 1, 2.0) - (m * r * r * theta) / pow(theta - 1, 2.0);
-
+    double d2f_t;
+    lcfit2_lnl_dt_v(t, model, NULL, NULL, &d2f_t);
     return d2f_t;
 }
 
@@ -221,39 +244,11 @@ double lcfit2_norm_lnl(const double t, const lcfit2_bsm_t* model)
     return lcfit2_lnl(t, model) - lcfit2_lnl(model->t0, model);
 }
 
-void lcfit2_evaluate_fn(double (*lnl_fn)(double, void*), void* lnl_fn_args,
-                        const size_t n, const double* t, double* lnl)
-{
-    for (size_t i = 0; i < n; ++i) {
-        lnl[i] = lnl_fn(t[i], lnl_fn_args);
-    }
-}
-
-double lcfit2_compute_weights(const size_t n, const double* lnl,
-                              const double alpha, double* w)
-{
-    double max_lnl = -HUGE_VAL;
-
-    for (size_t i = 0; i < n; ++i) {
-        if (lnl[i] > max_lnl) {
-            max_lnl = lnl[i];
-        }
-    }
-
-    for (size_t i = 0; i < n; ++i) {
-        w[i] = pow(exp(lnl[i] - max_lnl), alpha);
-    }
-
-    return max_lnl;
-}
-
 int lcfit2n_fit(const size_t n, const double* t, const double* lnl,
                 lcfit2_bsm_t* model)
 {
     double* w = malloc(n * sizeof(double));
-    for (size_t i = 0; i < n; ++i) {
-        w[i] = 1.0;
-    }
+    lcfit_compute_weights(LCFIT_WEIGHTS_UNIFORM, n, NULL, 0.0, w);
 
     int status = lcfit2n_fit_weighted(n, t, lnl, w, model);
 
@@ -305,62 +300,44 @@ int lcfit2_fit_auto(double (*lnl_fn)(double, void*), void* lnl_fn_args,
                     lcfit2_bsm_t* model, const double min_t, const double max_t,
                     const double alpha)
 {
-    const size_t n_points = 4;
-
-    double* t = malloc(n_points * sizeof(double));
-    double* lnl = malloc(n_points * sizeof(double));
-    double* w = malloc(n_points * sizeof(double));
-
-    const double max_lnl = lnl_fn(model->t0, lnl_fn_args);
-
-    //
-    // first pass
-    //
-
-    // initialize sample points
-
-    lcfit2_three_points(model, lcfit2_delta(model), min_t, max_t, t);
-    t[3] = max_t;
-
-    // evaluate, normalize, compute weights, and fit
-
-    lcfit2_evaluate_fn(lnl_fn, lnl_fn_args, n_points, t, lnl);
-    lcfit2_normalize(max_lnl, n_points, lnl);
-    lcfit2_compute_weights(n_points, lnl, alpha, w);
-
-#ifdef LCFIT2_VERBOSE
-    fprintf(stderr, "initial delta = %g\n", lcfit2_delta(model));
-    lcfit2_print_array("t", n_points, t);
-    lcfit2_print_array("w", n_points, w);
-#endif /* LCFIT2_VERBOSE */
-
-    int status = lcfit2n_fit_weighted(n_points, t, lnl, w, model);
+    return lcfit2_fit_auto_ex(lnl_fn, lnl_fn_args, model, min_t, max_t, alpha, NULL);
+}
 
-    //
-    // second pass
-    //
+int lcfit2_fit_auto_ex(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                       lcfit2_bsm_t* model, const double min_t, const double max_t,
+                       const double alpha, const lcfit_executor_t* executor)
+{
+    const lcfit2_fit_auto_options_t options = {executor, false, 0.0, NULL};
 
-    // recompute sample points with updated delta
+    return lcfit2_fit_auto_opt(lnl_fn, lnl_fn_args, model, min_t, max_t, alpha, &options, NULL);
+}
 
-    lcfit2_three_points(model, lcfit2_delta(model), min_t, max_t, t);
+int lcfit2_fit_auto_opt(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                        lcfit2_bsm_t* model, const double min_t, const double max_t,
+                        const double alpha, const lcfit2_fit_auto_options_t* options,
+                        size_t* n_evals)
+{
+    const lcfit_executor_t* executor = options ? options->executor : NULL;
+    const double* lnl_t0 = options && options->lnl_t0_known ? &options->lnl_t0 : NULL;
+    const lcfit_run_options_t run_options = {executor, options ? options->cancel : NULL};
 
-    // evaluate, normalize, compute weights, and fit
+    if (n_evals != NULL) {
+        *n_evals = 0;
+    }
 
-    lcfit2_evaluate_fn(lnl_fn, lnl_fn_args, n_points, t, lnl);
-    lcfit2_normalize(max_lnl, n_points, lnl);
-    lcfit2_compute_weights(n_points, lnl, alpha, w);
+    lcfit_auto_state_t* s = lcfit_auto_begin_lcfit2_ex(model, min_t, max_t, alpha, lnl_t0);
+    if (s == NULL) {
+        return -1;  // NLOPT_FAILURE
+    }
 
-#ifdef LCFIT2_VERBOSE
-    fprintf(stderr, "revised delta = %g\n", lcfit2_delta(model));
-    lcfit2_print_array("t", n_points, t);
-    lcfit2_print_array("w", n_points, w);
-#endif /* LCFIT2_VERBOSE */
+    lcfit_auto_run_opt(s, lnl_fn, lnl_fn_args, &run_options);
+    const int status = lcfit_auto_lcfit2_model(s, model);
 
-    status = lcfit2n_fit_weighted(n_points, t, lnl, w, model);
+    if (n_evals != NULL) {
+        *n_evals = lcfit_auto_n_evals(s);
+    }
 
-    free(t);
-    free(lnl);
-    free(w);
+    lcfit_auto_free(s);
 
     return status;
 }
@@ -6,6 +6,7 @@
 #ifndef LCFIT2_H
 #define LCFIT2_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "lcfit.h"
@@ -60,6 +61,17 @@ double lcfit2_lnl(const double t, const lcfit2_bsm_t* model);
 /** Computes the normalized log-likelihood at branch length \c t for a given model. */
 double lcfit2_norm_lnl(const double t, const lcfit2_bsm_t* model);
 
+/** Computes the log-likelihood and its first and second derivatives
+ *  with respect to branch length at \c t for a given model, from one
+ *  exponential. Either of \c d1 and \c d2 may be \c NULL. */
+double lcfit2_lnl_dt(const double t, const lcfit2_bsm_t* model, double* d1, double* d2);
+
+/** Computes the first derivative of the log-likelihood with respect to branch length at \c t for a given model. */
+double lcfit2_d1f_t(const double t, const lcfit2_bsm_t* model);
+
+/** Computes the second derivative of the log-likelihood with respect to branch length at \c t for a given model. */
+double lcfit2_d2f_t(const double t, const lcfit2_bsm_t* model);
+
 /** Fits a model to normalized log-likelihood data, without weighting. */
 int lcfit2n_fit(const size_t n, const double* t, const double* lnl,
                 lcfit2_bsm_t* model);
@@ -73,6 +85,41 @@ int lcfit2_fit_auto(double (*lnl_fn)(double, void*), void* lnl_fn_args,
                     lcfit2_bsm_t* model, const double min_t, const double max_t,
                     const double alpha);
 
+/** Fits a model to a log-likelihood function, evaluating each pass's
+ *  sample points as one batch through \c executor (which may be \c NULL). */
+int lcfit2_fit_auto_ex(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                       lcfit2_bsm_t* model, const double min_t, const double max_t,
+                       const double alpha, const lcfit_executor_t* executor);
+
+/** Options for #lcfit2_fit_auto_opt. */
+typedef struct {
+    /** Executor for each pass's sample points, or \c NULL. */
+    const lcfit_executor_t* executor;
+    /** Whether \c lnl_t0 holds the log-likelihood at the model's \c t0,
+     *  as when \c t0 comes from #lcfit_maximize. */
+    bool lnl_t0_known;
+    /** Log-likelihood at \c t0, if known. */
+    double lnl_t0;
+    /** Cancellation token, or \c NULL. A cancelled fit returns
+     *  \c NLOPT_FORCED_STOP, with the model of the first pass if it
+     *  was fitted and the initial model otherwise. */
+    const lcfit_cancel_t* cancel;
+} lcfit2_fit_auto_options_t;
+
+/** Fits a model to a log-likelihood function, evaluating it only where
+ *  its value is not known.
+ *
+ *  The second pass, which refits at sample points revised for the
+ *  first pass's model, is skipped when those points barely moved, and
+ *  evaluates only the two that did. All of #lcfit2_fit_auto's fits
+ *  work this way; this function also reuses a known \c lnl(t0) and
+ *  reports the number of evaluations in \c n_evals (if not \c NULL),
+ *  which is between three and six. \c options may be \c NULL. */
+int lcfit2_fit_auto_opt(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                        lcfit2_bsm_t* model, const double min_t, const double max_t,
+                        const double alpha, const lcfit2_fit_auto_options_t* options,
+                        size_t* n_evals);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -5,6 +5,7 @@
 #include <gsl/gsl_version.h>
 
 #include "lcfit2.h"
+#include "lcfit_dispatch.h"
 
 static const size_t MAX_ITERATIONS = 1000;
 
@@ -23,14 +24,24 @@ int lcfit2n_opt_f(const gsl_vector* x, void* data, gsl_vector* f)
                           d->d1,
                           d->d2};
 
-    for (size_t i = 0; i < n; ++i) {
-        //
-        // We expect that the observed log-likelihoods have already
-        // been normalized. The error is therefore the sum of squared
-        // differences between those log-likelihoods and the
-        // normalized lcfit2 log-likelihoods f(t[i]) - f(t0).
-        //
+    //
+    // We expect that the observed log-likelihoods have already
+    // been normalized. The error is therefore the sum of squared
+    // differences between those log-likelihoods and the
+    // normalized lcfit2 log-likelihoods f(t[i]) - f(t0).
+    //
+
+    if (f->stride == 1) {
+        lcfit2_norm_lnl_n(n, t, &model, f->data);
+
+        for (size_t i = 0; i < n; ++i) {
+            f->data[i] = w[i] * (f->data[i] - lnl[i]);
+        }
 
+        return GSL_SUCCESS;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
         const double err = lcfit2_norm_lnl(t[i], &model) - lnl[i];
         gsl_vector_set(f, i, w[i] * err);
     }
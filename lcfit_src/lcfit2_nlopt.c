@@ -13,6 +13,7 @@
 #include <nlopt.h>
 
 #include "lcfit2.h"
+#include "lcfit_dispatch.h"
 
 static const size_t MAX_ITERATIONS = 1000;
 
@@ -61,24 +62,33 @@ double lcfit2n_opt_fdf_nlopt(unsigned p, const double* x, double* grad, void* da
     }
 
     double grad_i[2];
+    double norm_lnl[LCFIT_KERNEL_BLOCK];
 
-    for (size_t i = 0; i < n; ++i) {
-        //
-        // We expect that the observed log-likelihoods have already
-        // been normalized. The error is therefore the sum of squared
-        // differences between those log-likelihoods and the
-        // normalized lcfit2 log-likelihoods f(t[i]) - f(t0).
-        //
+    for (size_t start = 0; start < n; start += LCFIT_KERNEL_BLOCK) {
+        const size_t k = n - start < LCFIT_KERNEL_BLOCK ? n - start : LCFIT_KERNEL_BLOCK;
 
-        const double err = lnl[i] - lcfit2_norm_lnl(t[i], &model);
+        lcfit2_norm_lnl_n(k, t + start, &model, norm_lnl);
 
-        sum_sq_err += w[i] * pow(err, 2.0);
+        for (size_t j = 0; j < k; ++j) {
+            const size_t i = start + j;
 
-        if (grad) {
-            lcfit2n_gradient(t[i], &model, grad_i);
+            //
+            // We expect that the observed log-likelihoods have already
+            // been normalized. The error is therefore the sum of squared
+            // differences between those log-likelihoods and the
+            // normalized lcfit2 log-likelihoods f(t[i]) - f(t0).
+            //
 
-            grad[0] -= 2 * w[i] * err * grad_i[0];
-            grad[1] -= 2 * w[i] * err * grad_i[1];
+            const double err = lnl[i] - norm_lnl[j];
+
+            sum_sq_err += w[i] * pow(err, 2.0);
+
+            if (grad) {
+                lcfit2n_gradient(t[i], &model, grad_i);
+
+                grad[0] -= 2 * w[i] * err * grad_i[0];
+                grad[1] -= 2 * w[i] * err * grad_i[1];
+            }
         }
     }
 
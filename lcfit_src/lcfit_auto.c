@@ -0,0 +1,1237 @@
+/**
+ * \file lcfit_auto.c
+ * \brief Reverse-communication implementation of automatic fitting.
+ *
+ * A fit is a sequence of stages. Each stage is a function that is
+ * handed the log-likelihoods of the batch it last requested, if any,
+ * and either requests another batch or moves the fit to its next
+ * stage.
+ */
+
+#include "lcfit_auto.h"
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gsl/gsl_errno.h>
+#include <gsl/gsl_min.h>
+
+#include "lcfit_priv.h"
+#include "lcfit_refit.h"
+#include "lcfit_trace.h"
+#include "lcfit_weights.h"
+
+/** Maximum number of refinement iterations in estimate_ml_t. */
+const static size_t MAX_ITERS = 30;
+
+/** Maximum number of Gauss-Newton steps when refitting incrementally
+ *  in estimate_ml_t. */
+static const size_t REFIT_MAX_STEPS = 2;
+
+/** Default maximum number of points to evaluate in select_points */
+static const size_t DEFAULT_MAX_POINTS = 8;
+
+/** Number of points in each lcfit2 pass. */
+#define LCFIT2_N_POINTS 4
+
+/** Shift of the lcfit2 sample points, relative to their distance from
+ *  t0, below which the second pass is skipped. */
+static const double LCFIT2_MAX_SHIFT = 0.05;
+
+typedef enum {
+    STAGE_BRACKET,
+    STAGE_BRENT,
+    STAGE_STENCIL,
+    STAGE_LCFIT2,
+    STAGE_ML_T_START,
+    STAGE_ML_T_SELECT,
+    STAGE_ML_T_REFINE,
+    STAGE_DONE
+} auto_stage;
+
+/** What a state was begun to compute. */
+typedef enum {
+    GOAL_FIT_AUTO,
+    GOAL_MAXIMIZE,
+    GOAL_LCFIT2,
+    GOAL_ML_T
+} auto_goal;
+
+/** Names of the stages and goals, for the trace probes. */
+static const char* const STAGE_NAMES[] = {
+    "bracket", "brent", "stencil", "lcfit2",
+    "ml_t_start", "ml_t_select", "ml_t_refine", "done"
+};
+static const char* const GOAL_NAMES[] = {"fit_auto", "maximize", "lcfit2", "ml_t"};
+
+/** The objective seen by the GSL minimizer; see #brent_step. */
+typedef struct {
+    double t;
+    double lnl;
+    bool known;
+    bool missed;
+} brent_probe;
+
+struct lcfit_auto_state {
+    auto_goal goal;
+    auto_stage stage;
+    int status;
+
+    double min_t;
+    double max_t;
+    bsm_t model;
+    double result_t;
+
+    /* The requested batch. Log-likelihoods are supplied in order, so
+     * the first batch_supplied entries of batch_lnl are valid. */
+    double* batch_t;
+    double* batch_lnl;
+    size_t batch_capacity;
+    size_t batch_n;
+    size_t batch_supplied;
+    size_t n_evals;
+
+    /* The evaluated point with the highest log-likelihood. */
+    double best_t;
+    double best_lnl;
+
+    /* mode finding */
+    bool derivatives;
+    double bracket_t[3];
+    double bracket_f[3];
+    size_t bracket_iter;
+    double mode_t;
+    double h;
+    double d1;
+    double d2;
+
+    gsl_min_fminimizer* brent;
+    gsl_min_fminimizer brent_saved;
+    void* brent_saved_state;
+    gsl_function brent_fn;
+    brent_probe probe;
+    bool brent_started;
+    int brent_iter;
+
+    /* lcfit2; allocated, as the model's mode and derivatives are const */
+    lcfit2_bsm_t* model2;
+    double alpha;
+    double lcfit2_t[LCFIT2_N_POINTS];
+    double lcfit2_lnl[LCFIT2_N_POINTS];
+    bool lcfit2_known[LCFIT2_N_POINTS];
+    int lcfit2_pass;
+    int lcfit2_status;
+
+    /* estimate_ml_t */
+    double tolerance;
+    size_t width;
+    bool initial_guess;
+    point_set_t set;
+    size_t orig_n_pts;
+    curve_type_t curvature;
+    double* tbuf;
+    double* lbuf;
+    double* wbuf;
+    lcfit_refit_t* refit;
+    bool refit_ready;
+    size_t iter;
+    double ml_t;
+    double prev_t;
+    estimate_ml_t_stats_t stats;
+};
+
+#ifdef LCFIT_AUTO_VERBOSE
+static void print_points(FILE* fp, const point_t* points, const size_t n)
+{
+    char* sep = "";
+    for (size_t i = 0; i < n; ++i) {
+        fprintf(fp, "%s%g", sep, points[i].t);
+        sep = ", ";
+    }
+}
+#endif /* LCFIT_AUTO_VERBOSE */
+
+/** Copy an array of points into preallocated vectors for the x and y values */
+static inline void
+blit_points_to_arrays(const point_t points[], const size_t n,
+                      double *t, double *l)
+{
+    size_t i;
+    for(i = 0; i < n; i++, points++) {
+        *t++ = points->t;
+        *l++ = points->ll;
+    }
+}
+
+/* Whether t is not among the points in set or the first n of ts. */
+static bool
+is_new_t(const double t, const point_set_t* set, const double* ts, const size_t n)
+{
+    const point_t* points = point_set_points(set);
+    for (size_t i = 0; i < set->n; ++i) {
+        if (points[i].t == t) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (ts[i] == t) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Request the first n branch lengths in batch_t. */
+static void request(lcfit_auto_state_t* s, const size_t n)
+{
+    assert(n > 0 && n <= s->batch_capacity);
+
+    s->batch_n = n;
+    s->batch_supplied = 0;
+}
+
+static bool set_model2(lcfit_auto_state_t* s, const lcfit2_bsm_t* model)
+{
+    if (s->model2 == NULL) {
+        s->model2 = malloc(sizeof(lcfit2_bsm_t));
+        if (s->model2 == NULL) {
+            return false;
+        }
+    }
+
+    memcpy(s->model2, model, sizeof(lcfit2_bsm_t));
+    return true;
+}
+
+static void finish(lcfit_auto_state_t* s, const double t, const int status)
+{
+    s->result_t = t;
+    s->status = status;
+    s->stage = STAGE_DONE;
+}
+
+/* Fire the trace probes for a change from stage \c from. */
+static void trace_stage(const lcfit_auto_state_t* s, const auto_stage from)
+{
+    if (s->stage == from) {
+        return;
+    }
+
+    LCFIT_TRACE3(auto_stage, s, STAGE_NAMES[from], STAGE_NAMES[s->stage]);
+    if (s->stage == STAGE_DONE) {
+        LCFIT_TRACE4(auto_done, s, GOAL_NAMES[s->goal], s->status, s->n_evals);
+    }
+}
+
+/*****************/
+/* Mode finding */
+/*****************/
+
+static void bracket_stage(lcfit_auto_state_t* s, const size_t n)
+{
+    double* t = s->bracket_t;
+    double* f = s->bracket_f;
+
+    if (n == 0) {
+        t[0] = s->min_t;
+        t[1] = (s->min_t + s->max_t) / 2.0;
+        t[2] = s->max_t;
+
+        memcpy(s->batch_t, t, sizeof(double) * 3);
+        s->bracket_iter = 0;
+        request(s, 3);
+        return;
+    }
+
+    if (n == 3) {
+        memcpy(f, s->batch_lnl, sizeof(double) * 3);
+    } else {
+        f[1] = s->batch_lnl[0];
+        ++s->bracket_iter;
+    }
+
+    int enclosed = 0;
+
+    if (s->bracket_iter < BRACKET_MAX_ITER) {
+        enclosed = bracket_maximum_update(t, f);
+
+        if (enclosed == 0) {
+            s->batch_t[0] = t[1];
+            request(s, 1);
+            return;
+        }
+    }
+
+#ifdef LCFIT_AUTO_VERBOSE
+    fprintf(stderr, "bracket_maximum: %zu iterations\n", s->bracket_iter);
+#endif /* LCFIT_AUTO_VERBOSE */
+
+    s->mode_t = (t[0] + t[2]) / 2.0;
+    s->stage = enclosed > 0 ? STAGE_BRENT : STAGE_STENCIL;
+}
+
+/* The minimizer's objective is the negated log-likelihood, known only
+ * at the point supplied for the current step. Other points are
+ * recorded and given a placeholder value. */
+static double brent_probe_fn(double t, void* data)
+{
+    brent_probe* probe = (brent_probe*) data;
+
+    if (probe->known && t == probe->t) {
+        return -probe->lnl;
+    }
+
+    probe->missed = true;
+    probe->t = t;
+    return 0.0;
+}
+
+/* Run one step of the GSL Brent minimizer: its initialization, or an
+ * iteration. Each evaluates the objective at exactly one point. If
+ * that point's log-likelihood has not been supplied, the minimizer is
+ * restored to its state before the step and false is returned with
+ * the point in probe.t; the step is deterministic, so once the
+ * log-likelihood is supplied, running it again evaluates the same
+ * point. */
+static bool brent_step(lcfit_auto_state_t* s)
+{
+    gsl_min_fminimizer* m = s->brent;
+
+    s->brent_saved = *m;
+    memcpy(s->brent_saved_state, m->state, m->type->size);
+    s->probe.missed = false;
+
+    if (s->brent_started) {
+        gsl_min_fminimizer_iterate(m);
+    } else {
+        // the bracketing points start the search, as the minimizer
+        // would otherwise evaluate them again
+        const double* t = s->bracket_t;
+        const double* f = s->bracket_f;
+        gsl_min_fminimizer_set_with_values(m, &s->brent_fn, t[1], -f[1],
+                                           t[0], -f[0], t[2], -f[2]);
+    }
+
+    if (s->probe.missed) {
+        *m = s->brent_saved;
+        memcpy(m->state, s->brent_saved_state, m->type->size);
+        return false;
+    }
+
+    s->probe.known = false;
+    return true;
+}
+
+static void brent_stage(lcfit_auto_state_t* s, const size_t n)
+{
+    if (n == 0) {
+        s->brent = gsl_min_fminimizer_alloc(gsl_min_fminimizer_brent);
+        if (s->brent == NULL) {
+            finish(s, NAN, LCFIT_ERROR);
+            return;
+        }
+
+        s->brent_saved_state = malloc(s->brent->type->size);
+        if (s->brent_saved_state == NULL) {
+            finish(s, NAN, LCFIT_ERROR);
+            return;
+        }
+
+        s->brent_fn.function = &brent_probe_fn;
+        s->brent_fn.params = &s->probe;
+        s->probe.known = false;
+        s->brent_started = false;
+        s->brent_iter = 0;
+    } else {
+        s->probe.lnl = s->batch_lnl[0];
+        s->probe.known = true;
+    }
+
+    gsl_min_fminimizer* m = s->brent;
+    int status = GSL_CONTINUE;
+
+    while (status == GSL_CONTINUE && s->brent_iter < BRENT_MAX_ITER) {
+        if (!brent_step(s)) {
+            s->batch_t[0] = s->probe.t;
+            request(s, 1);
+            return;
+        }
+
+        if (!s->brent_started) {
+            s->brent_started = true;
+            continue;
+        }
+
+        ++s->brent_iter;
+        LCFIT_TRACE2(brent_iter, s, s->brent_iter);
+
+        s->mode_t = gsl_min_fminimizer_x_minimum(m);
+        status = gsl_min_test_interval(gsl_min_fminimizer_x_lower(m),
+                                       gsl_min_fminimizer_x_upper(m),
+                                       0.0, pow(DBL_EPSILON, 0.25));
+    }
+
+#ifdef LCFIT_AUTO_VERBOSE
+    fprintf(stderr, "lcfit_maximize: %d iterations\n", s->brent_iter);
+#endif /* LCFIT_AUTO_VERBOSE */
+
+    if (s->brent_iter == BRENT_MAX_ITER) {
+        fprintf(stderr, "WARNING: maximum number of iterations reached during minimization\n");
+    }
+
+    gsl_min_fminimizer_free(s->brent);
+    free(s->brent_saved_state);
+    s->brent = NULL;
+    s->brent_saved_state = NULL;
+
+    s->stage = STAGE_STENCIL;
+}
+
+static bool ml_t_start(lcfit_auto_state_t* s, const double* t, const size_t n_pts,
+                       const double tolerance, const size_t width);
+
+static void stencil_stage(lcfit_auto_state_t* s, const size_t n)
+{
+    if (!s->derivatives) {
+        finish(s, s->mode_t, LCFIT_SUCCESS);
+        return;
+    }
+
+    if (n == 0) {
+        s->h = derivative_stencil(s->mode_t, s->batch_t);
+        request(s, 5);
+        return;
+    }
+
+    stencil_derivatives(s->batch_lnl, s->h, &s->d1, &s->d2);
+
+    if (s->goal == GOAL_MAXIMIZE) {
+        finish(s, s->mode_t, LCFIT_SUCCESS);
+        return;
+    }
+
+    const double t0 = s->mode_t;
+    const double d1 = s->d1;
+    const double d2 = s->d2;
+
+#ifdef LCFIT_AUTO_VERBOSE
+    fprintf(stderr, "lmax_t0 = %g, lmax_d1(lmax_t0) = %g, lmax_d2(lmax_t0) = %g\n",
+            t0, d1, d2);
+#endif /* LCFIT_AUTO_VERBOSE */
+
+    if (fabs(d1) < 0.1 && d2 < -0.1) {  // t0 is a local maximum
+        const lcfit2_bsm_t lcfit2_model = {s->model.c, s->model.m, t0, d1, d2};
+
+        if (!set_model2(s, &lcfit2_model)) {
+            finish(s, NAN, LCFIT_ERROR);
+            return;
+        }
+
+        // the stencil is centered on t0
+        s->alpha = 0.0;
+        s->lcfit2_lnl[1] = s->batch_lnl[2];
+        s->lcfit2_known[1] = true;
+        s->stage = STAGE_LCFIT2;
+    } else {
+        // HACK: basically copied from AdHocIntegrator.cpp
+        const double t[4] = {0.1, 0.5, 1.0, s->max_t};
+        const double tolerance = 1e-3;
+
+        if (!ml_t_start(s, t, 4, tolerance, 1)) {
+            finish(s, NAN, LCFIT_ERROR);
+        }
+    }
+}
+
+/**********/
+/* lcfit2 */
+/**********/
+
+// Request the sample points whose log-likelihoods are not known yet.
+static void lcfit2_request(lcfit_auto_state_t* s)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < LCFIT2_N_POINTS; ++i) {
+        if (!s->lcfit2_known[i]) {
+            s->batch_t[n++] = s->lcfit2_t[i];
+        }
+    }
+
+    request(s, n);
+}
+
+// Move the first and third sample points to those of the current
+// model, returning false if neither moved by more than LCFIT2_MAX_SHIFT.
+static bool lcfit2_move_points(lcfit_auto_state_t* s)
+{
+    double* t = s->lcfit2_t;
+    double revised[3];
+    lcfit2_three_points(s->model2, lcfit2_delta(s->model2), s->min_t, s->max_t, revised);
+
+    // t0 is fixed, so the points only move with the inflection point
+    const double shift = fmax(fabs(revised[0] - t[0]), fabs(revised[2] - t[2]));
+    if (shift <= LCFIT2_MAX_SHIFT * fmin(t[1] - t[0], t[2] - t[1])) {
+        return false;
+    }
+
+    t[0] = revised[0];
+    t[2] = revised[2];
+    s->lcfit2_known[0] = false;
+    s->lcfit2_known[2] = false;
+
+    return true;
+}
+
+static void lcfit2_stage(lcfit_auto_state_t* s, const size_t n)
+{
+    const size_t n_points = LCFIT2_N_POINTS;
+    double* t = s->lcfit2_t;
+
+    if (n == 0) {
+        // t[1] is t0, whose log-likelihood may be known already
+        lcfit2_three_points(s->model2, lcfit2_delta(s->model2), s->min_t, s->max_t, t);
+        t[3] = s->max_t;
+        s->lcfit2_known[0] = false;
+        s->lcfit2_known[2] = false;
+        s->lcfit2_known[3] = false;
+
+        s->lcfit2_pass = 1;
+        lcfit2_request(s);
+        return;
+    }
+
+    size_t k = 0;
+    for (size_t i = 0; i < n_points; ++i) {
+        if (!s->lcfit2_known[i]) {
+            s->lcfit2_lnl[i] = s->batch_lnl[k++];
+            s->lcfit2_known[i] = true;
+        }
+    }
+
+    // normalize, compute weights, and fit
+
+    double lnl[LCFIT2_N_POINTS];
+    double w[LCFIT2_N_POINTS];
+    memcpy(lnl, s->lcfit2_lnl, sizeof(lnl));
+    lcfit2_normalize(s->lcfit2_lnl[1], n_points, lnl);
+    lcfit_compute_weights(LCFIT_WEIGHTS_TEMPERED, n_points, lnl, s->alpha, w);
+
+#ifdef LCFIT2_VERBOSE
+    fprintf(stderr, "%s delta = %g\n", s->lcfit2_pass == 1 ? "initial" : "revised",
+            lcfit2_delta(s->model2));
+    lcfit2_print_array("t", n_points, t);
+    lcfit2_print_array("w", n_points, w);
+#endif /* LCFIT2_VERBOSE */
+
+    s->lcfit2_status = lcfit2n_fit_weighted(n_points, t, lnl, w, s->model2);
+    LCFIT_TRACE3(lcfit2_fit, s, s->lcfit2_pass, s->lcfit2_status);
+
+    // a second pass at the revised sample points only pays off if they
+    // moved; t0 and max_t are reused rather than evaluated again
+    if (s->lcfit2_pass == 1 && lcfit2_move_points(s)) {
+        s->lcfit2_pass = 2;
+        lcfit2_request(s);
+        return;
+    }
+
+    // lcfit2 fits report NLopt result codes, which are negative on failure
+    const int status = s->lcfit2_status < 0 ? LCFIT_ERROR : LCFIT_SUCCESS;
+
+    if (s->goal == GOAL_LCFIT2) {
+        finish(s, s->model2->t0, status);
+    } else {
+        lcfit2_to_lcfit4(s->model2, &s->model);
+        finish(s, s->mode_t, status);
+    }
+}
+
+/*****************/
+/* ML estimation */
+/*****************/
+
+static void ml_t_finish(lcfit_auto_state_t* s, double ml_t, const bool success)
+{
+    free(s->tbuf);
+    free(s->lbuf);
+    free(s->wbuf);
+    s->tbuf = NULL;
+    s->lbuf = NULL;
+    s->wbuf = NULL;
+    lcfit_refit_free(s->refit);
+    s->refit = NULL;
+    s->refit_ready = false;
+    point_set_free(&s->set);
+
+#ifdef LCFIT_AUTO_VERBOSE
+    fprintf(stderr, "ending iterative fit after %zu iteration(s)\n", s->iter);
+#endif /* LCFIT_AUTO_VERBOSE */
+
+    if (ml_t < s->min_t) {
+        ml_t = s->min_t;
+    } else if (ml_t > s->max_t) {
+        ml_t = s->max_t;
+    }
+
+    finish(s, ml_t, success ? LCFIT_SUCCESS : LCFIT_ERROR);
+}
+
+/* Request the starting points of estimate_ml_t. */
+static bool ml_t_start(lcfit_auto_state_t* s, const double* t, const size_t n_pts,
+                       const double tolerance, const size_t width)
+{
+    assert(n_pts <= s->batch_capacity);
+
+    s->tolerance = tolerance;
+    s->width = width > 1 ? width : 1;
+    s->iter = 0;
+    s->ml_t = 0.0;
+    s->prev_t = 0.0;
+    s->stats.rounds = 0;
+    s->stats.n_evals = 0;
+    s->stats.full_fits = 0;
+
+    if (!point_set_init(&s->set, n_pts > DEFAULT_MAX_POINTS ? n_pts : DEFAULT_MAX_POINTS)) {
+        return false;
+    }
+
+    memcpy(s->batch_t, t, sizeof(double) * n_pts);
+    s->stage = STAGE_ML_T_START;
+    request(s, n_pts);
+
+    return true;
+}
+
+static void ml_t_start_stage(lcfit_auto_state_t* s, const size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        point_t p;
+        p.t = s->batch_t[i];
+        p.ll = s->batch_lnl[i];
+        point_set_insert(&s->set, p);
+    }
+
+    s->orig_n_pts = n;
+    s->stats.rounds = 1;
+    s->stats.n_evals = n;
+
+    s->stage = STAGE_ML_T_SELECT;
+}
+
+static void ml_t_select_stage(lcfit_auto_state_t* s, const size_t n)
+{
+    point_set_t* set = &s->set;
+
+    /* select_points adds one point at a time */
+    if (n > 0) {
+        point_t p;
+        p.t = s->batch_t[0];
+        p.ll = s->batch_lnl[0];
+        point_set_insert(set, p);
+
+        ++s->stats.rounds;
+        ++s->stats.n_evals;
+    }
+
+    const int selected = select_points_next(set, DEFAULT_MAX_POINTS, s->min_t, s->max_t,
+                                            &s->batch_t[0]);
+
+    if (selected > 0) {
+        request(s, 1);
+        return;
+    } else if (selected < 0) {
+        fprintf(stderr, "ERROR: select_points returned NULL\n");
+        ml_t_finish(s, NAN, false);
+        return;
+    }
+
+    s->curvature = point_set_classify(set);
+
+    if (!(s->curvature == CRV_ENC_MAXIMA || s->curvature == CRV_MONO_DEC)) {
+        fprintf(stderr, "ERROR: "
+                "points don't enclose a maximum and aren't decreasing\n");
+        ml_t_finish(s, NAN, false);
+        return;
+    }
+
+    /* From here on, curvature is CRV_ENC_MAXIMA or CRV_MONO_DEC, and
+     * thus ml_t is zero or positive (but not infinite). */
+
+    size_t n_pts = set->n;
+    assert(n_pts >= s->orig_n_pts);
+
+    /* Subset to top orig_n_pts, leaving room for width new points
+     * per iteration. */
+    point_t* points = malloc(sizeof(point_t) * n_pts);
+    if (points == NULL) {
+        ml_t_finish(s, NAN, false);
+        return;
+    }
+
+    memcpy(points, point_set_points(set), sizeof(point_t) * n_pts);
+    point_set_free(set);
+
+    if (n_pts > s->orig_n_pts) {
+        subset_points(points, n_pts, s->orig_n_pts);
+        n_pts = s->orig_n_pts;
+    }
+
+    const size_t max_n_pts = n_pts + MAX_ITERS * s->width;
+    if (!point_set_init(set, max_n_pts)) {
+        free(points);
+        ml_t_finish(s, NAN, false);
+        return;
+    }
+
+    for (size_t i = 0; i < n_pts; ++i) {
+        point_set_insert(set, points[i]);
+    }
+    free(points);
+
+    assert(point_set_points(set)[0].t >= s->min_t);
+    assert(point_set_points(set)[set->n - 1].t <= s->max_t);
+
+#ifdef LCFIT_AUTO_VERBOSE
+    fprintf(stderr, "starting iterative fit\n");
+
+    fprintf(stderr, "starting points: ");
+    print_points(stderr, point_set_points(set), set->n);
+    fprintf(stderr, "\n");
+#endif /* LCFIT_AUTO_VERBOSE */
+
+    s->tbuf = malloc(sizeof(double) * max_n_pts);
+    s->lbuf = malloc(sizeof(double) * max_n_pts);
+    s->wbuf = malloc(sizeof(double) * max_n_pts);
+    s->refit = lcfit_refit_alloc(max_n_pts);
+    if (s->tbuf == NULL || s->lbuf == NULL || s->wbuf == NULL || s->refit == NULL) {
+        ml_t_finish(s, NAN, false);
+        return;
+    }
+
+    s->stage = STAGE_ML_T_REFINE;
+}
+
+static void ml_t_refine_stage(lcfit_auto_state_t* s, const size_t n)
+{
+    point_set_t* set = &s->set;
+
+    if (n > 0) {
+        ++s->stats.rounds;
+        s->stats.n_evals += n;
+
+        s->prev_t = s->batch_t[0];
+
+        for (size_t j = 0; j < n; ++j) {
+            point_t next;
+            next.t = s->batch_t[j];
+            next.ll = s->batch_lnl[j];
+            point_set_insert(set, next);
+
+            /* the weights are set when the model is refit */
+            if (s->refit_ready &&
+                lcfit_refit_add(s->refit, next.t, next.ll, 1.0) != LCFIT_SUCCESS) {
+                s->refit_ready = false;
+            }
+        }
+
+        s->curvature = point_set_classify(set);
+
+        if (!(s->curvature == CRV_ENC_MAXIMA || s->curvature == CRV_MONO_DEC)) {
+            fprintf(stderr, "ERROR: "
+                    "after iteration points don't enclose a maximum "
+                    "and aren't decreasing\n");
+            ml_t_finish(s, s->ml_t, false);
+            return;
+        }
+
+#ifdef LCFIT_AUTO_VERBOSE
+        fprintf(stderr, "current points: ");
+        print_points(stderr, point_set_points(set), set->n);
+        fprintf(stderr, "\n");
+#endif /* LCFIT_AUTO_VERBOSE */
+
+        ++s->iter;
+    }
+
+    if (s->iter == MAX_ITERS) {
+        fprintf(stderr, "WARNING: maximum number of iterations reached\n");
+        ml_t_finish(s, s->ml_t, false);
+        return;
+    }
+
+    const size_t n_pts = set->n;
+    const point_t* max_pt = point_set_max(set);
+    bsm_t* model = &s->model;
+
+    double alpha = (double) s->iter / (MAX_ITERS - 1);
+
+    /* Re-fit. After the first round, refit the previous round's model
+     * incrementally, falling back to a full fit starting from the
+     * refit's model when it does not converge in a few steps. The
+     * refit keeps its points in the order they were added. */
+    int refit_status = LCFIT_ERROR;
+    if (s->refit_ready) {
+        lcfit_compute_weights(LCFIT_WEIGHTS_TEMPERED, n_pts, lcfit_refit_lnl(s->refit),
+                              alpha, s->wbuf);
+        lcfit_refit_set_weights(s->refit, s->wbuf);
+        refit_status = lcfit_refit_step(s->refit, REFIT_MAX_STEPS, model);
+    }
+
+    if (refit_status != LCFIT_SUCCESS) {
+        blit_points_to_arrays(point_set_points(set), n_pts, s->tbuf, s->lbuf);
+
+        if (!s->refit_ready) {
+            if (!s->initial_guess ||
+                lcfit_bsm_initial_guess(n_pts, s->tbuf, s->lbuf, model) != LCFIT_SUCCESS) {
+                lcfit_bsm_rescale(max_pt->t, max_pt->ll, model);
+            }
+            s->initial_guess = false;
+        }
+
+        lcfit_compute_weights(LCFIT_WEIGHTS_TEMPERED, n_pts, s->lbuf, alpha, s->wbuf);
+
+#ifdef LCFIT_AUTO_VERBOSE
+        fprintf(stderr, "weights: ");
+        for (size_t i = 0; i < n_pts; ++i) {
+            fprintf(stderr, "%g ", s->wbuf[i]);
+        }
+        fprintf(stderr, "\n");
+#endif /* LCFIT_AUTO_VERBOSE */
+
+        lcfit_fit_bsm_weight(n_pts, s->tbuf, s->lbuf, s->wbuf, model, 250);
+        ++s->stats.full_fits;
+
+        s->refit_ready = lcfit_refit_reset(s->refit, model, n_pts, s->tbuf, s->lbuf,
+                                           s->wbuf) == LCFIT_SUCCESS;
+    }
+
+    LCFIT_TRACE4(ml_t_round, s, s->iter, n_pts, refit_status != LCFIT_SUCCESS);
+
+    const double ml_t = lcfit_bsm_ml_t(model);
+    s->ml_t = ml_t;
+
+    if (isnan(ml_t)) {
+        fprintf(stderr, "ERROR: "
+                "lcfit_bsm_ml_t returned NaN"
+                ", model = { %.3f, %.3f, %.6f, %.6f }\n",
+                model->c, model->m, model->r, model->b);
+        ml_t_finish(s, ml_t, false);
+        return;
+    }
+
+    if (s->curvature == CRV_ENC_MAXIMA) {
+        /* Stop if the modeled maximum likelihood branch length is
+         * within tolerance of the empirical maximum. */
+        if (rel_err(max_pt->t, ml_t) <= s->tolerance) {
+            ml_t_finish(s, ml_t, true);
+            return;
+        }
+    }
+
+    const double next_t = bound_point(ml_t, point_set_points(set), n_pts, s->min_t, s->max_t);
+
+    /* Stop if the next sample point is within tolerance of the
+     * previous sample point. */
+    if (rel_err(s->prev_t, next_t) <= s->tolerance) {
+        ml_t_finish(s, ml_t, true);
+        return;
+    }
+
+    /* Evaluate the predicted ML branch length and, when speculating,
+     * points alternately below and above it, spaced by half the last
+     * step but no closer than the tolerance. The next fit then has
+     * samples on both sides of the mode. */
+    const size_t width = s->width;
+    const double spread = fmax(s->tolerance * next_t, fabs(next_t - s->prev_t) / 2.0);
+    double* next_ts = s->batch_t;
+    size_t n_next = 0;
+    next_ts[n_next++] = next_t;
+
+    for (size_t j = 1; n_next < width && j < 2 * width; ++j) {
+        const double offset = (double) ((j + 1) / 2) * spread;
+        const double proposed_t = j % 2 == 1 ? next_t - offset : next_t + offset;
+        const double spec_t = bound_point(proposed_t, point_set_points(set), n_pts,
+                                          s->min_t, s->max_t);
+
+        if (is_new_t(spec_t, set, next_ts, n_next)) {
+            next_ts[n_next++] = spec_t;
+        }
+    }
+
+    request(s, n_next);
+}
+
+/***********/
+/* Driving */
+/***********/
+
+/* Hand the n log-likelihoods just supplied, if any, to the current
+ * stage and run the fit until it requests a batch or finishes. */
+static void advance(lcfit_auto_state_t* s, size_t n)
+{
+    s->batch_n = 0;
+    s->batch_supplied = 0;
+
+    while (s->batch_n == 0 && s->stage != STAGE_DONE) {
+        const auto_stage from = s->stage;
+
+        switch (s->stage) {
+        case STAGE_BRACKET:
+            bracket_stage(s, n);
+            break;
+        case STAGE_BRENT:
+            brent_stage(s, n);
+            break;
+        case STAGE_STENCIL:
+            stencil_stage(s, n);
+            break;
+        case STAGE_LCFIT2:
+            lcfit2_stage(s, n);
+            break;
+        case STAGE_ML_T_START:
+            ml_t_start_stage(s, n);
+            break;
+        case STAGE_ML_T_SELECT:
+            ml_t_select_stage(s, n);
+            break;
+        case STAGE_ML_T_REFINE:
+            ml_t_refine_stage(s, n);
+            break;
+        case STAGE_DONE:
+            break;
+        }
+
+        trace_stage(s, from);
+        n = 0;
+    }
+}
+
+/* Record that the next n log-likelihoods have been written to batch_lnl. */
+static void accept(lcfit_auto_state_t* s, const size_t n)
+{
+    assert(s->stage != STAGE_DONE);
+    assert(s->batch_supplied + n <= s->batch_n);
+
+    for (size_t i = s->batch_supplied; i < s->batch_supplied + n; ++i) {
+        if (s->batch_lnl[i] > s->best_lnl) {
+            s->best_t = s->batch_t[i];
+            s->best_lnl = s->batch_lnl[i];
+        }
+    }
+
+    s->batch_supplied += n;
+    s->n_evals += n;
+
+    if (s->batch_supplied == s->batch_n) {
+        advance(s, s->batch_n);
+    }
+}
+
+static lcfit_auto_state_t* auto_alloc(const auto_goal goal, const size_t batch_capacity,
+                                      const double min_t, const double max_t)
+{
+    lcfit_auto_state_t* s = calloc(1, sizeof(lcfit_auto_state_t));
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->batch_t = malloc(sizeof(double) * batch_capacity);
+    s->batch_lnl = malloc(sizeof(double) * batch_capacity);
+    if (s->batch_t == NULL || s->batch_lnl == NULL) {
+        lcfit_auto_free(s);
+        return NULL;
+    }
+
+    s->goal = goal;
+    s->status = LCFIT_SUCCESS;
+    s->min_t = min_t;
+    s->max_t = max_t;
+    s->result_t = NAN;
+    s->batch_capacity = batch_capacity;
+    s->best_t = NAN;
+    s->best_lnl = -INFINITY;
+
+    LCFIT_TRACE2(auto_begin, s, GOAL_NAMES[goal]);
+
+    return s;
+}
+
+lcfit_auto_state_t* lcfit_auto_begin(const bsm_t* model, const double min_t, const double max_t)
+{
+    lcfit_auto_state_t* s = auto_alloc(GOAL_FIT_AUTO, LCFIT2_N_POINTS + 1, min_t, max_t);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->model = *model;
+    s->derivatives = true;
+    s->stage = STAGE_BRACKET;
+    advance(s, 0);
+
+    return s;
+}
+
+lcfit_auto_state_t* lcfit_auto_begin_maximize(const double min_t, const double max_t,
+                                              const bool derivatives)
+{
+    lcfit_auto_state_t* s = auto_alloc(GOAL_MAXIMIZE, 5, min_t, max_t);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->derivatives = derivatives;
+    s->stage = STAGE_BRACKET;
+    advance(s, 0);
+
+    return s;
+}
+
+lcfit_auto_state_t* lcfit_auto_begin_lcfit2(const lcfit2_bsm_t* model, const double min_t,
+                                            const double max_t, const double alpha)
+{
+    return lcfit_auto_begin_lcfit2_ex(model, min_t, max_t, alpha, NULL);
+}
+
+lcfit_auto_state_t* lcfit_auto_begin_lcfit2_ex(const lcfit2_bsm_t* model, const double min_t,
+                                               const double max_t, const double alpha,
+                                               const double* lnl_t0)
+{
+    lcfit_auto_state_t* s = auto_alloc(GOAL_LCFIT2, LCFIT2_N_POINTS, min_t, max_t);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    if (!set_model2(s, model)) {
+        lcfit_auto_free(s);
+        return NULL;
+    }
+
+    if (lnl_t0 != NULL) {
+        s->lcfit2_lnl[1] = *lnl_t0;
+        s->lcfit2_known[1] = true;
+    }
+
+    s->alpha = alpha;
+    s->stage = STAGE_LCFIT2;
+    advance(s, 0);
+
+    return s;
+}
+
+lcfit_auto_state_t* lcfit_auto_begin_ml_t(const double* t, const size_t n_pts,
+                                          const double tolerance, const bsm_t* model,
+                                          const double min_t, const double max_t,
+                                          const size_t speculative_width,
+                                          const bool initial_guess)
+{
+    size_t capacity = n_pts > speculative_width ? n_pts : speculative_width;
+    if (capacity == 0) {
+        capacity = 1;
+    }
+
+    lcfit_auto_state_t* s = auto_alloc(GOAL_ML_T, capacity, min_t, max_t);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->model = *model;
+    s->initial_guess = initial_guess;
+
+    if (!ml_t_start(s, t, n_pts, tolerance, speculative_width)) {
+        lcfit_auto_free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+int lcfit_auto_next(lcfit_auto_state_t* s, double* t)
+{
+    if (s->stage == STAGE_DONE) {
+        return s->status;
+    }
+
+    *t = s->batch_t[s->batch_supplied];
+    return LCFIT_NEED_EVAL;
+}
+
+void lcfit_auto_supply(lcfit_auto_state_t* s, const double lnl)
+{
+    lcfit_auto_supply_n(s, 1, &lnl);
+}
+
+size_t lcfit_auto_next_n(lcfit_auto_state_t* s, const double** t)
+{
+    if (s->stage == STAGE_DONE) {
+        *t = NULL;
+        return 0;
+    }
+
+    *t = s->batch_t + s->batch_supplied;
+    return s->batch_n - s->batch_supplied;
+}
+
+void lcfit_auto_supply_n(lcfit_auto_state_t* s, const size_t n, const double* lnl)
+{
+    assert(s->batch_supplied + n <= s->batch_n);
+
+    memcpy(s->batch_lnl + s->batch_supplied, lnl, sizeof(double) * n);
+    accept(s, n);
+}
+
+int lcfit_auto_run(lcfit_auto_state_t* s, double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                   const lcfit_executor_t* executor)
+{
+    const lcfit_run_options_t options = {executor, NULL};
+
+    return lcfit_auto_run_opt(s, lnl_fn, lnl_fn_args, &options);
+}
+
+int lcfit_auto_run_opt(lcfit_auto_state_t* s, double (*lnl_fn)(double, void*),
+                       void* lnl_fn_args, const lcfit_run_options_t* options)
+{
+    const lcfit_executor_t* executor = options ? options->executor : NULL;
+    const lcfit_cancel_t* cancel = options ? options->cancel : NULL;
+
+    const double* t;
+    size_t n;
+
+    while ((n = lcfit_auto_next_n(s, &t)) > 0) {
+        if (lcfit_cancelled(cancel)) {
+            lcfit_auto_cancel(s);
+            break;
+        }
+
+        // sequential evaluations are checked for cancellation one by one
+        if (executor == NULL) {
+            n = 1;
+        }
+
+        lcfit_evaluate_n(executor, lnl_fn, lnl_fn_args, n, t,
+                         s->batch_lnl + s->batch_supplied);
+        accept(s, n);
+    }
+
+    return s->status;
+}
+
+void lcfit_auto_cancel(lcfit_auto_state_t* s)
+{
+    if (s->stage == STAGE_DONE) {
+        return;
+    }
+
+    double t = s->best_t;
+
+    switch (s->stage) {
+    case STAGE_BRACKET:
+    case STAGE_BRENT:
+    case STAGE_STENCIL:
+        s->d1 = NAN;
+        s->d2 = NAN;
+        if (s->stage == STAGE_STENCIL) {
+            t = s->mode_t;
+        }
+        break;
+    case STAGE_LCFIT2:
+        // lcfit2 fits report NLopt result codes
+        s->lcfit2_status = -5;  // NLOPT_FORCED_STOP
+        if (s->goal == GOAL_LCFIT2) {
+            t = s->model2->t0;
+        } else {
+            if (s->lcfit2_pass == 2) {
+                lcfit2_to_lcfit4(s->model2, &s->model);
+            }
+            t = s->mode_t;
+        }
+        break;
+    case STAGE_ML_T_START:
+    case STAGE_ML_T_SELECT:
+    case STAGE_ML_T_REFINE:
+        if (s->stats.full_fits > 0) {
+            t = fmin(fmax(s->ml_t, s->min_t), s->max_t);
+        } else if (s->goal == GOAL_FIT_AUTO) {
+            t = s->mode_t;
+        }
+        break;
+    case STAGE_DONE:
+        break;
+    }
+
+    const auto_stage from = s->stage;
+    finish(s, t, LCFIT_CANCELLED);
+    trace_stage(s, from);
+}
+
+double lcfit_auto_result(const lcfit_auto_state_t* s, bsm_t* model)
+{
+    assert(s->stage == STAGE_DONE);
+
+    if (model != NULL && (s->goal == GOAL_FIT_AUTO || s->goal == GOAL_ML_T)) {
+        *model = s->model;
+    }
+
+    return s->result_t;
+}
+
+void lcfit_auto_derivatives(const lcfit_auto_state_t* s, double* d1, double* d2)
+{
+    assert(s->stage == STAGE_DONE);
+    assert(s->derivatives);
+
+    *d1 = s->d1;
+    *d2 = s->d2;
+}
+
+int lcfit_auto_lcfit2_model(const lcfit_auto_state_t* s, lcfit2_bsm_t* model)
+{
+    assert(s->stage == STAGE_DONE);
+    assert(s->goal == GOAL_LCFIT2);
+
+    model->c = s->model2->c;
+    model->m = s->model2->m;
+
+    return s->lcfit2_status;
+}
+
+size_t lcfit_auto_n_evals(const lcfit_auto_state_t* s)
+{
+    return s->n_evals;
+}
+
+void lcfit_auto_ml_t_stats(const lcfit_auto_state_t* s, estimate_ml_t_stats_t* stats)
+{
+    assert(s->stage == STAGE_DONE);
+    assert(s->goal == GOAL_ML_T);
+
+    *stats = s->stats;
+    stats->status = s->status;
+}
+
+void lcfit_auto_free(lcfit_auto_state_t* s)
+{
+    if (s == NULL) {
+        return;
+    }
+
+    if (s->brent != NULL) {
+        gsl_min_fminimizer_free(s->brent);
+    }
+    free(s->brent_saved_state);
+
+    free(s->model2);
+
+    free(s->tbuf);
+    free(s->lbuf);
+    free(s->wbuf);
+    lcfit_refit_free(s->refit);
+    point_set_free(&s->set);
+
+    free(s->batch_t);
+    free(s->batch_lnl);
+    free(s);
+}
@@ -0,0 +1,237 @@
+/**
+ * \file lcfit_auto.h
+ * \brief Reverse-communication interface to automatic fitting
+ *
+ * The functions in this file run #lcfit_fit_auto and its stages
+ * (bracketing and Brent maximization, the derivative stencil, lcfit2,
+ * and #estimate_ml_t) without calling a log-likelihood function.
+ * Instead, the fit is a state that asks for the branch lengths it
+ * needs and resumes when their log-likelihoods are supplied:
+ *
+ * \code
+ * lcfit_auto_state_t* s = lcfit_auto_begin(&model, min_t, max_t);
+ *
+ * double t;
+ * while (lcfit_auto_next(s, &t) == LCFIT_NEED_EVAL) {
+ *     lcfit_auto_supply(s, log_likelihood(t));
+ * }
+ *
+ * double ml_t = lcfit_auto_result(s, &model);
+ * lcfit_auto_free(s);
+ * \endcode
+ *
+ * A caller fitting many branches can advance all of their states in
+ * lockstep and evaluate every requested branch length in one pass.
+ *
+ * Requests come in batches of branch lengths that can be evaluated
+ * independently, such as the five points of the derivative stencil.
+ * #lcfit_auto_next_n returns the whole outstanding batch, and
+ * #lcfit_auto_next only its first point. Either way, log-likelihoods
+ * are supplied in the order of the requests, and the fit resumes when
+ * the batch is complete.
+ *
+ * Given the same log-likelihoods, a state reaches the same result as
+ * the corresponding blocking function; those functions are
+ * implemented by #lcfit_auto_run.
+ */
+
+#ifndef LCFIT_AUTO_H
+#define LCFIT_AUTO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lcfit.h"
+#include "lcfit2.h"
+#include "lcfit_select.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The state of a reverse-communication fit. */
+typedef struct lcfit_auto_state lcfit_auto_state_t;
+
+/**
+ * Begin fitting a model as #lcfit_fit_auto does.
+ *
+ * \param[in] model  Initial model parameters.
+ * \param[in] min_t  Lower bound on branch length.
+ * \param[in] max_t  Upper bound on branch length.
+ *
+ * \return A new state, or \c NULL if it cannot be allocated.
+ */
+lcfit_auto_state_t* lcfit_auto_begin(const bsm_t* model, const double min_t, const double max_t);
+
+/**
+ * Begin finding the mode of a log-likelihood function as
+ * #lcfit_maximize does.
+ *
+ * \param[in] min_t        Lower bound on branch length.
+ * \param[in] max_t        Upper bound on branch length.
+ * \param[in] derivatives  Whether to estimate derivatives at the mode;
+ *                         see #lcfit_auto_derivatives.
+ */
+lcfit_auto_state_t* lcfit_auto_begin_maximize(const double min_t, const double max_t,
+                                              const bool derivatives);
+
+/**
+ * Begin fitting an lcfit2 model as #lcfit2_fit_auto does.
+ *
+ * \param[in] model  Initial model parameters, including the mode and
+ *                   derivatives there.
+ * \param[in] min_t  Lower bound on branch length.
+ * \param[in] max_t  Upper bound on branch length.
+ * \param[in] alpha  Weight tempering, as for #lcfit2_fit_auto.
+ */
+lcfit_auto_state_t* lcfit_auto_begin_lcfit2(const lcfit2_bsm_t* model, const double min_t,
+                                            const double max_t, const double alpha);
+
+/**
+ * Begin fitting an lcfit2 model as #lcfit2_fit_auto_opt does.
+ *
+ * \param[in] lnl_t0  Log-likelihood at the mode of \c model, or \c NULL
+ *                    to evaluate it with the first pass.
+ *
+ * The other parameters are as for #lcfit_auto_begin_lcfit2.
+ */
+lcfit_auto_state_t* lcfit_auto_begin_lcfit2_ex(const lcfit2_bsm_t* model, const double min_t,
+                                               const double max_t, const double alpha,
+                                               const double* lnl_t0);
+
+/**
+ * Begin estimating the ML branch length as #estimate_ml_t_ex does.
+ *
+ * \param[in] t                  Starting branch lengths.
+ * \param[in] n_pts              Number of starting branch lengths.
+ * \param[in] tolerance          Required fit tolerance.
+ * \param[in] model              Initial model parameters.
+ * \param[in] min_t              Lower bound on branch length.
+ * \param[in] max_t              Upper bound on branch length.
+ * \param[in] speculative_width  See #estimate_ml_t_options_t.
+ * \param[in] initial_guess      See #estimate_ml_t_options_t.
+ */
+lcfit_auto_state_t* lcfit_auto_begin_ml_t(const double* t, const size_t n_pts,
+                                          const double tolerance, const bsm_t* model,
+                                          const double min_t, const double max_t,
+                                          const size_t speculative_width,
+                                          const bool initial_guess);
+
+/**
+ * Get the next branch length to evaluate.
+ *
+ * \param[in,out] s  Fit state.
+ * \param[out]    t  Branch length whose log-likelihood is needed next.
+ *
+ * \return #LCFIT_NEED_EVAL if \c t was set, otherwise the fit is
+ *         finished and #LCFIT_SUCCESS, #LCFIT_ERROR or (after
+ *         #lcfit_auto_cancel) #LCFIT_CANCELLED is returned.
+ */
+int lcfit_auto_next(lcfit_auto_state_t* s, double* t);
+
+/**
+ * Supply the log-likelihood at the branch length from #lcfit_auto_next.
+ */
+void lcfit_auto_supply(lcfit_auto_state_t* s, const double lnl);
+
+/**
+ * Get the outstanding batch of branch lengths to evaluate.
+ *
+ * \param[in,out] s  Fit state.
+ * \param[out]    t  Branch lengths whose log-likelihoods are needed,
+ *                   valid until the next call to a function taking \c s.
+ *
+ * \return The number of branch lengths, which is zero once the fit is finished.
+ */
+size_t lcfit_auto_next_n(lcfit_auto_state_t* s, const double** t);
+
+/**
+ * Supply log-likelihoods for the first \c n outstanding branch lengths.
+ */
+void lcfit_auto_supply_n(lcfit_auto_state_t* s, const size_t n, const double* lnl);
+
+/**
+ * Run a fit to completion, evaluating each batch through an executor.
+ *
+ * \param[in,out] s            Fit state.
+ * \param[in]     lnl_fn       Log-likelihood function.
+ * \param[in]     lnl_fn_args  Additional data to pass to \c lnl_fn.
+ * \param[in]     executor     Executor to evaluate with, or \c NULL.
+ *
+ * \return #LCFIT_SUCCESS or #LCFIT_ERROR, as returned by #lcfit_auto_next.
+ */
+int lcfit_auto_run(lcfit_auto_state_t* s, double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                   const lcfit_executor_t* executor);
+
+/**
+ * Run a fit to completion or until it is cancelled.
+ *
+ * Without an executor, the points of a batch are evaluated one at a
+ * time, checking the cancellation token before each of them.
+ *
+ * \param[in] options  Executor and cancellation token, or \c NULL.
+ *
+ * \return #LCFIT_SUCCESS, #LCFIT_ERROR or #LCFIT_CANCELLED.
+ */
+int lcfit_auto_run_opt(lcfit_auto_state_t* s, double (*lnl_fn)(double, void*),
+                       void* lnl_fn_args, const lcfit_run_options_t* options);
+
+/**
+ * Stop a fit early, finishing it with #LCFIT_CANCELLED.
+ *
+ * The result is the best estimate so far: the ML branch length of the
+ * last model fitted by #estimate_ml_t, or else the mode if it has been
+ * found, or else the evaluated branch length with the highest
+ * log-likelihood (\c NAN if there is none). The model is the last one
+ * fitted, or the initial model if none was, and derivatives not yet
+ * estimated are \c NAN. An lcfit2 fit keeps the model of its first
+ * pass, if finished, and reports \c NLOPT_FORCED_STOP as its status.
+ *
+ * Cancelling a finished fit has no effect.
+ */
+void lcfit_auto_cancel(lcfit_auto_state_t* s);
+
+/**
+ * Get the result of a finished fit.
+ *
+ * \param[in]  s      Fit state.
+ * \param[out] model  Fitted model parameters, or \c NULL. Unchanged
+ *                    for a state from #lcfit_auto_begin_maximize or
+ *                    #lcfit_auto_begin_lcfit2.
+ *
+ * \return The estimated ML branch length, or \c NAN if the fit failed
+ *         before producing an estimate.
+ */
+double lcfit_auto_result(const lcfit_auto_state_t* s, bsm_t* model);
+
+/**
+ * Get the derivatives at the mode estimated by a finished fit from
+ * #lcfit_auto_begin or #lcfit_auto_begin_maximize.
+ */
+void lcfit_auto_derivatives(const lcfit_auto_state_t* s, double* d1, double* d2);
+
+/**
+ * Get the lcfit2 model of a finished fit from #lcfit_auto_begin_lcfit2.
+ *
+ * \return The status of the last lcfit2 fit, as from #lcfit2_fit_auto.
+ */
+int lcfit_auto_lcfit2_model(const lcfit_auto_state_t* s, lcfit2_bsm_t* model);
+
+/**
+ * Get the number of log-likelihoods supplied to a fit so far.
+ */
+size_t lcfit_auto_n_evals(const lcfit_auto_state_t* s);
+
+/**
+ * Get the statistics of a finished fit from #lcfit_auto_begin_ml_t.
+ */
+void lcfit_auto_ml_t_stats(const lcfit_auto_state_t* s, estimate_ml_t_stats_t* stats);
+
+/** Free a fit state, which need not be finished. */
+void lcfit_auto_free(lcfit_auto_state_t* s);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // LCFIT_AUTO_H
@@ -0,0 +1,380 @@
+/**
+ * \file lcfit_dispatch.c
+ * \brief Batched lcfit kernels with runtime instruction set selection.
+ */
+
+#include "lcfit_dispatch.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** The batched kernels for one instruction set. */
+typedef struct {
+    void (*bsm_log_like_n)(const size_t, const double*, const bsm_t*, double*);
+    void (*bsm_gradient_n)(const size_t, const double*, const bsm_t*, double*);
+    void (*bsm_log_like_dt_n)(const size_t, const double*, const bsm_t*,
+                              double*, double*, double*);
+    void (*lcfit2_norm_lnl_n)(const size_t, const double*, const lcfit2_bsm_t*, double*);
+    void (*lcfit2_norm_lnl_dt_n)(const size_t, const double*, const lcfit2_bsm_t*,
+                                 double*, double*, double*);
+    double (*scaled_exp_n)(const size_t, const double*, const double, const double, double*);
+    void (*bsm_soa_log_like_sum_n)(const size_t, const size_t, const double*,
+                                   const lcfit_bsm_soa_t*, double*, double*);
+    void (*bsm_log_like_shifted_nf)(const size_t, const float*, const bsm_t*,
+                                    const double, float*);
+} lcfit_kernels;
+
+static void scalar_bsm_log_like_n(const size_t n, const double* t,
+                                  const bsm_t* m, double* out)
+{
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = lcfit_bsm_log_like(t[i], m);
+    }
+}
+
+static void scalar_bsm_gradient_n(const size_t n, const double* t,
+                                  const bsm_t* m, double* grad)
+{
+    for (size_t i = 0; i < n; ++i) {
+        lcfit_bsm_gradient(t[i], m, grad + 4 * i);
+    }
+}
+
+static void scalar_bsm_log_like_dt_n(const size_t n, const double* t, const bsm_t* m,
+                                     double* lnl, double* d1, double* d2)
+{
+    for (size_t i = 0; i < n; ++i) {
+        double d1_i, d2_i;
+        const double lnl_i = lcfit_bsm_log_like_dt(t[i], m, &d1_i, &d2_i);
+
+        if (lnl != NULL) {
+            lnl[i] = lnl_i;
+        }
+        if (d1 != NULL) {
+            d1[i] = d1_i;
+        }
+        if (d2 != NULL) {
+            d2[i] = d2_i;
+        }
+    }
+}
+
+static void scalar_lcfit2_norm_lnl_n(const size_t n, const double* t,
+                                     const lcfit2_bsm_t* model, double* out)
+{
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = lcfit2_norm_lnl(t[i], model);
+    }
+}
+
+static void scalar_lcfit2_norm_lnl_dt_n(const size_t n, const double* t,
+                                        const lcfit2_bsm_t* model,
+                                        double* norm_lnl, double* d1, double* d2)
+{
+    const double lnl_t0 = lcfit2_lnl(model->t0, model);
+
+    for (size_t i = 0; i < n; ++i) {
+        double d1_i, d2_i;
+        const double lnl_i = lcfit2_lnl_dt(t[i], model, &d1_i, &d2_i);
+
+        if (norm_lnl != NULL) {
+            norm_lnl[i] = lnl_i - lnl_t0;
+        }
+        if (d1 != NULL) {
+            d1[i] = d1_i;
+        }
+        if (d2 != NULL) {
+            d2[i] = d2_i;
+        }
+    }
+}
+
+static double scalar_scaled_exp_n(const size_t n, const double* x,
+                                  const double alpha, const double shift, double* out)
+{
+    double sum = 0.0;
+
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = exp(alpha * (x[i] - shift));
+        sum += out[i];
+    }
+
+    return sum;
+}
+
+static void scalar_bsm_soa_log_like_sum_n(const size_t n_rows, const size_t n,
+                                          const double* t, const lcfit_bsm_soa_t* models,
+                                          double* sums, double* dlnl_dt)
+{
+    for (size_t row = 0; row < n_rows; ++row) {
+        const double* t_row = t + row * n;
+        double sum = 0.0;
+
+        for (size_t i = 0; i < n; ++i) {
+            const bsm_t m = {models->c[i], models->m[i], models->r[i], models->b[i]};
+            double d1;
+            sum += lcfit_bsm_log_like_dt(t_row[i], &m, &d1, NULL);
+            if (dlnl_dt != NULL) {
+                dlnl_dt[row * n + i] = d1;
+            }
+        }
+
+        sums[row] = sum;
+    }
+}
+
+static void scalar_bsm_log_like_shifted_nf(const size_t n, const float* t,
+                                            const bsm_t* m, const double shift,
+                                            float* out)
+{
+    const float r = (float) m->r;
+    const float b = (float) m->b;
+    const bool zero_is_singular = m->b == 0.0 && m->c > m->m;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (t[i] == 0.0f && zero_is_singular) {
+            out[i] = -INFINITY;
+            continue;
+        }
+
+        /* With em = exp(-r(t + b)) - 1, (1 + u)/2 = 1 + em/2 and
+         * (1 - u)/2 = -em/2, neither of which cancels as t + b -> 0. */
+        const float em = expm1f(-r * (t[i] + b));
+        const double lnl = m->c * (double) log1pf(0.5f * em) +
+                           m->m * (double) logf(-0.5f * em);
+        out[i] = (float) (lnl - shift);
+    }
+}
+
+static const lcfit_kernels scalar_kernels = {
+    scalar_bsm_log_like_n,
+    scalar_bsm_gradient_n,
+    scalar_bsm_log_like_dt_n,
+    scalar_lcfit2_norm_lnl_n,
+    scalar_lcfit2_norm_lnl_dt_n,
+    scalar_scaled_exp_n,
+    scalar_bsm_soa_log_like_sum_n,
+    scalar_bsm_log_like_shifted_nf
+};
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define LCFIT_HAVE_X86_KERNELS
+#endif
+
+#ifdef LCFIT_HAVE_X86_KERNELS
+
+/* constants shared by the vector exp and log */
+#define VEC_LOG2E 1.44269504088896338700e+00
+#define VEC_LN2_HI 6.93147180369123816490e-01
+#define VEC_LN2_LO 1.90821492927058770002e-10
+#define VEC_TWO_54 1.80143985094819840000e+16
+#define VEC_SQRT2 1.41421356237309504880e+00
+/* adding 1.5 * 2^52 rounds to an integer, which is left in the low mantissa bits */
+#define VEC_ROUND_SHIFT 6755399441055744.0
+#define VEC_ROUND_SHIFT_BITS INT64_C(0x4338000000000000)
+#define VEC_MANTISSA_MASK INT64_C(0x000fffffffffffff)
+#define VEC_ONE_BITS INT64_C(0x3ff0000000000000)
+
+/* and their single-precision counterparts; ln(2) is split so that
+ * k * VEC_LN2_HI_F is exact for the k that occur */
+#define VEC_LOG2E_F 1.44269504f
+#define VEC_LN2_HI_F 6.93145751953125e-01f
+#define VEC_LN2_LO_F 1.42860676533018704e-06f
+#define VEC_TWO_24_F 16777216.0f
+#define VEC_SQRT2_F 1.41421356f
+#define VEC_ROUND_SHIFT_F 12582912.0f
+#define VEC_ROUND_SHIFT_BITS_F INT32_C(0x4b400000)
+#define VEC_MANTISSA_MASK_F INT32_C(0x007fffff)
+#define VEC_ONE_BITS_F INT32_C(0x3f800000)
+
+#define LCFIT_VEC_WIDTH 2
+#define LCFIT_VEC_TARGET "sse4.2"
+#define LCFIT_VEC_NAME(name) sse42_##name
+#include "lcfit_kernels.inc"
+#undef LCFIT_VEC_WIDTH
+#undef LCFIT_VEC_TARGET
+#undef LCFIT_VEC_NAME
+
+#define LCFIT_VEC_WIDTH 4
+#define LCFIT_VEC_TARGET "avx2"
+#define LCFIT_VEC_NAME(name) avx2_##name
+#include "lcfit_kernels.inc"
+#undef LCFIT_VEC_WIDTH
+#undef LCFIT_VEC_TARGET
+#undef LCFIT_VEC_NAME
+
+#define LCFIT_VEC_WIDTH 8
+#define LCFIT_VEC_TARGET "avx512f"
+#define LCFIT_VEC_NAME(name) avx512_##name
+#include "lcfit_kernels.inc"
+#undef LCFIT_VEC_WIDTH
+#undef LCFIT_VEC_TARGET
+#undef LCFIT_VEC_NAME
+
+#endif /* LCFIT_HAVE_X86_KERNELS */
+
+static const char* const isa_names[LCFIT_ISA_COUNT] = {
+    "scalar", "sse4.2", "avx2", "avx512"
+};
+
+static const lcfit_kernels* isa_kernels(const lcfit_isa isa)
+{
+    switch (isa) {
+    case LCFIT_ISA_SCALAR:
+        return &scalar_kernels;
+#ifdef LCFIT_HAVE_X86_KERNELS
+    case LCFIT_ISA_SSE42:
+        return &sse42_kernels;
+    case LCFIT_ISA_AVX2:
+        return &avx2_kernels;
+    case LCFIT_ISA_AVX512:
+        return &avx512_kernels;
+#endif /* LCFIT_HAVE_X86_KERNELS */
+    default:
+        return NULL;
+    }
+}
+
+static lcfit_isa active_isa = LCFIT_ISA_SCALAR;
+static const lcfit_kernels* active_kernels = &scalar_kernels;
+
+const char* lcfit_isa_name(const lcfit_isa isa)
+{
+    if (isa < 0 || isa >= LCFIT_ISA_COUNT) {
+        return NULL;
+    }
+
+    return isa_names[isa];
+}
+
+bool lcfit_isa_supported(const lcfit_isa isa)
+{
+    if (isa_kernels(isa) == NULL) {
+        return false;
+    }
+
+#ifdef LCFIT_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    switch (isa) {
+    case LCFIT_ISA_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case LCFIT_ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case LCFIT_ISA_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        break;
+    }
+#endif /* LCFIT_HAVE_X86_KERNELS */
+
+    return true;
+}
+
+lcfit_isa lcfit_active_isa(void)
+{
+    return active_isa;
+}
+
+int lcfit_set_isa(const lcfit_isa isa)
+{
+    if (!lcfit_isa_supported(isa)) {
+        return LCFIT_ERROR;
+    }
+
+    active_isa = isa;
+    active_kernels = isa_kernels(isa);
+
+    return LCFIT_SUCCESS;
+}
+
+#ifdef LCFIT_HAVE_X86_KERNELS
+/* Select the kernels when the library is loaded, so that the hot
+ * paths only pay for an indirect call. Elsewhere only the scalar
+ * kernels exist and there is nothing to select. */
+__attribute__((constructor))
+static void select_isa(void)
+{
+    lcfit_isa best = LCFIT_ISA_SCALAR;
+    for (int isa = LCFIT_ISA_COUNT - 1; isa > LCFIT_ISA_SCALAR; --isa) {
+        if (lcfit_isa_supported((lcfit_isa) isa)) {
+            best = (lcfit_isa) isa;
+            break;
+        }
+    }
+
+    lcfit_isa chosen = best;
+    const char* requested = getenv("LCFIT_ISA");
+
+    if (requested != NULL && requested[0] != '\0') {
+        int isa = 0;
+        while (isa < LCFIT_ISA_COUNT && strcmp(requested, isa_names[isa]) != 0) {
+            ++isa;
+        }
+
+        if (isa < LCFIT_ISA_COUNT && lcfit_isa_supported((lcfit_isa) isa)) {
+            chosen = (lcfit_isa) isa;
+        } else {
+            fprintf(stderr, "lcfit: LCFIT_ISA=%s is not supported on this host, using %s\n",
+                    requested, isa_names[best]);
+        }
+    }
+
+    lcfit_set_isa(chosen);
+}
+#endif /* LCFIT_HAVE_X86_KERNELS */
+
+void lcfit_bsm_log_like_n(const size_t n, const double* t, const bsm_t* m, double* out)
+{
+    active_kernels->bsm_log_like_n(n, t, m, out);
+}
+
+void lcfit_bsm_gradient_n(const size_t n, const double* t, const bsm_t* m, double* grad)
+{
+    active_kernels->bsm_gradient_n(n, t, m, grad);
+}
+
+void lcfit_bsm_log_like_dt_n(const size_t n, const double* t, const bsm_t* m,
+                             double* lnl, double* d1, double* d2)
+{
+    active_kernels->bsm_log_like_dt_n(n, t, m, lnl, d1, d2);
+}
+
+void lcfit2_norm_lnl_n(const size_t n, const double* t, const lcfit2_bsm_t* model, double* out)
+{
+    active_kernels->lcfit2_norm_lnl_n(n, t, model, out);
+}
+
+void lcfit2_norm_lnl_dt_n(const size_t n, const double* t, const lcfit2_bsm_t* model,
+                          double* norm_lnl, double* d1, double* d2)
+{
+    active_kernels->lcfit2_norm_lnl_dt_n(n, t, model, norm_lnl, d1, d2);
+}
+
+double lcfit_scaled_exp_n(const size_t n, const double* x, const double alpha,
+                          const double shift, double* out)
+{
+    return active_kernels->scaled_exp_n(n, x, alpha, shift, out);
+}
+
+void lcfit_bsm_soa_log_like_sum_n(const size_t n_rows, const size_t n, const double* t,
+                                  const lcfit_bsm_soa_t* models, double* sums,
+                                  double* dlnl_dt)
+{
+    active_kernels->bsm_soa_log_like_sum_n(n_rows, n, t, models, sums, dlnl_dt);
+}
+
+void lcfit_bsm_log_like_shifted_nf(const size_t n, const float* t, const bsm_t* m,
+                                   const double shift, float* out)
+{
+    active_kernels->bsm_log_like_shifted_nf(n, t, m, shift, out);
+}
+
+void lcfit_bsm_log_like_nf(const size_t n, const float* t, const bsm_t* m, float* out)
+{
+    lcfit_bsm_log_like_shifted_nf(n, t, m, 0.0, out);
+}
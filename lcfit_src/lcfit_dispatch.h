@@ -0,0 +1,178 @@
+/**
+ * \file lcfit_dispatch.h
+ * \brief Batched lcfit kernels with runtime instruction set selection.
+ *
+ * The kernels in this file evaluate models and weights at many points at
+ * once. Each has a scalar implementation, which loops over the
+ * single-point functions in lcfit.h, lcfit2.h, and \c math.h and is
+ * the reference for the others, and on x86 with GCC or Clang, vector
+ * implementations for SSE4.2, AVX2, and AVX-512. The vector
+ * implementations are compiled for their instruction set regardless of
+ * the flags used to build the library, so a single binary can use
+ * whatever the host supports.
+ *
+ * The implementation is chosen when the library is loaded: the widest
+ * instruction set the CPU supports, unless the \c LCFIT_ISA
+ * environment variable names another one (\c scalar, \c sse4.2,
+ * \c avx2, or \c avx512). An unsupported request falls back to the
+ * default with a warning on \c stderr.
+ *
+ * The vector implementations use their own exponential and logarithm.
+ * Those of the double kernels agree with the scalar ones to within a
+ * few units in the last place of the quantities they are computed
+ * from.
+ *
+ * The single-precision functions lcfit_bsm_log_like_nf() and
+ * lcfit_bsm_log_like_shifted_nf() in lcfit.h dispatch the same way,
+ * with twice as many lanes per vector as the double kernels. Their
+ * vector implementations agree with the scalar ones only to within a
+ * few parts in a million.
+ */
+
+#ifndef LCFIT_DISPATCH_H
+#define LCFIT_DISPATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lcfit.h"
+#include "lcfit2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of points callers should evaluate per kernel call when
+ * working through longer arrays with stack buffers. */
+#define LCFIT_KERNEL_BLOCK 64
+
+/** Instruction sets for which the batched kernels are implemented. */
+typedef enum {
+    LCFIT_ISA_SCALAR = 0,
+    LCFIT_ISA_SSE42,
+    LCFIT_ISA_AVX2,
+    LCFIT_ISA_AVX512,
+    LCFIT_ISA_COUNT
+} lcfit_isa;
+
+/** Name of an instruction set as accepted by \c LCFIT_ISA, or \c NULL if \c isa is invalid. */
+const char* lcfit_isa_name(const lcfit_isa isa);
+
+/** Whether the kernels for \c isa were compiled in and the CPU supports them. */
+bool lcfit_isa_supported(const lcfit_isa isa);
+
+/** The instruction set whose kernels are in use. */
+lcfit_isa lcfit_active_isa(void);
+
+/** Use the kernels for a given instruction set.
+ *
+ * This is intended for testing and benchmarking, and must not be
+ * called while another thread may be running a kernel.
+ *
+ * \return #LCFIT_SUCCESS, or #LCFIT_ERROR if \c isa is not supported,
+ *         in which case the active kernels are unchanged.
+ */
+int lcfit_set_isa(const lcfit_isa isa);
+
+/** Compute the log-likelihood at many branch lengths.
+ *
+ * \param[in]  n    Number of branch lengths.
+ * \param[in]  t    Branch lengths.
+ * \param[in]  m    Model parameters.
+ * \param[out] out  #lcfit_bsm_log_like at each branch length; may alias \c t.
+ */
+void lcfit_bsm_log_like_n(const size_t n, const double* t, const bsm_t* m, double* out);
+
+/** Compute the model parameter gradient at many branch lengths.
+ *
+ * \param[in]  n     Number of branch lengths.
+ * \param[in]  t     Branch lengths.
+ * \param[in]  m     Model parameters.
+ * \param[out] grad  An \c n by 4 row-major array; row \c i receives
+ *                   #lcfit_bsm_gradient at <tt>t[i]</tt>.
+ */
+void lcfit_bsm_gradient_n(const size_t n, const double* t, const bsm_t* m, double* grad);
+
+/** Compute the log-likelihood and its branch length derivatives at many branch lengths.
+ *
+ * \param[in]  n    Number of branch lengths.
+ * \param[in]  t    Branch lengths.
+ * \param[in]  m    Model parameters.
+ * \param[out] lnl  #lcfit_bsm_log_like at each branch length, or \c NULL.
+ * \param[out] d1   #lcfit_bsm_dlnl_dt at each branch length, or \c NULL.
+ * \param[out] d2   #lcfit_bsm_d2lnl_dt2 at each branch length, or \c NULL.
+ */
+void lcfit_bsm_log_like_dt_n(const size_t n, const double* t, const bsm_t* m,
+                             double* lnl, double* d1, double* d2);
+
+/** Compute the normalized lcfit2 log-likelihood at many branch lengths.
+ *
+ * \param[in]  n      Number of branch lengths.
+ * \param[in]  t      Branch lengths.
+ * \param[in]  model  lcfit2 model parameters.
+ * \param[out] out    #lcfit2_norm_lnl at each branch length; may alias \c t.
+ */
+void lcfit2_norm_lnl_n(const size_t n, const double* t, const lcfit2_bsm_t* model, double* out);
+
+/** Compute the normalized lcfit2 log-likelihood and its branch length derivatives at many branch lengths.
+ *
+ * \param[in]  n         Number of branch lengths.
+ * \param[in]  t         Branch lengths.
+ * \param[in]  model     lcfit2 model parameters.
+ * \param[out] norm_lnl  #lcfit2_norm_lnl at each branch length, or \c NULL.
+ * \param[out] d1        #lcfit2_d1f_t at each branch length, or \c NULL.
+ * \param[out] d2        #lcfit2_d2f_t at each branch length, or \c NULL.
+ */
+void lcfit2_norm_lnl_dt_n(const size_t n, const double* t, const lcfit2_bsm_t* model,
+                          double* norm_lnl, double* d1, double* d2);
+
+/** Branch models in structure-of-arrays form.
+ *
+ * Element \c i of each array is a parameter of the model of branch
+ * \c i, as in #bsm_t.
+ */
+typedef struct {
+    const double* c;
+    const double* m;
+    const double* r;
+    const double* b;
+} lcfit_bsm_soa_t;
+
+/** Sum the log-likelihoods of many branches, each under its own model.
+ *
+ * Evaluates \c n_rows vectors of branch lengths, e.g. candidate trees,
+ * against the same branch models.
+ *
+ * \param[in]  n_rows   Number of branch length vectors.
+ * \param[in]  n        Number of branches.
+ * \param[in]  t        An \c n_rows by \c n row-major array of branch lengths.
+ * \param[in]  models   Model of each branch.
+ * \param[out] sums     Sum of #lcfit_bsm_log_like over the branches of each row.
+ * \param[out] dlnl_dt  An \c n_rows by \c n row-major array receiving
+ *                      #lcfit_bsm_dlnl_dt of each term, or \c NULL.
+ */
+void lcfit_bsm_soa_log_like_sum_n(const size_t n_rows, const size_t n, const double* t,
+                                  const lcfit_bsm_soa_t* models, double* sums,
+                                  double* dlnl_dt);
+
+/** Compute a scaled exponential at many points.
+ *
+ * Sets <tt>out[i] = exp(alpha * (x[i] - shift))</tt>. The vector
+ * implementations flush results below about \f$ 10^{-307} \f$ to zero.
+ *
+ * \param[in]  n      Number of points.
+ * \param[in]  x      Points.
+ * \param[in]  alpha  Scale.
+ * \param[in]  shift  Offset subtracted before scaling.
+ * \param[out] out    Result at each point; may alias \c x.
+ *
+ * \return The sum of the results.
+ */
+double lcfit_scaled_exp_n(const size_t n, const double* x, const double alpha,
+                          const double shift, double* out);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* LCFIT_DISPATCH_H */
@@ -11,6 +11,10 @@
 
 #include <stdbool.h>
 
+#include "lcfit.h"
+#include "lcfit2.h"
+#include "lcfit_select.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -21,8 +25,43 @@ bool bracket_maximum(double (*fn)(double, void*), void* fn_args,
 void estimate_derivatives(double (*fn)(double, void*), void* fn_args,
                           double x, double* d1, double* d2);
 
-double find_maximum(double (*fn)(double, void*), void* fn_args,
-                    double guess, double min_t, double max_t);
+bool bracket_maximum_ex(double (*fn)(double, void*), void* fn_args,
+                        double* min_t, double* max_t,
+                        const lcfit_executor_t* executor);
+
+void estimate_derivatives_ex(double (*fn)(double, void*), void* fn_args,
+                             double x, double* d1, double* d2,
+                             const lcfit_executor_t* executor);
+
+/* Steps shared by the blocking and reverse-communication fits. */
+
+extern const size_t BRACKET_MAX_ITER;
+extern const int BRENT_MAX_ITER;
+
+int bracket_maximum_update(double* t, double* f);
+
+double derivative_stencil(const double x, double* t);
+
+void stencil_derivatives(const double* f, const double h, double* d1, double* d2);
+
+int select_points_next(const point_set_t* set, const size_t max_pts,
+                       const double min_t, const double max_t, double* t);
+
+double bound_point(const double proposed_t, const point_t* points,
+                   const size_t n_pts, const double min_t, const double max_t);
+
+double rel_err(double expected, double actual);
+
+int check_model(const bsm_t* m);
+
+void lcfit2_print_array(const char* name, const size_t n, const double* x);
+
+double lcfit2_delta(const lcfit2_bsm_t* model);
+
+void lcfit2_three_points(const lcfit2_bsm_t* model, const double delta,
+                         const double min_t, const double max_t, double* t);
+
+void lcfit2_normalize(const double max_lnl, const size_t n, double* lnl);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,379 @@
+/**
+ * \file lcfit_refit.c
+ * \brief Incremental refitting of the binary symmetric model.
+ *
+ * The weighted residuals \f$w_i (f(t_i) - l_i)\f$ are linearized at
+ * the current model, and the rows \f$w_i J_i\f$ of their Jacobian are
+ * reduced with Givens rotations to an upper triangular \f$R\f$, with
+ * the residuals rotated alongside into \f$Q^T (-W e)\f$. Adding a point
+ * is one more row, so the factor is kept up to date without ever
+ * forming \f$J^T J\f$.
+ */
+
+#include "lcfit_refit.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lcfit_priv.h"
+
+/** Number of model parameters. */
+#define N_PARAMS 4
+
+/** Index of b among the parameters, the last one. */
+#define B_INDEX 3
+
+/** Relative change in every parameter below which a fit has converged. */
+static const double REFIT_XTOL = 1e-4;
+
+/** Maximum number of times a Gauss-Newton step is halved. */
+static const int REFIT_MAX_HALVINGS = 10;
+
+struct lcfit_refit {
+    size_t capacity;
+    size_t n;
+
+    double* t;
+    double* l;
+    double* w;
+
+    /* Unweighted residuals and Jacobian rows at model. */
+    double* err;
+    double* jac;
+
+    bsm_t model;
+
+    /* Number of parameters fitted; the last, b, is held at zero when
+     * this is N_PARAMS - 1. */
+    size_t p;
+
+    /* Upper triangular factor of the weighted Jacobian, row-major,
+     * and the weighted residuals rotated with it. */
+    double r[N_PARAMS * N_PARAMS];
+    double qtf[N_PARAMS];
+};
+
+lcfit_refit_t* lcfit_refit_alloc(const size_t capacity)
+{
+    lcfit_refit_t* f = calloc(1, sizeof(lcfit_refit_t));
+    if (f == NULL) {
+        return NULL;
+    }
+
+    f->t = malloc(sizeof(double) * capacity);
+    f->l = malloc(sizeof(double) * capacity);
+    f->w = malloc(sizeof(double) * capacity);
+    f->err = malloc(sizeof(double) * capacity);
+    f->jac = malloc(sizeof(double) * capacity * N_PARAMS);
+    if (f->t == NULL || f->l == NULL || f->w == NULL || f->err == NULL || f->jac == NULL) {
+        lcfit_refit_free(f);
+        return NULL;
+    }
+
+    f->capacity = capacity;
+
+    return f;
+}
+
+void lcfit_refit_free(lcfit_refit_t* f)
+{
+    if (f == NULL) {
+        return;
+    }
+
+    free(f->t);
+    free(f->l);
+    free(f->w);
+    free(f->err);
+    free(f->jac);
+    free(f);
+}
+
+/* Compute the residual and Jacobian row of a point, returning false
+ * if either is not finite. */
+static bool linearize_point(const bsm_t* m, const double t, const double l,
+                            double* err, double* row)
+{
+    *err = lcfit_bsm_log_like(t, m) - l;
+    lcfit_bsm_gradient(t, m, row);
+
+    bool finite = isfinite(*err);
+    for (size_t j = 0; j < N_PARAMS; ++j) {
+        finite = finite && isfinite(row[j]);
+    }
+
+    return finite;
+}
+
+/* Rotate the weighted row of point i into the factor. */
+static void add_row(lcfit_refit_t* f, const size_t i)
+{
+    const double w = f->w[i];
+    double a[N_PARAMS];
+    for (size_t j = 0; j < f->p; ++j) {
+        a[j] = w * f->jac[i * N_PARAMS + j];
+    }
+    double y = -w * f->err[i];
+
+    for (size_t k = 0; k < f->p; ++k) {
+        if (a[k] == 0.0) {
+            continue;
+        }
+
+        double* rk = &f->r[k * N_PARAMS];
+        const double h = hypot(rk[k], a[k]);
+        const double c = rk[k] / h;
+        const double s = a[k] / h;
+
+        for (size_t j = k; j < f->p; ++j) {
+            const double rkj = rk[j];
+            rk[j] = c * rkj + s * a[j];
+            a[j] = c * a[j] - s * rkj;
+        }
+
+        const double qk = f->qtf[k];
+        f->qtf[k] = c * qk + s * y;
+        y = c * y - s * qk;
+    }
+}
+
+static void factor(lcfit_refit_t* f)
+{
+    memset(f->r, 0, sizeof(f->r));
+    memset(f->qtf, 0, sizeof(f->qtf));
+
+    for (size_t i = 0; i < f->n; ++i) {
+        add_row(f, i);
+    }
+}
+
+static bool linearize(lcfit_refit_t* f)
+{
+    for (size_t i = 0; i < f->n; ++i) {
+        if (!linearize_point(&f->model, f->t[i], f->l[i], &f->err[i],
+                             &f->jac[i * N_PARAMS])) {
+            return false;
+        }
+    }
+
+    factor(f);
+
+    return true;
+}
+
+/* With b held at zero, whether increasing b would reduce the sum of
+ * squares; the same test as the reduced fit in lcfit.c. */
+static bool b_should_increase(const lcfit_refit_t* f)
+{
+    double d_sse = 0.0;
+    double scale = 0.0;
+    for (size_t i = 0; i < f->n; ++i) {
+        const double w2 = f->w[i] * f->w[i];
+        const double db = f->jac[i * N_PARAMS + B_INDEX];
+        d_sse += w2 * f->err[i] * db;
+        scale += w2 * fabs(f->l[i] * db);
+    }
+
+    return d_sse < -sqrt(DBL_EPSILON) * scale;
+}
+
+/* Release b if it is held at zero and should increase, returning true
+ * if it was released. */
+static bool update_active_set(lcfit_refit_t* f)
+{
+    if (f->p == N_PARAMS || !b_should_increase(f)) {
+        return false;
+    }
+
+    f->p = N_PARAMS;
+    factor(f);
+
+    return true;
+}
+
+static bool weighted_sse(const lcfit_refit_t* f, const bsm_t* m, double* sse)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < f->n; ++i) {
+        const double e = f->w[i] * (lcfit_bsm_log_like(f->t[i], m) - f->l[i]);
+        sum += e * e;
+    }
+
+    *sse = sum;
+
+    return isfinite(sum);
+}
+
+/* Solve R dx = Q^T (-W e) by back-substitution. */
+static bool solve(const lcfit_refit_t* f, double* dx)
+{
+    double max_diag = 0.0;
+    for (size_t k = 0; k < f->p; ++k) {
+        max_diag = fmax(max_diag, fabs(f->r[k * N_PARAMS + k]));
+    }
+
+    for (size_t k = f->p; k-- > 0;) {
+        const double* rk = &f->r[k * N_PARAMS];
+        if (!(fabs(rk[k]) > DBL_EPSILON * max_diag)) {
+            return false;
+        }
+
+        double sum = f->qtf[k];
+        for (size_t j = k + 1; j < f->p; ++j) {
+            sum -= rk[j] * dx[j];
+        }
+        dx[k] = sum / rk[k];
+    }
+
+    for (size_t k = f->p; k < N_PARAMS; ++k) {
+        dx[k] = 0.0;
+    }
+
+    return true;
+}
+
+int lcfit_refit_reset(lcfit_refit_t* f, const bsm_t* m, const size_t n,
+                      const double* t, const double* l, const double* w)
+{
+    f->n = 0;
+
+    if (n > f->capacity || check_model(m) != 0) {
+        return LCFIT_ERROR;
+    }
+
+    memcpy(f->t, t, sizeof(double) * n);
+    memcpy(f->l, l, sizeof(double) * n);
+    memcpy(f->w, w, sizeof(double) * n);
+    f->n = n;
+    f->model = *m;
+    f->p = m->b == 0.0 ? N_PARAMS - 1 : N_PARAMS;
+
+    if (!linearize(f)) {
+        f->n = 0;
+        return LCFIT_ERROR;
+    }
+
+    return LCFIT_SUCCESS;
+}
+
+int lcfit_refit_add(lcfit_refit_t* f, const double t, const double l, const double w)
+{
+    if (f->n == 0 || f->n == f->capacity) {
+        return LCFIT_ERROR;
+    }
+
+    const size_t i = f->n;
+    if (!linearize_point(&f->model, t, l, &f->err[i], &f->jac[i * N_PARAMS])) {
+        return LCFIT_ERROR;
+    }
+
+    f->t[i] = t;
+    f->l[i] = l;
+    f->w[i] = w;
+    ++f->n;
+
+    add_row(f, i);
+
+    return LCFIT_SUCCESS;
+}
+
+size_t lcfit_refit_size(const lcfit_refit_t* f)
+{
+    return f->n;
+}
+
+const double* lcfit_refit_lnl(const lcfit_refit_t* f)
+{
+    return f->l;
+}
+
+void lcfit_refit_set_weights(lcfit_refit_t* f, const double* w)
+{
+    /* The rows are stored unweighted, so only the factor changes. */
+    memcpy(f->w, w, sizeof(double) * f->n);
+    factor(f);
+}
+
+int lcfit_refit_step(lcfit_refit_t* f, const size_t max_steps, bsm_t* m)
+{
+    double sse;
+    if (f->n == 0 || !weighted_sse(f, &f->model, &sse)) {
+        return LCFIT_ERROR;
+    }
+
+    update_active_set(f);
+
+    bool moved = false;
+    for (size_t step = 0; step < max_steps; ++step) {
+        double dx[N_PARAMS];
+        if (!solve(f, dx)) {
+            break;
+        }
+
+        const bsm_t x = f->model;
+        double lambda = 1.0;
+        bool accepted = false;
+        bool at_bound = false;
+        bsm_t trial;
+        double trial_sse;
+
+        for (int i = 0; i <= REFIT_MAX_HALVINGS && !accepted; ++i, lambda /= 2.0) {
+            trial.c = x.c + lambda * dx[0];
+            trial.m = x.m + lambda * dx[1];
+            trial.r = x.r + lambda * dx[2];
+            trial.b = x.b + lambda * dx[B_INDEX];
+
+            /* Project onto b >= 0, holding b there from now on. */
+            at_bound = trial.b < 0.0;
+            if (at_bound) {
+                trial.b = 0.0;
+            }
+
+            accepted = check_model(&trial) == 0 &&
+                       weighted_sse(f, &trial, &trial_sse) && trial_sse <= sse;
+        }
+
+        if (!accepted) {
+            break;
+        }
+
+        /* b enters the model as r (t + b), so it is measured against
+         * 1 / r rather than itself, which may be zero. */
+        const double scale[N_PARAMS] = {trial.c, trial.m, trial.r, trial.b + 1.0 / trial.r};
+        bool converged = !at_bound;
+        for (size_t j = 0; j < f->p; ++j) {
+            converged = converged && fabs(dx[j]) <= REFIT_XTOL * fabs(scale[j]);
+        }
+
+        f->model = trial;
+        sse = trial_sse;
+        moved = true;
+        if (at_bound) {
+            f->p = N_PARAMS - 1;
+        }
+
+        if (!linearize(f)) {
+            f->n = 0;
+            return LCFIT_ERROR;
+        }
+
+        if (update_active_set(f)) {
+            converged = false;
+        }
+
+        if (converged) {
+            *m = f->model;
+            return LCFIT_SUCCESS;
+        }
+    }
+
+    if (!moved) {
+        return LCFIT_ERROR;
+    }
+
+    *m = f->model;
+    return LCFIT_MAXITER;
+}
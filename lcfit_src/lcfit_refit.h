@@ -0,0 +1,102 @@
+/**
+ * \file lcfit_refit.h
+ * \brief Incremental refitting of the binary symmetric model.
+ *
+ * #estimate_ml_t adds a point or a few to its fit in every round and
+ * fits again, starting from a model that already matches the other
+ * points well. A refit keeps the weighted Jacobian of the fit at the
+ * current model, linearized once per point, together with its
+ * triangular factor \f$R\f$. A new point then costs one Givens update
+ * of \f$R\f$, a change of weights only a rescaling of the stored rows
+ * before they are refactored, and each Gauss-Newton step one
+ * evaluation of the model per point. None of them evaluate the
+ * log-likelihood function or allocate.
+ *
+ * When the optimum has \f$b < 0\f$, the fit holds \f$b\f$ at zero and
+ * fits the other three parameters, releasing it again once the
+ * gradient shows that increasing \f$b\f$ would improve the fit.
+ */
+
+#ifndef LCFIT_REFIT_H
+#define LCFIT_REFIT_H
+
+#include <stddef.h>
+
+#include "lcfit.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Incremental fitting state. */
+typedef struct lcfit_refit lcfit_refit_t;
+
+/** Allocate a refit for up to \c capacity points.
+ *
+ * \return The refit, or \c NULL if allocation failed.
+ */
+lcfit_refit_t* lcfit_refit_alloc(const size_t capacity);
+
+/** Free a refit. */
+void lcfit_refit_free(lcfit_refit_t* f);
+
+/** Replace the points of a refit and linearize it at a model.
+ *
+ * \param[in,out] f  Refit, with capacity for at least \c n points.
+ * \param[in]     m  Model to linearize at, usually a converged fit
+ *                   to the points.
+ * \param[in]     n  Number of points.
+ * \param[in]     t  Branch lengths.
+ * \param[in]     l  Log-likelihood at each \c t.
+ * \param[in]     w  Weight of each point.
+ *
+ * \return #LCFIT_SUCCESS, or #LCFIT_ERROR if the model is invalid or
+ *         not finite at some point; the refit is then empty.
+ */
+int lcfit_refit_reset(lcfit_refit_t* f, const bsm_t* m, const size_t n,
+                      const double* t, const double* l, const double* w);
+
+/** Add a point to a refit, updating the factorization in place.
+ *
+ * \return #LCFIT_SUCCESS, or #LCFIT_ERROR if the refit is full, empty
+ *         or the model is not finite at \c t.
+ */
+int lcfit_refit_add(lcfit_refit_t* f, const double t, const double l, const double w);
+
+/** Number of points in a refit. */
+size_t lcfit_refit_size(const lcfit_refit_t* f);
+
+/** Log-likelihoods of the points, in the order they were added. */
+const double* lcfit_refit_lnl(const lcfit_refit_t* f);
+
+/** Change the weights of the points.
+ *
+ * \param[in] w  Weight of each point, in the order they were added.
+ */
+void lcfit_refit_set_weights(lcfit_refit_t* f, const double* w);
+
+/** Take Gauss-Newton steps from the model of a refit.
+ *
+ * Each step solves the linearized problem with the current factor,
+ * halving the step until the weighted sum of squares decreases, and
+ * linearizes again at the new model. The fit has converged when a
+ * full step changes none of \f$c\f$, \f$m\f$ and \f$r\f$ by more than
+ * \f$10^{-4}\f$ of its value, as for #lcfit_fit_bsm_weight, nor
+ * \f$b\f$ by more than \f$10^{-4} (b + 1/r)\f$.
+ *
+ * \param[in,out] f          Refit.
+ * \param[in]     max_steps  Maximum number of steps.
+ * \param[out]    m          Fitted model, unchanged on #LCFIT_ERROR.
+ *
+ * \return #LCFIT_SUCCESS if the fit converged, #LCFIT_MAXITER if it
+ *         did not within \c max_steps, or #LCFIT_ERROR if no step
+ *         reduced the sum of squares or the linearized problem is
+ *         singular.
+ */
+int lcfit_refit_step(lcfit_refit_t* f, const size_t max_steps, bsm_t* m);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* LCFIT_REFIT_H */
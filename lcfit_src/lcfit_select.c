@@ -10,12 +10,8 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "lcfit2.h"
-
-const static size_t MAX_ITERS = 30;
-
-/** Default maximum number of points to evaluate in select_points */
-static const size_t DEFAULT_MAX_POINTS = 8;
+#include "lcfit_auto.h"
+#include "lcfit_priv.h"
 
 static void
 point_ll_minmax(const point_t points[], const size_t n,
@@ -36,16 +32,27 @@ point_ll_minmax(const point_t points[], const size_t n,
     }
 }
 
-#ifdef LCFIT_AUTO_VERBOSE
-static void print_points(FILE* fp, const point_t* points, const size_t n)
+/* Classify n points from the positions of their minimum and maximum
+ * log-likelihoods. */
+static curve_type_t
+classify_minmax(const size_t mini, const size_t maxi, const size_t n)
 {
-    char* sep = "";
-    for (size_t i = 0; i < n; ++i) {
-        fprintf(fp, "%s%g", sep, points[i].t);
-        sep = ", ";
+    assert(mini < n);
+    assert(maxi < n);
+
+    const size_t end = n - 1;
+
+    if(mini == 0 && maxi == end) {
+        return CRV_MONO_INC;
+    } else if(mini == end && maxi == 0) {
+        return CRV_MONO_DEC;
+    } else if(mini != 0 && mini != end && (maxi == 0 || maxi == end)) {
+        return CRV_ENC_MINIMA;
+    } else if (maxi != 0 && maxi != end && (mini == 0 || mini == end)) {
+        return CRV_ENC_MAXIMA;
     }
+    return CRV_UNKNOWN;
 }
-#endif /* LCFIT_AUTO_VERBOSE */
 
 curve_type_t
 classify_curve(const point_t points[], const size_t n)
@@ -63,21 +70,171 @@ classify_curve(const point_t points[], const size_t n)
 #endif
 
     point_ll_minmax(points, n, &mini, &maxi);
-    assert(mini < n);
-    assert(maxi < n);
 
-    const size_t end = n - 1;
+    return classify_minmax(mini, maxi, n);
+}
 
-    if(mini == 0 && maxi == end) {
-        return CRV_MONO_INC;
-    } else if(mini == end && maxi == 0) {
-        return CRV_MONO_DEC;
-    } else if(mini != 0 && mini != end && (maxi == 0 || maxi == end)) {
-        return CRV_ENC_MINIMA;
-    } else if (maxi != 0 && maxi != end && (mini == 0 || mini == end)) {
-        return CRV_ENC_MAXIMA;
+/*************/
+/* Point set */
+/*************/
+
+bool
+point_set_init(point_set_t* set, const size_t capacity)
+{
+    assert(capacity > 0);
+
+    set->buf = malloc(sizeof(point_t) * 2 * capacity);
+    set->capacity = capacity;
+    point_set_clear(set);
+
+    return set->buf != NULL;
+}
+
+void
+point_set_free(point_set_t* set)
+{
+    free(set->buf);
+    set->buf = NULL;
+    set->capacity = 0;
+    set->n = 0;
+}
+
+void
+point_set_clear(point_set_t* set)
+{
+    set->head = set->capacity;
+    set->n = 0;
+    set->min_i = 0;
+    set->max_i = 0;
+    set->n_inc = 0;
+    set->n_dec = 0;
+}
+
+const point_t*
+point_set_points(const point_set_t* set)
+{
+    return set->buf + set->head;
+}
+
+const point_t*
+point_set_max(const point_set_t* set)
+{
+    assert(set->n > 0);
+    return point_set_points(set) + set->max_i;
+}
+
+/* Add (or remove) the neighbor pair (a, b) to the pair counts. */
+static void
+point_set_count_pair(point_set_t* set, const point_t* a, const point_t* b,
+                     const bool add)
+{
+    size_t* count = NULL;
+
+    if (b->ll > a->ll) {
+        count = &set->n_inc;
+    } else if (b->ll < a->ll) {
+        count = &set->n_dec;
+    } else {
+        return;
     }
-    return CRV_UNKNOWN;
+
+    if (add) {
+        ++*count;
+    } else {
+        --*count;
+    }
+}
+
+bool
+point_set_insert(point_set_t* set, const point_t p)
+{
+    if (set->n == set->capacity) {
+        return false;
+    }
+
+    point_t* pts = set->buf + set->head;
+    const size_t n = set->n;
+
+    /* Find the insertion index k, after any points with equal t. The
+     * common cases of appending and prepending are checked first. */
+    size_t k;
+    if (n == 0 || p.t >= pts[n - 1].t) {
+        k = n;
+    } else if (p.t < pts[0].t) {
+        k = 0;
+    } else {
+        size_t lo = 0, hi = n - 1;
+        while (lo < hi) {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (pts[mid].t <= p.t) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        k = lo;
+    }
+
+    /* Update the neighbor pair counts. */
+    if (k > 0 && k < n) {
+        point_set_count_pair(set, &pts[k - 1], &pts[k], false);
+    }
+    if (k > 0) {
+        point_set_count_pair(set, &pts[k - 1], &p, true);
+    }
+    if (k < n) {
+        point_set_count_pair(set, &p, &pts[k], true);
+    }
+
+    /* Make room at index k by moving whichever side is shorter and
+     * has space; there is always space on at least one side. */
+    const size_t space_front = set->head;
+    const size_t space_back = 2 * set->capacity - set->head - n;
+
+    if (space_front > 0 && (k < n - k || space_back == 0)) {
+        memmove(pts - 1, pts, sizeof(point_t) * k);
+        --set->head;
+        --pts;
+    } else {
+        assert(space_back > 0);
+        memmove(pts + k + 1, pts + k, sizeof(point_t) * (n - k));
+    }
+    pts[k] = p;
+    ++set->n;
+
+    /* Update the extrema, preferring the lowest index on ties as
+     * classify_curve does. */
+    if (n == 0) {
+        set->min_i = 0;
+        set->max_i = 0;
+        return true;
+    }
+
+    if (set->min_i >= k) {
+        ++set->min_i;
+    }
+    if (set->max_i >= k) {
+        ++set->max_i;
+    }
+
+    const double min_ll = pts[set->min_i].ll;
+    const double max_ll = pts[set->max_i].ll;
+
+    if (p.ll < min_ll || (p.ll == min_ll && k < set->min_i)) {
+        set->min_i = k;
+    }
+    if (p.ll > max_ll || (p.ll == max_ll && k < set->max_i)) {
+        set->max_i = k;
+    }
+
+    return true;
+}
+
+curve_type_t
+point_set_classify(const point_set_t* set)
+{
+    assert(set->n > 0 && "No min/max of 0 points");
+    return classify_minmax(set->min_i, set->max_i, set->n);
 }
 
 double bound_point(const double proposed_t, const point_t* points,
@@ -105,53 +262,94 @@ double bound_point(const double proposed_t, const point_t* points,
     return next_t;
 }
 
-point_t*
-select_points(log_like_function_t *log_like, const point_t starting_pts[],
-              size_t *num_pts, const size_t max_pts, const double min_t,
-              const double max_t)
+/* Decide how select_points_set continues from the points in set.
+ * Returns 1 with the next branch length to evaluate in t, 0 if the
+ * points enclose a maximum or max_pts points have been evaluated, or
+ * -1 if the points enclose a minimum or cannot be classified. */
+int
+select_points_next(const point_set_t* set, const size_t max_pts,
+                   const double min_t, const double max_t, double* t)
 {
-    size_t n = *num_pts;
-    assert(n >= 3);
+    if (set->n >= max_pts) {
+        return 0;
+    }
 
-    point_t* points = malloc(sizeof(point_t) * max_pts);
+    curve_type_t curvature = point_set_classify(set);
 
-    /* Copy already-evaluated points */
-    memcpy(points, starting_pts, sizeof(point_t) * n);
+    if (curvature == CRV_ENC_MAXIMA) {
+        return 0;
+    } else if (curvature == CRV_ENC_MINIMA || curvature == CRV_UNKNOWN) {
+        return -1;
+    }
+
+    const point_t* points = point_set_points(set);
+    double proposed_t = 0.0;
+
+    if (curvature == CRV_MONO_INC) {
+        proposed_t = points[set->n - 1].t * 2.0;
+    } else { /* curvature == CRV_MONO_DEC */
+        proposed_t = points[0].t / 10.0;
+    }
+
+    *t = bound_point(proposed_t, points, set->n, min_t, max_t);
+    return 1;
+}
+
+/* Add points to set until they enclose a maximum or max_pts points
+ * have been evaluated. Returns false if the points enclose a minimum
+ * or cannot be classified. */
+static bool
+select_points_set(log_like_function_t *log_like, point_set_t* set,
+                  const size_t max_pts, const double min_t,
+                  const double max_t)
+{
+    assert(set->capacity >= max_pts);
 
     /* Add additional samples until the evaluated branch lengths enclose a
      * maximum or the maximum number of points is reached. */
-    for (; n < max_pts; ++n) {
-        curve_type_t curvature = classify_curve(points, n);
-
-        if (curvature == CRV_ENC_MAXIMA) {
-            break;
-        } else if (curvature == CRV_ENC_MINIMA || curvature == CRV_UNKNOWN) {
-            free(points);
-            return NULL;
-        }
+    point_t next;
+    int status;
 
-        double proposed_t = 0.0;
+    while ((status = select_points_next(set, max_pts, min_t, max_t, &next.t)) > 0) {
+        next.ll = log_like->fn(next.t, log_like->args);
+        point_set_insert(set, next);
+    }
 
-        if (curvature == CRV_MONO_INC) {
-            proposed_t = points[n - 1].t * 2.0;
-        } else { /* curvature == CRV_MONO_DEC */
-            proposed_t = points[0].t / 10.0;
-        }
+    return status == 0;
+}
 
-        double next_t = bound_point(proposed_t, points, n, min_t, max_t);
+point_t*
+select_points(log_like_function_t *log_like, const point_t starting_pts[],
+              size_t *num_pts, const size_t max_pts, const double min_t,
+              const double max_t)
+{
+    size_t n = *num_pts;
+    assert(n >= 3);
+
+    point_set_t set;
+    if (!point_set_init(&set, n > max_pts ? n : max_pts)) {
+        return NULL;
+    }
 
-        points[n].t = next_t;
-        points[n].ll = log_like->fn(next_t, log_like->args);
+    /* Copy already-evaluated points */
+    for (size_t i = 0; i < n; ++i) {
+        point_set_insert(&set, starting_pts[i]);
+    }
 
-        sort_by_t(points, n + 1);
+    if (!select_points_set(log_like, &set, max_pts, min_t, max_t)) {
+        point_set_free(&set);
+        return NULL;
     }
 
+    n = set.n;
     *num_pts = n;
 
-    if (n < max_pts) {
-        return realloc(points, sizeof(point_t) * n);
+    point_t* points = malloc(sizeof(point_t) * n);
+    if (points != NULL) {
+        memcpy(points, point_set_points(&set), sizeof(point_t) * n);
     }
 
+    point_set_free(&set);
     return points;
 }
 
@@ -191,22 +389,6 @@ sort_by_t(point_t points[], const size_t n)
 /* ML estimation */
 /*****************/
 
-static inline const point_t*
-max_point(const point_t p[], const size_t n)
-{
-    assert(n > 0);
-    const point_t* m = p++;
-    size_t i;
-
-    for(i = 1; i < n; ++i) {
-        if(p->ll > m->ll) {
-            m = p;
-        }
-        ++p;
-    }
-    return m;
-}
-
 static inline size_t
 point_max_index(const point_t p[], const size_t n)
 {
@@ -261,31 +443,6 @@ subset_points(point_t p[], const size_t n, const size_t k)
     sort_by_t(p, k);
 }
 
-/* Fill points by evaluating log_like for each value in ts */
-static inline void
-evaluate_ll(log_like_function_t *log_like, const double *ts,
-            const size_t n_pts, point_t *points)
-{
-    point_t *p = points;
-    size_t i;
-    for(i = 0; i < n_pts; ++i, ++p) {
-        p->t = *ts++;
-        p->ll = log_like->fn(p->t, log_like->args);
-    }
-}
-
-/** Copy an array of points into preallocated vectors for the x and y values */
-static inline void
-blit_points_to_arrays(const point_t points[], const size_t n,
-                      double *t, double *l)
-{
-    size_t i;
-    for(i = 0; i < n; i++, points++) {
-        *t++ = points->t;
-        *l++ = points->ll;
-    }
-}
-
 double rel_err(double expected, double actual)
 {
     return fabs((expected - actual) / expected);
@@ -296,164 +453,45 @@ estimate_ml_t(log_like_function_t *log_like, const double* t,
               size_t n_pts, const double tolerance, bsm_t* model,
               bool* success, const double min_t, const double max_t)
 {
-    *success = false;
-
-    point_t *starting_pts = malloc(sizeof(point_t) * n_pts);
-    evaluate_ll(log_like, t, n_pts, starting_pts);
-
-    const size_t orig_n_pts = n_pts;
-    point_t* points = select_points(log_like, starting_pts, &n_pts,
-                                    DEFAULT_MAX_POINTS, min_t, max_t);
-    free(starting_pts);
-
-    if (points == NULL) {
-        fprintf(stderr, "ERROR: select_points returned NULL\n");
-        *success = false;
-        return NAN;
-    }
-
-    curve_type_t curvature = classify_curve(points, n_pts);
+    return estimate_ml_t_ex(log_like, t, n_pts, tolerance, model, success,
+                            min_t, max_t, NULL, NULL);
+}
 
-    if (!(curvature == CRV_ENC_MAXIMA || curvature == CRV_MONO_DEC)) {
-        fprintf(stderr, "ERROR: "
-                "points don't enclose a maximum and aren't decreasing\n");
+double
+estimate_ml_t_ex(log_like_function_t *log_like, const double* t,
+                 size_t n_pts, const double tolerance, bsm_t* model,
+                 bool* success, const double min_t, const double max_t,
+                 const estimate_ml_t_options_t* options,
+                 estimate_ml_t_stats_t* stats)
+{
+    *success = false;
 
-        free(points);
-        *success = false;
+    const lcfit_executor_t* executor = options ? options->executor : NULL;
+    const size_t width = options ? options->speculative_width : 1;
+    const bool initial_guess = options ? options->initial_guess : false;
+    const lcfit_run_options_t run_options = {executor, options ? options->cancel : NULL};
+
+    lcfit_auto_state_t* s = lcfit_auto_begin_ml_t(t, n_pts, tolerance, model,
+                                                  min_t, max_t, width, initial_guess);
+    if (s == NULL) {
+        if (stats != NULL) {
+            stats->rounds = 0;
+            stats->n_evals = 0;
+            stats->full_fits = 0;
+            stats->status = LCFIT_ERROR;
+        }
         return NAN;
     }
 
-    /* From here on, curvature is CRV_ENC_MAXIMA or CRV_MONO_DEC, and
-     * thus ml_t is zero or positive (but not infinite). */
+    const int status = lcfit_auto_run_opt(s, log_like->fn, log_like->args, &run_options);
+    const double ml_t = lcfit_auto_result(s, model);
 
-    assert(n_pts >= orig_n_pts);
-    if (n_pts > orig_n_pts) {
-        /* Subset to top orig_n_pts */
-        subset_points(points, n_pts, orig_n_pts);
-        n_pts = orig_n_pts;
+    *success = status == LCFIT_SUCCESS;
+    if (stats != NULL) {
+        lcfit_auto_ml_t_stats(s, stats);
     }
 
-    assert(points[0].t >= min_t);
-    assert(points[n_pts - 1].t <= max_t);
-
-#ifdef LCFIT_AUTO_VERBOSE
-    fprintf(stderr, "starting iterative fit\n");
-
-    fprintf(stderr, "starting points: ");
-    print_points(stderr, points, n_pts);
-    fprintf(stderr, "\n");
-#endif /* LCFIT_AUTO_VERBOSE */
-
-    /* Allocate an extra point for scratch */
-    points = realloc(points, sizeof(point_t) * (n_pts + 1));
-
-    size_t iter = 0;
-    const point_t* max_pt = NULL;
-    double ml_t = 0.0;
-    double prev_t = 0.0;
-
-    for (iter = 0; iter < MAX_ITERS; iter++) {
-        max_pt = max_point(points, n_pts);
-
-        /* Re-fit */
-        lcfit_bsm_rescale(max_pt->t, max_pt->ll, model);
-
-        double* tbuf = malloc(sizeof(double) * n_pts);
-        double* lbuf = malloc(sizeof(double) * n_pts);
-
-        blit_points_to_arrays(points, n_pts, tbuf, lbuf);
-
-        double* wbuf = malloc(sizeof(double) * n_pts);
-        double alpha = (double) iter / (MAX_ITERS - 1);
-
-        for (size_t i = 0; i < n_pts; ++i) {
-            wbuf[i] = exp(alpha * (lbuf[i] - max_pt->ll));
-        }
-
-#ifdef LCFIT_AUTO_VERBOSE
-        fprintf(stderr, "weights: ");
-        for (size_t i = 0; i < n_pts; ++i) {
-            fprintf(stderr, "%g ", wbuf[i]);
-        }
-        fprintf(stderr, "\n");
-#endif /* LCFIT_AUTO_VERBOSE */
-
-        lcfit_fit_bsm_weight(n_pts, tbuf, lbuf, wbuf, model, 250);
-
-        free(tbuf);
-        free(lbuf);
-        free(wbuf);
-
-        ml_t = lcfit_bsm_ml_t(model);
-
-        if (isnan(ml_t)) {
-            fprintf(stderr, "ERROR: "
-                    "lcfit_bsm_ml_t returned NaN"
-                    ", model = { %.3f, %.3f, %.6f, %.6f }\n",
-                    model->c, model->m, model->r, model->b);
-            *success = false;
-            break;
-        }
-
-        if (curvature == CRV_ENC_MAXIMA) {
-            /* Stop if the modeled maximum likelihood branch length is
-             * within tolerance of the empirical maximum. */
-            if (rel_err(max_pt->t, ml_t) <= tolerance) {
-                *success = true;
-                break;
-            }
-        }
-
-        double next_t = bound_point(ml_t, points, n_pts, min_t, max_t);
-
-        /* Stop if the next sample point is within tolerance of the
-         * previous sample point. */
-        if (rel_err(prev_t, next_t) <= tolerance) {
-            *success = true;
-            break;
-        }
-
-        points[n_pts].t = next_t;
-        points[n_pts].ll = log_like->fn(next_t, log_like->args);
-
-        prev_t = next_t;
-
-        sort_by_t(points, n_pts + 1);
-        curvature = classify_curve(points, n_pts + 1);
-
-        if (!(curvature == CRV_ENC_MAXIMA || curvature == CRV_MONO_DEC)) {
-            fprintf(stderr, "ERROR: "
-                    "after iteration points don't enclose a maximum "
-                    "and aren't decreasing\n");
-            *success = false;
-            break;
-        }
-
-        ++n_pts;
-        points = realloc(points, sizeof(point_t) * (n_pts + 1));
-
-#ifdef LCFIT_AUTO_VERBOSE
-        fprintf(stderr, "current points: ");
-        print_points(stderr, points, n_pts);
-        fprintf(stderr, "\n");
-#endif /* LCFIT_AUTO_VERBOSE */
-    }
-
-    if (iter == MAX_ITERS) {
-        fprintf(stderr, "WARNING: maximum number of iterations reached\n");
-    }
-
-    free(points);
-
-#ifdef LCFIT_AUTO_VERBOSE
-    fprintf(stderr, "ending iterative fit after %zu iteration(s)\n", iter);
-#endif /* LCFIT_AUTO_VERBOSE */
-
-    if (ml_t < min_t) {
-        ml_t = min_t;
-    } else if (ml_t > max_t) {
-        ml_t = max_t;
-    }
+    lcfit_auto_free(s);
 
     return ml_t;
 }
@@ -461,31 +499,38 @@ estimate_ml_t(log_like_function_t *log_like, const double* t,
 double lcfit_fit_auto(double (*lnl_fn)(double, void*), void* lnl_fn_args,
                       bsm_t* model, const double min_t, const double max_t)
 {
-    double d1;
-    double d2;
-    double t0 = lcfit_maximize(lnl_fn, lnl_fn_args, min_t, max_t, &d1, &d2);
+    return lcfit_fit_auto_ex(lnl_fn, lnl_fn_args, model, min_t, max_t, NULL);
+}
 
-#ifdef LCFIT_AUTO_VERBOSE
-    fprintf(stderr, "lmax_t0 = %g, lmax_d1(lmax_t0) = %g, lmax_d2(lmax_t0) = %g\n",
-            t0, d1, d2);
-#endif /* LCFIT_AUTO_VERBOSE */
+double lcfit_fit_auto_ex(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                         bsm_t* model, const double min_t, const double max_t,
+                         const lcfit_executor_t* executor)
+{
+    const lcfit_run_options_t options = {executor, NULL};
 
-    if (fabs(d1) < 0.1 && d2 < -0.1) {  // t0 is a local maximum
-        lcfit2_bsm_t lcfit2_model = {model->c, model->m, t0, d1, d2};
-        const double alpha = 0.0;
+    return lcfit_fit_auto_opt(lnl_fn, lnl_fn_args, model, min_t, max_t, &options, NULL);
+}
 
-        lcfit2_fit_auto(lnl_fn, lnl_fn_args, &lcfit2_model, min_t, max_t, alpha);
-        lcfit2_to_lcfit4(&lcfit2_model, model);
-    } else {
-        // HACK: basically copied from AdHocIntegrator.cpp
+double lcfit_fit_auto_opt(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                          bsm_t* model, const double min_t, const double max_t,
+                          const lcfit_run_options_t* options, int* status)
+{
+    if (status != NULL) {
+        *status = LCFIT_ERROR;
+    }
 
-        log_like_function_t lnl_fn_wrapper = {lnl_fn, lnl_fn_args};
-        double t[4] = {0.1, 0.5, 1.0, max_t};
-        const double tolerance = 1e-3;
-        bool success = false;
+    lcfit_auto_state_t* s = lcfit_auto_begin(model, min_t, max_t);
+    if (s == NULL) {
+        return NAN;
+    }
 
-        t0 = estimate_ml_t(&lnl_fn_wrapper, t, 4, tolerance, model, &success, min_t, max_t);
+    const int run_status = lcfit_auto_run_opt(s, lnl_fn, lnl_fn_args, options);
+    if (status != NULL) {
+        *status = run_status;
     }
+    const double t0 = lcfit_auto_result(s, model);
+
+    lcfit_auto_free(s);
 
     return t0;
 }
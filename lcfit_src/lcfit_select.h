@@ -55,6 +55,73 @@ typedef enum {
 curve_type_t
 classify_curve(const point_t[], const size_t);
 
+/**
+ * A set of #point_t kept ordered by increasing branch length.
+ *
+ * Points are stored contiguously in a buffer with free space on both
+ * sides, so adding a point before the first or after the last point
+ * takes constant time; other insertions move the shorter side. The
+ * positions of the minimum and maximum log-likelihood and the number
+ * of increasing and decreasing neighbor pairs are updated on
+ * insertion, so the set can be classified without rescanning it.
+ *
+ * Treat the members as read-only and use the \c point_set_ functions
+ * to modify the set.
+ */
+typedef struct
+{
+    /** Storage for <tt>2 * capacity</tt> points. */
+    point_t* buf;
+    /** Maximum number of points. */
+    size_t capacity;
+    /** Offset of the first point in \c buf. */
+    size_t head;
+    /** Number of points. */
+    size_t n;
+    /** Index of the (first) point with the minimum log-likelihood. */
+    size_t min_i;
+    /** Index of the (first) point with the maximum log-likelihood. */
+    size_t max_i;
+    /** Number of neighbor pairs with increasing log-likelihood. */
+    size_t n_inc;
+    /** Number of neighbor pairs with decreasing log-likelihood. */
+    size_t n_dec;
+} point_set_t;
+
+/** Initialize an empty set with room for \c capacity points.
+ *
+ * \return \c false if memory could not be allocated.
+ */
+bool
+point_set_init(point_set_t* set, const size_t capacity);
+
+/** Release the storage owned by a set. */
+void
+point_set_free(point_set_t* set);
+
+/** Remove all points from a set, keeping its storage. */
+void
+point_set_clear(point_set_t* set);
+
+/** Insert a point, keeping the set ordered by branch length.
+ *
+ * \return \c false if the set is full.
+ */
+bool
+point_set_insert(point_set_t* set, const point_t p);
+
+/** The points in a set, ordered by increasing branch length. */
+const point_t*
+point_set_points(const point_set_t* set);
+
+/** The point with the maximum log-likelihood in a non-empty set. */
+const point_t*
+point_set_max(const point_set_t* set);
+
+/** Classify a non-empty set as #classify_curve would classify its points. */
+curve_type_t
+point_set_classify(const point_set_t* set);
+
 /**
  * Select points to use in fitting the BSM for a given log-likelihood function.
  *
@@ -103,7 +170,10 @@ sort_by_like(point_t points[], const size_t n);
  * to update a best guess for the empirical ML branch length. This
  * procedure repeats until the model's computed ML branch length is
  * within the specified tolerance of the estimated empirical ML branch
- * length.
+ * length. After the first fit, each iteration starts from the previous
+ * model and takes a few Gauss-Newton steps with the factorization kept
+ * in an #lcfit_refit_t, fitting from scratch only when they do not
+ * converge.
  *
  * This function is intended to offer an alternative to more general
  * function value optimization procedures, such as Brent's method, in
@@ -136,6 +206,65 @@ estimate_ml_t(log_like_function_t *log_like, const double* t,
               size_t n_pts, const double tolerance, bsm_t* model,
               bool* success, const double min_t, const double max_t);
 
+/** Options for #estimate_ml_t_ex. */
+typedef struct
+{
+    /** Executor for concurrent evaluations, or \c NULL to evaluate sequentially. */
+    const lcfit_executor_t* executor;
+    /** Number of branch lengths to evaluate in each refinement round.
+     *  One (or zero) evaluates only the model's ML branch length, as
+     *  #estimate_ml_t does; larger values add speculative points on
+     *  either side of it. */
+    size_t speculative_width;
+    /** Start the first fit from #lcfit_bsm_initial_guess instead of
+     *  \c model rescaled to the best point, falling back to the latter
+     *  when no guess can be made. */
+    bool initial_guess;
+    /** Cancellation token, or \c NULL. A cancelled estimate returns
+     *  the ML branch length of the last model fitted, as described
+     *  for #lcfit_auto_cancel. */
+    const lcfit_cancel_t* cancel;
+} estimate_ml_t_options_t;
+
+/** Statistics reported by #estimate_ml_t_ex. */
+typedef struct
+{
+    /** Number of rounds of evaluation, where each round's
+     *  evaluations may run concurrently. */
+    size_t rounds;
+    /** Total number of log-likelihood evaluations. */
+    size_t n_evals;
+    /** Number of rounds that fit the model from scratch with
+     *  #lcfit_fit_bsm_weight; the others refit the previous round's
+     *  model incrementally, as in lcfit_refit.h. */
+    size_t full_fits;
+    /** #LCFIT_SUCCESS, #LCFIT_ERROR, or #LCFIT_CANCELLED if the
+     *  estimate was stopped by its cancellation token. */
+    int status;
+} estimate_ml_t_stats_t;
+
+/**
+ * As #estimate_ml_t, with concurrent and speculative evaluation.
+ *
+ * The starting points are evaluated as one batch. With a speculative
+ * width \c w greater than one, each refinement round evaluates the
+ * model's predicted ML branch length together with up to \c w - 1
+ * points alternately below and above it, spaced by half the previous
+ * step but no less than \c tolerance relative to the prediction. All
+ * of them are added to the fit, so the iteration usually converges in
+ * fewer rounds, at the cost of more evaluations. With an executor,
+ * each round costs about one evaluation of latency.
+ *
+ * \param[in]  options  Options, or \c NULL for the behavior of #estimate_ml_t.
+ * \param[out] stats    Statistics, or \c NULL.
+ */
+double
+estimate_ml_t_ex(log_like_function_t *log_like, const double* t,
+                 size_t n_pts, const double tolerance, bsm_t* model,
+                 bool* success, const double min_t, const double max_t,
+                 const estimate_ml_t_options_t* options,
+                 estimate_ml_t_stats_t* stats);
+
 /**
  * Choose the top \c k points by log-likelihood while maintaining monotonicity.
  *
@@ -176,6 +305,35 @@ subset_points(point_t p[], const size_t n, const size_t k);
 double lcfit_fit_auto(double (*lnl_fn)(double, void*), void* lnl_fn_args,
                       bsm_t* model, const double min_t, const double max_t);
 
+/**
+ * As #lcfit_fit_auto, but with independent likelihood evaluations
+ * issued through an executor so that they can run concurrently.
+ *
+ * This reaches the same result as #lcfit_fit_auto with fewer rounds
+ * of evaluation: the bracketing triple, the derivative stencil, each
+ * lcfit2 pass, and the starting points of #estimate_ml_t are each
+ * one batch. See #lcfit_executor_t.
+ *
+ * \param[in] executor  Executor to evaluate with, or \c NULL.
+ */
+double lcfit_fit_auto_ex(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                         bsm_t* model, const double min_t, const double max_t,
+                         const lcfit_executor_t* executor);
+
+/**
+ * As #lcfit_fit_auto, with an executor and a cancellation token.
+ *
+ * A cancelled fit returns the best estimate it has so far, as
+ * described for #lcfit_auto_cancel, and leaves in \c model the last
+ * model it fitted, or the initial model if it fitted none.
+ *
+ * \param[in]  options  Options, or \c NULL for the behavior of #lcfit_fit_auto.
+ * \param[out] status   #LCFIT_SUCCESS, #LCFIT_ERROR or #LCFIT_CANCELLED, or \c NULL.
+ */
+double lcfit_fit_auto_opt(double (*lnl_fn)(double, void*), void* lnl_fn_args,
+                          bsm_t* model, const double min_t, const double max_t,
+                          const lcfit_run_options_t* options, int* status);
+
 #ifdef LCFIT_DEBUG
 void
 lcfit_select_initialize(void);
@@ -0,0 +1,214 @@
+/**
+ * \file lcfit_store.c
+ * \brief On-disk model store implementation.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "lcfit_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char STORE_MAGIC[8] = {'L', 'C', 'F', 'I', 'T', 'M', 'D', 'L'};
+static const uint32_t STORE_BYTE_ORDER = 0x01020304;
+
+struct lcfit_store {
+    void* map;
+    size_t map_size;
+    const lcfit_store_record* records;
+    size_t n_records;
+    const uint64_t* index;
+    uint64_t index_mask;
+};
+
+/* splitmix64 finalizer; branch keys are often small or sequential,
+ * so they need mixing before masking. */
+static uint64_t hash_key(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/* Smallest power of two holding n keys at a load factor of at most 1/2. */
+static uint64_t index_slots_for(const size_t n)
+{
+    uint64_t slots = 2;
+    while (slots < 2 * (uint64_t) n) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+static int build_index(const lcfit_store_record* records, const size_t n,
+                       uint64_t* index, const uint64_t slots)
+{
+    const uint64_t mask = slots - 1;
+
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t s = hash_key(records[i].key) & mask;
+        while (index[s] != 0) {
+            if (records[index[s] - 1].key == records[i].key) {
+                return LCFIT_ERROR;
+            }
+            s = (s + 1) & mask;
+        }
+        index[s] = i + 1;
+    }
+
+    return LCFIT_SUCCESS;
+}
+
+int lcfit_store_write(const char* path, const lcfit_store_record* records,
+                      const size_t n, const bool build_index_flag)
+{
+    lcfit_store_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    header.version = LCFIT_STORE_VERSION;
+    header.byte_order = STORE_BYTE_ORDER;
+    header.record_size = sizeof(lcfit_store_record);
+    header.n_records = n;
+    header.records_offset = sizeof(lcfit_store_header);
+    header.index_slots = build_index_flag ? index_slots_for(n) : 0;
+    header.index_offset = header.records_offset + n * sizeof(lcfit_store_record);
+
+    uint64_t* index = NULL;
+    if (build_index_flag) {
+        index = calloc(header.index_slots, sizeof(uint64_t));
+        if (index == NULL) {
+            return LCFIT_ERROR;
+        }
+        if (build_index(records, n, index, header.index_slots) != LCFIT_SUCCESS) {
+            free(index);
+            return LCFIT_ERROR;
+        }
+    }
+
+    int status = LCFIT_ERROR;
+    FILE* fp = fopen(path, "wb");
+    if (fp != NULL) {
+        if (fwrite(&header, sizeof(header), 1, fp) == 1 &&
+            fwrite(records, sizeof(lcfit_store_record), n, fp) == n &&
+            (index == NULL ||
+             fwrite(index, sizeof(uint64_t), header.index_slots, fp) == header.index_slots)) {
+            status = LCFIT_SUCCESS;
+        }
+        if (fclose(fp) != 0) {
+            status = LCFIT_ERROR;
+        }
+    }
+
+    free(index);
+    return status;
+}
+
+lcfit_store* lcfit_store_open(const char* path)
+{
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(lcfit_store_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    const size_t size = st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const lcfit_store_header* h = map;
+    const uint64_t records_end = h->records_offset + h->n_records * sizeof(lcfit_store_record);
+    const bool valid =
+            memcmp(h->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0 &&
+            h->version == LCFIT_STORE_VERSION &&
+            h->byte_order == STORE_BYTE_ORDER &&
+            h->record_size == sizeof(lcfit_store_record) &&
+            h->records_offset % 8 == 0 &&
+            h->records_offset <= size &&
+            h->n_records <= size / sizeof(lcfit_store_record) &&
+            records_end <= size &&
+            (h->index_slots == 0 ||
+             ((h->index_slots & (h->index_slots - 1)) == 0 &&
+              h->index_offset % 8 == 0 &&
+              h->index_offset <= size &&
+              h->index_slots <= (size - h->index_offset) / sizeof(uint64_t)));
+
+    lcfit_store* store = valid ? malloc(sizeof(lcfit_store)) : NULL;
+    if (store == NULL) {
+        munmap(map, size);
+        return NULL;
+    }
+
+    const char* base = map;
+    store->map = map;
+    store->map_size = size;
+    store->records = (const lcfit_store_record*) (base + h->records_offset);
+    store->n_records = h->n_records;
+    store->index = h->index_slots ? (const uint64_t*) (base + h->index_offset) : NULL;
+    store->index_mask = h->index_slots ? h->index_slots - 1 : 0;
+
+    return store;
+}
+
+void lcfit_store_close(lcfit_store* store)
+{
+    if (store == NULL) {
+        return;
+    }
+
+    munmap(store->map, store->map_size);
+    free(store);
+}
+
+size_t lcfit_store_size(const lcfit_store* store)
+{
+    return store->n_records;
+}
+
+const lcfit_store_record* lcfit_store_records(const lcfit_store* store)
+{
+    return store->records;
+}
+
+const lcfit_store_record* lcfit_store_lookup(const lcfit_store* store, const uint64_t key)
+{
+    if (store->index == NULL) {
+        for (size_t i = 0; i < store->n_records; ++i) {
+            if (store->records[i].key == key) {
+                return &store->records[i];
+            }
+        }
+        return NULL;
+    }
+
+    /* The load factor is at most 1/2, so a well-formed index always has
+     * an empty slot; the probe count is bounded anyway in case the file
+     * is damaged. */
+    uint64_t s = hash_key(key) & store->index_mask;
+    for (uint64_t probes = 0; probes <= store->index_mask && store->index[s] != 0; ++probes) {
+        const uint64_t i = store->index[s] - 1;
+        if (i < store->n_records && store->records[i].key == key) {
+            return &store->records[i];
+        }
+        s = (s + 1) & store->index_mask;
+    }
+
+    return NULL;
+}
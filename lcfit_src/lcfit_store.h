@@ -0,0 +1,120 @@
+/**
+ * \file lcfit_store.h
+ * \brief On-disk table of fitted models.
+ *
+ * A model store is a file holding an array of fitted models, one
+ * #lcfit_store_record per branch, and optionally a hash index from a
+ * 64-bit branch key to the record. Stores are memory-mapped read-only
+ * by #lcfit_store_open, so any number of processes can share one
+ * without parsing it, and lookups take constant time.
+ *
+ * The file consists of a 64-byte #lcfit_store_header, the records,
+ * and then the index (if any). The index is an open-addressing hash
+ * table of \c index_slots 64-bit entries, where \c index_slots is a
+ * power of two; a nonzero entry \c i refers to record \c i-1. Values
+ * are stored in the byte order of the host that wrote the file, and
+ * #lcfit_store_open rejects files written with the other byte order.
+ */
+
+#ifndef LCFIT_STORE_H
+#define LCFIT_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lcfit.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Current model store format version. */
+#define LCFIT_STORE_VERSION 1
+
+/** Model store file header. */
+typedef struct {
+    /** Magic bytes <tt>LCFITMDL</tt>. */
+    char magic[8];
+    /** Format version, #LCFIT_STORE_VERSION. */
+    uint32_t version;
+    /** Byte order mark, \c 0x01020304 in host byte order. */
+    uint32_t byte_order;
+    /** Size of each record in bytes. */
+    uint32_t record_size;
+    /** Reserved; zero. */
+    uint32_t reserved[3];
+    /** Number of records. */
+    uint64_t n_records;
+    /** Offset of the first record from the start of the file. */
+    uint64_t records_offset;
+    /** Number of index slots, or zero if there is no index. */
+    uint64_t index_slots;
+    /** Offset of the index from the start of the file. */
+    uint64_t index_offset;
+} lcfit_store_header;
+
+/** A fitted model and its metadata; 64 bytes. */
+typedef struct {
+    /** Fitted model parameters. */
+    bsm_t model;
+    /** Caller-defined branch or split key. */
+    uint64_t key;
+    /** Maximum-likelihood branch length under the model. */
+    double ml_t;
+    /** #lcfit_status returned by the fit. */
+    int32_t status;
+    /** Number of likelihood evaluations used by the fit. */
+    uint32_t n_evals;
+    /** Caller-defined flags. */
+    uint32_t flags;
+    /** Reserved; zero. */
+    uint32_t reserved;
+} lcfit_store_record;
+
+/** A memory-mapped model store. */
+typedef struct lcfit_store lcfit_store;
+
+/** Write a model store.
+ *
+ * \param[in] path         Output file path.
+ * \param[in] records      Records to store, in the order they should appear.
+ * \param[in] n            Number of records.
+ * \param[in] build_index  Whether to build a hash index on #lcfit_store_record.key.
+ *
+ * \return #LCFIT_SUCCESS, or #LCFIT_ERROR if the file could not be
+ *         written or \c build_index is set and two records share a key.
+ */
+int lcfit_store_write(const char* path, const lcfit_store_record* records,
+                      const size_t n, const bool build_index);
+
+/** Map a model store for reading.
+ *
+ * \return The store, or \c NULL if the file could not be mapped or is
+ *         not a valid model store.
+ */
+lcfit_store* lcfit_store_open(const char* path);
+
+/** Unmap a model store. */
+void lcfit_store_close(lcfit_store* store);
+
+/** Number of records in a model store. */
+size_t lcfit_store_size(const lcfit_store* store);
+
+/** The records in a model store, in the order they were written. */
+const lcfit_store_record* lcfit_store_records(const lcfit_store* store);
+
+/** Find the record with the given key.
+ *
+ * This takes constant time if the store has an index, and falls back
+ * to a linear scan otherwise.
+ *
+ * \return The record, or \c NULL if there is none.
+ */
+const lcfit_store_record* lcfit_store_lookup(const lcfit_store* store, const uint64_t key);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* LCFIT_STORE_H */
@@ -0,0 +1,75 @@
+/**
+ * \file lcfit_trace.h
+ * \brief Static probe points for tracing lcfit in running processes.
+ *
+ * When \c LCFIT_USDT is defined (see the CMake option of the same
+ * name), each \c LCFIT_TRACEn macro places a USDT probe of the
+ * \c lcfit provider, in the style of <tt>sys/sdt.h</tt>. A probe
+ * compiles to a single \c nop plus an ELF note describing where its
+ * arguments are, so it costs nothing until a tracer such as \c perf
+ * or \c bpftrace attaches to it. Otherwise the macros evaluate their
+ * arguments and discard them, so variables computed only for a probe
+ * do not draw unused warnings. Arguments should be values the code
+ * has at hand anyway, without side effects.
+ *
+ * The probes and their arguments are:
+ *
+ * | Probe           | Arguments                                     |
+ * |-----------------|-----------------------------------------------|
+ * | fit_start       | number of points                              |
+ * | fit_done        | status, reduced (0/1), fell back to SLSQP (0/1) |
+ * | lm_iter         | parameters fitted (3 or 4), iteration         |
+ * | nlopt_fallback  | number of points, status of the LM fit        |
+ * | slsqp_iter      | iteration                                     |
+ * | eval_start      | branch length                                 |
+ * | eval_done       | branch length, log-likelihood                 |
+ * | batch_start     | number of branch lengths submitted            |
+ * | batch_done      | number of branch lengths evaluated            |
+ * | auto_begin      | state, goal name                              |
+ * | auto_stage      | state, name of stage left, name of stage entered |
+ * | auto_done       | state, goal name, status, evaluations         |
+ * | brent_iter      | state, iteration                              |
+ * | ml_t_round      | state, round, number of points, full fit (0/1) |
+ * | lcfit2_fit      | state, pass, NLopt status                     |
+ * | sample_accept   | branch length                                 |
+ * | sample_reject   | branch length                                 |
+ * | sample_block    | candidates accepted, candidates drawn         |
+ *
+ * \c fit_* are single fits of the four-parameter model, \c eval_*
+ * and \c batch_* evaluations of a caller's log-likelihood function
+ * without and with an executor, and \c auto_* fits run through
+ * lcfit_auto.h, which the blocking automatic fits also use; a state's
+ * address identifies its fit. Branch lengths and log-likelihoods are
+ * \c double. The scripts in \c trace/ use these probes.
+ */
+
+#ifndef LCFIT_TRACE_H
+#define LCFIT_TRACE_H
+
+#ifdef LCFIT_USDT
+
+#include <sys/sdt.h>
+
+#define LCFIT_TRACE1(name, a1) \
+    DTRACE_PROBE1(lcfit, name, a1)
+#define LCFIT_TRACE2(name, a1, a2) \
+    DTRACE_PROBE2(lcfit, name, a1, a2)
+#define LCFIT_TRACE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(lcfit, name, a1, a2, a3)
+#define LCFIT_TRACE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(lcfit, name, a1, a2, a3, a4)
+
+#else
+
+#define LCFIT_TRACE1(name, a1) \
+    ((void) (a1))
+#define LCFIT_TRACE2(name, a1, a2) \
+    ((void) (a1), (void) (a2))
+#define LCFIT_TRACE3(name, a1, a2, a3) \
+    ((void) (a1), (void) (a2), (void) (a3))
+#define LCFIT_TRACE4(name, a1, a2, a3, a4) \
+    ((void) (a1), (void) (a2), (void) (a3), (void) (a4))
+
+#endif /* LCFIT_USDT */
+
+#endif /* LCFIT_TRACE_H */
@@ -0,0 +1,38 @@
+/**
+ * \file lcfit_weights.c
+ * \brief Weights for fitting sampled log-likelihoods.
+ */
+
+#include "lcfit_weights.h"
+
+#include <math.h>
+
+#include "lcfit_dispatch.h"
+
+double lcfit_compute_weights(const lcfit_weight_scheme scheme, const size_t n,
+                             const double* lnl, const double alpha, double* w)
+{
+    if (scheme == LCFIT_WEIGHTS_UNIFORM) {
+        for (size_t i = 0; i < n; ++i) {
+            w[i] = 1.0;
+        }
+
+        return -HUGE_VAL;
+    }
+
+    double max_lnl = -HUGE_VAL;
+    for (size_t i = 0; i < n; ++i) {
+        max_lnl = lnl[i] > max_lnl ? lnl[i] : max_lnl;
+    }
+
+    const double sum = lcfit_scaled_exp_n(n, lnl, alpha, max_lnl, w);
+
+    if (scheme == LCFIT_WEIGHTS_SOFTMAX) {
+        const double scale = 1.0 / sum;
+        for (size_t i = 0; i < n; ++i) {
+            w[i] *= scale;
+        }
+    }
+
+    return max_lnl;
+}
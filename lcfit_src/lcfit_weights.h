@@ -0,0 +1,53 @@
+/**
+ * \file lcfit_weights.h
+ * \brief Weights for fitting sampled log-likelihoods.
+ *
+ * The weighted fits in lcfit and lcfit2 weight each sampled point by
+ * some function of its log-likelihood, so that points near the
+ * maximum dominate. This file computes those weights for all the
+ * schemes in use, in place in caller-supplied arrays and using the
+ * batched exponential in lcfit_dispatch.h.
+ */
+
+#ifndef LCFIT_WEIGHTS_H
+#define LCFIT_WEIGHTS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Weighting schemes. */
+typedef enum {
+    /** All weights are one. */
+    LCFIT_WEIGHTS_UNIFORM,
+
+    /** \f$ w_i = \exp(\alpha (l_i - \max_j l_j)) \f$, so the maximum has weight one. */
+    LCFIT_WEIGHTS_TEMPERED,
+
+    /** As #LCFIT_WEIGHTS_TEMPERED, normalized to sum to one. */
+    LCFIT_WEIGHTS_SOFTMAX
+} lcfit_weight_scheme;
+
+/** Compute weights from log-likelihoods.
+ *
+ * \param[in]  scheme  Weighting scheme.
+ * \param[in]  n       Number of points.
+ * \param[in]  lnl     Log-likelihood at each point; unused and may be
+ *                     \c NULL for #LCFIT_WEIGHTS_UNIFORM.
+ * \param[in]  alpha   Tempering exponent; zero gives uniform weights,
+ *                     and one weights points by their likelihood.
+ * \param[out] w       Weight of each point; may alias \c lnl.
+ *
+ * \return The maximum log-likelihood, which the weights are relative
+ *         to, or \c -HUGE_VAL for #LCFIT_WEIGHTS_UNIFORM or \c n = 0.
+ */
+double lcfit_compute_weights(const lcfit_weight_scheme scheme, const size_t n,
+                             const double* lnl, const double alpha, double* w);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* LCFIT_WEIGHTS_H */
@@ -1,23 +1,57 @@
 #include <math.h>
-#include <stdio.h>
-#include <unistd.h>
 
 #include "lcfit.h"
 
-static void nrerror(char error_text[])
-{
-    fprintf(stderr, "nr error: %s\n", error_text);
-    _exit(1);
-}
+/** Maximum number of bisection steps taken by #lcfit_inv_exp_prior. */
+static const size_t INV_EXP_PRIOR_MAX_ITER = 200;
+
+/* ln(n!) for n = 0, ..., 100, tabulated ahead of time so that factln
+ * needs no lazily-filled cache and is safe to call from any thread. */
+static const double FACTLN_TABLE[101] = {
+    0, 0, 0.69314718055994495,
+    1.7917594692280554, 3.1780538303479449, 4.7874917427820467,
+    6.5792512120101021, 8.5251613610654147, 10.604602902745249,
+    12.801827480081467, 15.104412573075514, 17.502307845873887,
+    19.987214495661885, 22.552163853123421, 25.191221182738683,
+    27.89927138384089, 30.671860106080672, 33.505073450136891,
+    36.395445208033053, 39.339884187199495, 42.335616460753485,
+    45.380138898476908, 48.47118135183522, 51.606675567764377,
+    54.784729398112319, 58.003605222980518, 61.261701761002008,
+    64.557538627006338, 67.889743137181526, 71.257038967168,
+    74.658236348830172, 78.092223553315307, 81.557959456115029,
+    85.054467017581516, 88.580827542197682, 92.136175603687093,
+    95.719694542143202, 99.330612454787428, 102.96819861451381,
+    106.63176026064346, 110.32063971475738, 114.03421178146169,
+    117.77188139974507, 121.53308151543864, 125.3172711493569,
+    129.12393363912722, 132.95257503561632, 136.80272263732635,
+    140.67392364823425, 144.5657439463449, 148.47776695177305,
+    152.40959258449732, 156.3608363030788, 160.3311282166309,
+    164.32011226319514, 168.32744544842765, 172.35279713916282,
+    176.39584840699737, 180.45629141754375, 184.53382886144948,
+    188.62817342367163, 192.7390472878449, 196.86618167288998,
+    201.00931639928152, 205.16819948264123, 209.34258675253685,
+    213.53224149456327, 217.73693411395419, 221.95644181913036,
+    226.1905483237276, 230.43904356577693, 234.70172344281826,
+    238.97838956183432, 243.26884900298276, 247.57291409618691,
+    251.89040220972316, 256.22113555000954, 260.56494097186322,
+    264.92164979855283, 269.29109765101981, 273.67312428569369,
+    278.06757344036612, 282.47429268763034, 286.89313329542699,
+    291.32395009427034, 295.7666013507606, 300.22094864701415,
+    304.68685676566867, 309.16419358014696, 313.65282994987905,
+    318.15263962020936, 322.66349912672626, 327.1852877037752,
+    331.71788719692847, 336.26118197919851, 340.81505887079896,
+    345.37940706226686, 349.95411804077025, 354.53908551944085,
+    359.1342053695754, 363.73937555556347
+};
 
 /* From "Numerical Recipes in C", 2e, p 214 */
 /* Returns the value ln[gamma(xx)] for xx > 0 */
-static float gammln(float xx)
+static double gammln(double xx)
 {
     double x,y,tmp,ser;
-    static double cof[6]={76.18009172947146,-86.50532032941677,
-                          24.01409824083091,-1.231739572450155,
-                          0.1208650973866179e-2,-0.5395239384953e-5};
+    static const double cof[6]={76.18009172947146,-86.50532032941677,
+                                24.01409824083091,-1.231739572450155,
+                                0.1208650973866179e-2,-0.5395239384953e-5};
     int j;
 
     y=x=xx;
@@ -29,15 +63,31 @@ static float gammln(float xx)
 }
 
 /* From "Numerical Recipes in C", 2e, p 215 */
-/* Returns ln(n!) */
-static float factln(int n)
+/* Computes ln(n!), returning an lcfit_status code */
+static int factln(int n, double* result)
 {
-    static float a[101];
+    if (n < 0) {
+        return LCFIT_ERROR;
+    }
 
-    if (n < 0) nrerror("Negative factorial in routine factln");
-    if (n <= 1) return 0.0;
-    if (n <= 100) return a[n] ? a[n] : (a[n]=gammln(n+1.0));
-    else return gammln(n+1.0);
+    *result = (n <= 100) ? FACTLN_TABLE[n] : gammln(n+1.0);
+    return LCFIT_SUCCESS;
+}
+
+/* Computes the log of the binomial coefficient nCr(n, k), returning
+ * an lcfit_status code */
+static int bicoln(int n, int k, double* result)
+{
+    double fn, fk, fnk;
+
+    if (factln(n, &fn) != LCFIT_SUCCESS ||
+        factln(k, &fk) != LCFIT_SUCCESS ||
+        factln(n-k, &fnk) != LCFIT_SUCCESS) {
+        return LCFIT_ERROR;
+    }
+
+    *result = fn-fk-fnk;
+    return LCFIT_SUCCESS;
 }
 
 /*
@@ -46,23 +96,18 @@ static float factln(int n)
 */
 
 /* From "Numerical Recipes in C", 2e, p 215 */
-/* Returns the binomial coefficient nCr(n, k) as a floating-point number */
-static float bico(int n, int k)
-{
-    return floor(0.5+exp(factln(n)-factln(k)-factln(n-k)));
-}
-
-static float bicoln(int n, int k)
+/* Computes the binomial coefficient nCr(n, k) as a floating-point
+ * number, returning an lcfit_status code */
+static int bico(int n, int k, double* result)
 {
-    return factln(n)-factln(k)-factln(n-k);
-}
+    double lnc;
+    int status = bicoln(n, k, &lnc);
 
+    if (status == LCFIT_SUCCESS) {
+        *result = floor(0.5+exp(lnc));
+    }
 
-/* From "Numerical Recipes in C", 2e, p 216 */
-/* Returns the value of the beta function B(z, w) */
-static float beta(float z, float w)
-{
-    return exp(gammln(z)+gammln(w)-gammln(z+w));
+    return status;
 }
 
 /*
@@ -79,12 +124,15 @@ def K(c,m,l,r, x):
   return s
 */
 
-// TODO: lock down types and casts
-/* Inversion sampling helper function */
-double lcfit_k_exp_prior(const bsm_t* model, double lambda, double x)
+int lcfit_k_exp_prior(const bsm_t* model, double lambda, double x, double* k)
 {
+    if (!(model->c >= 0.0 && model->m >= 0.0 && model->r > 0.0 && lambda > 0.0)) {
+        return LCFIT_ERROR;
+    }
+
     if (x == 0.0) {
-        return 0.0;
+        *k = 0.0;
+        return LCFIT_SUCCESS;
     }
 
     // round or floor?
@@ -97,9 +145,19 @@ double lcfit_k_exp_prior(const bsm_t* model, double lambda, double x)
 
     // TODO: vectorize?
     for (int i = 0; i <= c; ++i) {
+        double bc_i;
+        if (bico(c, i, &bc_i) != LCFIT_SUCCESS) {
+            return LCFIT_ERROR;
+        }
+
         for (int j = 0; j <= m; ++j) {
+            double bc_j;
+            if (bico(m, j, &bc_j) != LCFIT_SUCCESS) {
+                return LCFIT_ERROR;
+            }
+
             // TODO: will need to be done in log space or with GMP
-            double term = bico(c, i) * bico(m, j) / (i + j + lr) * pow(x, i + j);
+            double term = bc_i * bc_j / (i + j + lr) * pow(x, i + j);
 
             if (j % 2 == 0) {
                 s += term;
@@ -111,7 +169,12 @@ double lcfit_k_exp_prior(const bsm_t* model, double lambda, double x)
 
     s *= pow(x, lr);
 
-    return s;
+    if (!isfinite(s)) {
+        return LCFIT_ERROR;
+    }
+
+    *k = s;
+    return LCFIT_SUCCESS;
 }
 
 /*
@@ -131,27 +194,35 @@ def inv(c,m,l,r,u):
   return x
 */
 
-// TODO: lock down types and casts
-double lcfit_inv_exp_prior(const bsm_t* model, double lambda, double u)
+int lcfit_inv_exp_prior(const bsm_t* model, double lambda, double u, double* x)
 {
     double a = 0.0;
     double b = 1.0;
-    double x = 0.5;
-    double al = lcfit_k_exp_prior(model, lambda, x);
+    double mid = 0.5;
+    double al = 0.0;
+
+    int status = lcfit_k_exp_prior(model, lambda, mid, &al);
+    size_t iter = 0;
 
     // bisect until K(x) ~= u
-    while (fabs(al - u) > 1e-6) {
+    while (status == LCFIT_SUCCESS && fabs(al - u) > 1e-6) {
+        if (iter++ == INV_EXP_PRIOR_MAX_ITER) {
+            status = LCFIT_MAXITER;
+            break;
+        }
+
         if (al > u) {
-            b = x;
+            b = mid;
         } else {
-            a = x;
+            a = mid;
         }
 
-        x = (a + b) / 2.0;
-        al = lcfit_k_exp_prior(model, lambda, x);
+        mid = (a + b) / 2.0;
+        status = lcfit_k_exp_prior(model, lambda, mid, &al);
     }
 
-    return x;
+    *x = mid;
+    return status;
 }
 
 /* Usage:
@@ -159,11 +230,15 @@ double lcfit_inv_exp_prior(const bsm_t* model, double lambda, double u)
    size_t N = 1000;
    double* a = calloc(N, sizeof(double));
 
-   double k0 = lcfit_k_exp_prior(model, lambda, exp(-1.0 * model->r * model->b));
+   double k0;
+   lcfit_k_exp_prior(model, lambda, exp(-1.0 * model->r * model->b), &k0);
    for (size_t i = 0; i < N; ++i) {
        double u = unifrnd(0, 1);
 
-       double x = lcfit_inv_exp_prior(model, lambda, (1 - u) * K0);
+       double x;
+       if (lcfit_inv_exp_prior(model, lambda, (1 - u) * k0, &x) != LCFIT_SUCCESS) {
+           // handle the error
+       }
        double t = -1.0 / model->r * log(x) - b;
 
        a[i] = t;
@@ -1,9 +1,18 @@
 #include "catch.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <vector>
 #include "lcfit.h"
+#include "lcfit2.h"
+#include "lcfit_auto.h"
+#include "lcfit_dispatch.h"
 #include "lcfit_priv.h"
+#include "lcfit_refit.h"
 #include "lcfit_select.h"
+#include "lcfit_store.h"
+#include "lcfit_weights.h"
 
 std::ostream& operator<<(std::ostream& os, const bsm_t& model)
 {
@@ -134,6 +143,49 @@ TEST_CASE("curves are classified correctly", "[classify_curve]") {
     }
 }
 
+TEST_CASE("point sets stay sorted and classified", "[point_set]") {
+    point_set_t set;
+    REQUIRE(point_set_init(&set, 6));
+
+    const point_t points[] = {{0.5, -10.0}, {1.0, -12.0}, {0.2, -11.0},
+                              {2.0, -15.0}, {0.7, -9.0}, {0.1, -14.0}};
+    const size_t n = sizeof(points) / sizeof(point_t);
+
+    std::vector<point_t> expected;
+
+    for (size_t i = 0; i < n; ++i) {
+        REQUIRE(point_set_insert(&set, points[i]));
+
+        expected.push_back(points[i]);
+        sort_by_t(expected.data(), expected.size());
+
+        REQUIRE(set.n == expected.size());
+        for (size_t j = 0; j < set.n; ++j) {
+            REQUIRE(point_set_points(&set)[j].t == expected[j].t);
+        }
+
+        if (set.n > 1) {
+            REQUIRE(point_set_classify(&set) ==
+                    classify_curve(expected.data(), expected.size()));
+        }
+    }
+
+    REQUIRE(point_set_max(&set)->t == 0.7);
+
+    SECTION("when the set is full") {
+        const point_t extra = {3.0, -20.0};
+        REQUIRE_FALSE(point_set_insert(&set, extra));
+    }
+
+    SECTION("when the set is cleared") {
+        point_set_clear(&set);
+        REQUIRE(set.n == 0);
+        REQUIRE(point_set_insert(&set, points[0]));
+    }
+
+    point_set_free(&set);
+}
+
 TEST_CASE("test points are selected properly", "[select_points]") {
     bsm_t model = {1200.0, 300.0, 1.0, 0.2}; // ml_t = 0.310826
     log_like_function_t log_like = {lcfit_lnl_callback, &model};
@@ -391,9 +443,7 @@ TEST_CASE("maxima are bracketed and found properly", "[bracket_and_find]") {
         REQUIRE(min_t < true_ml_t);
         REQUIRE(max_t > true_ml_t);
 
-        double guess = (min_t + max_t) / 2.0;
-
-        double est_ml_t = find_maximum(lcfit_lnl_callback, &true_model, guess, min_t, max_t);
+        double est_ml_t = lcfit_maximize(lcfit_lnl_callback, &true_model, min_t, max_t, NULL, NULL);
         REQUIRE(est_ml_t == Approx(true_ml_t));
 
         double d1;
@@ -414,9 +464,7 @@ TEST_CASE("maxima are bracketed and found properly", "[bracket_and_find]") {
         REQUIRE(min_t < true_ml_t);
         REQUIRE(max_t > true_ml_t);
 
-        double guess = (min_t + max_t) / 2.0;
-
-        double est_ml_t = find_maximum(lcfit_lnl_callback, &true_model, guess, min_t, max_t);
+        double est_ml_t = lcfit_maximize(lcfit_lnl_callback, &true_model, min_t, max_t, NULL, NULL);
         REQUIRE(est_ml_t == Approx(true_ml_t));
 
         double d1;
@@ -588,6 +636,375 @@ TEST_CASE("lcfit_fit_auto converges to a good model", "[lcfit_fit_auto]") {
     }
 }
 
+/* An executor that runs submitted evaluations at wait, last first,
+ * so that reading a result before waiting gives a wrong answer. */
+struct deferred_executor {
+    struct request {
+        double (*fn)(double, void*);
+        void* fn_args;
+        double t;
+        double* result;
+    };
+
+    std::vector<request> pending;
+    size_t n_batches = 0;
+    size_t n_evals = 0;
+    size_t max_batch = 0;
+
+    static void submit(void* ctx, double (*fn)(double, void*), void* fn_args,
+                       double t, double* result)
+    {
+        deferred_executor* self = static_cast<deferred_executor*>(ctx);
+        *result = NAN;
+        self->pending.push_back({fn, fn_args, t, result});
+    }
+
+    static void wait(void* ctx)
+    {
+        deferred_executor* self = static_cast<deferred_executor*>(ctx);
+        for (auto it = self->pending.rbegin(); it != self->pending.rend(); ++it) {
+            *it->result = it->fn(it->t, it->fn_args);
+        }
+
+        ++self->n_batches;
+        self->n_evals += self->pending.size();
+        self->max_batch = std::max(self->max_batch, self->pending.size());
+        self->pending.clear();
+    }
+};
+
+TEST_CASE("lcfit_fit_auto_ex with an executor matches lcfit_fit_auto", "[lcfit_executor]") {
+    const bsm_t true_models[] = {REGIME_1, REGIME_2, REGIME_3};
+
+    for (const bsm_t& true_model : true_models) {
+        CAPTURE(true_model);
+
+        bsm_t expected_model = {1100.0, 100.0, 2.0, 0.5};
+        bsm_t fit_model = expected_model;
+
+        const double expected_ml_t = lcfit_fit_auto(lcfit_lnl_callback, const_cast<bsm_t*>(&true_model),
+                                                    &expected_model, MIN_BL, MAX_BL);
+
+        deferred_executor deferred;
+        const lcfit_executor_t executor = {&deferred_executor::submit,
+                                           &deferred_executor::wait,
+                                           &deferred};
+
+        const double fit_ml_t = lcfit_fit_auto_ex(lcfit_lnl_callback, const_cast<bsm_t*>(&true_model),
+                                                  &fit_model, MIN_BL, MAX_BL, &executor);
+
+        CHECK(fit_ml_t == expected_ml_t);
+        CHECK(fit_model.c == expected_model.c);
+        CHECK(fit_model.m == expected_model.m);
+        CHECK(fit_model.r == expected_model.r);
+        CHECK(fit_model.b == expected_model.b);
+
+        CHECK(deferred.pending.empty());
+        // the bracketing triple, the stencil, and each lcfit2 or
+        // estimate_ml_t starting batch
+        CHECK(deferred.n_batches >= 3);
+        CHECK(deferred.max_batch >= 4);
+    }
+
+    SECTION("derivatives") {
+        bsm_t model = REGIME_1;
+        double expected_d1, expected_d2, d1, d2;
+        estimate_derivatives(lcfit_lnl_callback, &model, 0.3, &expected_d1, &expected_d2);
+
+        deferred_executor deferred;
+        const lcfit_executor_t executor = {&deferred_executor::submit,
+                                           &deferred_executor::wait,
+                                           &deferred};
+        estimate_derivatives_ex(lcfit_lnl_callback, &model, 0.3, &d1, &d2, &executor);
+
+        CHECK(d1 == expected_d1);
+        CHECK(d2 == expected_d2);
+        CHECK(deferred.n_batches == 1);
+        CHECK(deferred.n_evals == 5);
+    }
+}
+
+TEST_CASE("reverse-communication fits match lcfit_fit_auto", "[lcfit_auto]") {
+    const bsm_t true_models[] = {REGIME_1, REGIME_2, REGIME_3};
+    const size_t n_models = sizeof(true_models) / sizeof(true_models[0]);
+
+    std::vector<double> expected_ml_t(n_models);
+    std::vector<bsm_t> expected_models(n_models, bsm_t{1100.0, 100.0, 2.0, 0.5});
+    for (size_t i = 0; i < n_models; ++i) {
+        expected_ml_t[i] = lcfit_fit_auto(lcfit_lnl_callback, const_cast<bsm_t*>(&true_models[i]),
+                                          &expected_models[i], MIN_BL, MAX_BL);
+    }
+
+    SECTION("one branch length at a time") {
+        for (size_t i = 0; i < n_models; ++i) {
+            CAPTURE(true_models[i]);
+
+            bsm_t model = {1100.0, 100.0, 2.0, 0.5};
+            lcfit_auto_state_t* s = lcfit_auto_begin(&model, MIN_BL, MAX_BL);
+            REQUIRE(s != NULL);
+
+            double t;
+            int status;
+            while ((status = lcfit_auto_next(s, &t)) == LCFIT_NEED_EVAL) {
+                REQUIRE(t >= MIN_BL);
+                REQUIRE(t <= MAX_BL);
+                lcfit_auto_supply(s, lcfit_bsm_log_like(t, &true_models[i]));
+            }
+
+            const double ml_t = lcfit_auto_result(s, &model);
+            lcfit_auto_free(s);
+
+            CHECK(status == LCFIT_SUCCESS);
+            CHECK(ml_t == expected_ml_t[i]);
+            CHECK(model.c == expected_models[i].c);
+            CHECK(model.m == expected_models[i].m);
+            CHECK(model.r == expected_models[i].r);
+            CHECK(model.b == expected_models[i].b);
+        }
+    }
+
+    SECTION("in batches, in lockstep") {
+        std::vector<lcfit_auto_state_t*> states;
+        std::vector<bsm_t> models(n_models, bsm_t{1100.0, 100.0, 2.0, 0.5});
+        for (size_t i = 0; i < n_models; ++i) {
+            states.push_back(lcfit_auto_begin(&models[i], MIN_BL, MAX_BL));
+            REQUIRE(states.back() != NULL);
+        }
+
+        bool running = true;
+        while (running) {
+            running = false;
+            for (size_t i = 0; i < n_models; ++i) {
+                const double* t;
+                const size_t n = lcfit_auto_next_n(states[i], &t);
+                if (n == 0) {
+                    continue;
+                }
+
+                std::vector<double> lnl(n);
+                lcfit_bsm_log_like_n(n, t, &true_models[i], lnl.data());
+                lcfit_auto_supply_n(states[i], n, lnl.data());
+                running = true;
+            }
+        }
+
+        for (size_t i = 0; i < n_models; ++i) {
+            CAPTURE(true_models[i]);
+
+            const double* t;
+            CHECK(lcfit_auto_next_n(states[i], &t) == 0);
+            CHECK(lcfit_auto_result(states[i], &models[i]) == Approx(expected_ml_t[i]));
+            CHECK(models[i].c == Approx(expected_models[i].c));
+            CHECK(models[i].m == Approx(expected_models[i].m));
+            CHECK(models[i].r == Approx(expected_models[i].r));
+            CHECK(models[i].b == Approx(expected_models[i].b));
+
+            lcfit_auto_free(states[i]);
+        }
+    }
+}
+
+TEST_CASE("speculative estimate_ml_t converges and reports its rounds", "[estimate_ml_t]") {
+    bsm_t true_model = REGIME_2;
+    const double true_ml_t = lcfit_bsm_ml_t(&true_model);
+    log_like_function_t log_like = {lcfit_lnl_callback, &true_model};
+
+    const double tolerance = 1e-3;
+    double t[4] = {MIN_BL, 0.1, 0.5, MAX_BL};
+
+    bsm_t expected_model = DEFAULT_INIT;
+    bool expected_success = false;
+    const double expected_ml_t = estimate_ml_t(&log_like, t, 4, tolerance, &expected_model,
+                                               &expected_success, MIN_BL, MAX_BL);
+    REQUIRE(expected_success);
+
+    deferred_executor deferred;
+    const lcfit_executor_t executor = {&deferred_executor::submit,
+                                       &deferred_executor::wait,
+                                       &deferred};
+
+    SECTION("a width of one matches estimate_ml_t") {
+        const estimate_ml_t_options_t options = {&executor, 1};
+        estimate_ml_t_stats_t stats;
+        bsm_t model = DEFAULT_INIT;
+        bool success = false;
+
+        const double ml_t = estimate_ml_t_ex(&log_like, t, 4, tolerance, &model, &success,
+                                             MIN_BL, MAX_BL, &options, &stats);
+
+        CHECK(success);
+        CHECK(ml_t == expected_ml_t);
+        CHECK(model.c == expected_model.c);
+        CHECK(model.r == expected_model.r);
+        CHECK(stats.n_evals == stats.rounds + 3);
+        CHECK(stats.n_evals == deferred.n_evals + stats.rounds - deferred.n_batches);
+        CHECK(stats.full_fits >= 1);
+        CHECK(stats.full_fits <= stats.rounds);
+    }
+
+    SECTION("wider rounds converge in fewer rounds than a width of one") {
+        const estimate_ml_t_options_t narrow_options = {&executor, 1};
+        estimate_ml_t_stats_t narrow_stats;
+        bsm_t narrow_model = DEFAULT_INIT;
+        bool narrow_success = false;
+
+        const double narrow_ml_t = estimate_ml_t_ex(&log_like, t, 4, tolerance, &narrow_model,
+                                                    &narrow_success, MIN_BL, MAX_BL,
+                                                    &narrow_options, &narrow_stats);
+        REQUIRE(narrow_success);
+
+        const estimate_ml_t_options_t options = {&executor, 3};
+        estimate_ml_t_stats_t stats;
+        bsm_t model = DEFAULT_INIT;
+        bool success = false;
+
+        const double ml_t = estimate_ml_t_ex(&log_like, t, 4, tolerance, &model, &success,
+                                             MIN_BL, MAX_BL, &options, &stats);
+
+        CHECK(success);
+        CHECK(stats.rounds < narrow_stats.rounds);
+        CHECK(stats.n_evals > stats.rounds + 3);
+        CHECK(deferred.max_batch <= 4);
+        CHECK(ml_t == Approx(narrow_ml_t).epsilon(tolerance));
+        CHECK(ml_t == Approx(true_ml_t).epsilon(10 * tolerance));
+    }
+}
+
+/* A log-likelihood function that counts its evaluations, and a
+ * cancellation token that stops a fit after a given number of them. */
+struct counted_log_like {
+    bsm_t model;
+    size_t n_evals;
+    size_t limit;
+
+    static double fn(double t, void* ctx)
+    {
+        counted_log_like* self = static_cast<counted_log_like*>(ctx);
+        ++self->n_evals;
+        return lcfit_bsm_log_like(t, &self->model);
+    }
+
+    static int cancelled(void* ctx)
+    {
+        const counted_log_like* self = static_cast<const counted_log_like*>(ctx);
+        return self->n_evals >= self->limit;
+    }
+};
+
+TEST_CASE("cancelled fits stop between evaluations", "[lcfit_cancel]") {
+    SECTION("lcfit_fit_auto_opt before any evaluation") {
+        counted_log_like lnl = {REGIME_2, 0, 0};
+        const lcfit_cancel_t cancel = {&counted_log_like::cancelled, &lnl};
+        const lcfit_run_options_t options = {NULL, &cancel};
+
+        bsm_t model = {1100.0, 100.0, 2.0, 0.5};
+        int status = LCFIT_SUCCESS;
+        const double ml_t = lcfit_fit_auto_opt(&counted_log_like::fn, &lnl, &model,
+                                               MIN_BL, MAX_BL, &options, &status);
+
+        CHECK(status == LCFIT_CANCELLED);
+        CHECK(lnl.n_evals == 0);
+        CHECK(std::isnan(ml_t));
+        CHECK(model.c == 1100.0);
+    }
+
+    SECTION("lcfit_fit_auto_opt part way through the search") {
+        counted_log_like lnl = {REGIME_2, 0, 6};
+        const lcfit_cancel_t cancel = {&counted_log_like::cancelled, &lnl};
+        const lcfit_run_options_t options = {NULL, &cancel};
+
+        bsm_t model = {1100.0, 100.0, 2.0, 0.5};
+        int status = LCFIT_SUCCESS;
+        const double ml_t = lcfit_fit_auto_opt(&counted_log_like::fn, &lnl, &model,
+                                               MIN_BL, MAX_BL, &options, &status);
+
+        CHECK(status == LCFIT_CANCELLED);
+        CHECK(lnl.n_evals == 6);
+        CHECK(ml_t >= MIN_BL);
+        CHECK(ml_t <= MAX_BL);
+    }
+
+    SECTION("lcfit_fit_auto_opt without cancelling matches lcfit_fit_auto") {
+        bsm_t true_model = REGIME_2;
+        counted_log_like lnl = {REGIME_2, 0, static_cast<size_t>(-1)};
+        const lcfit_cancel_t cancel = {&counted_log_like::cancelled, &lnl};
+        const lcfit_run_options_t options = {NULL, &cancel};
+
+        bsm_t expected_model = {1100.0, 100.0, 2.0, 0.5};
+        const double expected_ml_t = lcfit_fit_auto(lcfit_lnl_callback, &true_model,
+                                                    &expected_model, MIN_BL, MAX_BL);
+
+        bsm_t model = {1100.0, 100.0, 2.0, 0.5};
+        int status = LCFIT_ERROR;
+        const double ml_t = lcfit_fit_auto_opt(&counted_log_like::fn, &lnl, &model,
+                                               MIN_BL, MAX_BL, &options, &status);
+
+        CHECK(status == LCFIT_SUCCESS);
+        CHECK(ml_t == expected_ml_t);
+        CHECK(model.c == expected_model.c);
+        CHECK(model.b == expected_model.b);
+    }
+
+    SECTION("lcfit_maximize_opt leaves unestimated derivatives NAN") {
+        counted_log_like lnl = {REGIME_2, 0, 2};
+        const lcfit_cancel_t cancel = {&counted_log_like::cancelled, &lnl};
+        const lcfit_run_options_t options = {NULL, &cancel};
+
+        double d1 = 0.0, d2 = 0.0;
+        int status = LCFIT_SUCCESS;
+        const double t = lcfit_maximize_opt(&counted_log_like::fn, &lnl, MIN_BL, MAX_BL,
+                                            &d1, &d2, &options, &status);
+
+        CHECK(status == LCFIT_CANCELLED);
+        CHECK(lnl.n_evals == 2);
+        CHECK(t >= MIN_BL);
+        CHECK(std::isnan(d1));
+        CHECK(std::isnan(d2));
+    }
+
+    SECTION("estimate_ml_t_ex returns the last model fitted") {
+        // cancel once the starting points have been fitted
+        counted_log_like lnl = {REGIME_2, 0, 4};
+        log_like_function_t log_like = {&counted_log_like::fn, &lnl};
+        const lcfit_cancel_t cancel = {&counted_log_like::cancelled, &lnl};
+        const estimate_ml_t_options_t options = {NULL, 1, false, &cancel};
+
+        double t[4] = {MIN_BL, 0.1, 0.5, MAX_BL};
+        bsm_t model = DEFAULT_INIT;
+        bool success = true;
+        estimate_ml_t_stats_t stats;
+        const double ml_t = estimate_ml_t_ex(&log_like, t, 4, 1e-3, &model, &success,
+                                             MIN_BL, MAX_BL, &options, &stats);
+
+        CHECK_FALSE(success);
+        CHECK(stats.status == LCFIT_CANCELLED);
+        CHECK(stats.full_fits == 1);
+        CHECK(lnl.n_evals == 4);
+        CHECK(ml_t == Approx(lcfit_bsm_ml_t(&model)));
+    }
+
+    SECTION("lcfit2_fit_auto_opt keeps the initial model") {
+        bsm_t true_model = REGIME_2;
+        const double t0 = lcfit_bsm_ml_t(&true_model);
+        double d1, d2;
+        estimate_derivatives(lcfit_lnl_callback, &true_model, t0, &d1, &d2);
+
+        counted_log_like lnl = {REGIME_2, 0, 2};
+        const lcfit_cancel_t cancel = {&counted_log_like::cancelled, &lnl};
+        const lcfit2_fit_auto_options_t options = {NULL, false, 0.0, &cancel};
+
+        lcfit2_bsm_t model = {1100.0, 100.0, t0, d1, d2};
+        size_t n_evals = 0;
+        const int status = lcfit2_fit_auto_opt(&counted_log_like::fn, &lnl, &model,
+                                               MIN_BL, MAX_BL, 0.0, &options, &n_evals);
+
+        CHECK(status == -5);  // NLOPT_FORCED_STOP
+        CHECK(n_evals == 2);
+        CHECK(model.c == 1100.0);
+        CHECK(model.m == 100.0);
+    }
+}
+
 TEST_CASE("estimated maximum likelihood branch length is within tolerance", "[ml_t_tolerance]") {
     bsm_t true_model = {1200.0, 300.0, 1.0, 0.2}; // ml_t = 0.310826
     const double true_ml_t = lcfit_bsm_ml_t(&true_model);
@@ -667,6 +1084,132 @@ TEST_CASE("model scale factors are computed correctly", "[lcfit_bsm_scale_factor
     REQUIRE(l == Approx(calc_ll));
 }
 
+static double sum_sq_residuals(const size_t n, const double* t, const double* l, const bsm_t* m)
+{
+    double sse = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        const double err = lcfit_bsm_log_like(t[i], m) - l[i];
+        sse += err * err;
+    }
+    return sse;
+}
+
+TEST_CASE("initial models are derived from the data", "[lcfit_bsm_initial_guess]") {
+    const double scales[6] = {0.25, 0.5, 1.0, 1.5, 2.0, 4.0};
+
+    SECTION("around the maximum") {
+        const bsm_t true_models[] = {{700.0, 300.0, 1.0, 0.1},
+                                     {9000.0, 1000.0, 1.0, 0.01},
+                                     {9970.0, 30.0, 1.0, 0.0},
+                                     {970.0, 30.0, 2.0, 0.01}};
+
+        for (const bsm_t& true_model : true_models) {
+            CAPTURE(true_model);
+
+            const double true_ml_t = lcfit_bsm_ml_t(&true_model);
+            double t[6], l[6];
+            for (size_t i = 0; i < 6; ++i) {
+                t[i] = scales[i] * true_ml_t;
+                l[i] = lcfit_bsm_log_like(t[i], &true_model);
+            }
+
+            bsm_t guess;
+            REQUIRE(lcfit_bsm_initial_guess(6, t, l, &guess) == LCFIT_SUCCESS);
+            CAPTURE(guess);
+
+            CHECK(guess.c > guess.m);
+            CHECK(guess.m >= 1.0);
+            CHECK(guess.r > 0.0);
+            CHECK(guess.b >= 0.0);
+            CHECK(lcfit_bsm_ml_t(&guess) == Approx(true_ml_t).epsilon(0.15));
+
+            bsm_t rescaled = DEFAULT_INIT;
+            lcfit_bsm_rescale(t[2], l[2], &rescaled);
+            CHECK(sum_sq_residuals(6, t, l, &guess) < sum_sq_residuals(6, t, l, &rescaled));
+        }
+    }
+
+    SECTION("but not from points without an interior maximum") {
+        const bsm_t true_model = REGIME_3;
+        const double t[4] = {0.1, 0.2, 0.5, 1.0};
+        double l[4];
+        for (size_t i = 0; i < 4; ++i) {
+            l[i] = lcfit_bsm_log_like(t[i], &true_model);
+        }
+
+        bsm_t guess = DEFAULT_INIT;
+        CHECK(lcfit_bsm_initial_guess(4, t, l, &guess) == LCFIT_ERROR);
+        CHECK(guess.c == DEFAULT_INIT.c);
+        CHECK(guess.m == DEFAULT_INIT.m);
+        CHECK(guess.r == DEFAULT_INIT.r);
+        CHECK(guess.b == DEFAULT_INIT.b);
+    }
+}
+
+TEST_CASE("benchmark_initial_guess", "Compare fits from lcfit_bsm_initial_guess and DEFAULT_INIT [.][benchmark]") {
+    const double sites[] = {100.0, 1000.0, 10000.0};
+    const double mutated[] = {0.003, 0.03, 0.1, 0.3};
+    const double rates[] = {1.0, 2.0};
+    const double offsets[] = {0.0, 0.01, 0.1};
+    const double scales[6] = {0.25, 0.5, 1.0, 1.5, 2.0, 4.0};
+
+    lcfit_fit_workspace* rescaled_ws = lcfit_fit_workspace_alloc();
+    lcfit_fit_workspace* guess_ws = lcfit_fit_workspace_alloc();
+    REQUIRE(rescaled_ws != NULL);
+    REQUIRE(guess_ws != NULL);
+
+    size_t n_guesses = 0;
+    for (const double n_sites : sites) {
+        for (const double p : mutated) {
+            for (const double r : rates) {
+                for (const double b : offsets) {
+                    const bsm_t true_model = {n_sites * (1.0 - p), n_sites * p, r, b};
+                    const double true_ml_t = lcfit_bsm_ml_t(&true_model);
+                    if (!(true_ml_t > 0.0)) {
+                        continue;
+                    }
+
+                    double t[6], l[6];
+                    const double w[6] = {1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+                    for (size_t i = 0; i < 6; ++i) {
+                        t[i] = scales[i] * true_ml_t;
+                        l[i] = lcfit_bsm_log_like(t[i], &true_model);
+                    }
+
+                    bsm_t rescaled = DEFAULT_INIT;
+                    lcfit_bsm_rescale(t[2], l[2], &rescaled);
+                    lcfit_fit_bsm_weight_ws(6, t, l, w, &rescaled, 250, rescaled_ws);
+
+                    bsm_t guess = DEFAULT_INIT;
+                    if (lcfit_bsm_initial_guess(6, t, l, &guess) == LCFIT_SUCCESS) {
+                        ++n_guesses;
+                    } else {
+                        lcfit_bsm_rescale(t[2], l[2], &guess);
+                    }
+                    lcfit_fit_bsm_weight_ws(6, t, l, w, &guess, 250, guess_ws);
+                }
+            }
+        }
+    }
+
+    lcfit_fit_stats rescaled_stats, guess_stats;
+    lcfit_fit_workspace_stats(rescaled_ws, &rescaled_stats);
+    lcfit_fit_workspace_stats(guess_ws, &guess_stats);
+    lcfit_fit_workspace_free(rescaled_ws);
+    lcfit_fit_workspace_free(guess_ws);
+
+    REQUIRE(guess_stats.fits == rescaled_stats.fits);
+
+    std::printf("initial models for %zu fits (%zu guessed): "
+                "DEFAULT_INIT %.1f LM iterations/fit, %zu reduced, %zu fallbacks; "
+                "lcfit_bsm_initial_guess %.1f LM iterations/fit, %zu reduced, %zu fallbacks\n",
+                guess_stats.fits, n_guesses,
+                (double) rescaled_stats.lm_iterations / rescaled_stats.fits,
+                rescaled_stats.reduced, rescaled_stats.fallbacks,
+                (double) guess_stats.lm_iterations / guess_stats.fits,
+                guess_stats.reduced, guess_stats.fallbacks);
+}
+
 /* Run a single fit, require that it converge, and the residuals decrase from
  * initial conditions */
 void
@@ -733,6 +1276,105 @@ TEST_CASE("fitting actually improves fit", "[lcfit_fit_bsm]") {
     }
 }
 
+TEST_CASE("fits with b = 0 use the reduced model", "[lcfit_fit_bsm_b0]") {
+    const double t[6] = {0.05, 0.1, 0.2, 0.3, 0.5, 1.0};
+    const double w[6] = {1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+    double l[6];
+
+    lcfit_fit_workspace* ws = lcfit_fit_workspace_alloc();
+    REQUIRE(ws != NULL);
+
+    SECTION("when the data have no offset") {
+        const bsm_t true_model = {1000.0, 100.0, 1.0, 0.0};
+        lcfit_bsm_log_like(6, t, l, &true_model);
+
+        bsm_t fit = {900.0, 120.0, 1.2, 0.0};
+        REQUIRE(lcfit_fit_bsm_weight_ws(6, t, l, w, &fit, 500, ws) == LCFIT_SUCCESS);
+        CHECK(fit.b == 0.0);
+        CHECK(fit.c == Approx(true_model.c).epsilon(1e-4));
+        CHECK(fit.m == Approx(true_model.m).epsilon(1e-4));
+        CHECK(fit.r == Approx(true_model.r).epsilon(1e-4));
+
+        lcfit_fit_stats stats;
+        lcfit_fit_workspace_stats(ws, &stats);
+        CHECK(stats.fits == 1);
+        CHECK(stats.reduced == 1);
+        CHECK(stats.fallbacks == 0);
+    }
+
+    SECTION("but not when b = 0 is not optimal") {
+        lcfit_bsm_log_like(6, t, l, &REGIME_2);
+
+        bsm_t fit = {9.0, 1.2, 1.2, 0.0};
+        REQUIRE(lcfit_fit_bsm_weight_ws(6, t, l, w, &fit, 500, ws) == LCFIT_SUCCESS);
+        CHECK(fit.b > 0.0);
+        CHECK(lcfit_bsm_ml_t(&fit) == Approx(lcfit_bsm_ml_t(&REGIME_2)).epsilon(1e-3));
+
+        lcfit_fit_stats stats;
+        lcfit_fit_workspace_stats(ws, &stats);
+        CHECK(stats.reduced == 0);
+    }
+
+    lcfit_fit_workspace_free(ws);
+}
+
+TEST_CASE("incremental refits converge from the previous model", "[lcfit_refit]") {
+    const double t[6] = {0.1, 0.2, 0.3, 0.5, 1.0, 0.4};
+    const double w[6] = {1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+    double l[6];
+
+    lcfit_refit_t* refit = lcfit_refit_alloc(6);
+    REQUIRE(refit != NULL);
+
+    SECTION("after adding a point") {
+        const bsm_t true_model = {1200.0, 300.0, 1.0, 0.2};
+        lcfit_bsm_log_like(6, t, l, &true_model);
+
+        const bsm_t previous = {1205.0, 298.0, 1.01, 0.19};
+        REQUIRE(lcfit_refit_reset(refit, &previous, 5, t, l, w) == LCFIT_SUCCESS);
+        REQUIRE(lcfit_refit_add(refit, t[5], l[5], w[5]) == LCFIT_SUCCESS);
+        REQUIRE(lcfit_refit_size(refit) == 6);
+
+        bsm_t fit = previous;
+        int status = LCFIT_MAXITER;
+        for (int i = 0; i < 3 && status == LCFIT_MAXITER; ++i) {
+            status = lcfit_refit_step(refit, 2, &fit);
+        }
+        REQUIRE(status == LCFIT_SUCCESS);
+        CHECK(fit.c == Approx(true_model.c));
+        CHECK(fit.m == Approx(true_model.m));
+        CHECK(fit.r == Approx(true_model.r));
+        CHECK(fit.b == Approx(true_model.b));
+    }
+
+    SECTION("holding b at zero when the optimum is beyond it") {
+        const bsm_t beyond = {1000.0, 100.0, 1.0, -0.001};
+        lcfit_bsm_log_like(6, t, l, &beyond);
+
+        const bsm_t previous = {1020.0, 102.0, 0.98, 0.001};
+        REQUIRE(lcfit_refit_reset(refit, &previous, 6, t, l, w) == LCFIT_SUCCESS);
+
+        bsm_t fit = previous;
+        int status = LCFIT_MAXITER;
+        for (int i = 0; i < 3 && status == LCFIT_MAXITER; ++i) {
+            status = lcfit_refit_step(refit, 2, &fit);
+        }
+        REQUIRE(status == LCFIT_SUCCESS);
+        CHECK(fit.b == 0.0);
+        CHECK(check_model(&fit) == 0);
+    }
+
+    SECTION("but not from an invalid model") {
+        const bsm_t invalid = {10.0, 1.0, -1.0, 0.0};
+        lcfit_bsm_log_like(6, t, l, &REGIME_1);
+        CHECK(lcfit_refit_reset(refit, &invalid, 6, t, l, w) == LCFIT_ERROR);
+        CHECK(lcfit_refit_size(refit) == 0);
+        CHECK(lcfit_refit_add(refit, 0.4, l[5], 1.0) == LCFIT_ERROR);
+    }
+
+    lcfit_refit_free(refit);
+}
+
 TEST_CASE("maximum-likelihood branch lengths are computed properly", "[lcfit_bsm_ml_t]") {
     SECTION("in regime 1") {
         REQUIRE(lcfit_bsm_ml_t(&REGIME_1) == Approx(0.2006707));
@@ -776,3 +1418,415 @@ TEST_CASE("log-likelihoods are computed properly", "[lcfit_bsm_log_like]") {
         REQUIRE(lcfit_bsm_log_like(INFINITY, &REGIME_2) == Approx(-7.624619));
     }
 }
+
+TEST_CASE("branch length derivatives are computed properly", "[lcfit_bsm_dlnl_dt]") {
+    SECTION("at the special cases of the log-likelihood") {
+        double d1, d2;
+        CHECK(lcfit_bsm_log_like_dt(0.0, &REGIME_1, &d1, &d2) == -INFINITY);
+        CHECK(d1 == INFINITY);
+        CHECK(d2 == -INFINITY);
+
+        CHECK(lcfit_bsm_log_like_dt(INFINITY, &REGIME_4, &d1, &d2) ==
+              lcfit_bsm_log_like(INFINITY, &REGIME_4));
+        CHECK(d1 == 0.0);
+        CHECK(d2 == 0.0);
+    }
+
+    SECTION("at the maximum") {
+        const bsm_t model = {1500.0, 300.0, 1.0, 0.05};
+        const double t0 = lcfit_bsm_ml_t(&model);
+
+        CHECK(std::abs(lcfit_bsm_dlnl_dt(t0, &model)) < 1e-9);
+        CHECK(lcfit_bsm_d2lnl_dt2(t0, &model) < 0.0);
+    }
+
+    SECTION("against finite differences") {
+        const bsm_t models[] = {REGIME_1, REGIME_2, REGIME_3, REGIME_4,
+                                {1500.0, 300.0, 1.0, 0.05}};
+
+        for (const bsm_t& model : models) {
+            for (double t : {1e-3, 0.1, 0.5, 2.0, 10.0}) {
+                INFO("model = " << model << ", t = " << t);
+                const double h = 1e-4 * t;
+
+                double d1, d2;
+                const double lnl = lcfit_bsm_log_like_dt(t, &model, &d1, &d2);
+                CHECK(lnl == Approx(lcfit_bsm_log_like(t, &model)).epsilon(1e-13));
+                CHECK(lcfit_bsm_dlnl_dt(t, &model) == d1);
+                CHECK(lcfit_bsm_d2lnl_dt2(t, &model) == d2);
+
+                const double fd1 = (lcfit_bsm_log_like(t + h, &model) -
+                                    lcfit_bsm_log_like(t - h, &model)) / (2 * h);
+                const double fd2 = (lcfit_bsm_dlnl_dt(t + h, &model) -
+                                    lcfit_bsm_dlnl_dt(t - h, &model)) / (2 * h);
+                CHECK(d1 == Approx(fd1).epsilon(1e-6));
+                CHECK(d2 == Approx(fd2).epsilon(1e-6));
+            }
+        }
+    }
+}
+
+TEST_CASE("single-precision log-likelihoods match the double reference", "[lcfit_bsm_log_like_nf]") {
+    const bsm_t models[] = {REGIME_1, REGIME_2, REGIME_3, REGIME_4,
+                            {1500.0, 300.0, 1.0, 0.05},
+                            {1e5, 1e3, 0.3, 1e-3}};
+
+    std::vector<float> t;
+    for (double x = 1e-6; x < 50.0; x *= 1.01) {
+        t.push_back(static_cast<float>(x));
+    }
+    std::vector<float> out(t.size());
+
+    for (const bsm_t& model : models) {
+        lcfit_bsm_log_like_nf(t.size(), t.data(), &model, out.data());
+
+        for (size_t i = 0; i < t.size(); ++i) {
+            const double expected = lcfit_bsm_log_like(t[i], &model);
+            REQUIRE(std::abs(out[i] - expected) <= 1e-6 * std::abs(expected));
+        }
+
+        // relative to the maximum, the absolute error stays small
+        const double ml_ll = lcfit_bsm_log_like(lcfit_bsm_ml_t(&model), &model);
+        lcfit_bsm_log_like_shifted_nf(t.size(), t.data(), &model, ml_ll, out.data());
+
+        for (size_t i = 0; i < t.size(); ++i) {
+            const double expected = lcfit_bsm_log_like(t[i], &model) - ml_ll;
+            REQUIRE(std::abs(out[i] - expected) <= 1e-6 * std::abs(expected) + 1e-6 * std::abs(ml_ll));
+        }
+    }
+
+    const float edges[] = {0.0f, INFINITY};
+    float edge_out[2];
+    lcfit_bsm_log_like_nf(2, edges, &REGIME_1, edge_out);
+    CHECK(edge_out[0] == -INFINITY);
+    CHECK(edge_out[1] == Approx(lcfit_bsm_log_like(INFINITY, &REGIME_1)));
+}
+
+TEST_CASE("exponential prior inversion helpers report errors", "[exp_prior]") {
+    const bsm_t model = {10.0, 1.0, 1.0, 0.0};
+    const double lambda = 0.1;
+
+    SECTION("when inverting a value in range") {
+        double k1 = 0.0;
+        REQUIRE(lcfit_k_exp_prior(&model, lambda, 1.0, &k1) == LCFIT_SUCCESS);
+
+        const double u = 0.5 * k1;
+        double x = 0.0;
+        REQUIRE(lcfit_inv_exp_prior(&model, lambda, u, &x) == LCFIT_SUCCESS);
+        REQUIRE(x > 0.0);
+        REQUIRE(x < 1.0);
+
+        double kx = 0.0;
+        REQUIRE(lcfit_k_exp_prior(&model, lambda, x, &kx) == LCFIT_SUCCESS);
+        REQUIRE(std::abs(kx - u) <= 1e-6);
+    }
+
+    SECTION("when the model is invalid") {
+        const bsm_t bad_model = {-1.0, 1.0, 1.0, 0.0};
+        double k = 0.0;
+        REQUIRE(lcfit_k_exp_prior(&bad_model, lambda, 0.5, &k) == LCFIT_ERROR);
+    }
+
+    SECTION("when the bisection cannot converge") {
+        // the alternating series loses all precision for large c and m
+        const bsm_t large_model = {200.0, 150.0, 1.0, 0.0};
+        double x = 0.0;
+        REQUIRE(lcfit_inv_exp_prior(&large_model, lambda, 1e-3, &x) == LCFIT_MAXITER);
+    }
+}
+
+TEST_CASE("model stores round-trip and look up records by key", "[store]") {
+    const char* path = "lcfit-test-store.bin";
+    const size_t n = 1000;
+
+    REQUIRE(sizeof(lcfit_store_header) == 64);
+    REQUIRE(sizeof(lcfit_store_record) == 64);
+
+    std::vector<lcfit_store_record> records(n);
+    for (size_t i = 0; i < n; ++i) {
+        lcfit_store_record& r = records[i];
+        r.model = {1000.0 + i, 100.0, 1.0, 0.01 * i};
+        r.key = 7 * i + 3;
+        r.ml_t = lcfit_bsm_ml_t(&r.model);
+        r.status = LCFIT_SUCCESS;
+        r.n_evals = i % 11;
+        r.flags = 0;
+        r.reserved = 0;
+    }
+
+    for (const bool indexed : {true, false}) {
+        REQUIRE(lcfit_store_write(path, records.data(), n, indexed) == LCFIT_SUCCESS);
+
+        lcfit_store* store = lcfit_store_open(path);
+        REQUIRE(store != NULL);
+        REQUIRE(lcfit_store_size(store) == n);
+
+        for (size_t i = 0; i < n; ++i) {
+            const lcfit_store_record* r = lcfit_store_lookup(store, records[i].key);
+            REQUIRE(r == lcfit_store_records(store) + i);
+            CHECK(r->model.c == records[i].model.c);
+            CHECK(r->model.b == records[i].model.b);
+            CHECK(r->ml_t == records[i].ml_t);
+            CHECK(r->n_evals == records[i].n_evals);
+        }
+
+        CHECK(lcfit_store_lookup(store, 1) == NULL);
+        CHECK(lcfit_store_lookup(store, 7 * n + 3) == NULL);
+
+        lcfit_store_close(store);
+    }
+
+    SECTION("duplicate keys cannot be indexed") {
+        records[1].key = records[0].key;
+        CHECK(lcfit_store_write(path, records.data(), n, true) == LCFIT_ERROR);
+    }
+
+    SECTION("other files are rejected") {
+        FILE* fp = fopen(path, "wb");
+        REQUIRE(fp != NULL);
+        fputs("node_id,c,m,r,b\n", fp);
+        fclose(fp);
+        CHECK(lcfit_store_open(path) == NULL);
+    }
+
+    std::remove(path);
+}
+
+/* Whether a kernel result matches the reference, including at singularities. */
+bool kernel_matches(const double out, const double expected, const double tolerance)
+{
+    if (std::isnan(expected)) {
+        return std::isnan(out);
+    }
+    if (std::isinf(expected)) {
+        return out == expected;
+    }
+
+    return std::abs(out - expected) <= tolerance;
+}
+
+TEST_CASE("every kernel variant matches the scalar reference", "[lcfit_dispatch]") {
+    const bsm_t models[] = {REGIME_1, REGIME_2, REGIME_3, REGIME_4,
+                            {1500.0, 300.0, 1.0, 0.05},
+                            {1e5, 1e3, 0.3, 1e-3}};
+    const lcfit2_bsm_t models2[] = {{1100.0, 800.0, 0.1, 0.0, -500.0},
+                                    {1e4, 10.0, 0.5, 0.0, -2000.0}};
+
+    // an odd count exercises the partial last vector of every width
+    std::vector<double> t;
+    for (double x = 1e-3; x < 50.0; x *= 1.01) {
+        t.push_back(x);
+    }
+    t.push_back(0.0);
+    if (t.size() % 2 == 1) {
+        t.push_back(1.0);
+    }
+    t.push_back(INFINITY);
+
+    const size_t n = t.size();
+    std::vector<double> expected(n), out(n);
+    std::vector<double> expected_grad(4 * n), out_grad(4 * n);
+
+    const lcfit_isa initial = lcfit_active_isa();
+    REQUIRE(lcfit_isa_supported(LCFIT_ISA_SCALAR));
+
+    for (int i = 0; i < LCFIT_ISA_COUNT; ++i) {
+        const lcfit_isa isa = static_cast<lcfit_isa>(i);
+        if (!lcfit_isa_supported(isa)) {
+            CHECK(lcfit_set_isa(isa) == LCFIT_ERROR);
+            continue;
+        }
+
+        INFO("isa = " << lcfit_isa_name(isa));
+
+        for (const bsm_t& model : models) {
+            INFO("model = " << model);
+
+            REQUIRE(lcfit_set_isa(LCFIT_ISA_SCALAR) == LCFIT_SUCCESS);
+            lcfit_bsm_log_like_n(n, t.data(), &model, expected.data());
+            lcfit_bsm_gradient_n(n - 1, t.data(), &model, expected_grad.data());
+
+            REQUIRE(lcfit_set_isa(isa) == LCFIT_SUCCESS);
+            CHECK(lcfit_active_isa() == isa);
+            lcfit_bsm_log_like_n(n, t.data(), &model, out.data());
+            lcfit_bsm_gradient_n(n - 1, t.data(), &model, out_grad.data());
+
+            for (size_t j = 0; j < n; ++j) {
+                REQUIRE(kernel_matches(out[j], expected[j], 1e-13 * std::abs(expected[j])));
+            }
+
+            // the gradient is undefined at t = infinity, the last point
+            for (size_t j = 0; j < 4 * (n - 1); ++j) {
+                REQUIRE(kernel_matches(out_grad[j], expected_grad[j],
+                                       1e-11 * (std::abs(expected_grad[j]) + 1.0)));
+            }
+
+            const std::vector<float> tf(t.begin(), t.end());
+            std::vector<float> expected_f(n), out_f(n);
+
+            REQUIRE(lcfit_set_isa(LCFIT_ISA_SCALAR) == LCFIT_SUCCESS);
+            lcfit_bsm_log_like_shifted_nf(n, tf.data(), &model, -1.0, expected_f.data());
+
+            REQUIRE(lcfit_set_isa(isa) == LCFIT_SUCCESS);
+            lcfit_bsm_log_like_shifted_nf(n, tf.data(), &model, -1.0, out_f.data());
+
+            for (size_t j = 0; j < n; ++j) {
+                REQUIRE(kernel_matches(out_f[j], expected_f[j],
+                                       4e-6 * (std::abs(expected_f[j]) + 1.0)));
+            }
+        }
+
+        {
+            // each of the models is a branch, and each run of t one of its rows
+            const size_t n_branches = sizeof(models) / sizeof(models[0]);
+            const size_t n_rows = n / n_branches;
+            std::vector<double> c, m, r, b;
+            for (const bsm_t& model : models) {
+                c.push_back(model.c);
+                m.push_back(model.m);
+                r.push_back(model.r);
+                b.push_back(model.b);
+            }
+            const lcfit_bsm_soa_t soa = {c.data(), m.data(), r.data(), b.data()};
+
+            std::vector<double> expected_sums(n_rows), sums(n_rows);
+
+            REQUIRE(lcfit_set_isa(LCFIT_ISA_SCALAR) == LCFIT_SUCCESS);
+            lcfit_bsm_soa_log_like_sum_n(n_rows, n_branches, t.data(), &soa,
+                                         expected_sums.data(), expected_grad.data());
+
+            REQUIRE(lcfit_set_isa(isa) == LCFIT_SUCCESS);
+            lcfit_bsm_soa_log_like_sum_n(n_rows, n_branches, t.data(), &soa,
+                                         sums.data(), out_grad.data());
+
+            for (size_t j = 0; j < n_rows; ++j) {
+                REQUIRE(kernel_matches(sums[j], expected_sums[j], 1e-13 * std::abs(expected_sums[j])));
+            }
+            for (size_t j = 0; j < n_rows * n_branches; ++j) {
+                REQUIRE(kernel_matches(out_grad[j], expected_grad[j],
+                                       1e-11 * (std::abs(expected_grad[j]) + 1.0)));
+            }
+        }
+
+        for (const bsm_t& model : models) {
+            INFO("model = " << model);
+            std::vector<double> expected_d1(n), expected_d2(n), d1(n), d2(n);
+
+            REQUIRE(lcfit_set_isa(LCFIT_ISA_SCALAR) == LCFIT_SUCCESS);
+            lcfit_bsm_log_like_dt_n(n, t.data(), &model, expected.data(),
+                                    expected_d1.data(), expected_d2.data());
+
+            REQUIRE(lcfit_set_isa(isa) == LCFIT_SUCCESS);
+            lcfit_bsm_log_like_dt_n(n, t.data(), &model, out.data(), d1.data(), d2.data());
+
+            for (size_t j = 0; j < n; ++j) {
+                REQUIRE(kernel_matches(out[j], expected[j], 1e-13 * std::abs(expected[j])));
+                REQUIRE(kernel_matches(d1[j], expected_d1[j], 1e-11 * (std::abs(expected_d1[j]) + 1.0)));
+                REQUIRE(kernel_matches(d2[j], expected_d2[j], 1e-11 * (std::abs(expected_d2[j]) + 1.0)));
+            }
+        }
+
+        for (const lcfit2_bsm_t& model : models2) {
+            // lcfit2 models are undefined for t far enough below t0
+            std::vector<double> t2;
+            for (double x : t) {
+                if (x >= model.t0 && std::isfinite(x)) {
+                    t2.push_back(x);
+                }
+            }
+
+            REQUIRE(lcfit_set_isa(LCFIT_ISA_SCALAR) == LCFIT_SUCCESS);
+            lcfit2_norm_lnl_n(t2.size(), t2.data(), &model, expected.data());
+
+            REQUIRE(lcfit_set_isa(isa) == LCFIT_SUCCESS);
+            lcfit2_norm_lnl_n(t2.size(), t2.data(), &model, out.data());
+
+            // the normalized log-likelihood is a difference of terms of size ~(c + m) log(c + m)
+            const double scale = (model.c + model.m) * std::log(2 * (model.c + model.m));
+            for (size_t j = 0; j < t2.size(); ++j) {
+                REQUIRE(std::abs(out[j] - expected[j]) <= 1e-15 * scale);
+            }
+
+            std::vector<double> expected_d1(t2.size()), expected_d2(t2.size());
+            std::vector<double> d1(t2.size()), d2(t2.size());
+
+            REQUIRE(lcfit_set_isa(LCFIT_ISA_SCALAR) == LCFIT_SUCCESS);
+            lcfit2_norm_lnl_dt_n(t2.size(), t2.data(), &model, nullptr,
+                                 expected_d1.data(), expected_d2.data());
+
+            REQUIRE(lcfit_set_isa(isa) == LCFIT_SUCCESS);
+            lcfit2_norm_lnl_dt_n(t2.size(), t2.data(), &model, out.data(), d1.data(), d2.data());
+
+            for (size_t j = 0; j < t2.size(); ++j) {
+                REQUIRE(std::abs(out[j] - expected[j]) <= 1e-15 * scale);
+                REQUIRE(std::abs(d1[j] - expected_d1[j]) <= 1e-13 * (std::abs(expected_d1[j]) + 1.0));
+                REQUIRE(std::abs(d2[j] - expected_d2[j]) <= 1e-13 * (std::abs(expected_d2[j]) + 1.0));
+            }
+        }
+
+        std::vector<double> lnl;
+        for (double x = -800.0; x <= 10.0; x += 0.37) {
+            lnl.push_back(x);
+        }
+        lnl.push_back(-INFINITY);
+
+        std::vector<double> expected_w(lnl.size()), out_w(lnl.size());
+
+        REQUIRE(lcfit_set_isa(LCFIT_ISA_SCALAR) == LCFIT_SUCCESS);
+        const double expected_sum = lcfit_scaled_exp_n(lnl.size(), lnl.data(), 0.8, 10.0, expected_w.data());
+
+        REQUIRE(lcfit_set_isa(isa) == LCFIT_SUCCESS);
+        const double sum = lcfit_scaled_exp_n(lnl.size(), lnl.data(), 0.8, 10.0, out_w.data());
+
+        CHECK(sum == Approx(expected_sum).epsilon(1e-14));
+        for (size_t j = 0; j < lnl.size(); ++j) {
+            // vector implementations flush tiny results to zero
+            REQUIRE(kernel_matches(out_w[j], expected_w[j], 1e-14 * expected_w[j] + 1e-300));
+        }
+    }
+
+    REQUIRE(lcfit_set_isa(initial) == LCFIT_SUCCESS);
+}
+
+TEST_CASE("weights are computed for each scheme", "[lcfit_weights]") {
+    const double lnl[] = {-20.0, -12.5, -10.0, -11.0, -300.0};
+    const size_t n = sizeof(lnl) / sizeof(lnl[0]);
+    const double alpha = 0.5;
+
+    double w[n];
+
+    SECTION("uniform") {
+        CHECK(lcfit_compute_weights(LCFIT_WEIGHTS_UNIFORM, n, nullptr, alpha, w) == -HUGE_VAL);
+        for (size_t i = 0; i < n; ++i) {
+            CHECK(w[i] == 1.0);
+        }
+    }
+
+    SECTION("tempered") {
+        CHECK(lcfit_compute_weights(LCFIT_WEIGHTS_TEMPERED, n, lnl, alpha, w) == -10.0);
+        for (size_t i = 0; i < n; ++i) {
+            CHECK(w[i] == Approx(std::pow(std::exp(lnl[i] + 10.0), alpha)).epsilon(1e-14));
+        }
+        CHECK(w[2] == 1.0);
+    }
+
+    SECTION("softmax") {
+        CHECK(lcfit_compute_weights(LCFIT_WEIGHTS_SOFTMAX, n, lnl, alpha, w) == -10.0);
+
+        double sum = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += std::exp(alpha * lnl[i]);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            CHECK(w[i] == Approx(std::exp(alpha * lnl[i]) / sum).epsilon(1e-14));
+        }
+    }
+
+    SECTION("in place") {
+        double x[n];
+        std::copy(lnl, lnl + n, x);
+        lcfit_compute_weights(LCFIT_WEIGHTS_TEMPERED, n, x, 1.0, x);
+        CHECK(x[2] == 1.0);
+        CHECK(x[0] == Approx(std::exp(-10.0)).epsilon(1e-14));
+    }
+}
@@ -4,20 +4,6 @@
 #include "lcfit.h"
 #include "lcfit2.h"
 
-double lcfit4_d2f_t(const double t, const bsm_t* model)
-{
-    const double c = model->c;
-    const double m = model->m;
-    const double r = model->r;
-    const double b = model->b;
-
-    const double theta = exp(r * (t + b));
-
-    const double d2 = ((c - m)*pow(r, 2)*pow(theta, 3) - 2*(c + m)*pow(r, 2)*pow(theta, 2) + (c - m)*pow(r, 2)*theta)/(pow(theta, 4) - 2*pow(theta, 2) + 1);
-
-    return d2;
-}
-
 TEST_CASE("simple normalized curves are fitted correctly", "[simple_curves]") {
     SECTION("with points sampled from a parabola") {
         const double t0 = 0.1;
@@ -64,7 +50,7 @@ TEST_CASE("simple normalized curves are fitted correctly", "[simple_curves]") {
         }
 
         const double d1 = 0.0;
-        const double d2 = lcfit4_d2f_t(t0, &true_model);
+        const double d2 = lcfit_bsm_d2lnl_dt2(t0, &true_model);
 
         lcfit2_bsm_t fit_model = {1100.0, 800.0, t0, d1, d2};
 
@@ -90,7 +76,7 @@ TEST_CASE("automatic fitting of a function works correctly", "[lcfit2_fit_auto]"
 
         const double t0 = lcfit_bsm_ml_t(&true_model);
         const double d1 = 0.0;
-        const double d2 = lcfit4_d2f_t(t0, &true_model);
+        const double d2 = lcfit_bsm_d2lnl_dt2(t0, &true_model);
 
         lcfit2_bsm_t fit_model = {1100.0, 800.0, t0, d1, d2};
 
@@ -109,4 +95,60 @@ TEST_CASE("automatic fitting of a function works correctly", "[lcfit2_fit_auto]"
         REQUIRE(fit_model4.r == Approx(true_model.r));
         REQUIRE(fit_model4.b == Approx(true_model.b));
     }
+    SECTION("with a known log-likelihood at t0") {
+        bsm_t true_model = {1200.0, 800.0, 2.0, 0.5};
+
+        const double t0 = lcfit_bsm_ml_t(&true_model);
+        const double d1 = 0.0;
+        const double d2 = lcfit_bsm_d2lnl_dt2(t0, &true_model);
+
+        const double min_t = 0.0;
+        const double max_t = 10.0;
+        const double alpha = 0.0;
+
+        const lcfit2_fit_auto_options_t options = {nullptr, true, lcfit_bsm_log_like(t0, &true_model)};
+        double (*f)(double, void*) = reinterpret_cast<double (*)(double, void*)>(&lcfit_bsm_log_like);
+
+        // starting at the true model, the sample points do not move
+        lcfit2_bsm_t exact_model = {true_model.c, true_model.m, t0, d1, d2};
+        size_t n_evals = 0;
+        lcfit2_fit_auto_opt(f, &true_model, &exact_model, min_t, max_t, alpha, &options, &n_evals);
+
+        REQUIRE(n_evals == 3);
+        REQUIRE(exact_model.c == Approx(true_model.c));
+        REQUIRE(exact_model.m == Approx(true_model.m));
+
+        lcfit2_bsm_t fit_model = {1100.0, 800.0, t0, d1, d2};
+        lcfit2_fit_auto_opt(f, &true_model, &fit_model, min_t, max_t, alpha, &options, &n_evals);
+
+        bsm_t fit_model4;
+        lcfit2_to_lcfit4(&fit_model, &fit_model4);
+
+        REQUIRE(n_evals <= 5);
+        REQUIRE(fit_model4.c == Approx(true_model.c));
+        REQUIRE(fit_model4.m == Approx(true_model.m));
+        REQUIRE(fit_model4.r == Approx(true_model.r));
+        REQUIRE(fit_model4.b == Approx(true_model.b));
+    }
+}
+
+TEST_CASE("branch length derivatives match the lcfit4 model", "[lcfit2_derivatives]") {
+    const bsm_t true_model = {1200.0, 800.0, 2.0, 0.5};
+    const double t0 = lcfit_bsm_ml_t(&true_model);
+    const lcfit2_bsm_t model = {true_model.c, true_model.m, t0, 0.0,
+                                lcfit_bsm_d2lnl_dt2(t0, &true_model)};
+
+    CHECK(std::abs(lcfit2_d1f_t(t0, &model)) < 1e-9);
+    CHECK(lcfit2_d2f_t(t0, &model) == Approx(model.d2));
+
+    for (double t : {t0, 0.5, 1.0, 2.0, 5.0}) {
+        double d1, d2;
+        const double lnl = lcfit2_lnl_dt(t, &model, &d1, &d2);
+
+        CHECK(lnl == lcfit2_lnl(t, &model));
+        CHECK(lcfit2_d1f_t(t, &model) == d1);
+        CHECK(lcfit2_d2f_t(t, &model) == d2);
+        CHECK(d1 == Approx(lcfit_bsm_dlnl_dt(t, &true_model)));
+        CHECK(d2 == Approx(lcfit_bsm_d2lnl_dt2(t, &true_model)));
+    }
 }
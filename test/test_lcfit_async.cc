@@ -0,0 +1,187 @@
+#include "catch.hpp"
+
+// lcfit_async.h needs C++20; CMake only builds this file when the
+// compiler accepts -std=c++20, but older compilers may still lack coroutines
+#if defined(__cpp_impl_coroutine)
+
+#include <chrono>
+#include <coroutine>
+#include <iostream>
+#include <span>
+#include <vector>
+
+#include "lcfit.h"
+#include "lcfit_async.h"
+#include "lcfit_select.h"
+
+namespace {
+
+const bsm_t ASYNC_REGIME_1 = {10.0, 1.0, 1.0, 0.0};
+const bsm_t ASYNC_REGIME_2 = {10.0, 1.0, 1.0, 0.1};
+const bsm_t ASYNC_REGIME_3 = {10.0, 1.0, 1.0, 1.0};
+
+const double ASYNC_MIN_BL = 1e-6;
+const double ASYNC_MAX_BL = 1e4;
+
+const bsm_t ASYNC_INIT = {1100.0, 100.0, 2.0, 0.5};
+
+double model_callback(double t, void* data)
+{
+    return lcfit_bsm_log_like(t, static_cast<const bsm_t*>(data));
+}
+
+void evaluate_models(const std::vector<bsm_t>& models, std::span<const size_t> keys,
+                     std::span<const double> t, std::span<double> lnl)
+{
+    for (size_t i = 0; i < t.size(); ++i) {
+        lnl[i] = lcfit_bsm_log_like(t[i], &models[keys[i]]);
+    }
+}
+
+/* An awaitable log-likelihood that evaluates immediately. */
+struct ready_lnl
+{
+    const bsm_t* model;
+
+    std::suspend_never operator()(std::span<const double> t, std::span<double> out) const
+    {
+        for (size_t i = 0; i < t.size(); ++i) {
+            out[i] = lcfit_bsm_log_like(t[i], model);
+        }
+        return {};
+    }
+};
+
+lcfit::task<double> fit_twice(const bsm_t* model)
+{
+    const lcfit::fit_auto_result first =
+        co_await lcfit::fit_auto_async(ready_lnl{model}, ASYNC_INIT, ASYNC_MIN_BL, ASYNC_MAX_BL);
+    const lcfit::fit_auto_result second =
+        co_await lcfit::fit_auto_async(ready_lnl{model}, first.model, ASYNC_MIN_BL, ASYNC_MAX_BL);
+    co_return second.ml_t;
+}
+
+} // namespace
+
+TEST_CASE("asynchronous fits match lcfit_fit_auto", "[lcfit_async]")
+{
+    const std::vector<bsm_t> true_models = {ASYNC_REGIME_1, ASYNC_REGIME_2, ASYNC_REGIME_3};
+
+    lcfit::batching_executor<size_t> executor(
+        [&true_models](std::span<const size_t> keys, std::span<const double> t, std::span<double> lnl) {
+            evaluate_models(true_models, keys, t, lnl);
+        });
+
+    std::vector<lcfit::task<lcfit::fit_auto_result>> fits;
+    for (size_t i = 0; i < true_models.size(); ++i) {
+        fits.push_back(lcfit::fit_auto_async(executor.lnl(i), ASYNC_INIT, ASYNC_MIN_BL, ASYNC_MAX_BL));
+        fits.back().start();
+    }
+
+    // every fit is waiting on its first batch
+    REQUIRE(executor.pending() > 0);
+    executor.run();
+    REQUIRE(executor.pending() == 0);
+
+    size_t n_evals = 0;
+    for (size_t i = 0; i < true_models.size(); ++i) {
+        CAPTURE(i);
+        REQUIRE(fits[i].done());
+
+        bsm_t expected_model = ASYNC_INIT;
+        const double expected_ml_t = lcfit_fit_auto(model_callback, const_cast<bsm_t*>(&true_models[i]),
+                                                    &expected_model, ASYNC_MIN_BL, ASYNC_MAX_BL);
+
+        const lcfit::fit_auto_result result = fits[i].get();
+        CHECK(result.status == LCFIT_SUCCESS);
+        CHECK(result.ml_t == expected_ml_t);
+        CHECK(result.model.c == expected_model.c);
+        CHECK(result.model.m == expected_model.m);
+        CHECK(result.model.r == expected_model.r);
+        CHECK(result.model.b == expected_model.b);
+
+        n_evals += result.n_evals;
+    }
+
+    CHECK(executor.n_evals() == n_evals);
+    CHECK(executor.n_batches() < n_evals);
+
+    SECTION("and compose with other coroutines") {
+        lcfit::task<double> nested = fit_twice(&true_models[1]);
+        nested.start();
+        REQUIRE(nested.done());
+        CHECK(nested.get() == Approx(lcfit_bsm_ml_t(&true_models[1])));
+    }
+}
+
+TEST_CASE("benchmark_async_fit", "Benchmark asynchronous against blocking fits [.][benchmark]")
+{
+    const size_t n_fits = 2000;
+    // fixed cost of a call to the engine, standing in for a remote or
+    // vectorized likelihood engine
+    const std::chrono::microseconds call_latency(20);
+
+    std::vector<bsm_t> true_models;
+    for (size_t i = 0; i < n_fits; ++i) {
+        const double c = 1000.0 + 10.0 * (i % 50);
+        true_models.push_back({c, c / 4.0, 1.0 + 0.01 * (i % 7), 0.05 * (i % 5)});
+    }
+
+    size_t n_calls = 0;
+    auto engine = [&](std::span<const size_t> keys, std::span<const double> t, std::span<double> lnl) {
+        const auto until = std::chrono::steady_clock::now() + call_latency;
+        while (std::chrono::steady_clock::now() < until) {
+        }
+        evaluate_models(true_models, keys, t, lnl);
+        ++n_calls;
+    };
+
+    struct blocking_data
+    {
+        decltype(engine)* evaluate;
+        size_t key;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    double sink = 0.0;
+    for (size_t i = 0; i < n_fits; ++i) {
+        blocking_data data{&engine, i};
+        bsm_t model = ASYNC_INIT;
+        sink += lcfit_fit_auto(
+            [](double t, void* p) {
+                blocking_data* d = static_cast<blocking_data*>(p);
+                double lnl;
+                (*d->evaluate)(std::span<const size_t>(&d->key, 1), std::span<const double>(&t, 1),
+                               std::span<double>(&lnl, 1));
+                return lnl;
+            },
+            &data, &model, ASYNC_MIN_BL, ASYNC_MAX_BL);
+    }
+    std::chrono::duration<double> blocking_s = std::chrono::steady_clock::now() - start;
+    const size_t blocking_calls = n_calls;
+
+    n_calls = 0;
+    start = std::chrono::steady_clock::now();
+    lcfit::batching_executor<size_t> executor(engine);
+    std::vector<lcfit::task<lcfit::fit_auto_result>> fits;
+    fits.reserve(n_fits);
+    for (size_t i = 0; i < n_fits; ++i) {
+        fits.push_back(lcfit::fit_auto_async(executor.lnl(i), ASYNC_INIT, ASYNC_MIN_BL, ASYNC_MAX_BL));
+        fits.back().start();
+    }
+    executor.run();
+    for (auto& fit : fits) {
+        sink += fit.get().ml_t;
+    }
+    std::chrono::duration<double> async_s = std::chrono::steady_clock::now() - start;
+
+    REQUIRE(sink > 0.0);
+
+    std::cout << "fit_auto x " << n_fits << " with " << call_latency.count() << " us per engine call: "
+              << "blocking " << blocking_s.count() << " s (" << n_fits / blocking_s.count() << " fits/s, "
+              << blocking_calls << " calls), "
+              << "async " << async_s.count() << " s (" << n_fits / async_s.count() << " fits/s, "
+              << n_calls << " calls)\n";
+}
+
+#endif // defined(__cpp_impl_coroutine)
@@ -1,13 +1,28 @@
 #include "catch.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <gsl/gsl_histogram.h>
 #include <gsl/gsl_rng.h>
+#include <unistd.h>
 
 #include "lcfit.h"
+#include "lcfit_columnar.h"
 #include "lcfit_cpp.h"
+#include "lcfit_curve_reader.h"
+#include "lcfit_curve_sampling.h"
+#include "lcfit_fit_cache.h"
 #include "lcfit_rejection_sampler.h"
+#include "lcfit_tree_surrogate.h"
 
 using namespace lcfit;
 
@@ -114,6 +129,144 @@ TEST_CASE("test_bsm_fit", "Test fitting an actual BSM log-likelihood function")
     }
 }
 
+TEST_CASE("test_bsm_fit_callable", "Test that callables and std::function fit identically")
+{
+    const bsm_t true_model = {2000, 500, 2.0, 0.4};
+    auto log_like = [&true_model](const double t) {
+        return lcfit_bsm_log_like(t, &true_model);
+    };
+    const std::function<double(double)> log_like_fn = log_like;
+
+    const std::vector<double> t{0.1, 0.15, 0.5};
+    const bsm_t m = {1500, 1000, 1.0, 0.5};
+
+    lcfit::LCFitResult r1 = fit_bsm_log_likelihood(log_like, m, t);
+    lcfit::LCFitResult r2 = fit_bsm_log_likelihood(log_like_fn, m, t);
+
+    REQUIRE(r1.evaluated_points == r2.evaluated_points);
+    REQUIRE(r1.model_fit.c == r2.model_fit.c);
+    REQUIRE(r1.model_fit.m == r2.model_fit.m);
+    REQUIRE(r1.model_fit.r == r2.model_fit.r);
+    REQUIRE(r1.model_fit.b == r2.model_fit.b);
+}
+
+TEST_CASE("test_bsm_fitter_reuse", "Test that a reused Fitter matches one-shot fits")
+{
+    const std::vector<bsm_t> true_models = {{2000, 500, 2.0, 0.4},
+                                            {1200, 300, 1.0, 0.0},
+                                            {2000, 500, 2.0, 0.4},
+                                            {800, 100, 5.0, 0.05}};
+    const std::vector<double> t{0.1, 0.15, 0.5};
+    const bsm_t m = {1500, 1000, 1.0, 0.5};
+
+    lcfit::Fitter fitter;
+    lcfit::LCFitResult result;
+
+    for (const bsm_t& true_model : true_models) {
+        auto log_like = [&true_model](const double t) {
+            return lcfit_bsm_log_like(t, &true_model);
+        };
+
+        lcfit::LCFitResult expected = fit_bsm_log_likelihood(log_like, m, t);
+        fitter.fit(log_like, m, t, result);
+
+        REQUIRE(result.evaluated_points == expected.evaluated_points);
+        REQUIRE(result.model_fit.c == expected.model_fit.c);
+        REQUIRE(result.model_fit.m == expected.model_fit.m);
+        REQUIRE(result.model_fit.r == expected.model_fit.r);
+        REQUIRE(result.model_fit.b == expected.model_fit.b);
+    }
+
+    // A moved-to fitter keeps working.
+    lcfit::Fitter moved = std::move(fitter);
+    auto log_like = [&true_models](const double t) {
+        return lcfit_bsm_log_like(t, &true_models[0]);
+    };
+    lcfit::LCFitResult expected = fit_bsm_log_likelihood(log_like, m, t);
+    moved.fit(log_like, m, t, result);
+    REQUIRE(result.model_fit.c == expected.model_fit.c);
+    REQUIRE(result.model_fit.r == expected.model_fit.r);
+}
+
+TEST_CASE("test_bsm_fit_deadline", "Test that an expired deadline cancels a fit")
+{
+    const bsm_t true_model = {2000, 500, 2.0, 0.4};
+    size_t n_evals = 0;
+    auto log_like = [&true_model, &n_evals](const double t) {
+        ++n_evals;
+        return lcfit_bsm_log_like(t, &true_model);
+    };
+
+    const std::vector<double> t{0.1, 0.15, 0.5};
+    const bsm_t m = {1500, 1000, 1.0, 0.5};
+
+    const lcfit::Deadline expired(lcfit::Deadline::clock::now());
+    REQUIRE(expired.expired());
+
+    lcfit::LCFitResult r = fit_bsm_log_likelihood(log_like, m, t, 8, 250, expired.token());
+    REQUIRE(r.status == LCFIT_CANCELLED);
+    REQUIRE(n_evals == 0);
+    REQUIRE(r.evaluated_points.empty());
+    REQUIRE(r.model_fit.c == m.c);
+
+    const lcfit::Deadline distant(std::chrono::hours(1));
+    lcfit::LCFitResult expected = fit_bsm_log_likelihood(log_like, m, t);
+    r = fit_bsm_log_likelihood(log_like, m, t, 8, 250, distant.token());
+    REQUIRE(r.status == expected.status);
+    REQUIRE(r.evaluated_points == expected.evaluated_points);
+    REQUIRE(r.model_fit.c == expected.model_fit.c);
+}
+
+template<typename Callable>
+double time_fits(Callable&& log_like, const size_t n_fits)
+{
+    const std::vector<double> t{0.1, 0.15, 0.5};
+    const bsm_t m = {1500, 1000, 1.0, 0.5};
+
+    auto start = std::chrono::steady_clock::now();
+    double sink = 0.0;
+    for (size_t i = 0; i < n_fits; ++i) {
+        sink += fit_bsm_log_likelihood(log_like, m, t).model_fit.c;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    REQUIRE(sink > 0.0);
+    return elapsed.count();
+}
+
+TEST_CASE("benchmark_callable_fit", "Benchmark fitting through callables and std::function [.][benchmark]")
+{
+    const size_t n_fits = 20000;
+
+    const bsm_t true_model = {2000, 500, 2.0, 0.4};
+    auto log_like = [&true_model](const double t) {
+        return lcfit_bsm_log_like(t, &true_model);
+    };
+    const std::function<double(double)> log_like_fn = log_like;
+
+    const double callable_s = time_fits(log_like, n_fits);
+    const double function_s = time_fits(log_like_fn, n_fits);
+
+    const std::vector<double> t{0.1, 0.15, 0.5};
+    const bsm_t m = {1500, 1000, 1.0, 0.5};
+    lcfit::Fitter fitter;
+    lcfit::LCFitResult result;
+
+    auto start = std::chrono::steady_clock::now();
+    double sink = 0.0;
+    for (size_t i = 0; i < n_fits; ++i) {
+        fitter.fit(log_like, m, t, result);
+        sink += result.model_fit.c;
+    }
+    std::chrono::duration<double> fitter_s = std::chrono::steady_clock::now() - start;
+    REQUIRE(sink > 0.0);
+
+    std::cout << "fit_bsm_log_likelihood x " << n_fits << ": "
+              << "callable " << callable_s << " s, "
+              << "std::function " << function_s << " s, "
+              << "reused Fitter " << fitter_s.count() << " s\n";
+}
+
 TEST_CASE("test_rejection_sampler", "Test sampling from a BSM log-likelihood function")
 {
     gsl_rng* rng = gsl_rng_alloc(gsl_rng_default);
@@ -246,3 +399,525 @@ TEST_CASE("test_samples", "Test sample distribution")
 
     gsl_rng_free(rng);
 }
+
+/** Two-sample Kolmogorov-Smirnov statistic: the largest difference
+ * between the empirical distribution functions of \c a and \c b. */
+static double ks_statistic(std::vector<double> a, std::vector<double> b)
+{
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+
+    double d = 0.0;
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        const double x = std::min(a[i], b[j]);
+        while (i < a.size() && a[i] == x) ++i;
+        while (j < b.size() && b[j] == x) ++j;
+
+        d = std::max(d, std::abs(double(i) / a.size() - double(j) / b.size()));
+    }
+
+    return d;
+}
+
+TEST_CASE("test_mixed_precision_sampler", "Test single-precision sampling and densities")
+{
+    const double lambda = 0.1;
+    const bsm_t models[] = {REGIME_1, REGIME_2, REGIME_3, REGIME_4};
+    const size_t n_samples = 10000;
+
+    // the 0.1% critical value of the statistic for two samples of this size
+    const double critical_d = 1.95 * std::sqrt(2.0 / n_samples);
+
+    for (const bsm_t& model : models) {
+        INFO("model = " << model.c << ", " << model.m << ", " << model.r << ", " << model.b);
+
+        gsl_rng* rng = gsl_rng_alloc(gsl_rng_default);
+        gsl_rng* rng_mixed = gsl_rng_alloc(gsl_rng_default);
+        gsl_rng_set(rng_mixed, 2);
+
+        lcfit::rejection_sampler sampler(rng, model, lambda);
+        lcfit::rejection_sampler sampler_mixed(rng_mixed, model, lambda);
+
+        const std::vector<double> samples = sampler.sample_n(n_samples);
+        const std::vector<double> samples_mixed = sampler_mixed.sample_n_mixed(n_samples);
+
+        REQUIRE(samples_mixed.size() == n_samples);
+        CHECK(ks_statistic(samples, samples_mixed) < critical_d);
+
+        std::vector<float> t;
+        for (double x = 1e-4; x < 100.0; x *= 1.05) {
+            t.push_back(static_cast<float>(x));
+        }
+        std::vector<float> out(t.size());
+        sampler.log_density_nf(t.size(), t.data(), out.data());
+
+        for (size_t i = 0; i < t.size(); ++i) {
+            const double expected = sampler.log_density(t[i]);
+            REQUIRE(std::abs(out[i] - expected) <= 1e-5 * (1.0 + std::abs(expected)));
+        }
+
+        gsl_rng_free(rng);
+        gsl_rng_free(rng_mixed);
+    }
+}
+
+TEST_CASE("test_columnar_round_trip", "Test writing and reading a columnar file [columnar]")
+{
+    const std::string path = "lcfit-test-columnar.lcol";
+    const std::vector<std::string> names = {"node_id", "t", "empirical", "lcfit"};
+    const size_t n_rows = 1000;
+
+    std::vector<double> rows;
+    for (size_t i = 0; i < n_rows; ++i) {
+        const double t = 0.001 * (i + 1);
+        rows.insert(rows.end(), {double(i % 7), t,
+                                 lcfit_bsm_log_like(t, &REGIME_1),
+                                 lcfit_bsm_log_like(t, &REGIME_2)});
+    }
+
+    {
+        lcfit::columnar_writer writer(path, names);
+        writer.add_rows(rows.data(), n_rows - 1);
+        writer.add_row({rows.end()[-4], rows.end()[-3], rows.end()[-2], rows.end()[-1]});
+        writer.close();
+    }
+
+    lcfit::columnar_reader reader(path);
+    REQUIRE(reader.n_columns() == names.size());
+    REQUIRE(reader.n_rows() == n_rows);
+
+    for (size_t j = 0; j < names.size(); ++j) {
+        CHECK(reader.column_name(j) == names[j]);
+        CHECK(reader.column_index(names[j]) == j);
+    }
+    CHECK_THROWS(reader.column_index("missing"));
+
+    for (size_t i = 0; i < n_rows; ++i) {
+        for (size_t j = 0; j < names.size(); ++j) {
+            REQUIRE(reader.value(i, j) == rows[i * names.size() + j]);
+        }
+    }
+
+    std::remove(path.c_str());
+}
+
+/** Encode \c curves, whose IDs must be integers, in the binary curve format. */
+static std::string encode_curves(const std::vector<lcfit::curve>& curves, uint32_t version = lcfit::CURVE_VERSION)
+{
+    std::string out(lcfit::CURVE_MAGIC, sizeof(lcfit::CURVE_MAGIC));
+    auto put = [&out](uint64_t value, size_t n_bytes) {
+        for (size_t i = 0; i < n_bytes; ++i) {
+            out.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    };
+    auto put_double = [&put](double x) {
+        uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(x));
+        put(bits, 8);
+    };
+
+    put(version, 4);
+    put(0, 4);
+    for (const lcfit::curve& c : curves) {
+        put(std::stoull(c.id), 8);
+        put(c.t.size(), 4);
+        put(c.has_derivatives ? lcfit::CURVE_HAS_DERIVATIVES : 0, 4);
+        for (double t : c.t) put_double(t);
+        for (double lnl : c.lnl) put_double(lnl);
+        if (c.has_derivatives) {
+            put_double(c.t0);
+            put_double(c.d1);
+            put_double(c.d2);
+        }
+    }
+
+    return out;
+}
+
+static void write_file(const std::string& path, const std::string& contents)
+{
+    FILE* fp = std::fopen(path.c_str(), "wb");
+    REQUIRE(fp != nullptr);
+    REQUIRE(std::fwrite(contents.data(), 1, contents.size(), fp) == contents.size());
+    std::fclose(fp);
+}
+
+/** Read every curve from \c reader. */
+static std::vector<lcfit::curve> read_curves(lcfit::curve_reader& reader)
+{
+    std::vector<lcfit::curve> curves;
+    lcfit::curve c;
+    while (reader.next(c)) {
+        curves.push_back(c);
+    }
+    return curves;
+}
+
+/** Read every curve from \c contents through a pipe, written by another thread. */
+static std::vector<lcfit::curve> read_curves_from_pipe(const std::string& contents)
+{
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+
+    std::thread writer([&contents, fds] {
+        size_t n_written = 0;
+        while (n_written < contents.size()) {
+            const ssize_t k = ::write(fds[1], contents.data() + n_written, contents.size() - n_written);
+            if (k <= 0) {
+                break;
+            }
+            n_written += k;
+        }
+        ::close(fds[1]);
+    });
+
+    std::vector<lcfit::curve> curves;
+    try {
+        lcfit::binary_stream_reader reader(fds[0]);
+        curves = read_curves(reader);
+    } catch (...) {
+        ::close(fds[0]);
+        writer.join();
+        throw;
+    }
+
+    ::close(fds[0]);
+    writer.join();
+    return curves;
+}
+
+static void check_curves_equal(const std::vector<lcfit::curve>& actual,
+                               const std::vector<lcfit::curve>& expected)
+{
+    REQUIRE(actual.size() == expected.size());
+    for (size_t i = 0; i < actual.size(); ++i) {
+        INFO("curve " << i);
+        CHECK(actual[i].id == expected[i].id);
+        CHECK(actual[i].t == expected[i].t);
+        CHECK(actual[i].lnl == expected[i].lnl);
+        REQUIRE(actual[i].has_derivatives == expected[i].has_derivatives);
+        if (expected[i].has_derivatives) {
+            CHECK(actual[i].t0 == expected[i].t0);
+            CHECK(actual[i].d1 == expected[i].d1);
+            CHECK(actual[i].d2 == expected[i].d2);
+        }
+    }
+}
+
+TEST_CASE("test_curve_reader_round_trip", "Test reading text and binary curves [curve_reader]")
+{
+    std::vector<lcfit::curve> curves;
+    for (size_t i = 0; i < 5; ++i) {
+        lcfit::curve c;
+        c.id = std::to_string(100 + i);
+        // one curve is larger than the stream buffer and the pipe
+        const size_t n = i == 3 ? 20000 : 4 + i;
+        for (size_t j = 0; j < n; ++j) {
+            const double t = 0.01 * (j + 1);
+            c.t.push_back(t);
+            c.lnl.push_back(lcfit_bsm_log_like(t, &REGIME_2));
+        }
+        c.has_derivatives = i % 2 == 1;
+        c.t0 = lcfit_bsm_ml_t(&REGIME_2);
+        c.d1 = 0.0;
+        c.d2 = lcfit_bsm_d2lnl_dt2(c.t0, &REGIME_2);
+        curves.push_back(c);
+    }
+
+    SECTION("as text") {
+        std::string text = "# comment\n\n";
+        char buf[32];
+        for (const lcfit::curve& c : curves) {
+            text += c.id + "  " + std::to_string(c.t.size());
+            for (double t : c.t) { std::snprintf(buf, sizeof(buf), " %.17g", t); text += buf; }
+            for (double lnl : c.lnl) { std::snprintf(buf, sizeof(buf), "\t%.17g", lnl); text += buf; }
+            if (c.has_derivatives) {
+                std::snprintf(buf, sizeof(buf), " %.17g", c.t0); text += buf;
+                std::snprintf(buf, sizeof(buf), " %.17g", c.d1); text += buf;
+                std::snprintf(buf, sizeof(buf), " %.17g", c.d2); text += buf;
+            }
+            text += "\r\n   \n";
+        }
+        // no newline at the end of the input
+        text.resize(text.size() - 6);
+
+        const std::string path = "lcfit-test-curves.txt";
+        write_file(path, text);
+        std::unique_ptr<lcfit::curve_reader> reader = lcfit::open_curve_reader(path);
+        check_curves_equal(read_curves(*reader), curves);
+        std::remove(path.c_str());
+    }
+
+    SECTION("as a mapped binary file") {
+        const std::string path = "lcfit-test-curves.bin";
+        write_file(path, encode_curves(curves));
+        std::unique_ptr<lcfit::curve_reader> reader = lcfit::open_curve_reader(path);
+        check_curves_equal(read_curves(*reader), curves);
+        std::remove(path.c_str());
+    }
+
+    SECTION("as a binary stream") {
+        check_curves_equal(read_curves_from_pipe(encode_curves(curves)), curves);
+    }
+
+    SECTION("as an empty binary stream") {
+        CHECK(read_curves_from_pipe(encode_curves({})).empty());
+    }
+}
+
+TEST_CASE("test_curve_reader_errors", "Test that malformed curves are rejected [curve_reader]")
+{
+    auto read_text = [](const std::string& text) {
+        const std::string path = "lcfit-test-curves.txt";
+        write_file(path, text);
+        try {
+            std::unique_ptr<lcfit::curve_reader> reader = lcfit::open_curve_reader(path);
+            read_curves(*reader);
+        } catch (...) {
+            std::remove(path.c_str());
+            throw;
+        }
+        std::remove(path.c_str());
+    };
+
+    auto read_binary = [](const std::string& contents) {
+        lcfit::binary_reader reader(reinterpret_cast<const unsigned char*>(contents.data()),
+                                    contents.size());
+        read_curves(reader);
+    };
+
+    lcfit::curve c;
+    c.id = "7";
+    c.t = {0.1, 0.2, 0.3};
+    c.lnl = {-3.0, -2.0, -2.5};
+    c.has_derivatives = false;
+    const std::string good = encode_curves({c});
+
+    SECTION("in text") {
+        CHECK_NOTHROW(read_text("7 3 0.1 0.2 0.3 -3 -2 -2.5\n"));
+        CHECK_THROWS(read_text("7\n"));
+        CHECK_THROWS(read_text("7 -3 0.1\n"));
+        CHECK_THROWS(read_text("7 3 0.1 0.2 0.3 -3 -2\n"));
+        CHECK_THROWS(read_text("7 3 0.1 0.2 0.3 -3 -2 x\n"));
+        CHECK_THROWS(read_text("7 3 0.1 0.2 0.3 -3 -2 -2.5 1 2\n"));
+        CHECK_THROWS(read_text("7 3 0.1 0.2 0.3 -3 -2 -2.5 1 2 3 4\n"));
+        // counts beyond the line fail without allocating for them
+        CHECK_THROWS(read_text("7 9000000000000000000 0.1\n"));
+        CHECK_THROWS(read_text("7 99999999999999999999 0.1\n"));
+    }
+
+    SECTION("in a binary file") {
+        CHECK_NOTHROW(read_binary(good));
+        CHECK_THROWS(read_binary(good.substr(0, lcfit::CURVE_HEADER_SIZE - 1)));
+        CHECK_THROWS(read_binary(encode_curves({c}, lcfit::CURVE_VERSION + 1)));
+        CHECK_THROWS(read_binary(good.substr(0, good.size() - 1)));
+        CHECK_THROWS(read_binary(good.substr(0, lcfit::CURVE_HEADER_SIZE + 8)));
+    }
+
+    SECTION("in a binary stream") {
+        CHECK_NOTHROW(read_curves_from_pipe(good));
+        CHECK_THROWS(read_curves_from_pipe(good.substr(0, lcfit::CURVE_HEADER_SIZE - 1)));
+        CHECK_THROWS(read_curves_from_pipe(encode_curves({c}, lcfit::CURVE_VERSION + 1)));
+        CHECK_THROWS(read_curves_from_pipe(good.substr(0, good.size() - 1)));
+        CHECK_THROWS(read_curves_from_pipe(good.substr(0, lcfit::CURVE_HEADER_SIZE + 8)));
+
+        // a record claiming 2^32 - 1 samples, followed by only a few
+        std::string huge = good;
+        huge[lcfit::CURVE_HEADER_SIZE + 8] = huge[lcfit::CURVE_HEADER_SIZE + 9] =
+            huge[lcfit::CURVE_HEADER_SIZE + 10] = huge[lcfit::CURVE_HEADER_SIZE + 11] = '\xff';
+        CHECK_THROWS(read_curves_from_pipe(huge));
+    }
+}
+
+static double bsm_lnl_callback(double t, void* data)
+{
+    return lcfit_bsm_log_like(t, static_cast<const bsm_t*>(data));
+}
+
+/** A BSM log-likelihood with an optional Gaussian bump, which counts its evaluations. */
+struct bumped_bsm {
+    bsm_t model;
+    double center, width, height;
+    size_t n_evals;
+
+    static double fn(double t, void* data)
+    {
+        bumped_bsm* self = static_cast<bumped_bsm*>(data);
+        ++self->n_evals;
+        const double z = (t - self->center) / self->width;
+        return lcfit_bsm_log_like(t, &self->model) + self->height * std::exp(-z * z);
+    }
+};
+
+TEST_CASE("test_sample_curves_adaptive", "Test adaptive sampling of likelihood curves [curve_sampling]")
+{
+    const bsm_t true_model = {1500.0, 300.0, 1.0, 0.05};
+    const double t0 = lcfit_bsm_ml_t(&true_model);
+    const double min_t = 1e-6;
+    const double max_t = 20.0;
+    const int node_id = 3;
+
+    bumped_bsm lnl = {true_model, t0 + 0.05, 0.005, 0.0, 0};
+    std::ostringstream log;
+    std::vector<double> rows;
+
+    SECTION("points concentrate where the curve bends") {
+        // a bump the model does not have, within the sampled region
+        lnl.height = 0.5;
+        const size_t max_points = 201;
+        lcfit::sample_curves_adaptive(&bumped_bsm::fn, &lnl, &true_model, min_t, max_t, t0,
+                                      node_id, max_points, 1e-2, rows, log);
+
+        // converged within the budget
+        CHECK(lnl.n_evals < max_points);
+        REQUIRE(rows.size() == 4 * (rows.size() / 4));
+
+        std::vector<double> t;
+        for (size_t i = 0; i < rows.size(); i += 4) {
+            CHECK(rows[i] == node_id);
+            t.push_back(rows[i + 1]);
+        }
+        REQUIRE(std::is_sorted(t.begin(), t.end()));
+
+        // the rows bracket t0 and the bump, and stay near them
+        REQUIRE_FALSE(t.empty());
+        CHECK(t.front() < t0);
+        CHECK(t.back() > lnl.center);
+        CHECK(t.back() < max_t);
+
+        // compare the bump with a window as far from t0 on the other side
+        size_t n_bump = 0, n_mirror = 0;
+        for (const double x : t) {
+            n_bump += std::abs(x - lnl.center) <= 2.0 * lnl.width;
+            n_mirror += std::abs(x - (2.0 * t0 - lnl.center)) <= 2.0 * lnl.width;
+        }
+        CHECK(n_mirror > 0u);
+        CHECK(n_bump >= 2 * n_mirror);
+    }
+
+    SECTION("an unreachable tolerance stops at the budget") {
+        for (const size_t max_points : {5, 20, 64}) {
+            INFO("max_points = " << max_points);
+            lnl.n_evals = 0;
+            rows.clear();
+
+            lcfit::sample_curves_adaptive(&bumped_bsm::fn, &lnl, &true_model, min_t, max_t, t0,
+                                          node_id, max_points, 0.0, rows, log);
+
+            const size_t n_evals = lnl.n_evals;
+            CHECK(n_evals <= max_points);
+            CHECK(n_evals >= max_points - 1);
+            CHECK_FALSE(rows.empty());
+        }
+    }
+
+    SECTION("a loose tolerance stops before the budget") {
+        const size_t max_points = 1000;
+        lcfit::sample_curves_adaptive(&bumped_bsm::fn, &lnl, &true_model, min_t, max_t, t0,
+                                      node_id, max_points, 1.0, rows, log);
+
+        CHECK(lnl.n_evals < max_points / 10);
+        CHECK_FALSE(rows.empty());
+    }
+}
+
+TEST_CASE("test_fit_cache", "Test reuse, validation and eviction in the fit cache [fit_cache]")
+{
+    bsm_t true_model = {1500.0, 300.0, 1.0, 0.05};
+    const double min_t = 1e-6;
+    const double max_t = 20.0;
+
+    lcfit::fit_cache cache(2);
+    const lcfit::fit_cache_key key = {42, 7};
+
+    bsm_t first = DEFAULT_INIT;
+    const double t0 = cache.fit(key, &bsm_lnl_callback, &true_model, &first, min_t, max_t);
+    CHECK(cache.stats().misses == 1);
+
+    SECTION("a valid cached fit is reused") {
+        bsm_t second = DEFAULT_INIT;
+        CHECK(cache.fit(key, &bsm_lnl_callback, &true_model, &second, min_t, max_t) == t0);
+        CHECK(second.c == first.c);
+        CHECK(second.r == first.r);
+
+        const lcfit::fit_cache_stats stats = cache.stats();
+        CHECK(stats.hits == 1);
+        CHECK(stats.validation_failures == 0);
+        CHECK(stats.misses == 1);
+    }
+
+    SECTION("a stale cached fit is refitted") {
+        bsm_t other_model = {1500.0, 600.0, 1.0, 0.05};
+        bsm_t second = DEFAULT_INIT;
+        cache.fit(key, &bsm_lnl_callback, &other_model, &second, min_t, max_t);
+
+        CHECK(cache.stats().hits == 0);
+        CHECK(cache.stats().validation_failures == 1);
+        CHECK(lcfit_bsm_ml_t(&second) == Approx(lcfit_bsm_ml_t(&other_model)).epsilon(1e-3));
+    }
+
+    SECTION("the least recently used fit is evicted") {
+        lcfit::cached_fit value = {true_model, 0.5};
+        cache.insert({1, 0}, value);
+        REQUIRE(cache.lookup(key, value));  // key is now most recently used
+        cache.insert({2, 0}, value);
+
+        CHECK(cache.size() == 2);
+        CHECK(cache.stats().evictions == 1);
+        CHECK(cache.lookup(key, value));
+        CHECK_FALSE(cache.lookup({1, 0}, value));
+        CHECK(cache.lookup({2, 0}, value));
+    }
+}
+
+TEST_CASE("test_tree_surrogate", "Test the summed branch models and their gradient [tree_surrogate]")
+{
+    const std::vector<bsm_t> models = {REGIME_1, REGIME_2, REGIME_3, REGIME_4,
+                                       {1500.0, 300.0, 1.0, 0.05}};
+    const lcfit::tree_surrogate surrogate(models);
+    REQUIRE(surrogate.size() == models.size());
+    CHECK(surrogate.model(4).m == 300.0);
+    CHECK_THROWS(surrogate.model(5));
+
+    const size_t n = models.size();
+    const size_t n_candidates = 3;
+    const std::vector<double> t = {0.1, 0.2, 0.3, 0.4, 0.5,
+                                   1.0, 0.01, 2.0, 0.05, 0.2,
+                                   0.3, 0.3, 0.3, 0.3, 0.3};
+
+    std::vector<double> lnl(n_candidates);
+    std::vector<double> grad(n_candidates * n);
+    surrogate.log_like_n(n_candidates, t.data(), lnl.data(), grad.data());
+
+    const double h = 1e-6;
+    for (size_t k = 0; k < n_candidates; ++k) {
+        const double* row = &t[k * n];
+
+        double expected = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            expected += lcfit_bsm_log_like(row[i], &models[i]);
+        }
+        CHECK(lnl[k] == Approx(expected).epsilon(1e-12));
+        CHECK(surrogate.log_like(row) == Approx(expected).epsilon(1e-12));
+
+        for (size_t i = 0; i < n; ++i) {
+            const double fd = (lcfit_bsm_log_like(row[i] + h, &models[i]) -
+                               lcfit_bsm_log_like(row[i] - h, &models[i])) / (2 * h);
+            CHECK(grad[k * n + i] == Approx(fd).epsilon(1e-5));
+        }
+    }
+
+    SECTION("replacing a branch model changes only its term") {
+        lcfit::tree_surrogate changed = surrogate;
+        const bsm_t other = {1500.0, 600.0, 1.0, 0.05};
+        changed.set_model(4, other);
+
+        std::vector<double> changed_grad(n);
+        const double changed_lnl = changed.log_like(t.data(), changed_grad.data());
+        CHECK(changed_lnl == Approx(lnl[0] - lcfit_bsm_log_like(t[4], &models[4]) +
+                                    lcfit_bsm_log_like(t[4], &other)).epsilon(1e-12));
+        CHECK(changed_grad[0] == grad[0]);
+        CHECK(changed_grad[4] != grad[4]);
+    }
+}